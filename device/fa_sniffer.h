@@ -43,7 +43,7 @@ struct fa_row { struct fa_entry row[0]; };
 
 /* ioctl definitions. */
 
-#define FASNIF_IOCTL_VERSION        2
+#define FASNIF_IOCTL_VERSION        3
 
 /* Returns ioctl interface version number.  Just a sanity check. */
 #define FASNIF_IOCTL_GET_VERSION    _IO('C', 0)
@@ -80,3 +80,34 @@ struct fa_timestamp {
 /* Sets the fa_entry_count.  Note that the device will need to be closed and
  * reopened for the change to take effect. */
 #define FASNIF_IOCTL_SET_ENTRY_COUNT _IOW('C', 3, uint32_t)
+
+
+/* From version 3 the driver's circular queue of DMA blocks can be mapped into
+ * user space with mmap(), so that blocks can be consumed without a read() and
+ * GET_TIMESTAMP call for each block.  This returns the layout of the mapping:
+ * a struct fa_ring_header at offset 0 and block_count data blocks of block_size
+ * bytes starting at data_offset. */
+struct fa_ring_info {
+    uint32_t block_size;            // Size of each ring block in bytes
+    uint32_t block_count;           // Number of blocks in ring
+    uint32_t data_offset;           // Offset of first data block in mapping
+    uint32_t map_size;              // Total length to pass to mmap()
+} __attribute__((packed));
+#define FASNIF_IOCTL_GET_RING_INFO  _IOR('R', 4, struct fa_ring_info)
+
+/* Header shared between driver and client at the start of the mapped ring.
+ * Both counts are free running and are reset to zero by RESTART: block n is
+ * held in slot n % block_count.  The driver advances producer as each block is
+ * completed and the client advances consumer as each block is released; the
+ * driver halts with overrun set if it needs a slot not yet released.  The
+ * completion timestamp of each slot follows the two counts. */
+struct fa_ring_header {
+    uint32_t producer;              // Blocks completed by driver
+    uint32_t consumer;              // Blocks released by client
+    uint64_t timestamps[0];         // Completion timestamp of each slot
+};
+
+/* Blocks until the producer count differs from the consumer count and returns
+ * the producer count, or fails with EIO if the stream has halted and all
+ * completed blocks have been consumed. */
+#define FASNIF_IOCTL_RING_WAIT      _IOR('R', 5, uint32_t)
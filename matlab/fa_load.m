@@ -76,6 +76,14 @@ function d = fa_load(tse, mask, type, server, show_bar)
     [request_mask, dummy, perm] = unique(mask);
     id_count = length(request_mask);
 
+    % If the compiled loader has been built use it to fetch the data, it is
+    % very much faster for large data sets.
+    if exist('fa_load_mex', 'file') == 3
+        d = mex_load(server, port, decimation, frequency, typestr, ...
+            request_mask, perm, max_id, tse, save_id0);
+        return
+    end
+
     % Prepare the request and send to server
     [request, tz_offset] = format_server_request( ...
         request_mask, max_id, save_id0, typestr, tse, decimation, ts_at_end);
@@ -105,6 +113,39 @@ function d = fa_load(tse, mask, type, server, show_bar)
 end
 
 
+% Fetches data using fa_load_mex, which formats the request, receives the data
+% directly into the result arrays and converts the timestamps.  Start and end
+% times are passed as UTC in seconds in the Unix epoch.
+function d = mex_load(server, port, decimation, frequency, typestr, ...
+        request_mask, perm, max_id, tse, save_id0)
+
+    unix_epoch = 719529;                % 1970-01-01 in Matlab time
+    if typestr == 'C'
+        tz_offset = get_tz_offset(now);
+        range = tse(1);
+    else
+        tz_offset = get_tz_offset(tse(2));
+        range = 3600 * 24 * (tse(1:2) - tz_offset - unix_epoch);
+    end
+
+    [data, t, day, timestamp, id0] = fa_load_mex( ...
+        server, port, typestr, decimation, double(request_mask), max_id, ...
+        range, double(save_id0), round(3600 * 24 * tz_offset));
+
+    d = struct();
+    d.decimation = decimation;
+    d.f_s = frequency;
+    d.day = day;
+    d.timestamp = timestamp;
+    d.t = t;
+    if save_id0
+        d.id0 = id0;
+    end
+    d = assign_data(d, request_mask, perm, data, ...
+        strcmp(typestr, 'C')  ||  decimation == 1);
+end
+
+
 % Process decimation request in light of server parameters.  This involves an
 % initial parameter request to the server.
 %   Note that the ts_at_end flag for DD data is an important optimisation;
@@ -377,7 +418,13 @@ function d = format_results( ...
             id_zeros, sample_count, block_size, initial_offset, decimation);
     end
 
-    % Restore the originally requested permutation if necessary.
+    d = assign_data(d, request_mask, perm, data, simple_data);
+end
+
+
+% Assigns ids and data to the result, restoring the originally requested
+% permutation if necessary.
+function d = assign_data(d, request_mask, perm, data, simple_data)
     if any(diff(perm) ~= 1)
         d.ids = request_mask(perm);
         if simple_data
@@ -0,0 +1,416 @@
+/* MEX implementation of fa_load data transfer.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* This is called by fa_load.m when it has been compiled, as
+ *
+ *  [data, t, day, timestamp, id0] = fa_load_mex( ...
+ *      server, port, type, decimation, ids, max_id, range, save_id0,
+ *      local_offset)
+ *
+ * where type is one of F, D, DD or C as computed by fa_load, ids is the sorted
+ * list of ids to fetch, range is either [start end] in seconds in the Unix
+ * epoch (UTC) or, for C, the number of samples, and local_offset is the offset
+ * in seconds to add to timestamps to convert them to local time.  The request
+ * is formatted and the returned timestamps are converted exactly as for
+ * fa-capture, and the data is received directly into the returned arrays. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "mex.h"
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "reader.h"
+#include "request.h"
+
+
+/* Arguments as passed from fa_load.m. */
+struct load_args {
+    char server[256];
+    int port;
+    char type[4];               // F, D, DD or C
+    unsigned int decimation;
+    struct filter_mask mask;
+    unsigned int id_count;
+    unsigned int max_id;
+    double range[2];
+    bool save_id0;
+    time_t local_offset;
+};
+
+
+/* Converts a scalar argument to unsigned int, failing if out of range. */
+static bool get_uint(const mxArray *arg, const char *name, unsigned int *result)
+{
+    double value = 0;
+    return
+        TEST_OK_(mxIsNumeric(arg)  &&  mxGetNumberOfElements(arg) == 1,
+            "%s must be a scalar", name)  &&
+        DO_(value = mxGetScalar(arg))  &&
+        TEST_OK_(0 <= value  &&  value <= UINT32_MAX  &&  value == floor(value),
+            "Invalid value for %s", name)  &&
+        DO_(*result = (unsigned int) value);
+}
+
+/* Copies a string argument into result. */
+static bool get_string(
+    const mxArray *arg, const char *name, char *result, size_t length)
+{
+    return TEST_OK_(
+        mxIsChar(arg)  &&  mxGetString(arg, result, (mwSize) length) == 0,
+        "%s must be a short string", name);
+}
+
+
+/* Converts the id list into a filter mask. */
+static bool get_mask(const mxArray *arg, struct load_args *args)
+{
+    bool ok = TEST_OK_(mxIsDouble(arg)  &&  !mxIsEmpty(arg),
+        "Empty list of ids");
+    const double *ids = ok ? mxGetPr(arg) : NULL;
+    args->id_count = ok ? (unsigned int) mxGetNumberOfElements(arg) : 0;
+    memset(&args->mask, 0, sizeof(args->mask));
+    for (unsigned int i = 0; ok  &&  i < args->id_count; i ++)
+    {
+        ok = TEST_OK_(0 <= ids[i]  &&  ids[i] < args->max_id  &&
+                (i == 0  ||  ids[i - 1] < ids[i]),
+            "Invalid range of ids");
+        if (ok)
+            set_mask_bit(&args->mask, (unsigned int) ids[i]);
+    }
+    return ok;
+}
+
+/* Checks and converts the arguments passed from fa_load.m. */
+static bool parse_args(int nrhs, const mxArray *prhs[], struct load_args *args)
+{
+    unsigned int port = 0, save_id0 = 0;
+    double local_offset = 0;
+    return
+        TEST_OK_(nrhs == 9, "Wrong number of arguments")  &&
+        get_string(prhs[0], "server", args->server, sizeof(args->server))  &&
+        get_uint(prhs[1], "port", &port)  &&
+        DO_(args->port = (int) port)  &&
+        get_string(prhs[2], "type", args->type, sizeof(args->type))  &&
+        TEST_OK_(
+            strcmp(args->type, "F") == 0  ||  strcmp(args->type, "D") == 0  ||
+            strcmp(args->type, "DD") == 0  ||  strcmp(args->type, "C") == 0,
+            "Invalid datatype requested")  &&
+        get_uint(prhs[3], "decimation", &args->decimation)  &&
+        get_uint(prhs[5], "max_id", &args->max_id)  &&
+        TEST_OK_(args->max_id <= MAX_FA_ENTRY_COUNT, "Invalid max_id")  &&
+        get_mask(prhs[4], args)  &&
+        TEST_OK_(mxIsDouble(prhs[6])  &&
+            mxGetNumberOfElements(prhs[6]) ==
+                (strcmp(args->type, "C") == 0 ? 1 : 2),
+            "Invalid range")  &&
+        DO_(memcpy(args->range, mxGetPr(prhs[6]),
+            mxGetNumberOfElements(prhs[6]) * sizeof(double)))  &&
+        get_uint(prhs[7], "save_id0", &save_id0)  &&
+        DO_(args->save_id0 = save_id0)  &&
+        TEST_OK_(mxIsDouble(prhs[8]), "Invalid local offset")  &&
+        DO_(local_offset = mxGetScalar(prhs[8]))  &&
+        DO_(args->local_offset = (time_t) local_offset);
+}
+
+
+/* Connects to the server, as for fa-capture. */
+static bool connect_server(const struct load_args *args, FILE **stream)
+{
+    struct sockaddr_in s_in = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons((uint16_t) args->port)
+    };
+    struct hostent *hostent;
+    int sock;
+    return
+        TEST_NULL_(
+            hostent = gethostbyname(args->server),
+            "Unable to resolve server \"%s\"", args->server)  &&
+        DO_(memcpy(
+            &s_in.sin_addr.s_addr, hostent->h_addr,
+            (size_t) hostent->h_length))  &&
+        TEST_IO(sock = socket(AF_INET, SOCK_STREAM, 0))  &&
+        UNLESS(
+            TEST_IO_(
+                connect(sock, (struct sockaddr *) &s_in, sizeof(s_in)),
+                "Unable to connect to server %s:%d", args->server, args->port)  &&
+            TEST_NULL(*stream = fdopen(sock, "r+")),
+
+            // Close sock if connect or fdopen failed
+            TEST_IO(close(sock)));
+}
+
+
+/* Formats a time in seconds for the S time format. */
+static void format_seconds(char *string, double seconds)
+{
+    double whole = floor(seconds);
+    sprintf(string, "S%.0f.%09.0f", whole, floor(1e9 * (seconds - whole)));
+}
+
+
+/* Sends the request to the server: a subscription for C data, otherwise a read
+ * with sample count, all available data and extended timestamps requested. */
+static bool send_request(const struct load_args *args, FILE *stream)
+{
+    char raw_mask[RAW_MASK_BYTES];
+    format_mask(&args->mask, args->max_id, raw_mask);
+    const char *id0 = args->save_id0 ? "Z" : "";
+    if (strcmp(args->type, "C") == 0)
+        return TEST_OK(fprintf(stream, "S%sTE%s%s\n",
+            raw_mask, id0, args->decimation > 1 ? "D" : "") > 0);
+    else
+    {
+        enum data_format data_format =
+            strcmp(args->type, "F") == 0 ? DATA_FA :
+            strcmp(args->type, "D") == 0 ? DATA_D : DATA_DD;
+        char source[READ_SOURCE_BYTES];
+        format_read_source(source, data_format, 0, 15);
+        char start[64], end[64];
+        format_seconds(start, args->range[0]);
+        format_seconds(end, args->range[1]);
+        return TEST_OK(fprintf(stream, "R%sM%s%sE%sNATE%s\n",
+            source, raw_mask, start, end, id0) > 0);
+    }
+}
+
+
+/* If the request was accepted the first byte of the response is a null
+ * character, otherwise the entire response is an error message. */
+static bool check_response(FILE *stream)
+{
+    char response[1024];
+    if (fread(response, 1, 1, stream) != 1)
+        return FAIL_("Unexpected server disconnect");
+    else if (*response == '\0')
+        return true;
+    else
+    {
+        size_t rx = fread(response + 1, 1, sizeof(response) - 2, stream);
+        response[rx + 1] = '\0';
+        /* Strip the trailing newline from the server's message. */
+        char *newline = strchr(response, '\n');
+        if (newline)
+            *newline = '\0';
+        return FAIL_("%s", response);
+    }
+}
+
+
+/* Converts count 32-bit integers at the end of the buffer into doubles filling
+ * the buffer.  Working forwards each integer has been read before the double
+ * being written can overlap it. */
+static void convert_in_place(double *buffer, size_t count)
+{
+    const int32_t *source = (const int32_t *) (void *) (buffer + count) - count;
+    for (size_t i = 0; i < count; i ++)
+        buffer[i] = source[i];
+}
+
+
+/* Receives the data stream into the preallocated result arrays, setting
+ * *samples_read to the number of samples actually received. */
+static bool receive_data(
+    const struct load_args *args, FILE *stream, size_t sample_count,
+    const struct extended_timestamp_header *header,
+    double *data, size_t field_count, double *t, uint32_t *id0,
+    double *day, double *timestamp, size_t *samples_read)
+{
+    unsigned int block_size = header->block_size;
+    double *block_t = malloc(block_size * sizeof(double));
+    struct timestamp_conversion conversion;
+    size_t line_values = 2 * field_count * args->id_count;
+    size_t ts_size = args->save_id0 ?
+        sizeof(struct extended_timestamp_id0) :
+        sizeof(struct extended_timestamp);
+
+    unsigned int block_offset = header->offset;
+    *samples_read = 0;
+    bool ok = true;
+    while (ok  &&  *samples_read < sample_count)
+    {
+        /* Each block of data is preceded by its timestamp.  If this is missing
+         * the server has run out of data and we return what we have. */
+        struct extended_timestamp_id0 block;
+        if (fread(&block, ts_size, 1, stream) != 1)
+            break;
+        if (*samples_read == 0)
+            prepare_timestamps(&conversion, header, &block,
+                args->local_offset, true, timestamp, day);
+
+        size_t block_count = block_size - block_offset;
+        if (block_count > sample_count - *samples_read)
+            block_count = sample_count - *samples_read;
+
+        /* Timestamps and id0 values for the samples in this block. */
+        convert_timestamps(&conversion, &block, block_t);
+        memcpy(t + *samples_read, block_t + block_offset,
+            block_count * sizeof(double));
+        if (args->save_id0)
+            for (size_t i = 0; i < block_count; i ++)
+                id0[*samples_read + i] = block.id_zero +
+                    (uint32_t) ((block_offset + i) * args->decimation);
+
+        /* Receive the raw data into the tail of its place in the result and
+         * convert to double in place. */
+        size_t count = line_values * block_count;
+        double *target = data + line_values * *samples_read;
+        size_t rx = fread(
+            (int32_t *) (void *) (target + count) - count,
+            sizeof(int32_t) * line_values, block_count, stream);
+        convert_in_place(target, count);
+        *samples_read += rx;
+        ok = TEST_OK_(rx == block_count  ||  feof(stream),
+            "Error reading from server");
+        if (rx < block_count)
+            break;
+        block_offset = 0;
+    }
+    free(block_t);
+    return ok;
+}
+
+
+/* Reads the sample count, if sent, and the timestamp header. */
+static bool read_header(
+    const struct load_args *args, FILE *stream,
+    uint64_t *sample_count, struct extended_timestamp_header *header)
+{
+    return
+        IF_ELSE(strcmp(args->type, "C") == 0,
+            DO_(*sample_count = (uint64_t) args->range[0]),
+            TEST_OK_(fread(sample_count, sizeof(*sample_count), 1, stream) == 1,
+                "Unexpected server disconnect"))  &&
+        TEST_OK_(fread(header, sizeof(*header), 1, stream) == 1,
+            "Unexpected server disconnect")  &&
+        TEST_OK_(header->offset < header->block_size,
+            "Invalid response from server");
+}
+
+
+/* Allocates the result arrays, receives the data, and truncates the results if
+ * the server sent fewer samples than promised. */
+static bool load_data(
+    const struct load_args *args, FILE *stream, size_t sample_count,
+    const struct extended_timestamp_header *header, mxArray *outputs[])
+{
+    bool simple_data =
+        strcmp(args->type, "C") == 0  ||  args->decimation == 1;
+    size_t field_count = simple_data ? 1 : 4;
+    mwSize dims[4] = { 2, field_count, args->id_count, sample_count };
+    mwSize ndim = 4;
+    if (simple_data)
+    {
+        /* Data is indexed as data(xy, id, t), squeeze out the field index. */
+        dims[1] = args->id_count;
+        dims[2] = sample_count;
+        ndim = 3;
+    }
+    mxArray *data = mxCreateNumericArray(ndim, dims, mxDOUBLE_CLASS, mxREAL);
+    mxArray *t = mxCreateDoubleMatrix(sample_count, 1, mxREAL);
+    mxArray *id0 = args->save_id0 ?
+        mxCreateNumericMatrix(sample_count, 1, mxUINT32_CLASS, mxREAL) :
+        mxCreateDoubleMatrix(0, 0, mxREAL);
+
+    double day = NAN, timestamp = NAN;
+    size_t samples_read;
+    bool ok = receive_data(
+        args, stream, sample_count, header,
+        mxGetPr(data), field_count, mxGetPr(t), mxGetData(id0),
+        &day, &timestamp, &samples_read);
+    if (ok  &&  samples_read < sample_count)
+    {
+        mexWarnMsgIdAndTxt("fa_load:truncated", "Data truncated");
+        dims[ndim - 1] = samples_read;
+        mxSetDimensions(data, dims, ndim);
+        mxSetM(t, samples_read);
+        if (args->save_id0)
+            mxSetM(id0, samples_read);
+    }
+
+    outputs[0] = data;
+    outputs[1] = t;
+    outputs[2] = mxCreateDoubleScalar(day);
+    outputs[3] = mxCreateDoubleScalar(timestamp);
+    outputs[4] = id0;
+    return ok;
+}
+
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    struct load_args args;
+    FILE *stream = NULL;
+    uint64_t sample_count;
+    struct extended_timestamp_header header;
+    mxArray *outputs[5];
+
+    push_error_handling();
+    bool ok =
+        TEST_OK_(nlhs <= 5, "Too many output arguments")  &&
+        parse_args(nrhs, prhs, &args)  &&
+        connect_server(&args, &stream)  &&
+        send_request(&args, stream)  &&
+        TEST_OK(fflush(stream) == 0)  &&
+        check_response(stream)  &&
+        read_header(&args, stream, &sample_count, &header)  &&
+        load_data(&args, stream, (size_t) sample_count, &header, outputs);
+    if (stream)
+        fclose(stream);
+
+    char *error_message = pop_error_handling(!ok);
+    if (ok)
+        for (int i = 0; i < nlhs  ||  i == 0; i ++)
+            plhs[i] = outputs[i];
+    else
+    {
+        /* mexErrMsgIdAndTxt() doesn't return, so the message can't be freed
+         * after it has been reported. */
+        char message[1024];
+        snprintf(message, sizeof(message), "%s", error_message);
+        free(error_message);
+        mexErrMsgIdAndTxt("fa_load:error", "%s", message);
+    }
+}
@@ -30,14 +30,17 @@ DEFAULT_SERVER = 'fa-archiver.diamond.ac.uk'
 DEFAULT_PORT = 8888
 
 import re
+import socket
+import struct
+import threading
 import numpy
 import cothread
 from cothread import cosocket
 
 
 __all__ = [
-    'connection', 'subscription', 'get_sample_frequency', 'get_decimation',
-    'Server']
+    'connection', 'subscription', 'persistent_connection', 'stream_reader',
+    'get_sample_frequency', 'get_decimation', 'Server']
 
 
 def format_mask(mask):
@@ -151,6 +154,327 @@ class subscription(connection):
         return array.reshape((samples, self.count, 2))
 
 
+class persistent_connection(connection):
+    '''c = persistent_connection(server, port)
+
+    Holds a single connection to the server open for any number of commands
+    other than subscriptions.  Each command returns the complete response as a
+    string, and several commands can be pipelined by calling c.commands().
+    '''
+
+    def __init__(self, **kargs):
+        connection.__init__(self, **kargs)
+        self.sock.sendall('K\n')
+        # The K command is acknowledged by an empty response.
+        if self.read_block(8).tostring() != 8 * chr(0):
+            raise self.Error('Server does not support persistent connections')
+
+    def read_response(self):
+        # Each response is sent as a sequence of frames prefixed by their
+        # length, terminated by an empty frame.
+        frames = []
+        while True:
+            length, = struct.unpack('<Q', self.read_block(8).tostring())
+            if length:
+                frames.append(self.read_block(length).tostring())
+            else:
+                return ''.join(frames)
+
+    def command(self, command):
+        return self.commands([command])[0]
+
+    def commands(self, commands):
+        self.sock.sendall(''.join('%s\n' % command for command in commands))
+        return [self.read_response() for command in commands]
+
+
+# Compressed data is packed in groups of this many samples, see compress.h in
+# the archiver sources.
+DELTA_GROUP_SIZE = 64
+
+def unpack_column(packed, count):
+    '''Unpacks a single column of count samples from the given uint8 array,
+    returning a (count, 2) array of int32 values.'''
+    if len(packed) == 8 * count:
+        return packed.view(numpy.int32).reshape(count, 2)
+
+    # The column starts with an X and Y bit width for each group, followed by
+    # the packed zig zag coded differences for each, X and Y in turn.
+    groups = count // DELTA_GROUP_SIZE
+    table = (2 * groups + 7) & ~7
+    widths = packed[:2 * groups].astype(numpy.uint64)
+    words = numpy.append(packed[table:].view('<u8'), numpy.uint64(0))
+    starts = numpy.cumsum(widths) - widths
+
+    # Work out where every value lives in the packed words and extract them all
+    # in one go, including the high bits of values straddling two words.
+    index = numpy.arange(DELTA_GROUP_SIZE, dtype = numpy.uint64)
+    width = widths[:, None]
+    bit = width * index[None, :]
+    word = (starts[:, None] + bit // numpy.uint64(64)).astype(numpy.intp)
+    shift = bit % numpy.uint64(64)
+    low = words[word] >> shift
+    high = numpy.where(shift + width > numpy.uint64(64),
+        words[word + 1] << ((numpy.uint64(64) - shift) % numpy.uint64(64)),
+        numpy.uint64(0))
+    mask = (numpy.uint64(1) << width) - numpy.uint64(1)
+    values = ((low | high) & mask).astype(numpy.uint32)
+
+    # Undo the zig zag coding and integrate the differences.
+    deltas = (values >> numpy.uint32(1)) ^ \
+        ((values & numpy.uint32(1)) * numpy.uint32(0xFFFFFFFF))
+    deltas = deltas.reshape(groups, 2, DELTA_GROUP_SIZE)
+    result = numpy.empty((count, 2), dtype = numpy.uint32)
+    result[:, 0] = numpy.cumsum(deltas[:, 0, :].ravel(), dtype = numpy.uint32)
+    result[:, 1] = numpy.cumsum(deltas[:, 1, :].ravel(), dtype = numpy.uint32)
+    return result.view(numpy.int32)
+
+
+def unpack_frames(packed, sample_count, field_count):
+    '''Unpacks a compressed chunk of frames from the given uint8 array as sent
+    by the server, returning an array indexed by sample, field and channel.'''
+    packed_count = sample_count - sample_count % DELTA_GROUP_SIZE
+    lengths = packed[:4 * field_count].view('<u4')
+    offset = (4 * field_count + 7) & ~7
+    result = numpy.empty((sample_count, field_count, 2), dtype = numpy.int32)
+    for i, length in enumerate(lengths):
+        if packed_count > 0:
+            result[:packed_count, i] = \
+                unpack_column(packed[offset:offset + length], packed_count)
+        offset += length
+    result[packed_count:] = packed[offset:].view(numpy.int32).reshape(
+        sample_count - packed_count, field_count, 2)
+    return result
+
+
+class stream_reader:
+    '''r = stream_reader(bpm_list, decimated, timestamps, buffer_size, ...)
+
+    Creates a stream connection to the given server like subscription, but the
+    data is received on a background thread directly into a preallocated ring
+    buffer of buffer_size samples.  Reception continues while the caller is
+    busy, and as the socket is read outside the Python interpreter lock no data
+    is copied or converted by Python on the way in.
+
+    The r.read() method returns the next block of samples as a view into the
+    ring buffer, which remains valid until the next call to r.read().  If
+    timestamps is set extended timestamps are requested and r.read() also
+    returns an array of sample timestamps in seconds in the Unix epoch.
+
+    If compressed is set the server is asked to compress the data, which is
+    unpacked as each block arrives.  This is worth doing over slow links.
+    '''
+
+    class EOF(Exception):
+        pass
+    class Error(Exception):
+        pass
+
+    def __init__(self, mask, decimated=False, uncork=False, timestamps=False,
+            compressed=False, buffer_size=1 << 18,
+            server=DEFAULT_SERVER, port=DEFAULT_PORT, timeout=1):
+        self.count, format = format_mask(mask)
+        self.decimated = decimated
+        self.timestamps = timestamps
+        self.compressed = compressed
+        self.__running = True
+
+        # The socket is read from an ordinary thread, so can't be a cosocket.
+        self.sock = socket.create_connection((server, port), timeout)
+        flags = ''
+        if timestamps: flags = flags + 'TE'
+        if uncork: flags = flags + 'U'
+        if compressed: flags = flags + 'X'
+        if decimated: flags = flags + 'D'
+        self.sock.sendall('S%s%s\n' % (format, flags))
+        c = self.sock.recv(1)
+        if c != chr(0):
+            raise self.Error((c + self.sock.recv(1024))[:-1])
+
+        # With extended timestamps each block of data is preceded by its
+        # timestamp and duration.  We keep these in a parallel ring of blocks,
+        # taking care that blocks never straddle the end of the data ring.
+        self.sample_size = 8 * self.count
+        if timestamps:
+            header = numpy.empty(2, dtype = numpy.uint32)
+            self.__fill(header.view(numpy.uint8))
+            self.block_size = int(header[0])
+            blocks = max(buffer_size // self.block_size, 2)
+            self.ring_size = blocks * self.block_size
+            self.block_stamps = numpy.empty(blocks,
+                dtype = [('timestamp', '<u8'), ('duration', '<u4')])
+            self.max_read = self.ring_size - self.block_size
+        else:
+            self.ring_size = buffer_size
+            self.max_read = buffer_size
+        self.data = numpy.empty(
+            (self.ring_size, self.count, 2), dtype = numpy.int32)
+        self.__raw = self.data.reshape(-1).view(numpy.uint8)
+
+        # The reader thread writes up to the position released by the caller
+        # plus the ring size.  Positions are absolute byte offsets so that
+        # partial samples can be received when not reading in blocks.
+        self.__lock = threading.Lock()
+        self.__space = threading.Condition(self.__lock)
+        self.__written = 0          # Bytes received
+        self.__released = 0         # Samples no longer in use by caller
+        self.__position = 0         # Next sample to return
+        self.__wanted = None        # Bytes wanted by waiting caller
+        self.__error = None
+        self.__ready = cothread.Event(auto_reset = True)
+
+        self.__thread = threading.Thread(target = self.__reader)
+        self.__thread.daemon = True
+        self.__thread.start()
+
+    def close(self):
+        with self.__lock:
+            self.__running = False
+            self.__space.notify()
+        try:
+            self.sock.shutdown(socket.SHUT_RDWR)
+        except socket.error:
+            pass
+        self.__thread.join()
+        self.sock.close()
+
+    def __fill(self, buffer):
+        '''Receives exactly enough data to fill the given byte array.'''
+        view = memoryview(buffer)
+        rx = 0
+        while rx < len(buffer):
+            rx += self.__recv_into(view[rx:])
+
+    def __recv_into(self, view):
+        while True:
+            try:
+                rx = self.sock.recv_into(view)
+            except socket.timeout:
+                if not self.__running:
+                    raise self.EOF('Connection closed')
+            else:
+                if rx == 0:
+                    raise self.EOF('Connection closed by server')
+                return rx
+
+    def __wait_for_space(self, length):
+        '''Waits until length bytes can be written without overwriting data
+        still in use by the caller, returns the ring offset to write to.'''
+        with self.__lock:
+            while self.__running and self.__written + length > \
+                    (self.__released + self.ring_size) * self.sample_size:
+                self.__space.wait(1)
+            if not self.__running:
+                raise self.EOF('Connection closed')
+            return self.__written % (self.ring_size * self.sample_size)
+
+    def __read_chunk(self):
+        '''Receives and unpacks a single compressed chunk.'''
+        header = numpy.empty(2, dtype = numpy.uint32)
+        self.__fill(header.view(numpy.uint8))
+        packed = numpy.empty(int(header[1]), dtype = numpy.uint8)
+        self.__fill(packed)
+        frames = unpack_frames(packed, int(header[0]), self.count)
+        return frames.reshape(-1).view(numpy.uint8)
+
+    def __store(self, data):
+        '''Copies unpacked data into the ring, wrapping as necessary.'''
+        length = len(data)
+        offset = self.__wait_for_space(length)
+        first = min(length, len(self.__raw) - offset)
+        self.__raw[offset:offset + first] = data[:first]
+        self.__raw[:length - first] = data[first:]
+        self.__publish(length)
+
+    def __publish(self, length):
+        with self.__lock:
+            self.__written += length
+            wake = self.__wanted is not None and \
+                self.__written >= self.__wanted
+            if wake:
+                self.__wanted = None
+        if wake:
+            cothread.Callback(self.__ready.Signal)
+
+    def __reader(self):
+        block_bytes = self.block_size * self.sample_size \
+            if self.timestamps else 0
+        ring_bytes = self.ring_size * self.sample_size
+        try:
+            while True:
+                if self.timestamps:
+                    # Read the timestamp and then the complete block.
+                    offset = self.__wait_for_space(block_bytes)
+                    block = offset // block_bytes
+                    self.__fill(
+                        self.block_stamps[block:block+1].view(numpy.uint8))
+                    if self.compressed:
+                        data = self.__read_chunk()
+                        if len(data) != block_bytes:
+                            raise self.Error('Unexpected compressed block')
+                        self.__raw[offset:offset + block_bytes] = data
+                    else:
+                        self.__fill(self.__raw[offset:offset + block_bytes])
+                    self.__publish(block_bytes)
+                elif self.compressed:
+                    self.__store(self.__read_chunk())
+                else:
+                    # Take whatever has arrived, up to the end of the ring.
+                    offset = self.__wait_for_space(1)
+                    with self.__lock:
+                        length = min(ring_bytes - offset,
+                            (self.__released + self.ring_size) *
+                                self.sample_size - self.__written)
+                    self.__publish(self.__recv_into(
+                        memoryview(self.__raw[offset:offset + length])))
+        except Exception, error:
+            with self.__lock:
+                self.__error = error
+            cothread.Callback(self.__ready.Signal)
+
+    def read(self, samples):
+        '''Returns the next samples samples indexed by sample count, bpm
+        count and channel, as for subscription.read(), together with sample
+        timestamps if requested.  The returned array is normally a view of the
+        ring buffer and is only valid until the next call.'''
+        assert samples <= self.max_read, 'Read larger than buffer'
+        target = self.__position + samples
+        with self.__lock:
+            # The previously returned block can now be overwritten.
+            self.__released = self.__position
+            self.__space.notify()
+        while True:
+            with self.__lock:
+                if self.__written >= target * self.sample_size:
+                    break
+                elif self.__error is not None:
+                    raise self.__error
+                self.__wanted = target * self.sample_size
+            self.__ready.Wait()
+
+        first = self.__position
+        self.__position = target
+        start = first % self.ring_size
+        if start + samples <= self.ring_size:
+            data = self.data[start:start + samples]
+        else:
+            data = numpy.concatenate((
+                self.data[start:],
+                self.data[:start + samples - self.ring_size]))
+        if self.timestamps:
+            return data, self.__compute_timestamps(first, samples)
+        else:
+            return data
+
+    def __compute_timestamps(self, first, samples):
+        '''Interpolates sample timestamps from the block timestamps.'''
+        index = numpy.arange(first, first + samples)
+        block = index // self.block_size
+        stamps = self.block_stamps[block % len(self.block_stamps)]
+        fraction = (index - block * self.block_size) / float(self.block_size)
+        return 1e-6 * (stamps['timestamp'] + fraction * stamps['duration'])
+
+
 def server_command(command, **kargs):
     server = connection(**kargs)
     server.sock.send(command)
@@ -209,6 +533,14 @@ class Server:
         return subscription(
             mask, server = self.server, port = self.port, **kargs)
 
+    def stream_reader(self, mask, **kargs):
+        return stream_reader(
+            mask, server = self.server, port = self.port, **kargs)
+
+    def persistent_connection(self, **kargs):
+        return persistent_connection(
+            server = self.server, port = self.port, **kargs)
+
     def get_fa_ids(self, stored = False, missing = False):
         '''Retrieves list of BPM FA ids from server.  If stored is set then the
         list is filtered to return only archived ids.  If missing is set then
@@ -36,26 +36,45 @@ import numpy
 
 
 class buffer:
-    '''Circular buffer.'''
-    # Super lazy implementation: we always just copy the data to the bottom!
+    '''Circular buffer.  Each write overwrites the oldest data, and reads
+    return the most recent data in time order.  The buffer is stored twice
+    over, so that every read is a view of a contiguous slice and no data is
+    ever moved or copied on reading.'''
 
     def __init__(self, buffer_size):
-        self.buffer = numpy.zeros((buffer_size, 2))
+        self.buffer = numpy.zeros((2 * buffer_size, 2))
         self.buffer_size = buffer_size
+        self.write_ix = 0
+        self.written = 0
+
+    def __write(self, ix, block):
+        # Writes block at ix into both copies of the buffer.
+        size = self.buffer_size
+        self.buffer[ix:ix + len(block)] = block
+        self.buffer[size + ix:size + ix + len(block)] = block
 
     def write(self, block):
+        size = self.buffer_size
+        block = block[-size:]
         blen = len(block)
-        self.buffer[:-blen] = self.buffer[blen:]
-        self.buffer[-blen:] = block
+        ix = self.write_ix
+        first = min(blen, size - ix)
+        self.__write(ix, block[:first])
+        self.__write(0, block[first:])
+        self.write_ix = (ix + blen) % size
+        self.written += blen
 
     def size(self):
-        return self.data_size
+        return self.buffer_size
 
     def read(self, size):
-        return self.buffer[-size:]
+        end = self.write_ix + self.buffer_size
+        return self.buffer[end - size:end]
 
     def reset(self):
         self.buffer[:] = 0
+        self.write_ix = 0
+        self.written = 0
 
 
 class monitor:
@@ -76,8 +95,11 @@ class monitor:
     def start(self):
         assert not self.running, 'Strange: we are already running'
         try:
-            self.subscription = self.server.subscription(
-                [self.id], decimated = self.decimated, uncork = self.decimated)
+            # The stream reader keeps receiving on its own thread while we're
+            # busy updating the display, so we don't fall behind the server.
+            self.subscription = self.server.stream_reader(
+                [self.id], decimated = self.decimated, uncork = self.decimated,
+                buffer_size = self.buffer.buffer_size)
         except Exception, message:
             import traceback
             traceback.print_exc()
@@ -129,3 +151,8 @@ class monitor:
     def read(self):
         '''Can be called at any time to read the most recent buffer.'''
         return 1e-3 * self.buffer.read(self.notify_size)
+
+    def position(self):
+        '''Returns the number of samples received since the last restart, which
+        is the stream position just after the end of the most recent buffer.'''
+        return self.buffer.written
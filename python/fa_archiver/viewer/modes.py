@@ -249,18 +249,26 @@ class mode_raw(mode_common):
         self.set_visible()
 
 
+hann_windows = {}
+
+def hann_window(N):
+    '''Returns a Hann window of length N, computed on first use.'''
+    # The Hann window is good enough.  In some cases the Hamming window looks a
+    # bit better, but then I'd need a choice of windows.  Not really the point
+    # here, so just go for the simplest...
+    if N not in hann_windows:
+        hann_windows[N] = \
+            1 + numpy.cos(numpy.linspace(-numpy.pi, numpy.pi, N))
+    return hann_windows[N]
+
 def scaled_abs_fft(value, sample_frequency, windowed=False, axis=0):
     '''Returns the fft of value (along axis 0) scaled so that values are in
     units per sqrt(Hz).  The magnitude of the first half of the spectrum is
     returned.'''
     if windowed:
-        # The Hann window is good enough.  In some cases the Hamming window
-        # looks a bit better, but then I'd need a choice of windows.  Not really
-        # the point here, so just go for the simplest...
-        window = 1 + numpy.cos(
-            numpy.linspace(-numpy.pi, numpy.pi, value.shape[axis]))
-        value = value * window[:, None]
-    fft = numpy.fft.fft(value, axis=axis)
+        value = value * hann_window(value.shape[axis])[:, None]
+    # As the data is real only the first half of the spectrum is needed.
+    fft = numpy.fft.rfft(value, axis=axis)
 
     # This trickery below is simply implementing fft[:N//2] where the slicing is
     # along the specified axis rather than axis 0.  It does seem a bit
@@ -273,6 +281,66 @@ def scaled_abs_fft(value, sample_frequency, windowed=False, axis=0):
     # Finally scale the result into units per sqrt(Hz)
     return numpy.abs(fft) * numpy.sqrt(2.0 / (sample_frequency * N))
 
+class running_spectrum:
+    '''Maintains the mean power spectrum of the most recent segments of the
+    data stream.  Segments of segment_length samples start every hop samples of
+    the stream, and the spectrum of each segment is computed only once, as soon
+    as the segment is complete.  The spectra are kept in a ring together with
+    their running sum, so that each update costs the same however many segments
+    are averaged.'''
+
+    def __init__(self, segment_length, window_length, hop):
+        self.segment_length = segment_length
+        self.hop = hop
+        # Number of segments which fit into the displayed window.
+        self.segment_count = (window_length - segment_length) // hop + 1
+        self.powers = numpy.zeros(
+            (self.segment_count, segment_length // 2, 2))
+        self.reset()
+
+    def reset(self):
+        self.total = numpy.zeros(self.powers.shape[1:])
+        self.ix = 0
+        self.valid = 0
+        self.next = None
+
+    def __add_power(self, power):
+        # Replaces the oldest segment in the ring by power.
+        self.total += power - self.powers[self.ix]
+        self.powers[self.ix] = power
+        self.ix = (self.ix + 1) % self.segment_count
+        self.valid = min(self.valid + 1, self.segment_count)
+        if self.ix == 0:
+            # Refresh the sum to stop rounding errors accumulating.
+            self.total = numpy.sum(self.powers, axis=0)
+
+    def update(self, value, position, sample_frequency, windowed):
+        '''Processes any new complete segments in value, the most recent data
+        ending at stream position, and returns the mean amplitude spectrum.'''
+        L = self.segment_length
+        start = position - len(value)
+        # Start of the last complete segment in value.
+        last = (position - L) // self.hop * self.hop
+        if self.next is None  or  self.next > last + self.hop  or \
+                self.next < start:
+            # Restart from the oldest segments still in value.
+            self.reset()
+            self.next = max(
+                -(-start // self.hop) * self.hop,
+                last - (self.segment_count - 1) * self.hop)
+
+        if self.next <= last:
+            offsets = numpy.arange(self.next - start, last - start + 1, self.hop)
+            segments = value[offsets[:, None] + numpy.arange(L)]
+            power = scaled_abs_fft(
+                segments, sample_frequency, windowed = windowed, axis = 1)**2
+            for p in power:
+                self.__add_power(p)
+            self.next = last + self.hop
+
+        return numpy.sqrt(self.total / max(self.valid, 1))
+
+
 def fft_timebase(sample_count, sample_frequency, scale=1.0):
     '''Returns a waveform suitable for an FFT timebase with the given number of
     points.'''
@@ -300,6 +368,7 @@ class mode_fft(mode_common):
 
         self.windowed = QtGui.QCheckBox('Windowed', parent.ui)
         self.windowed.setChecked(True)
+        self.windowed.stateChanged.connect(self.reset_spectrum)
         self.addWidget(self.windowed)
 
         squared = QtGui.QCheckBox(
@@ -313,6 +382,7 @@ class mode_fft(mode_common):
 
         self.set_squared_state(False)
         self.decimation = self.selector.decimation
+        self.spectrum = None
 
     def set_timebase(self, sample_count, sample_frequency):
         self.sample_count = sample_count
@@ -322,8 +392,16 @@ class mode_fft(mode_common):
 
     def set_decimation(self, decimation):
         self.decimation = decimation
-        self.xaxis = fft_timebase(
-            self.sample_count // self.decimation, self.sample_frequency)
+        segment_length = self.sample_count // self.decimation
+        self.xaxis = fft_timebase(segment_length, self.sample_frequency)
+        # Segments overlap so that each update adds at least one new segment.
+        self.spectrum = running_spectrum(
+            segment_length, self.sample_count,
+            min(segment_length, self.parent.monitor.update_size))
+
+    def reset_spectrum(self, state=None):
+        if self.spectrum:
+            self.spectrum.reset()
 
     def set_squared_state(self, show_squared):
         self.show_squared = show_squared
@@ -344,16 +422,12 @@ class mode_fft(mode_common):
             result = scaled_abs_fft(
                 value, self.sample_frequency, windowed = windowed)
         else:
-            # Compute a decimated fft by segmenting the waveform (by reshaping),
-            # computing the fft of each segment, and computing the mean power of
-            # all the resulting transforms.
-            N = len(value)
-            points = len(value) // self.decimation
-            value = value[:points * self.decimation].reshape(
-                (self.decimation, points, 2))
-            fft = scaled_abs_fft(
-                value, self.sample_frequency, windowed = windowed, axis=1)
-            result = numpy.sqrt(numpy.mean(fft**2, axis=0))
+            # Compute a decimated fft as the mean power of the ffts of the
+            # segments making up the waveform.  Only segments which have
+            # arrived since the last update need to be transformed.
+            result = self.spectrum.update(
+                value, self.parent.monitor.position(),
+                self.sample_frequency, windowed)
         if self.show_squared:
             return result ** 2
         else:
@@ -373,16 +447,10 @@ def condense(value, counts):
     number of points are generated in each decade.  The accumulation and number
     of accumulated points are returned as separate waveforms.'''
 
-    # The result is the same shape as the value in all axes except the first.
-    shape = list(value.shape)
-    shape[0] = len(counts)
-    sums = numpy.empty(shape)
-
-    left = 0
-    for i, step in enumerate(counts):
-        sums[i] = numpy.sum(value[left:left + step], axis=0)
-        left += step
-    return sums
+    # The counts are all positive, so each sum runs from the start of its
+    # interval to the start of the next.
+    starts = numpy.cumsum(counts) - counts
+    return numpy.add.reduceat(value[:numpy.sum(counts)], starts, axis=0)
 
 
 FFT_LOGF_POINTS = 5000
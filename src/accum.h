@@ -0,0 +1,255 @@
+/* Accumulators for computing decimated data.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* To avoid overflow and to support the incremental calculation of variance we
+ * need to use a long accumulator.  Unfortunately on 32 bit systems we have no
+ * intrinsic support for 128 bit integers, so we need some conditional
+ * compilation here.
+ *    The only operations we need are accumulation (of 64 and 128 bit
+ * intermediates) and shifting out or converting the result. */
+
+#ifdef __i386__
+/* Only have 64 bit integers, need to emulate the 128 bit accumulator. */
+
+struct uint128 { uint64_t low; uint64_t high; };
+typedef struct uint128 uint128_t;
+
+/* It's really rather annoying, there doesn't seem to be any good way other than
+ * resorting to the assembler below to efficiently compute with 128 bit numbers.
+ * The principal problem is that the carry is inaccessible.  The alternative
+ * trick of writing:
+ *      acc->low += val; if (acc->low < val) acc->high += 1;
+ * generates horrible code.
+ *
+ * Some notes on the assembler constraints, because the documentation can be a
+ * bit opaque and some of the interactions are quite subtle:
+ *
+ *  1.  The form of the asm statement is
+ *          __asm__(<code> : <outputs> : <inputs> : <effects>)
+ *  2.  We must at least specify "m"(*acc) otherwise the code can end up being
+ *      discarded (as having no significant side effects).
+ *  3.  The "=&r"(t) output assigns a temporary register.  The & ensures that
+ *      this register doesn't overlap with any of the input registers.
+ *  4.  The register modifier = is used for an output which is written without
+ *      being read, + is used for an output which is also read. */
+
+static inline void accum128_64(uint128_t *acc, uint64_t val)
+{
+    __asm__(
+        "addl   %[vall], 0(%[acc])" "\n\t"
+        "adcl   %[valh], 4(%[acc])" "\n\t"
+        "adcl   $0, 8(%[acc])" "\n\t"
+        "adcl   $0, 12(%[acc])"
+        :
+        : [acc] "r" (acc), "m" (*acc),
+          [vall] "r" ((uint32_t) val), [valh] "r" ((uint32_t) (val >> 32))
+        : "cc" );
+}
+
+static inline void accum128_128(uint128_t *acc, const uint128_t *val)
+{
+    int t;
+    __asm__(
+        "movl   0(%[val]), %[t]" "\n\t"
+        "addl   %[t], 0(%[acc])" "\n\t"
+        "movl   4(%[val]), %[t]" "\n\t"
+        "adcl   %[t], 4(%[acc])" "\n\t"
+        "movl   8(%[val]), %[t]" "\n\t"
+        "adcl   %[t], 8(%[acc])" "\n\t"
+        "movl   12(%[val]), %[t]" "\n\t"
+        "adcl   %[t], 12(%[acc])"
+        : [t] "=&r" (t), "+m" (*acc)
+        : [acc] "r" (acc), [val] "r" (val), "m" (*val)
+        : "cc" );
+}
+
+static inline uint64_t sr128(uint128_t *acc, unsigned int shift)
+{
+    return (acc->low >> shift) | (acc->high << (64 - shift));
+}
+
+static inline double uint128_to_double(const uint128_t *acc)
+{
+    return ldexp((double) acc->high, 64) + (double) acc->low;
+}
+
+#else
+/* Assume built-in 128 bit integers. */
+
+typedef __uint128_t uint128_t;
+
+static inline void accum128_64(uint128_t *acc, uint64_t val)
+{
+    *acc += val;
+}
+
+static inline void accum128_128(uint128_t *acc, const uint128_t *val)
+{
+    *acc += *val;
+}
+
+static inline uint64_t sr128(uint128_t *acc, unsigned int shift)
+{
+    return (uint64_t) (*acc >> shift);
+}
+
+static inline double uint128_to_double(const uint128_t *acc)
+{
+    return (double) *acc;
+}
+
+#endif
+
+
+/* The calculation of variance is really rather delicate, as it is enormously
+ * susceptible to numerical problems.  The "proper" way to compute variance is
+ * using the formula
+ *      var = SUM((x[i] - m)^2) / N   where  m = mean(x) = SUM(x[i]) / N  .
+ * This approach isn't so great when dealing with a stream of data, which we
+ * have in the case of double decimation, as we need to pass over the dataset
+ * twice.  The alternative calulcation is:
+ *      var = SUM(x[i]^2) / N - m^2  ,
+ * but this is *very* demanding on the intermediate values, particularly if the
+ * result is to be accurate when m is large.  In this application x[i] is 32
+ * bits, N maybe up to 16 bits, and so we need around 80 bits for the sum, hence
+ * the use of 128 bits for the accumulator. */
+
+static inline int32_t compute_std(
+    uint128_t *acc, int64_t sum, unsigned int shift)
+{
+    /* It's sufficiently accurate and actually faster to change over to floating
+     * point arithmetic at this point. */
+    double mean = (double) sum / (double) (1 << shift);
+    double var  = (double) sr128(acc, shift) - mean * mean;
+    /* Note that rounding errors still allow var in the range -1..0, so need to
+     * truncate these to zero. */
+    return var > 0 ? (int32_t) sqrt(var) : 0;
+}
+
+
+/* Accumulator for generating decimated data. */
+struct fa_accum {
+    int32_t minx, maxx, miny, maxy;
+    int64_t sumx, sumy;
+    uint128_t sum_sq_x, sum_sq_y;
+};
+
+static inline void initialise_accum(struct fa_accum *acc)
+{
+    memset(acc, 0, sizeof(struct fa_accum));
+    acc->minx = INT32_MAX;
+    acc->maxx = INT32_MIN;
+    acc->miny = INT32_MAX;
+    acc->maxy = INT32_MIN;
+}
+
+static inline void accum_xy(struct fa_accum *acc, const struct fa_entry *input)
+{
+    int32_t x = input->x;
+    int32_t y = input->y;
+    if (x < acc->minx)   acc->minx = x;
+    if (acc->maxx < x)   acc->maxx = x;
+    if (y < acc->miny)   acc->miny = y;
+    if (acc->maxy < y)   acc->maxy = y;
+    acc->sumx += x;
+    acc->sumy += y;
+    accum128_64(&acc->sum_sq_x, (uint64_t) ((int64_t) x * x));
+    accum128_64(&acc->sum_sq_y, (uint64_t) ((int64_t) y * y));
+}
+
+static inline void accum_accum(
+    struct fa_accum *result, const struct fa_accum *input)
+{
+    if (input->minx < result->minx)   result->minx = input->minx;
+    if (result->maxx < input->maxx)   result->maxx = input->maxx;
+    if (input->miny < result->miny)   result->miny = input->miny;
+    if (result->maxy < input->maxy)   result->maxy = input->maxy;
+    result->sumx += input->sumx;
+    result->sumy += input->sumy;
+    accum128_128(&result->sum_sq_x, &input->sum_sq_x);
+    accum128_128(&result->sum_sq_y, &input->sum_sq_y);
+}
+
+static inline void compute_result(
+    struct fa_accum *acc, unsigned int shift, struct decimated_data *result)
+{
+    result->min.x = acc->minx;
+    result->max.x = acc->maxx;
+    result->min.y = acc->miny;
+    result->max.y = acc->maxy;
+    result->mean.x = (int32_t) (acc->sumx >> shift);
+    result->mean.y = (int32_t) (acc->sumy >> shift);
+    result->std.x = compute_std(&acc->sum_sq_x, acc->sumx, shift);
+    result->std.y = compute_std(&acc->sum_sq_y, acc->sumy, shift);
+}
+
+
+/* The following are used to aggregate decimated data and to compute results
+ * over counts which needn't be a power of 2. */
+
+/* Accumulates a single decimated sample: the sum of squares is accumulated
+ * from the mean and variance of the sample. */
+static inline void accum_decimated(
+    struct fa_accum *acc, const struct decimated_data *input)
+{
+    if (input->min.x < acc->minx)   acc->minx = input->min.x;
+    if (acc->maxx < input->max.x)   acc->maxx = input->max.x;
+    if (input->min.y < acc->miny)   acc->miny = input->min.y;
+    if (acc->maxy < input->max.y)   acc->maxy = input->max.y;
+    acc->sumx += input->mean.x;
+    acc->sumy += input->mean.y;
+    accum128_64(&acc->sum_sq_x,
+        (uint64_t) ((int64_t) input->mean.x * input->mean.x) +
+        (uint64_t) ((int64_t) input->std.x * input->std.x));
+    accum128_64(&acc->sum_sq_y,
+        (uint64_t) ((int64_t) input->mean.y * input->mean.y) +
+        (uint64_t) ((int64_t) input->std.y * input->std.y));
+}
+
+static inline int32_t compute_count_std(
+    const uint128_t *acc, int64_t sum, unsigned int count)
+{
+    double mean = (double) sum / count;
+    double var  = uint128_to_double(acc) / count - mean * mean;
+    return var > 0 ? (int32_t) sqrt(var) : 0;
+}
+
+/* Computes the result of accumulating count samples. */
+static inline void compute_count_result(
+    struct fa_accum *acc, unsigned int count, struct decimated_data *result)
+{
+    result->min.x = acc->minx;
+    result->max.x = acc->maxx;
+    result->min.y = acc->miny;
+    result->max.y = acc->maxy;
+    result->mean.x = (int32_t) floor((double) acc->sumx / count);
+    result->mean.y = (int32_t) floor((double) acc->sumy / count);
+    result->std.x = compute_count_std(&acc->sum_sq_x, acc->sumx, count);
+    result->std.y = compute_count_std(&acc->sum_sq_y, acc->sumy, count);
+}
@@ -57,6 +57,10 @@
 #include "decimate.h"
 #include "replay.h"
 #include "gigabit.h"
+#include "relay.h"
+#include "placement.h"
+#include "spectrum.h"
+#include "snapshot.h"
 
 
 #define K               1024
@@ -90,6 +94,13 @@ static unsigned int buffer_blocks = BUFFER_BLOCKS;
 static int server_socket = 8888;
 /* Socket of the incoming fa-data stream */
 static int gigabit_port = 2048;
+static const char *gigabit_interface = NULL;
+/* Upstream archiver as server[:port] when relaying. */
+static const char *relay_upstream = NULL;
+/* Placement of large buffers. */
+static bool use_hugepages = false;
+static bool lock_memory = false;
+static int numa_node = -1;
 /* Decimation configuration file. */
 static const char *decimation_config = NULL;
 /* File from which to load list of FA ids. */
@@ -100,6 +111,7 @@ static enum sniffer_source {
     SNIFFER_DEVICE,         // Standard sniffer device /dev/fa_sniffer0 etc
     SNIFFER_REPLAY,         // Replay sniffer data from file
     SNIFFER_GIGABIT,        // Gigabit ethernet (Libera grouping) data source
+    SNIFFER_RELAY,          // Subscription to an upstream archiver
     SNIFFER_NONE,           // No data source
 } sniffer_source = SNIFFER_UNSET;
 /* If set enables extra socket server commands for debug control. */
@@ -114,6 +126,27 @@ static const char *server_bind_address = NULL;
 static const char *server_name = "";
 /* If non zero, identifies FA id used for event stream. */
 static unsigned int events_fa_id = (unsigned int) -1;
+/* Number of threads sharing the transposition and decimation of archive data. */
+static unsigned int transform_threads = 1;
+/* Number of major blocks which can be queued for writing to disk. */
+static unsigned int write_queue_depth = 1;
+/* Number of threads warming up the in memory data at startup, 0 for none. */
+static unsigned int warm_up_threads = 2;
+/* Limit on bandwidth used for reading from the archive, 0 for no limit. */
+static uint64_t read_bandwidth = 0;
+/* Size of shared cache for archive reads, 0 for no cache. */
+static uint64_t read_cache_size = 0;
+/* Size of cache for paging DD data, 0 to keep all DD data in memory. */
+static uint64_t dd_cache_size = 0;
+/* Number of threads serving archive read requests. */
+static unsigned int server_threads = 16;
+/* Number of threads computing spectra for spectrum subscriptions. */
+static unsigned int spectrum_threads = 1;
+/* Files replayed in turn by the dummy sniffer. */
+static const char *replay_files[MAX_REPLAY_FILES];
+static unsigned int replay_file_count = 0;
+/* Replay speed relative to the normal FA rate, 0 for as fast as possible. */
+static double replay_speed = 1;
 
 
 static void usage(void)
@@ -136,14 +169,42 @@ static void usage(void)
 "    -p:  Write PID to specified file\n"
 "    -s:  Specify server socket (default 8888)\n"
 "    -B:  Bind server socket to specified address (otherwise listens on all)\n"
-"    -F:  Run dummy sniffer with canned data.\n"
+"    -F:  Run dummy sniffer with canned data.  Can be repeated to replay\n"
+"         several files in turn.\n"
+"    -f:  Replay canned data at this multiple of normal speed, or as fast as\n"
+"         the archiver can accept it if 0 (default 1)\n"
 "    -E:  Specify event code FA id\n"
 "    -X   Enable extra commands (debug only)\n"
 "    -R   Set SO_REUSEADDR on listening socket, debug use only\n"
 "    -G   Use gigabit ethernet as data source\n"
 "    -S:  Specify the gigabit ethernet data source socket (default 2048)\n"
+"    -I:  Capture gigabit ethernet through a packet ring on this interface\n"
+"    -U:  Relay live data from the upstream archiver server[:port]\n"
 "    -N   Run without data source, archive effectively read-only\n"
-        , argv0, buffer_blocks);
+"    -w:  Specify number of threads for archive processing (default %u)\n"
+"    -W:  Specify number of major blocks queued for writing (default %u)\n"
+"    -Q:  Limit archive read bandwidth in bytes per second (default no limit)\n"
+"    -u:  Specify number of threads reading in the index and DD data at\n"
+"         startup (default %u), or 0 to only read them in as needed\n"
+"    -C:  Specify size of shared cache for archive reads (default no cache)\n"
+"    -m:  Page DD data from disk through a cache of this size instead of\n"
+"         keeping it all in memory\n"
+"    -T:  Specify number of threads serving client commands (default %u)\n"
+"    -P:  Specify number of threads computing spectra (default %u)\n"
+"    -H   Back the FA and transform buffers with hugepages\n"
+"    -L   Lock the FA and transform buffers in memory\n"
+"    -M:  Bind the FA and transform buffers to the given NUMA node\n"
+"    -A:  Set the placement of a class of pipeline thread, of the form\n"
+"         name=cpus[:policy[:priority]], where name is one of sniffer,\n"
+"         transform, writer or decimate, and policy is one of other, fifo\n"
+"         or rr.  Can be repeated.\n"
+"    -y:  Set the snapshot window as pre,post[,count]: samples captured before\n"
+"         and after each trigger and number of snapshots kept (default\n"
+"         10000,10000,8)\n"
+"    -Y:  Add a snapshot trigger, either E<mask> for event bits or\n"
+"         B<id>:<limit> for a position threshold.  Can be repeated.\n"
+        , argv0, buffer_blocks, transform_threads, write_queue_depth,
+        warm_up_threads, server_threads, spectrum_threads);
 }
 
 
@@ -156,13 +217,24 @@ static bool set_sniffer_source(enum sniffer_source source)
 }
 
 
+static bool add_replay_file(const char *file_name)
+{
+    return
+        IF_(replay_file_count == 0,
+            set_sniffer_source(SNIFFER_REPLAY))  &&
+        TEST_OK_(replay_file_count < MAX_REPLAY_FILES,
+            "Too many replay files")  &&
+        DO_(replay_files[replay_file_count++] = file_name);
+}
+
+
 static bool process_options(int *argc, char ***argv)
 {
     argv0 = (*argv)[0];
     bool ok = true;
     while (ok)
     {
-        switch (getopt(*argc, *argv, "+hc:l:n:d:rb:qtDp:s:F:E:B:XRGS:N"))
+        switch (getopt(*argc, *argv, "+hc:l:n:d:rb:qtDp:s:F:f:E:B:XRGS:I:U:Nw:W:Q:u:C:m:T:P:HLM:A:y:Y:"))
         {
             case 'h':   usage();                                    exit(0);
             case 'c':   decimation_config = optarg;                 break;
@@ -178,9 +250,18 @@ static bool process_options(int *argc, char ***argv)
             case 'B':   server_bind_address = optarg;               break;
             case 'd':   fa_sniffer_device = optarg;
                         ok = set_sniffer_source(SNIFFER_DEVICE);    break;
-            case 'F':   fa_sniffer_device = optarg;
-                        ok = set_sniffer_source(SNIFFER_REPLAY);    break;
+            case 'F':
+                ok = add_replay_file(optarg);
+                break;
+            case 'f':
+                ok = DO_PARSE("replay speed",
+                    parse_double, optarg, &replay_speed);
+                break;
             case 'G':   ok = set_sniffer_source(SNIFFER_GIGABIT);   break;
+            case 'I':   gigabit_interface = optarg;
+                        ok = set_sniffer_source(SNIFFER_GIGABIT);   break;
+            case 'U':   relay_upstream = optarg;
+                        ok = set_sniffer_source(SNIFFER_RELAY);     break;
             case 'N':   ok = set_sniffer_source(SNIFFER_NONE);      break;
             case 'E':
                 ok = DO_PARSE("event code id",
@@ -198,6 +279,55 @@ static bool process_options(int *argc, char ***argv)
                 ok = DO_PARSE("input data socket",
                     parse_int, optarg, &gigabit_port);
                 break;
+            case 'w':
+                ok = DO_PARSE("transform threads",
+                    parse_uint, optarg, &transform_threads);
+                break;
+            case 'W':
+                ok = DO_PARSE("write queue depth",
+                    parse_uint, optarg, &write_queue_depth);
+                break;
+            case 'Q':
+                ok = DO_PARSE("read bandwidth",
+                    parse_size64, optarg, &read_bandwidth);
+                break;
+            case 'u':
+                ok = DO_PARSE("warm-up threads",
+                    parse_uint, optarg, &warm_up_threads);
+                break;
+            case 'C':
+                ok = DO_PARSE("read cache size",
+                    parse_size64, optarg, &read_cache_size);
+                break;
+            case 'm':
+                ok = DO_PARSE("DD cache size",
+                    parse_size64, optarg, &dd_cache_size);
+                break;
+            case 'T':
+                ok = DO_PARSE("server threads",
+                    parse_uint, optarg, &server_threads);
+                break;
+            case 'P':
+                ok = DO_PARSE("spectrum threads",
+                    parse_uint, optarg, &spectrum_threads);
+                break;
+            case 'H':   use_hugepages = true;                       break;
+            case 'L':   lock_memory = true;                         break;
+            case 'M':
+                ok = DO_PARSE("NUMA node", parse_int, optarg, &numa_node);
+                break;
+            case 'A':
+                ok = DO_PARSE("thread placement",
+                    parse_thread_placement, optarg);
+                break;
+            case 'y':
+                ok = DO_PARSE("snapshot window",
+                    parse_snapshot_window, optarg);
+                break;
+            case 'Y':
+                ok = DO_PARSE("snapshot trigger",
+                    parse_snapshot_trigger, optarg);
+                break;
             default:
                 fprintf(stderr, "Try `%s -h` for usage\n", argv0);
                 return false;
@@ -214,7 +344,8 @@ static bool process_args(int argc, char **argv)
 {
     bool ok =
         process_options(&argc, &argv)  &&
-        TEST_OK_(argc == 1, "Try `%s -h` for usage", argv0);
+        TEST_OK_(argc == 1, "Try `%s -h` for usage", argv0)  &&
+        configure_memory(use_hugepages, lock_memory, numa_node);
 
     output_filename = argv[0];
     verbose_logging(verbose);
@@ -289,15 +420,21 @@ static bool initialise_sniffer(
     {
         case SNIFFER_UNSET:
         case SNIFFER_DEVICE:
-            sniffer_context =
-                initialise_sniffer_device(fa_sniffer_device, fa_entry_count);
+            sniffer_context = initialise_sniffer_device(
+                fa_sniffer_device, fa_entry_count,
+                buffer_block_size(fa_block_buffer));
             break;
         case SNIFFER_REPLAY:
-            sniffer_context =
-                initialise_replay(fa_sniffer_device, fa_entry_count);
+            sniffer_context = initialise_replay(
+                replay_files, replay_file_count, fa_entry_count,
+                replay_speed, fa_block_buffer);
             break;
         case SNIFFER_GIGABIT:
-            sniffer_context = initialise_gigabit(fa_entry_count, gigabit_port);
+            sniffer_context = initialise_gigabit(
+                fa_entry_count, gigabit_port, gigabit_interface);
+            break;
+        case SNIFFER_RELAY:
+            sniffer_context = initialise_relay(relay_upstream, fa_entry_count);
             break;
         case SNIFFER_NONE:
             sniffer_context = initialise_empty_sniffer();
@@ -361,6 +498,8 @@ static void run_archiver(void)
 
     log_message("Shutting down");
     terminate_server();
+    terminate_spectrum();
+    terminate_snapshot();
     terminate_sniffer();
     if (decimation_config)
         terminate_decimation();
@@ -375,13 +514,13 @@ int main(int argc, char **argv)
 {
     uint32_t input_block_size, fa_entry_count;
     struct buffer *fa_block_buffer;
-    struct buffer *decimated_buffer = NULL;
     pthread_t exit_thread;
     bool ok =
         process_args(argc, argv)  &&
         initialise_disk_writer(
             output_filename, &input_block_size, &fa_entry_count,
-            events_fa_id)  &&
+            events_fa_id, transform_threads, write_queue_depth,
+            read_bandwidth, warm_up_threads)  &&
         load_fa_ids(fa_id_list, fa_entry_count)  &&
         create_buffer(&fa_block_buffer, input_block_size, buffer_blocks)  &&
         TEST_OK_(
@@ -389,16 +528,24 @@ int main(int argc, char **argv)
             "Event id out of range")  &&
         IF_(decimation_config,
             initialise_decimation(
-                decimation_config, fa_block_buffer, &decimated_buffer,
+                decimation_config, fa_block_buffer,
                 fa_entry_count, events_fa_id))  &&
+        initialise_spectrum(
+            fa_block_buffer, get_decimation_buffer(0), fa_entry_count,
+            spectrum_threads)  &&
         initialise_sniffer(fa_block_buffer, fa_entry_count)  &&
+        initialise_snapshot(fa_block_buffer, fa_entry_count, events_fa_id)  &&
         initialise_server(
-            fa_block_buffer, decimated_buffer, events_fa_id, server_name,
-            server_bind_address, server_socket, extra_commands, reuseaddr)  &&
-        initialise_reader(output_filename)  &&
+            fa_block_buffer, events_fa_id, server_name,
+            server_bind_address, server_socket, extra_commands, reuseaddr,
+            server_threads)  &&
+        initialise_reader(
+            output_filename, (size_t) read_cache_size,
+            (size_t) dd_cache_size)  &&
 
         maybe_daemonise()  &&
         initialise_signals()  &&
+        lock_allocated_buffers()  &&
 
         /* All the thread initialisation must be done after daemonising, as of
          * course threads don't survive across the daemon() call!  Alas, this
@@ -406,6 +553,8 @@ int main(int argc, char **argv)
         start_disk_writer(fa_block_buffer)  &&
         start_sniffer(boost_priority)  &&
         IF_(decimation_config, start_decimation())  &&
+        start_spectrum()  &&
+        start_snapshot()  &&
         start_server()  &&
 
         IF_(!daemon_mode,
@@ -0,0 +1,604 @@
+/* Micro-benchmarks for archiver processing kernels.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Runs the archiver processing kernels and pipeline stages over synthetic data
+ * and reports their throughput.  This is not built by default, use `make
+ * bench` (or equivalently `make fa-bench`). */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "parse.h"
+#include "transpose.h"
+#include "buffer.h"
+#include "disk.h"
+#include "disk_writer.h"
+#include "transform.h"
+#include "decimate.h"
+#include "placement.h"
+
+
+#define K               1024
+
+/* Number of distinct blocks of synthetic input data cycled through. */
+#define INPUT_BLOCKS    16
+/* Number of blocks in the central buffer. */
+#define BUFFER_BLOCKS   64
+#define MAX_SUBSCRIBERS 64
+
+/* Headroom is reported against the nominal FA data rate. */
+#define FA_SAMPLE_RATE  10000
+
+/* Archive parameters for the transform benchmark. */
+#define ARCHIVE_SIZE        ((uint64_t) 1 << 34)
+#define FIRST_DECIMATION    64
+#define MAX_SECOND_DECIMATION   256
+#define TIMESTAMP_IIR       0.1
+
+
+static char *argv0;
+
+static uint32_t input_block_size = 512 * K;
+static uint32_t major_sample_count = 8192;
+static unsigned int mask_density = 100;     // Percentage of ids archived
+static unsigned int repeat_count = 1000;    // Number of input blocks
+static unsigned int fa_entry_count = 0;     // 0 means try all standard counts
+static unsigned int subscriber_count = 4;   // Subscribers to central buffer
+static unsigned int transform_threads = 1;
+static const char *decimation_config = NULL;
+
+
+static void usage(void)
+{
+    printf(
+"Usage: %s [<options>]\n"
+"\n"
+"Benchmarks archiver processing kernels against synthetic data.\n"
+"\n"
+"Options:\n"
+"   -N:  Specify FA entry count, otherwise 256, 512 and 1024 are all tested.\n"
+"   -I:  Specify input block size, default %"PRIu32" bytes.\n"
+"   -M:  Specify major sample count, default %"PRIu32".\n"
+"   -p:  Percentage of FA ids archived, default %u.\n"
+"   -r:  Number of input blocks processed per test, default %u.\n"
+"   -s:  Number of subscribers reading the central buffer, default %u.\n"
+"   -t:  Number of transform threads, default %u.\n"
+"   -c:  Decimation configuration file.  The decimation benchmark is only run\n"
+"        if this is given.\n"
+        , argv0, input_block_size, major_sample_count,
+        mask_density, repeat_count, subscriber_count, transform_threads);
+}
+
+
+static bool process_options(int argc, char **argv)
+{
+    argv0 = argv[0];
+    bool ok = true;
+    while (ok)
+    {
+        switch (getopt(argc, argv, "+hN:I:M:p:r:s:t:c:"))
+        {
+            case 'h':
+                usage();
+                exit(0);
+            case 'N':
+                ok = DO_PARSE("FA entry count",
+                    parse_uint, optarg, &fa_entry_count);
+                break;
+            case 'I':
+                ok = DO_PARSE("input block size",
+                    parse_size32, optarg, &input_block_size);
+                break;
+            case 'M':
+                ok = DO_PARSE("major sample count",
+                    parse_uint32, optarg, &major_sample_count);
+                break;
+            case 'p':
+                ok = DO_PARSE("mask density", parse_uint, optarg, &mask_density);
+                break;
+            case 'r':
+                ok = DO_PARSE("repeat count", parse_uint, optarg, &repeat_count);
+                break;
+            case 's':
+                ok = DO_PARSE("subscriber count",
+                    parse_uint, optarg, &subscriber_count);
+                break;
+            case 't':
+                ok = DO_PARSE("transform threads",
+                    parse_uint, optarg, &transform_threads);
+                break;
+            case 'c':
+                decimation_config = optarg;
+                break;
+            case '?':
+            default:
+                fprintf(stderr, "Try `%s -h` for usage\n", argv0);
+                return false;
+            case -1:
+                return
+                    TEST_OK_(optind == argc, "Unexpected arguments")  &&
+                    TEST_OK_(0 < mask_density  &&  mask_density <= 100,
+                        "Mask density must be a percentage")  &&
+                    TEST_OK_(fa_entry_count <= MAX_FA_ENTRY_COUNT,
+                        "FA entry count too large")  &&
+                    TEST_OK_(subscriber_count <= MAX_SUBSCRIBERS,
+                        "Too many subscribers");
+        }
+    }
+    return false;
+}
+
+
+static double get_clock_seconds(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (double) now.tv_sec + 1e-9 * (double) now.tv_nsec;
+}
+
+static double get_seconds(void)
+{
+    return get_clock_seconds(CLOCK_MONOTONIC);
+}
+
+
+/* Builds an evenly spread mask with the requested density. */
+static unsigned int make_mask(
+    unsigned int entry_count, struct filter_mask *mask)
+{
+    memset(mask, 0, sizeof(struct filter_mask));
+    for (unsigned int id = 0; id < entry_count; id ++)
+        if ((id * mask_density) % 100 < mask_density)
+            set_mask_bit(mask, id);
+    return count_mask_bits(mask, entry_count);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Transpose benchmark. */
+
+/* Input frames are filled so that every entry identifies its frame and id. */
+static void fill_frames(
+    struct fa_entry *input, unsigned int entry_count, unsigned int frames,
+    unsigned int first_frame)
+{
+    for (unsigned int f = 0; f < frames; f ++)
+        for (unsigned int id = 0; id < entry_count; id ++)
+            input[f * entry_count + id] = (struct fa_entry) {
+                .x = (int32_t) (first_frame + f), .y = (int32_t) id };
+}
+
+
+static bool check_transpose(
+    const struct fa_entry *output, const struct filter_mask *mask,
+    unsigned int entry_count, unsigned int frames)
+{
+    unsigned int column = 0;
+    bool ok = true;
+    for (unsigned int id = 0; ok  &&  id < entry_count; id ++)
+        if (test_mask_bit(mask, id))
+        {
+            const struct fa_entry *out = output + column * major_sample_count;
+            for (unsigned int f = 0; ok  &&  f < frames; f ++)
+                ok = TEST_OK_(
+                    out[f].x == (int32_t) f  &&  out[f].y == (int32_t) id,
+                    "Transpose mismatch at frame %u id %u", f, id);
+            column += 1;
+        }
+    return ok;
+}
+
+
+/* Returns time in seconds to transpose repeat_count input blocks, or a
+ * negative number if the kernel is not available or gives wrong results. */
+static double time_transpose(
+    enum transpose_kernel kernel, const struct filter_mask *mask,
+    unsigned int entry_count, unsigned int archive_count,
+    const struct fa_entry *input, struct fa_entry *output, unsigned int frames)
+{
+    if (!initialise_transpose(mask, entry_count, major_sample_count, kernel))
+        return -1;
+
+    /* Check the kernel is correct before timing it. */
+    transpose_frames(input, output, frames, 0, archive_count);
+    if (!check_transpose(output, mask, entry_count, frames))
+        return -1;
+
+    unsigned int blocks = major_sample_count / frames;
+    double start = get_seconds();
+    for (unsigned int i = 0; i < repeat_count; i ++)
+        transpose_frames(
+            input, output + (i % blocks) * frames, frames, 0, archive_count);
+    return get_seconds() - start;
+}
+
+
+static bool bench_transpose(unsigned int entry_count)
+{
+    struct filter_mask mask;
+    unsigned int archive_count = make_mask(entry_count, &mask);
+    unsigned int frames = input_block_size / entry_count / FA_ENTRY_SIZE;
+
+    struct fa_entry *input, *output;
+    bool ok =
+        TEST_OK_(frames > 0  &&  major_sample_count % frames == 0,
+            "Major sample count must be a multiple of block frame count")  &&
+        TEST_NULL(input = valloc(input_block_size))  &&
+        TEST_NULL(output = valloc(
+            FA_ENTRY_SIZE * archive_count * major_sample_count));
+    if (ok)
+    {
+        fill_frames(input, entry_count, frames, 0);
+        memset(output, 0, FA_ENTRY_SIZE * archive_count * major_sample_count);
+
+        static const enum transpose_kernel kernels[] = {
+            TRANSPOSE_COLUMN, TRANSPOSE_SSE2, TRANSPOSE_AVX2 };
+        double column_time = 0;
+        for (unsigned int i = 0; i < ARRAY_SIZE(kernels); i ++)
+        {
+            double seconds = time_transpose(
+                kernels[i], &mask, entry_count, archive_count,
+                input, output, frames);
+            if (seconds < 0)
+                continue;
+            if (kernels[i] == TRANSPOSE_COLUMN)
+                column_time = seconds;
+            double rows = (double) repeat_count * frames;
+            printf("transpose %4u/%4u %-6s %8.1f ns/row %10.0f rows/s"
+                " %5.2fx\n",
+                archive_count, entry_count, transpose_kernel_name(),
+                1e9 * seconds / rows, rows / seconds, column_time / seconds);
+        }
+        free(input);
+        free(output);
+    }
+    return ok;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Pipeline benchmarks. */
+
+/* The pipeline stages are run in memory with nothing written to disk: major
+ * blocks are discarded as soon as they are handed to the disk writer, and
+ * subscriber data is written to /dev/null.  As only one stage is run at a time
+ * the process CPU time can be attributed to the stage under test. */
+
+static double get_cpu_seconds(void)
+{
+    return get_clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static double get_thread_cpu_seconds(void)
+{
+    return get_clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+
+/* Reports the throughput of a stage together with its CPU cost per row and
+ * the fraction of a CPU it needs at the nominal FA rate. */
+static void report_stage(
+    const char *stage, unsigned int archive_count, unsigned int entry_count,
+    double rows, double seconds, double cpu_seconds)
+{
+    printf("%-10s %4u/%4u %10.0f rows/s %5.2fx %8.2f us/row"
+        " %5.1f%% cpu at %dHz\n",
+        stage, archive_count, entry_count, rows / seconds,
+        rows / seconds / FA_SAMPLE_RATE, 1e6 * cpu_seconds / rows,
+        100 * FA_SAMPLE_RATE * cpu_seconds / rows, FA_SAMPLE_RATE);
+}
+
+
+/* The transform hands each completed major block to the disk writer, here we
+ * simply discard it. */
+void schedule_write(
+    unsigned int stripe, off64_t offset, void *block, size_t length)
+{
+}
+
+
+/* Duration of one input block at the nominal FA rate in microseconds. */
+static uint64_t block_duration(unsigned int frames)
+{
+    return (uint64_t) frames * 1000000 / FA_SAMPLE_RATE;
+}
+
+
+static bool bench_transform(
+    unsigned int entry_count, const struct fa_entry *input, unsigned int frames)
+{
+    struct filter_mask mask;
+    unsigned int archive_count = make_mask(entry_count, &mask);
+    /* Use the standard decimation unless the major block is too short. */
+    uint32_t second_decimation = major_sample_count / FIRST_DECIMATION;
+    if (second_decimation > MAX_SECOND_DECIMATION)
+        second_decimation = MAX_SECOND_DECIMATION;
+
+    struct disk_header *header;
+    struct data_index *data_index;
+    struct decimated_data *dd_area;
+    bool ok =
+        TEST_NULL(header = allocate_buffer(DISK_HEADER_SIZE))  &&
+        initialise_header(header, &mask, ARCHIVE_SIZE,
+            input_block_size, major_sample_count,
+            FIRST_DECIMATION, second_decimation, FA_SAMPLE_RATE,
+            TIMESTAMP_IIR, entry_count, 0, 0, NULL, 0, NULL,
+            D_FORMAT_INTERLEAVED)  &&
+        TEST_NULL(data_index = allocate_buffer(header->index_data_size))  &&
+        TEST_NULL(dd_area = allocate_buffer((size_t) header->dd_data_size))  &&
+        initialise_transform(header, data_index, dd_area,
+            (unsigned int) -1, transform_threads, 2)  &&
+        start_transform_workers();
+    if (ok)
+    {
+        uint64_t timestamp = get_timestamp();
+        double start = get_seconds();
+        double cpu_start = get_cpu_seconds();
+        for (unsigned int i = 0; i < repeat_count; i ++)
+        {
+            process_block(
+                input + (i % INPUT_BLOCKS) * frames * entry_count, timestamp);
+            timestamp += block_duration(frames);
+        }
+        double seconds = get_seconds() - start;
+        double cpu_seconds = get_cpu_seconds() - cpu_start;
+        terminate_transform_workers();
+
+        report_stage("transform", archive_count, entry_count,
+            (double) repeat_count * frames, seconds, cpu_seconds);
+    }
+    return ok;
+}
+
+
+/* Waits until no reader of buffer has more than limit blocks still to read. */
+static void wait_for_readers(struct buffer *buffer, unsigned int limit)
+{
+    while (get_reader_backlog(buffer) > limit)
+        usleep(50);
+}
+
+
+/* Plays the part of the sniffer, writing repeat_count blocks of synthetic data
+ * into buffer.  Writing is paced so that no reader falls more than half a
+ * buffer behind, and we return when all readers have caught up. */
+static void write_blocks(
+    struct buffer *buffer, const struct fa_entry *input,
+    unsigned int entry_count, unsigned int frames)
+{
+    size_t block_size = buffer_block_size(buffer);
+    uint64_t timestamp = get_timestamp();
+    for (unsigned int i = 0; i < repeat_count; i ++)
+    {
+        wait_for_readers(buffer, BUFFER_BLOCKS / 2);
+        memcpy(get_write_block(buffer),
+            input + (i % INPUT_BLOCKS) * frames * entry_count, block_size);
+        release_write_block(buffer, false, timestamp);
+        timestamp += block_duration(frames);
+    }
+    wait_for_readers(buffer, 0);
+}
+
+
+/* Each subscriber takes a masked copy of every block and sends it, as for a
+ * full rate subscription with a private mask. */
+struct subscriber {
+    pthread_t thread;
+    struct reader_state *reader;
+    const struct filter_mask *mask;
+    unsigned int entry_count;
+    unsigned int archive_count;
+    int output;
+    unsigned int underruns;
+    double cpu_seconds;
+};
+
+static void *subscriber_thread(void *context)
+{
+    struct subscriber *subscriber = context;
+    size_t block_size = reader_block_size(subscriber->reader);
+    size_t in_frame_size = subscriber->entry_count * FA_ENTRY_SIZE;
+    unsigned int frames = (unsigned int) (block_size / in_frame_size);
+    size_t out_size = frames * subscriber->archive_count * FA_ENTRY_SIZE;
+    struct fa_entry *frame_buffer = malloc(out_size);
+
+    const void *block;
+    while (block = get_read_block(subscriber->reader, NULL), block)
+    {
+        struct fa_entry *out = frame_buffer;
+        const struct fa_entry *in = block;
+        for (unsigned int f = 0; f < frames; f ++)
+        {
+            for (unsigned int id = 0; id < subscriber->entry_count; id ++)
+                if (test_mask_bit(subscriber->mask, id))
+                    *out++ = in[id];
+            in += subscriber->entry_count;
+        }
+        if (release_read_block(subscriber->reader))
+            IGNORE(TEST_write(subscriber->output, frame_buffer, out_size));
+        else
+            subscriber->underruns += 1;
+    }
+
+    free(frame_buffer);
+    subscriber->cpu_seconds = get_thread_cpu_seconds();
+    return NULL;
+}
+
+
+static bool bench_subscribers(
+    unsigned int entry_count, const struct fa_entry *input, unsigned int frames)
+{
+    struct filter_mask mask;
+    unsigned int archive_count = make_mask(entry_count, &mask);
+    struct subscriber subscribers[MAX_SUBSCRIBERS];
+    struct buffer *buffer;
+    int output;
+    bool ok =
+        TEST_IO(output = open("/dev/null", O_WRONLY))  &&
+        create_buffer(&buffer, input_block_size, BUFFER_BLOCKS);
+    unsigned int started = 0;
+    for (; ok  &&  started < subscriber_count; started ++)
+    {
+        struct subscriber *subscriber = &subscribers[started];
+        *subscriber = (struct subscriber) {
+            .reader = open_reader(buffer, false),
+            .mask = &mask,
+            .entry_count = entry_count,
+            .archive_count = archive_count,
+            .output = output,
+        };
+        ok = TEST_0(pthread_create(
+            &subscriber->thread, NULL, subscriber_thread, subscriber));
+        if (!ok)
+            close_reader(subscriber->reader);
+    }
+
+    if (ok)
+    {
+        double start = get_seconds();
+        double cpu_start = get_thread_cpu_seconds();
+        write_blocks(buffer, input, entry_count, frames);
+        double seconds = get_seconds() - start;
+        double cpu_seconds = get_thread_cpu_seconds() - cpu_start;
+        report_stage("buffer", entry_count, entry_count,
+            (double) repeat_count * frames, seconds, cpu_seconds);
+        start = get_seconds();
+
+        /* Stop the subscribers and gather their CPU usage. */
+        unsigned int underruns = 0;
+        double subscriber_cpu = 0;
+        for (unsigned int i = 0; i < started; i ++)
+            interrupt_reader(subscribers[i].reader);
+        for (unsigned int i = 0; i < started; i ++)
+        {
+            ASSERT_0(pthread_join(subscribers[i].thread, NULL));
+            close_reader(subscribers[i].reader);
+            underruns += subscribers[i].underruns;
+            subscriber_cpu += subscribers[i].cpu_seconds;
+        }
+        if (started > 0)
+        {
+            report_stage("subscriber", archive_count, entry_count,
+                (double) repeat_count * frames, seconds,
+                subscriber_cpu / started);
+            if (underruns > 0)
+                printf("%u subscriber underruns\n", underruns);
+        }
+    }
+    return ok;
+}
+
+
+static bool bench_decimation(
+    unsigned int entry_count, const struct fa_entry *input, unsigned int frames)
+{
+    struct buffer *buffer;
+    bool ok =
+        create_buffer(&buffer, input_block_size, BUFFER_BLOCKS)  &&
+        initialise_decimation(
+            decimation_config, buffer, entry_count, (unsigned int) -1)  &&
+        start_decimation();
+    if (ok)
+    {
+        double start = get_seconds();
+        double cpu_start = get_cpu_seconds();
+        double writer_start = get_thread_cpu_seconds();
+        write_blocks(buffer, input, entry_count, frames);
+        double seconds = get_seconds() - start;
+        /* Discount the CPU used by this thread to write the buffer. */
+        double cpu_seconds =
+            get_cpu_seconds() - cpu_start -
+            (get_thread_cpu_seconds() - writer_start);
+        terminate_decimation();
+
+        report_stage("decimate", entry_count, entry_count,
+            (double) repeat_count * frames, seconds, cpu_seconds);
+    }
+    return ok;
+}
+
+
+static bool bench_pipeline(unsigned int entry_count)
+{
+    unsigned int frames = input_block_size / entry_count / FA_ENTRY_SIZE;
+    struct fa_entry *input;
+    bool ok =
+        TEST_OK_(frames > 0  &&  major_sample_count % frames == 0,
+            "Major sample count must be a multiple of block frame count")  &&
+        TEST_NULL(input = valloc(INPUT_BLOCKS * (size_t) input_block_size));
+    if (ok)
+    {
+        for (unsigned int i = 0; i < INPUT_BLOCKS; i ++)
+            fill_frames(input + i * frames * entry_count,
+                entry_count, frames, i * frames);
+        ok =
+            bench_transform(entry_count, input, frames)  &&
+            bench_subscribers(entry_count, input, frames)  &&
+            IF_(decimation_config,
+                bench_decimation(entry_count, input, frames));
+        free(input);
+    }
+    return ok;
+}
+
+
+
+static bool run_benchmarks(unsigned int entry_count)
+{
+    return
+        bench_transpose(entry_count)  &&
+        bench_pipeline(entry_count);
+}
+
+
+int main(int argc, char **argv)
+{
+    static const unsigned int entry_counts[] = { 256, 512, 1024 };
+    bool ok = process_options(argc, argv);
+    if (ok  &&  fa_entry_count > 0)
+        ok = run_benchmarks(fa_entry_count);
+    else
+        for (unsigned int i = 0; ok  &&  i < ARRAY_SIZE(entry_counts); i ++)
+            ok = run_benchmarks(entry_counts[i]);
+    return ok ? 0 : 1;
+}
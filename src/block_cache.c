@@ -0,0 +1,231 @@
+/* Shared cache of archive blocks.
+ *
+ * Copyright (c) 2012 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "list.h"
+#include "locking.h"
+
+#include "block_cache.h"
+
+
+/* Number of hash buckets, must be a power of 2. */
+#define CACHE_BUCKETS   4096
+
+
+DECLARE_LOCKING(cache_lock);
+
+struct cache_entry {
+    struct cache_entry *next;   // Hash chain
+    struct list_head lru;       // Position in list, most recently used first
+    struct list_head block;     // List of entries for the same major block
+    enum cache_source source;
+    unsigned int major_block;
+    unsigned int id;
+    size_t size;
+    char data[];
+};
+
+static size_t cache_size;           // Limit on cached data, 0 if disabled
+static size_t cache_used;           // Bytes of cached data
+static unsigned int cache_entries;  // Number of cached blocks
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static LIST_HEAD(lru_list);
+/* For each major block a list of its entries and a generation count. */
+static struct list_head *block_lists;
+static unsigned int *block_generations;
+
+
+static unsigned int hash_key(
+    enum cache_source source, unsigned int major_block, unsigned int id)
+{
+    uint32_t key = (major_block << 11) ^ (id << 1) ^ source;
+    return ((key * 2654435761U) >> 20) & (CACHE_BUCKETS - 1);
+}
+
+
+static struct cache_entry **find_entry(
+    enum cache_source source, unsigned int major_block, unsigned int id)
+{
+    struct cache_entry **entry = &buckets[hash_key(source, major_block, id)];
+    while (*entry  &&  !(
+        (*entry)->source == source  &&  (*entry)->major_block == major_block  &&
+        (*entry)->id == id))
+        entry = &(*entry)->next;
+    return entry;
+}
+
+
+/* Unlinks entry from all lists and releases it. */
+static void discard_entry(struct cache_entry *entry)
+{
+    struct cache_entry **link =
+        find_entry(entry->source, entry->major_block, entry->id);
+    *link = entry->next;
+    list_del(&entry->lru);
+    list_del(&entry->block);
+    cache_used -= entry->size;
+    cache_entries -= 1;
+    free(entry);
+}
+
+
+unsigned int block_cache_generation(unsigned int major_block)
+{
+    unsigned int generation = 0;
+    if (cache_size > 0)
+    {
+        LOCK(cache_lock);
+        generation = block_generations[major_block];
+        UNLOCK(cache_lock);
+    }
+    return generation;
+}
+
+
+bool lookup_cached_block(
+    enum cache_source source, unsigned int major_block, unsigned int id,
+    void *buffer, size_t size)
+{
+    bool hit = false;
+    if (cache_size > 0)
+    {
+        LOCK(cache_lock);
+        struct cache_entry *entry = *find_entry(source, major_block, id);
+        hit = entry != NULL  &&  entry->size == size;
+        if (hit)
+        {
+            memcpy(buffer, entry->data, size);
+            /* Move to the head of the LRU list. */
+            list_del(&entry->lru);
+            list_add(&entry->lru, &lru_list);
+            cache_hits += 1;
+        }
+        else
+            cache_misses += 1;
+        UNLOCK(cache_lock);
+    }
+    return hit;
+}
+
+
+/* Adds entry to the cache, called with the cache locked. */
+static void insert_entry(
+    enum cache_source source, unsigned int major_block, unsigned int id,
+    const void *buffer, size_t size, unsigned int generation)
+{
+    /* Don't cache data from a block that has been invalidated since it was
+     * read, and don't cache anything twice. */
+    struct cache_entry **link = find_entry(source, major_block, id);
+    if (generation != block_generations[major_block]  ||  *link)
+        return;
+
+    while (cache_used + size > cache_size)
+        discard_entry(container_of(lru_list.prev, struct cache_entry, lru));
+    /* Discarding may have changed the hash chain. */
+    link = find_entry(source, major_block, id);
+
+    struct cache_entry *entry = malloc(sizeof(struct cache_entry) + size);
+    if (entry)
+    {
+        *entry = (struct cache_entry) {
+            .next = NULL, .source = source,
+            .major_block = major_block, .id = id, .size = size };
+        memcpy(entry->data, buffer, size);
+        *link = entry;
+        list_add(&entry->lru, &lru_list);
+        list_add(&entry->block, &block_lists[major_block]);
+        cache_used += size;
+        cache_entries += 1;
+    }
+}
+
+void cache_block(
+    enum cache_source source, unsigned int major_block, unsigned int id,
+    const void *buffer, size_t size, unsigned int generation)
+{
+    if (0 < size  &&  size <= cache_size)
+    {
+        LOCK(cache_lock);
+        insert_entry(source, major_block, id, buffer, size, generation);
+        UNLOCK(cache_lock);
+    }
+}
+
+
+void invalidate_cached_block(unsigned int major_block)
+{
+    if (cache_size > 0)
+    {
+        LOCK(cache_lock);
+        struct list_head *list = &block_lists[major_block];
+        while (list->next != list)
+            discard_entry(container_of(list->next, struct cache_entry, block));
+        block_generations[major_block] += 1;
+        UNLOCK(cache_lock);
+    }
+}
+
+
+void get_block_cache_status(struct block_cache_status *status)
+{
+    LOCK(cache_lock);
+    *status = (struct block_cache_status) {
+        .cache_size = cache_size,
+        .cache_used = cache_used,
+        .entries = cache_entries,
+        .hits = cache_hits,
+        .misses = cache_misses,
+    };
+    UNLOCK(cache_lock);
+}
+
+
+bool initialise_block_cache(size_t cache_size_, unsigned int major_block_count)
+{
+    cache_size = cache_size_;
+    bool ok =
+        TEST_NULL(block_lists =
+            calloc(major_block_count, sizeof(struct list_head)))  &&
+        TEST_NULL(block_generations =
+            calloc(major_block_count, sizeof(unsigned int)));
+    for (unsigned int i = 0; ok  &&  i < major_block_count; i ++)
+        INIT_LIST_HEAD(&block_lists[i]);
+    return ok;
+}
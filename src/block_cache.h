@@ -0,0 +1,73 @@
+/* Shared cache of archive blocks.
+ *
+ * Copyright (c) 2012 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Cache of FA and D blocks read from the archive, shared between all reader
+ * threads, so that repeated requests for the same data can be served from
+ * memory.  Blocks are cached by major block, archive index and data source, and
+ * all the blocks cached for a major block are discarded when the transform
+ * starts to overwrite it. */
+
+enum cache_source {
+    CACHE_FA,                   // Entry holds an FA block for one id
+    CACHE_D,                    // Entry holds a D block for one id
+};
+
+/* Prepares the cache to hold up to cache_size bytes of data.  If cache_size is
+ * zero the cache is disabled and all lookups will miss. */
+bool initialise_block_cache(size_t cache_size, unsigned int major_block_count);
+
+/* Returns the current generation of the given major block.  This must be read
+ * before reading the block from disk and passed to cache_block(), so that data
+ * read from a block while it is being overwritten is never cached. */
+unsigned int block_cache_generation(unsigned int major_block);
+
+/* Looks up the requested block.  On a hit size bytes are copied into buffer
+ * and true is returned. */
+bool lookup_cached_block(
+    enum cache_source source, unsigned int major_block, unsigned int id,
+    void *buffer, size_t size);
+
+/* Adds a freshly read block to the cache, discarding the least recently used
+ * blocks as necessary to make room. */
+void cache_block(
+    enum cache_source source, unsigned int major_block, unsigned int id,
+    const void *buffer, size_t size, unsigned int generation);
+
+/* Discards all cached data for the given major block. */
+void invalidate_cached_block(unsigned int major_block);
+
+/* Cache statistics for reporting. */
+struct block_cache_status {
+    size_t cache_size;          // Configured size of cache
+    size_t cache_used;          // Bytes of data currently cached
+    unsigned int entries;       // Number of cached blocks
+    uint64_t hits;              // Count of blocks served from the cache
+    uint64_t misses;            // Count of blocks read from disk
+};
+void get_block_cache_status(struct block_cache_status *status);
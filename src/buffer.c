@@ -35,16 +35,32 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include <errno.h>
 #include <pthread.h>
 #include <time.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "error.h"
 #include "locking.h"
+#include "list.h"
+#include "placement.h"
 
 #include "buffer.h"
 
 
+/* The buffer is written by a single writer and read by any number of readers
+ * without taking any locks.  The writer publishes each completed block by
+ * advancing write_sequence, a count of all blocks ever written, from which the
+ * write index and buffer cycle count are both derived.  Each reader keeps its
+ * own sequence number, so underflow is detected by comparing sequence numbers.
+ *
+ * Readers which have caught up with the writer wait on a futex, and the writer
+ * only makes the system call to wake them if any readers are actually waiting,
+ * so the cost of releasing a block doesn't depend on the number of readers. */
+
 struct frame_info {
     /* True if this frame is a gap and contains no true data, false if the
      * associated frame in frame_buffer[] is valid. */
@@ -66,19 +82,27 @@ struct buffer
     /* Frame information including gap marks and timestamps. */
     struct frame_info *frame_info;
 
-    /* Lock and pthread signal structure. */
+    /* Lock used only for opening and closing readers. */
     struct locking lock;
+    /* List of open readers, only used for reporting occupancy. */
+    struct list_head readers;
 
-    /* Write pointer. */
-    size_t index_in;
+    /* Count of blocks written, the write pointer is this modulo block_count. */
+    uint64_t write_sequence;
     /* Flag to halt writes for debugging. */
     bool write_blocked;
-    /* Used to detect reader underflow. */
-    size_t cycle_count;
+
+    /* Futex word incremented on every change of state, and a count of readers
+     * waiting on it. */
+    int wake_count;
+    unsigned int waiters;
 
     /* One reserved reader is supported: we will never overwrite the block it's
-     * reading and a gap will be forced instead if necessary. */
-    struct reader_state *reserved_reader;
+     * reading and a gap will be forced instead if necessary.  We track its read
+     * sequence here rather than through the reader so that the writer never
+     * touches reader structures. */
+    bool reserved_active;
+    uint64_t reserved_sequence;
 };
 
 
@@ -86,17 +110,43 @@ struct buffer
 /* Miscellaneous support routines.                                           */
 
 
-static size_t advance_index(struct buffer *buffer, size_t index)
+static void *get_buffer(struct buffer *buffer, size_t index)
 {
-    index += 1;
-    if (index >= buffer->block_count)
-        index = 0;
-    return index;
+    return buffer->frame_buffer + index * buffer->block_size;
 }
 
-static void *get_buffer(struct buffer *buffer, size_t index)
+static size_t sequence_index(struct buffer *buffer, uint64_t sequence)
 {
-    return buffer->frame_buffer + index * buffer->block_size;
+    return (size_t) (sequence % buffer->block_count);
+}
+
+
+/* Atomic access to shared state.  Stores with release semantics ensure that
+ * everything written before is visible to an acquiring load. */
+#define LOAD(var)           __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#define STORE(var, value)   __atomic_store_n(&(var), value, __ATOMIC_RELEASE)
+
+
+/* Wakes all waiting readers.  The wake count is always advanced so that a
+ * reader about to wait will see the change. */
+static void wake_readers(struct buffer *buffer)
+{
+    __atomic_add_fetch(&buffer->wake_count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&buffer->waiters, __ATOMIC_SEQ_CST) > 0)
+        IGNORE(TEST_IO(syscall(SYS_futex, &buffer->wake_count,
+            FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0)));
+}
+
+/* Waits for wake_count to move on from wake_count, returns false on timeout.
+ * Returns immediately if the count has already changed. */
+static bool wait_for_wake(struct buffer *buffer, int wake_count, int secs)
+{
+    struct timespec timeout = { .tv_sec = secs, .tv_nsec = 0 };
+    __atomic_add_fetch(&buffer->waiters, 1, __ATOMIC_SEQ_CST);
+    long rc = syscall(SYS_futex, &buffer->wake_count,
+        FUTEX_WAIT_PRIVATE, wake_count, &timeout, NULL, 0);
+    __atomic_sub_fetch(&buffer->waiters, 1, __ATOMIC_SEQ_CST);
+    return rc == 0  ||  errno != ETIMEDOUT;
 }
 
 
@@ -106,11 +156,12 @@ static void *get_buffer(struct buffer *buffer, size_t index)
 
 struct reader_state
 {
+    struct list_head list;          // Position in buffer's list of readers
     struct buffer *buffer;          // Associated buffer
     bool running;                   // Used to interrupt reader
     bool gap_reported;              // Set once we've reported a gap
-    size_t index_out;               // Next block to read
-    size_t cycle_count;             // Buffer cycle count at last reading
+    bool reserved;                  // Set for the reserved reader
+    uint64_t read_sequence;         // Sequence number of next block to read
 };
 
 
@@ -120,14 +171,16 @@ struct reader_state *open_reader(struct buffer *buffer, bool reserved_reader)
     reader->buffer = buffer;
     reader->running = true;
     reader->gap_reported = false;
+    reader->reserved = reserved_reader;
 
     LOCK(buffer->lock);
-    reader->index_out = buffer->index_in;
-    reader->cycle_count = buffer->cycle_count;
+    list_add_tail(&reader->list, &buffer->readers);
+    reader->read_sequence = LOAD(buffer->write_sequence);
     if (reserved_reader)
     {
-        ASSERT_OK(buffer->reserved_reader == NULL);
-        buffer->reserved_reader = reader;
+        ASSERT_OK(!buffer->reserved_active);
+        STORE(buffer->reserved_sequence, reader->read_sequence);
+        STORE(buffer->reserved_active, true);
     }
     UNLOCK(buffer->lock);
 
@@ -135,44 +188,86 @@ struct reader_state *open_reader(struct buffer *buffer, bool reserved_reader)
 }
 
 
+struct reader_state *open_history_reader(
+    struct reader_state *reader, unsigned int *backlog)
+{
+    struct buffer *buffer = reader->buffer;
+    struct reader_state *history = malloc(sizeof(struct reader_state));
+    history->buffer = buffer;
+    history->running = true;
+    history->gap_reported = false;
+    history->reserved = false;
+
+    LOCK(buffer->lock);
+    list_add_tail(&history->list, &buffer->readers);
+    /* The slot being written holds the block a full buffer behind the writer,
+     * so the oldest block we can still read is one less than that. */
+    uint64_t read_sequence = LOAD(reader->read_sequence);
+    uint64_t behind = LOAD(buffer->write_sequence) - read_sequence;
+    uint64_t held =
+        behind < buffer->block_count ? buffer->block_count - 1 - behind : 0;
+    if (held > read_sequence)
+        held = read_sequence;
+    if (*backlog > held)
+        *backlog = (unsigned int) held;
+    history->read_sequence = read_sequence - *backlog;
+    UNLOCK(buffer->lock);
+
+    return history;
+}
+
+
 void close_reader(struct reader_state *reader)
 {
     struct buffer *buffer = reader->buffer;
 
     LOCK(buffer->lock);
-    if (buffer->reserved_reader == reader)
-        buffer->reserved_reader = NULL;
+    list_del(&reader->list);
+    if (reader->reserved)
+        STORE(buffer->reserved_active, false);
     UNLOCK(buffer->lock);
 
     free(reader);
 }
 
 
+/* Tests whether a block or gap is available at the reader's position.  If
+ * there's nothing to read the current wake count is returned for waiting. */
+static bool read_ready(struct reader_state *reader, int *wake_count)
+{
+    struct buffer *buffer = reader->buffer;
+    *wake_count = LOAD(buffer->wake_count);
+    size_t index_out = sequence_index(buffer, reader->read_sequence);
+    return
+        !LOAD(reader->running)  ||
+        reader->read_sequence != LOAD(buffer->write_sequence)  ||
+        (!reader->gap_reported  &&  LOAD(buffer->frame_info[index_out].gap));
+}
+
+
 const void *get_read_block(struct reader_state *reader, uint64_t *timestamp)
 {
     struct buffer *buffer = reader->buffer;
     void *block;
 
-    LOCK(buffer->lock);
-
-    struct frame_info *frame_info = &buffer->frame_info[reader->index_out];
     /* Wait until one of the following conditions is satisfied:
      *  1. We're stopped by setting running to false
      *  2. The out and in indexes don't coincide
      *  3. We haven't reported a gap yet and the new frame starts a new gap. */
-    while (reader->running  &&
-           reader->index_out == buffer->index_in  &&
-           (reader->gap_reported  ||  !frame_info->gap)  &&
-           pwait_timeout(&buffer->lock, 2, 0))
+    int wake_count;
+    while (!read_ready(reader, &wake_count)  &&
+           wait_for_wake(buffer, wake_count, 2))
         ;
 
-    if (!reader->running)
+    size_t index_out = sequence_index(buffer, reader->read_sequence);
+    struct frame_info *frame_info = &buffer->frame_info[index_out];
+    if (!LOAD(reader->running))
         block = NULL;
-    else if (frame_info->gap  &&  !reader->gap_reported)
+    else if (LOAD(frame_info->gap)  &&  !reader->gap_reported)
         /* This block is preceded by a gap.  Return a gap indicator this time,
          * we'll return the block itself next time. */
         block = NULL;
-    else if (reader->index_out == buffer->index_in)
+    else if (reader->read_sequence == LOAD(buffer->write_sequence))
     {
         /* If we get here there must have been a timeout.  This is definitely
          * not normal, log and treat as no data. */
@@ -181,13 +276,11 @@ const void *get_read_block(struct reader_state *reader, uint64_t *timestamp)
     }
     else
     {
-        block = get_buffer(buffer, reader->index_out);
+        block = get_buffer(buffer, index_out);
         if (timestamp)
             *timestamp = frame_info->timestamp;
     }
 
-    UNLOCK(buffer->lock);
-
     reader->gap_reported = block == NULL;
     return block;
 }
@@ -195,52 +288,32 @@ const void *get_read_block(struct reader_state *reader, uint64_t *timestamp)
 
 void interrupt_reader(struct reader_state *reader)
 {
-    struct buffer *buffer = reader->buffer;
-    LOCK(buffer->lock);
-    reader->running = false;
-    pbroadcast(&reader->buffer->lock);
-    UNLOCK(buffer->lock);
+    STORE(reader->running, false);
+    wake_readers(reader->buffer);
 }
 
 
-/* Detects buffer underflow, returns true if ok. */
-static bool check_underflow(
-    struct reader_state *reader, size_t index_in, size_t cycle_count)
+bool check_read_block(struct reader_state *reader, unsigned int margin)
 {
-    /* Detect buffer underflow by inspecting the in and out pointers and
-     * checking the buffer cycle count.  We can only be deceived if a full 2^32
-     * cycles have ocurred since the last time we looked, but the pacing of
-     * reading and writing eliminates that risk. */
-    if (index_in == reader->index_out)
-        /* Unmistakable collision! */
-        return false;
-    else if (index_in > reader->index_out)
-        /* Out pointer ahead of in pointer.  We're ok if we're both on the same
-         * cycle. */
-        return cycle_count == reader->cycle_count;
-    else
-        /* Out pointer behind in pointer.  In this case the buffer should be one
-         * step ahead of us. */
-        return cycle_count == reader->cycle_count + 1;
+    struct buffer *buffer = reader->buffer;
+    uint64_t write_sequence = LOAD(buffer->write_sequence);
+    return write_sequence - reader->read_sequence + margin < buffer->block_count;
 }
 
 
 bool release_read_block(struct reader_state *reader)
 {
-    /* Grab consistent snapshot of current buffer position. */
-    size_t index_in, cycle_count;
+    /* Detect buffer underflow by comparing sequence numbers: if the writer has
+     * got a full buffer ahead of us then the block we were reading has been
+     * overwritten. */
     struct buffer *buffer = reader->buffer;
-    LOCK(buffer->lock);
-    index_in    = buffer->index_in;
-    cycle_count = buffer->cycle_count;
-    UNLOCK(buffer->lock);
-
-    if (check_underflow(reader, index_in, cycle_count))
+    uint64_t write_sequence = LOAD(buffer->write_sequence);
+    if (write_sequence - reader->read_sequence < buffer->block_count)
     {
         /* Normal case.  Advance to point to the next block. */
-        reader->index_out = advance_index(buffer, reader->index_out);
-        if (reader->index_out == 0)
-            reader->cycle_count += 1;
+        STORE(reader->read_sequence, reader->read_sequence + 1);
+        if (reader->reserved)
+            STORE(buffer->reserved_sequence, reader->read_sequence);
         return true;
     }
     else
@@ -248,56 +321,79 @@ bool release_read_block(struct reader_state *reader)
         /* If we were underflowed then perform a complete reset of the read
          * stream.  Discard everything in the buffer and start again.  This
          * helps the writer which can rely on this. */
-        reader->index_out = index_in;
-        reader->cycle_count = cycle_count;
+        STORE(reader->read_sequence, write_sequence);
         reader->gap_reported = false;   // Strictly speaking, already set so!
+        if (reader->reserved)
+            STORE(buffer->reserved_sequence, reader->read_sequence);
         return false;
     }
 }
 
 
 
+unsigned int reader_backlog(struct reader_state *reader)
+{
+    struct buffer *buffer = reader->buffer;
+    uint64_t behind = LOAD(buffer->write_sequence) - reader->read_sequence;
+    return (unsigned int) (
+        behind < buffer->block_count ? behind : buffer->block_count);
+}
+
+
+unsigned int skip_read_blocks(struct reader_state *reader, unsigned int count)
+{
+    /* We never skip past the writer, and if we skip to the current block we
+     * simply wait for it as normal. */
+    unsigned int backlog = reader_backlog(reader);
+    if (count > backlog)
+        count = backlog;
+    STORE(reader->read_sequence, reader->read_sequence + count);
+    if (reader->reserved)
+        STORE(reader->buffer->reserved_sequence, reader->read_sequence);
+    return count;
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Writer routines.                                                          */
 
 void *get_write_block(struct buffer *buffer)
 {
-    return get_buffer(buffer, buffer->index_in);
+    return get_buffer(buffer, sequence_index(buffer, buffer->write_sequence));
 }
 
 
 bool release_write_block(struct buffer *buffer, bool gap, uint64_t timestamp)
 {
     gap = gap || buffer->write_blocked;     // Allow blocking override
-    volatile bool blocked = false;          // Implicit longjmp in [UN]LOCK
+    bool blocked = false;
 
-    LOCK(buffer->lock);
+    /* Only this thread writes write_sequence, so we can read it freely. */
+    uint64_t sequence = buffer->write_sequence;
+    size_t index_in = sequence_index(buffer, sequence);
     if (gap)
         /* If we're deliberately writing a gap there's nothing more to do. */
-        buffer->frame_info[buffer->index_in].gap = true;
+        STORE(buffer->frame_info[index_in].gap, true);
     else
     {
         /* If a gap isn't forced we might still have to make one if we can't
-         * actually advance. */
-        size_t new_index = advance_index(buffer, buffer->index_in);
-        /* Check for presence of blocking reserved reader. */
-        blocked = buffer->reserved_reader  &&
-            new_index == buffer->reserved_reader->index_out;
+         * actually advance.  Check for presence of blocking reserved reader. */
+        size_t new_index = sequence_index(buffer, sequence + 1);
+        blocked = LOAD(buffer->reserved_active)  &&
+            new_index ==
+                sequence_index(buffer, LOAD(buffer->reserved_sequence));
         if (blocked)
             /* Whoops.  Can't advance, instead force a gap and fail. */
-            buffer->frame_info[buffer->index_in].gap = true;
+            STORE(buffer->frame_info[index_in].gap, true);
         else
         {
             /* This is the normal case: fresh data to be stored. */
-            buffer->frame_info[buffer->index_in].timestamp = timestamp;
-            buffer->index_in = new_index;
-            buffer->frame_info[new_index].gap = false;
-            if (new_index == 0)
-                buffer->cycle_count += 1;
+            buffer->frame_info[index_in].timestamp = timestamp;
+            STORE(buffer->frame_info[new_index].gap, false);
+            STORE(buffer->write_sequence, sequence + 1);
         }
     }
-    pbroadcast(&buffer->lock);
-    UNLOCK(buffer->lock);
+    wake_readers(buffer);
 
     return !blocked;
 }
@@ -314,6 +410,53 @@ bool buffer_write_enabled(struct buffer *buffer)
 }
 
 
+unsigned int get_reader_occupancy(
+    struct buffer *buffer, unsigned int occupancy[], unsigned int max_count)
+{
+    unsigned int count = 0;
+    LOCK(buffer->lock);
+    uint64_t write_sequence = LOAD(buffer->write_sequence);
+    list_for_each_entry(struct reader_state, list, reader, &buffer->readers)
+    {
+        if (count >= max_count)
+            break;
+        /* An underrun reader can be more than a buffer behind until it next
+         * releases a block. */
+        uint64_t behind = write_sequence - LOAD(reader->read_sequence);
+        occupancy[count++] = (unsigned int) (
+            behind < buffer->block_count ? behind : buffer->block_count);
+    }
+    UNLOCK(buffer->lock);
+    return count;
+}
+
+
+/* Computes the backlog of the furthest behind reader.  The result is returned
+ * through a pointer, as the compiler warns that a local variable updated under
+ * LOCK might be clobbered. */
+static void compute_backlog(struct buffer *buffer, uint64_t *backlog)
+{
+    *backlog = 0;
+    LOCK(buffer->lock);
+    uint64_t write_sequence = LOAD(buffer->write_sequence);
+    list_for_each_entry(struct reader_state, list, reader, &buffer->readers)
+    {
+        uint64_t behind = write_sequence - LOAD(reader->read_sequence);
+        if (behind > *backlog)
+            *backlog = behind;
+    }
+    UNLOCK(buffer->lock);
+}
+
+unsigned int get_reader_backlog(struct buffer *buffer)
+{
+    uint64_t backlog;
+    compute_backlog(buffer, &backlog);
+    return (unsigned int) (
+        backlog < buffer->block_count ? backlog : buffer->block_count);
+}
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 size_t buffer_block_size(struct buffer *buffer)
@@ -321,6 +464,11 @@ size_t buffer_block_size(struct buffer *buffer)
     return buffer->block_size;
 }
 
+size_t buffer_block_count(struct buffer *buffer)
+{
+    return buffer->block_count;
+}
+
 size_t reader_block_size(struct reader_state *reader)
 {
     return buffer_block_size(reader->buffer);
@@ -349,13 +497,21 @@ bool create_buffer(
     (*buffer)->block_count = block_count;
     /* The frame buffer must be page aligned, because we're going to write to
      * disk with direct I/O. */
-    (*buffer)->frame_buffer = valloc(block_count * block_size);
+    (*buffer)->frame_buffer = allocate_buffer(block_count * block_size);
     (*buffer)->frame_info = calloc(block_count, sizeof(struct frame_info));
+    /* The buffer starts out clean so that sparse writers such as the gigabit
+     * sniffer only need to clear the entries they have written before.  We
+     * touch it all anyway to fault in the buffer before capture starts. */
+    if ((*buffer)->frame_buffer)
+        memset((*buffer)->frame_buffer, 0, block_count * block_size);
     initialise_locking(&(*buffer)->lock);
-    (*buffer)->index_in = 0;
+    INIT_LIST_HEAD(&(*buffer)->readers);
+    (*buffer)->write_sequence = 0;
     (*buffer)->write_blocked = false;
-    (*buffer)->cycle_count = 0;
-    (*buffer)->reserved_reader = NULL;
+    (*buffer)->wake_count = 0;
+    (*buffer)->waiters = 0;
+    (*buffer)->reserved_active = false;
+    (*buffer)->reserved_sequence = 0;
     return
         TEST_NULL((*buffer)->frame_buffer)  &&
         TEST_NULL((*buffer)->frame_info);
@@ -36,7 +36,8 @@
  *
  * Firstly, we support multiple readers of the buffer.  It is possible for
  * other applications to subscribe to the FA data stream, in which case they
- * will also be updated.  If a subscriber falls behind it is simply cut off!
+ * will also be updated.  If a subscriber falls behind it is simply cut off,
+ * unless it chooses to skip blocks to keep up.
  *
  * Secondly, we need some mechanism to cope with gaps in the FA data stream.
  * Whenever the communication controller network stops the feed of data into
@@ -80,6 +81,11 @@ bool release_write_block(struct buffer *buffer, bool gap, uint64_t timestamp);
 
 /* Creates a new reading connection to the buffer. */
 struct reader_state *open_reader(struct buffer *buffer, bool reserved_reader);
+/* Creates a new reader positioned up to *backlog blocks before the current
+ * position of reader, so that data already read can be read again.  *backlog
+ * is reduced to the number of blocks still held in the buffer. */
+struct reader_state *open_history_reader(
+    struct reader_state *reader, unsigned int *backlog);
 /* Closes a previously opened reader connection. */
 void close_reader(struct reader_state *reader);
 
@@ -95,6 +101,16 @@ const void *get_read_block(struct reader_state *reader, uint64_t *timestamp);
  * opened with reserved_reader set this is guaranteed not to happen.  Only
  * call if non-NULL value returned by get_read_block(). */
 bool release_read_block(struct reader_state *reader);
+/* Checks without releasing it that the block returned by get_read_block() is
+ * still clean and that the writer is at least margin further blocks away from
+ * overwriting it. */
+bool check_read_block(struct reader_state *reader, unsigned int margin);
+/* Returns the number of blocks written but not yet read by the reader. */
+unsigned int reader_backlog(struct reader_state *reader);
+/* Skips over up to count blocks not yet read, returning the number of blocks
+ * actually skipped.  Only call after release_read_block(), so that a reader
+ * which is falling behind can catch up by discarding data. */
+unsigned int skip_read_blocks(struct reader_state *reader, unsigned int count);
 /* Interrupts the reader, interruping any waits in release_read_block() and
  * forcing further calls to get_read_block() to immediately return NULL. */
 void interrupt_reader(struct reader_state *reader);
@@ -103,3 +119,14 @@ void interrupt_reader(struct reader_state *reader);
 void enable_buffer_write(struct buffer *buffer, bool enabled);
 /* Returns state of buffer write enable flag. */
 bool buffer_write_enabled(struct buffer *buffer);
+
+/* Reports how many blocks each open reader has still to read, up to max_count
+ * readers, returning the number of readers reported.  A reader with
+ * buffer_block_count() blocks outstanding is about to underrun. */
+unsigned int get_reader_occupancy(
+    struct buffer *buffer, unsigned int occupancy[], unsigned int max_count);
+/* Returns the largest number of blocks any reader has still to read.  A writer
+ * which can outpace its readers can poll this to avoid overrunning them. */
+unsigned int get_reader_backlog(struct buffer *buffer);
+/* Returns number of blocks in buffer. */
+size_t __pure buffer_block_count(struct buffer *buffer);
@@ -45,6 +45,7 @@
 #include <errno.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "error.h"
 #include "fa_sniffer.h"
@@ -52,25 +53,27 @@
 #include "matlab.h"
 #include "parse.h"
 #include "reader.h"
+#include "compress.h"
+#include "request.h"
 
 
 #define DEFAULT_SERVER      "fa-archiver.diamond.ac.uk"
 #define BUFFER_SIZE         (1 << 16)
 #define PROGRESS_INTERVAL   (1 << 18)
+#define MAX_CONNECTIONS     64
 
 /* Minimum server protocol supported.  We just can't talk to older servers. */
 #define SERVER_MAJOR_VERSION   1
 #define SERVER_MINOR_VERSION   1
 
 
-enum data_format { DATA_FA, DATA_D, DATA_DD };
-
 /* Command line parameters. */
 static int port = 8888;
 static const char *server_name = DEFAULT_SERVER;
 static const char *output_filename = NULL;
 static struct filter_mask capture_mask;
 static bool matlab_format = true;
+static bool stream_format = false;
 static bool squeeze_matlab = true;
 static bool continuous_capture = false;
 static bool decimated_capture = false;
@@ -81,6 +84,7 @@ static struct timespec end;
 static uint64_t sample_count = 0;
 static enum data_format data_format = DATA_FA;
 static unsigned int data_mask = 1;
+static unsigned int dd_tier = 0;        // Decimation tier above DD, if any
 static bool show_progress = true;
 static bool request_contiguous = false;
 static const char *data_name = "data";
@@ -89,6 +93,8 @@ static bool check_id0 = false;
 static bool offset_matlab_times = true;
 static bool subtract_day_zero = false;
 static bool save_id0 = false;
+static unsigned int connection_count = 1;
+static bool compress_transfer = false;
 
 /* Archiver parameters read from archiver during initialisation. */
 static double sample_frequency;
@@ -97,6 +103,7 @@ static unsigned int second_decimation;
 static unsigned int major_version, minor_version;
 static unsigned int fa_entry_count = 256;
 static unsigned int continuous_decimation;
+static unsigned int tier_decimation = 1;    // Decimation from DD to dd_tier
 
 static FILE *output_file;
 
@@ -205,6 +212,44 @@ static bool read_archive_parameters(void)
 }
 
 
+/* Parses response to CP command: a list of tier decimation factors, of which
+ * the first dd_tier are accumulated into tier_decimation. */
+static bool parse_tier_decimations(const char **string)
+{
+    unsigned int tier_count = 0;
+    bool ok = true;
+    while (ok  &&  !read_char(string, '\n'))
+    {
+        unsigned int decimation;
+        ok =
+            IF_(tier_count > 0, parse_char(string, ' '))  &&
+            parse_uint(string, &decimation);
+        tier_count += 1;
+        if (ok  &&  tier_count <= dd_tier)
+            tier_decimation *= decimation;
+    }
+    return ok  &&
+        TEST_OK_(dd_tier <= tier_count,
+            "Decimation tier %u not available from server", dd_tier);
+}
+
+/* Interrogates server for the decimation factors of the higher tiers, only
+ * needed if such a tier has been requested. */
+static bool read_tier_decimations(void)
+{
+    FILE *stream;
+    char buffer[128];
+    return
+        connect_server(&stream)  &&
+        FINALLY(
+            TEST_OK(fprintf(stream, "CP\n") > 0)  &&
+            read_response(stream, buffer, sizeof(buffer)),
+            // Finally, whether read_response succeeds
+            TEST_OK(fclose(stream) == 0))  &&
+        DO_PARSE("server response", parse_tier_decimations, buffer);
+}
+
+
 /* Returns configured decimation factor. */
 static unsigned int get_decimation(void)
 {
@@ -214,7 +259,8 @@ static unsigned int get_decimation(void)
     {
         switch (data_format)
         {
-            case DATA_DD:   return first_decimation * second_decimation;
+            case DATA_DD:
+                return first_decimation * second_decimation * tier_decimation;
             case DATA_D:    return first_decimation;
             case DATA_FA:   return 1;
             default:        return 0;   // Not going to happen
@@ -266,12 +312,15 @@ static void usage(char *argv0)
 "   -f:  Specify data format, can be -fF for FA (the default), -fd[mask] for\n"
 "        single decimated data, or -fD[mask] for double decimated data, where\n"
 "        [mask] is an optional data mask, default value 15 (all fields).\n"
+"        Each further D, as in -fDD[mask], selects the next decimation tier\n"
+"        above double decimated data, if configured on the archive.\n"
 "        Decimated data is only available for archived data.\n"
 "           The bits in the data mask correspond to decimated fields:\n"
 "            1 => mean, 2 => min, 4 => max, 8 => standard deviation\n"
 "   -a   Capture all available data even if too much requested.  Otherwise\n"
 "        capture fails if more data requested than present in archive.\n"
 "   -R   Save in raw format, otherwise the data is saved in matlab format\n"
+"   -W   Save in streamed format, written incrementally as data arrives\n"
 "   -c   Forbid any gaps in the captured sequence, contiguous data only\n"
 "   -z   Check for gaps in ID0 data when checking for gaps, otherwise ignored\n"
 "   -k   Keep extra dimensions in matlab values\n"
@@ -279,6 +328,10 @@ static void usage(char *argv0)
 "   -S:  Specify archive server to read from (default is\n"
 "            %s)\n"
 "   -p:  Specify port to connect to on server (default is %d)\n"
+"   -j:  Split historical capture across this many concurrent connections.\n"
+"        Output must be to a file, and only FA and D data can be split.\n"
+"   -x   Request compressed data from the server.  This reduces the network\n"
+"        bandwidth needed, at the cost of some processing on both ends.\n"
 "   -q   Suppress display of progress of capture on stderr\n"
 "   -Z   Use UTC timestamps for matlab timestamps, otherwise local time is\n"
 "        used including any local daylight saving offset.\n"
@@ -288,22 +341,11 @@ static void usage(char *argv0)
 "Note that if matlab format is specified and no sample count is specified\n"
 "(interrupted continuous capture or range of times given) then output must be\n"
 "directed to a file, otherwise the capture count in the result will be\n"
-"invalid.\n"
+"invalid.  Streamed format (-W) has no such restriction.\n"
     , argv0, data_name, server_name, port);
 }
 
 
-/* Computes the offset from local time to UTC.  This is needed to fix up matlab
- * timestamps. */
-static time_t local_time_offset(void)
-{
-    time_t now = time(NULL);
-    struct tm tm;
-    localtime_r(&now, &tm);
-    return timegm(&tm) - now;
-}
-
-
 /* Returns seconds at midnight this morning for time of day relative timestamp
  * specification.  This uses the current timezone. */
 static time_t midnight_today(void)
@@ -358,7 +400,11 @@ static bool parse_data_format(const char **string, enum data_format *format)
         if (read_char(string, 'd'))
             *format = DATA_D;
         else if (read_char(string, 'D'))
+        {
             *format = DATA_DD;
+            while (read_char(string, 'D'))
+                dd_tier += 1;
+        }
         else
             return FAIL_("Invalid data format");
 
@@ -422,10 +468,11 @@ static bool parse_opts(int *argc, char ***argv)
     bool ok = true;
     while (ok)
     {
-        switch (getopt(*argc, *argv, "+hRCDo:aS:qckn:zZdTs:t:b:p:f:"))
+        switch (getopt(*argc, *argv, "+hRWCDo:aS:qxckn:zZdTs:t:b:p:f:j:"))
         {
             case 'h':   usage(argv0);                               exit(0);
             case 'R':   matlab_format = false;                      break;
+            case 'W':   stream_format = true;                       break;
             case 'C':   continuous_capture = true;                  break;
             case 'D':   continuous_capture = true;
                         decimated_capture = true;                   break;
@@ -433,6 +480,7 @@ static bool parse_opts(int *argc, char ***argv)
             case 'a':   all_data = true;                            break;
             case 'S':   server_name = optarg;                       break;
             case 'q':   show_progress = false;                      break;
+            case 'x':   compress_transfer = true;                   break;
             case 'c':   request_contiguous = true;                  break;
             case 'k':   squeeze_matlab = false;                     break;
             case 'n':   data_name = optarg;                         break;
@@ -450,6 +498,10 @@ static bool parse_opts(int *argc, char ***argv)
                 ok = DO_PARSE("data format",
                     parse_data_format, optarg, &data_format);
                 break;
+            case 'j':
+                ok = DO_PARSE("connection count",
+                    parse_uint, optarg, &connection_count);
+                break;
             default:
                 fprintf(stderr, "Try `capture -h` for usage\n");
                 return false;
@@ -500,6 +552,7 @@ static bool parse_args(int argc, char **argv)
          * the server settings, but before we parse the sample count or capture
          * mask, because these use the settings we read. */
         read_archive_parameters()  &&
+        IF_(dd_tier > 0, read_tier_decimations())  &&
         DO_PARSE("capture mask",
             parse_mask, argv[0], fa_entry_count, &capture_mask)  &&
         IF_(argc == 2,
@@ -525,14 +578,28 @@ static bool validate_args(void)
             "End time isn't after start")  &&
         TEST_OK_(start_specified  ||  data_format == DATA_FA,
             "Decimated data must be historical")  &&
-        TEST_OK_(!matlab_format  ||  sample_count <= UINT32_MAX,
+        TEST_OK_(matlab_format  ||  !stream_format,
+            "Cannot combine raw and streamed format")  &&
+        TEST_OK_(!matlab_format  ||  stream_format  ||
+                sample_count <= UINT32_MAX,
             "Too many samples for matlab format capture")  &&
         TEST_OK_(matlab_format  ||  !save_id0,
             "Can only capture ID0 in matlab format")  &&
         TEST_OK_(request_contiguous  ||  !check_id0,
             "ID0 checking only meaningful with gap checking")  &&
         TEST_OK_(!decimated_capture  ||  continuous_decimation > 0,
-            "Continuous decimated data not available from server");
+            "Continuous decimated data not available from server")  &&
+        TEST_OK_(0 < connection_count  &&  connection_count <= MAX_CONNECTIONS,
+            "Invalid connection count")  &&
+        IF_(connection_count > 1,
+            TEST_OK_(!continuous_capture,
+                "Can only split historical data captures")  &&
+            TEST_OK_(data_format != DATA_DD,
+                "Cannot split double decimated data captures")  &&
+            TEST_OK_(!stream_format,
+                "Cannot split streamed format captures")  &&
+            TEST_OK_(output_filename != NULL,
+                "Must specify output file for split capture"));
 }
 
 
@@ -583,6 +650,12 @@ static void format_read_options(char *options)
     *options = '\0';
 }
 
+/* The compression option comes last, after any extra options. */
+static const char *compress_option(void)
+{
+    return compress_transfer ? "X" : "";
+}
+
 /* Formats data request options for subscription data request.  See subscribe.c
  * for definitions of these options. */
 static void format_subscribe_options(char *options)
@@ -591,42 +664,58 @@ static void format_subscribe_options(char *options)
     if (matlab_format)      *options++ = 'E';   //  in extended format
     if (matlab_format  &&  save_id0)
                             *options++ = 'Z';   //  with id0 values
+    if (compress_transfer)  *options++ = 'X';   // Compressed data
     if (decimated_capture)  *options++ = 'D';   // Decimated data stream
     *options = '\0';
 }
 
 
-/* Sends request for archived or live data to archiver. */
-static bool request_data(FILE *stream)
+/* Sends request for archived data with the given start and end specifications
+ * and any extra options. */
+static bool request_archive_data(
+    FILE *stream, const char *start_str, const char *end_str,
+    const char *extra_options)
 {
     char raw_mask[RAW_MASK_BYTES];
     format_mask(&capture_mask, fa_entry_count, raw_mask);
+    char format[READ_SOURCE_BYTES];
+    format_read_source(format, data_format, dd_tier, data_mask);
+    char options[64];
+    format_read_options(options);
+    // Send R<source> M<mask> <start> <end> <options>
+    return TEST_OK(fprintf(stream, "R%sM%s%s%s%s%s%s\n",
+        format, raw_mask, start_str, end_str, options, extra_options,
+        compress_option()) > 0);
+}
+
+
+/* Formats the start and end of the requested range of archived data. */
+static void format_range(char *start_str, char *end_str)
+{
+    sprintf(start_str, "S%ld.%09ld", start.tv_sec, start.tv_nsec);
+    if (end_specified)
+        sprintf(end_str, "ES%ld.%09ld", end.tv_sec, end.tv_nsec);
+    else
+        sprintf(end_str, "N%"PRIu64, sample_count);
+}
+
+
+/* Sends request for archived or live data to archiver. */
+static bool request_data(FILE *stream)
+{
     if (continuous_capture)
     {
+        char raw_mask[RAW_MASK_BYTES];
+        format_mask(&capture_mask, fa_entry_count, raw_mask);
         char options[64];
         format_subscribe_options(options);
         return TEST_OK(fprintf(stream, "S%s%s\n", raw_mask, options) > 0);
     }
     else
     {
-        char format[16];
-        switch (data_format)
-        {
-            case DATA_FA:   sprintf(format, "F");                   break;
-            case DATA_D:    sprintf(format, "DF%u",  data_mask);    break;
-            case DATA_DD:   sprintf(format, "DDF%u", data_mask);    break;
-        }
-        char end_str[64];
-        if (end_specified)
-            sprintf(end_str, "ES%ld.%09ld", end.tv_sec, end.tv_nsec);
-        else
-            sprintf(end_str, "N%"PRIu64, sample_count);
-        char options[64];
-        format_read_options(options);
-        // Send R<source> M<mask> S<start> <end> <options>
-        return TEST_OK(fprintf(stream, "R%sM%sS%ld.%09ld%s%s\n",
-            format, raw_mask, start.tv_sec, start.tv_nsec,
-            end_str, options) > 0);
+        char start_str[64], end_str[64];
+        format_range(start_str, end_str);
+        return request_archive_data(stream, start_str, end_str, "");
     }
 }
 
@@ -699,9 +788,9 @@ static struct extended_timestamp_id0 *get_timestamp_block(void)
 
 
 /* Reads the appropriate size of block from input. */
-static bool read_timestamp_block(FILE *stream)
+static bool read_timestamp_block(
+    FILE *stream, struct extended_timestamp_id0 *block)
 {
-    struct extended_timestamp_id0 *block = get_timestamp_block();
     if (save_id0)
         return READ_ITEM(stream, *block);
     else
@@ -709,14 +798,107 @@ static bool read_timestamp_block(FILE *stream)
 }
 
 
+/* Size of a single line of captured data. */
+static size_t get_line_size(void)
+{
+    return
+        count_data_bits(data_mask) *
+        count_mask_bits(&capture_mask, fa_entry_count) * FA_ENTRY_SIZE;
+}
+
+
+/* Data lines are read through a line reader so that compressed data can be
+ * unpacked as it arrives.  Each compressed chunk is unpacked in full and then
+ * handed out as requested.  The server never lets a chunk cross a timestamp
+ * block, so reads limited to the next timestamp end on a chunk boundary. */
+struct line_reader {
+    FILE *stream;
+    size_t line_size;
+    void *packed;               // Packed chunk as received
+    size_t packed_size;         // Allocated size of packed
+    struct fa_entry *lines;     // Unpacked lines of current chunk
+    unsigned int lines_size;    // Allocated capacity of lines
+    unsigned int line_count;    // Number of lines in current chunk
+    unsigned int next_line;     // Next line to be returned
+};
+
+#define LINE_READER(reader, stream_) \
+    struct line_reader reader = { \
+        .stream = stream_, .line_size = get_line_size() }
+
+
+static void release_line_reader(struct line_reader *reader)
+{
+    free(reader->packed);
+    free(reader->lines);
+}
+
+
+/* Reads and unpacks the next compressed chunk.  Returns false at the end of
+ * input, also reporting an error if the chunk is malformed. */
+static bool read_compressed_chunk(struct line_reader *reader)
+{
+    unsigned int field_count =
+        (unsigned int) (reader->line_size / FA_ENTRY_SIZE);
+    struct compressed_chunk chunk;
+    if (!READ_ITEM(reader->stream, chunk))
+        return false;
+    bool ok =
+        TEST_OK_(chunk.sample_count > 0  &&  chunk.length <=
+            packed_frames_size(chunk.sample_count, field_count),
+            "Malformed compressed data");
+    if (ok  &&  chunk.length > reader->packed_size)
+    {
+        reader->packed_size = chunk.length;
+        reader->packed = realloc(reader->packed, chunk.length);
+    }
+    if (ok  &&  chunk.sample_count > reader->lines_size)
+    {
+        reader->lines_size = chunk.sample_count;
+        reader->lines = realloc(reader->lines,
+            chunk.sample_count * reader->line_size);
+    }
+    ok = ok  &&
+        TEST_OK_(fread(reader->packed, 1, chunk.length, reader->stream) ==
+            chunk.length, "Truncated compressed data")  &&
+        unpack_frames(reader->packed, chunk.length,
+            chunk.sample_count, field_count, reader->lines);
+    reader->line_count = ok ? chunk.sample_count : 0;
+    reader->next_line = 0;
+    return ok;
+}
+
+
+/* Reads up to line_count lines, returning the number actually read.  This may
+ * be less than requested, and returns 0 at the end of input. */
+static size_t read_lines(
+    struct line_reader *reader, void *buffer, size_t line_count)
+{
+    if (!compress_transfer)
+        return fread(buffer, reader->line_size, line_count, reader->stream);
+    else if (reader->next_line < reader->line_count  ||
+             read_compressed_chunk(reader))
+    {
+        unsigned int available = reader->line_count - reader->next_line;
+        if (line_count > available)
+            line_count = available;
+        memcpy(buffer,
+            (void *) reader->lines + reader->next_line * reader->line_size,
+            line_count * reader->line_size);
+        reader->next_line += (unsigned int) line_count;
+        return line_count;
+    }
+    else
+        return 0;
+}
+
+
 /* This routine reads data from stream and writes out complete frames until
  * either the sample count is reached or the read is interrupted. */
 static bool capture_data(FILE *stream, uint64_t *frames_written)
 {
-    /* Size of line of data. */
-    size_t line_size =
-        count_data_bits(data_mask) *
-        count_mask_bits(&capture_mask, fa_entry_count) * FA_ENTRY_SIZE;
+    size_t line_size = get_line_size();
+    LINE_READER(reader, stream);
 
     /* If matlab_format is set we need to read timestamp frames interleaved
      * in the data stream.  These two variables keep track of this. */
@@ -733,7 +915,7 @@ static bool capture_data(FILE *stream, uint64_t *frames_written)
         /* Read the extended timestamp if appropriate. */
         if (matlab_format  &&  lines_to_timestamp == 0)
         {
-            if (!read_timestamp_block(stream))
+            if (!read_timestamp_block(stream, get_timestamp_block()))
                 break;      // End of input
 
             timestamps_count += 1;
@@ -753,7 +935,7 @@ static bool capture_data(FILE *stream, uint64_t *frames_written)
 
         /* Read lines of data. */
         char buffer[BUFFER_SIZE];
-        size_t lines_read = fread(buffer, line_size, lines_to_read, stream);
+        size_t lines_read = read_lines(&reader, buffer, lines_to_read);
         if (lines_read == 0)
             break;          // End of input
         lines_to_timestamp -= lines_read;
@@ -770,6 +952,7 @@ static bool capture_data(FILE *stream, uint64_t *frames_written)
 
     if (show_progress)
         reset_progress();
+    release_line_reader(&reader);
     return ok;
 }
 
@@ -871,49 +1054,22 @@ static bool buffered_convert_write(
 }
 
 
-/* Timestamp to add to or subtract from server timestamps. */
-static uint64_t timestamp_offset;
+/* Conversion from server timestamps, set up from the first timestamp block. */
+static struct timestamp_conversion timestamp_conversion;
 
 /* Computes a block of timestamps for a single data block. */
-static void convert_timestamps(
+static void convert_block_timestamps(
     struct extended_timestamp_id0 *timestamps, void *buffer)
 {
-    unsigned int block_size = timestamp_header.block_size;
-    double scaling = 1e-6 / SECS_PER_DAY;
-    double increment = (scaling * timestamps->duration) / block_size;
-    double timestamp =
-        scaling * (double) (timestamps->timestamp + timestamp_offset);
-    double delta = 0.0;     // Separate accumulator to improve precision
-
-    double *result = buffer;
-    for (unsigned int i = 0; i < block_size; i ++)
-    {
-        result[i] = timestamp + delta;
-        delta += increment;
-    }
+    convert_timestamps(&timestamp_conversion, timestamps, buffer);
 }
 
 static bool write_timestamps(unsigned int frames_written, time_t local_offset)
 {
-    /* Prepare timestamp conversion.  First we need to compute the starting
-     * timestamp and day_zero and then from this the timestamp offset used in
-     * the conversion above. */
-
-    /* Matlab epoch in archive units, taking the local offset into account. */
-    timestamp_offset = (uint64_t) 1000000 *
-        ((uint64_t) local_offset + (uint64_t) SECS_PER_DAY * MATLAB_EPOCH);
-    /* Timestamp of first point in captured data in archive epoch. */
-    uint64_t start_ts =
-        timestamps_array[0].timestamp +
-        (uint64_t) timestamps_array[0].duration * timestamp_header.offset /
-            timestamp_header.block_size;
-    /* Can now compute timestamp and day */
-    double timestamp =
-        1e-6 / SECS_PER_DAY * (double) (start_ts + timestamp_offset);
-    double day_zero = floor(timestamp);
-
-    if (subtract_day_zero)
-        timestamp_offset -= (uint64_t) (1e6 * SECS_PER_DAY * day_zero);
+    double timestamp, day_zero;
+    prepare_timestamps(
+        &timestamp_conversion, &timestamp_header, &timestamps_array[0],
+        local_offset, subtract_day_zero, &timestamp, &day_zero);
 
     /* Output the matlab values. */
     DECLARE_MATLAB_BUFFER(header, 512); // Just need space for vector heading
@@ -925,7 +1081,8 @@ static bool write_timestamps(unsigned int frames_written, time_t local_offset)
     return
         write_matlab_buffer(output_file, &header)  &&
         buffered_convert_write(
-            padding, frames_written, sizeof(double), convert_timestamps);
+            padding, frames_written, sizeof(double),
+            convert_block_timestamps);
 }
 
 
@@ -989,6 +1146,657 @@ static bool capture_matlab_data(FILE *stream)
 
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Streamed data capture */
+
+/* The matlab format can only be completed once the capture length is known, so
+ * it either has to be seeked back over or assembled from timestamps held in
+ * memory.  Streamed format is instead written strictly in order as data
+ * arrives: a header, a sequence of chunks each holding a run of data lines
+ * together with their timestamps and optional id0 values, and finally an index
+ * of chunks followed by a fixed size trailer.  Chunks are filled and written
+ * alternately from a pair of buffers so that network reads and file writes can
+ * overlap.  See docs/fa-capture.rst for the format description. */
+
+#define STREAM_CHUNK_SIZE   (1 << 20)   // Target data size of a single chunk
+#define STREAM_VERSION      1
+
+#define STREAM_FLAG_ID0     1           // Chunks include id0 values
+
+/* Header at start of file, followed by the array of captured ids padded to a
+ * multiple of 8 bytes. */
+struct stream_header {
+    char magic[8];              // "FASTREAM"
+    uint32_t version;           // STREAM_VERSION
+    uint32_t header_size;       // Total header size including ids
+    uint32_t decimation;        // Decimation factor, 1 for FA data
+    uint32_t data_mask;         // Decimated data fields captured
+    uint32_t field_count;       // Number of data fields per id
+    uint32_t id_count;          // Number of captured ids
+    uint32_t flags;             // STREAM_FLAG_ flags
+    uint32_t padding;
+    double f_s;                 // Sample frequency of captured data
+    double timestamp;           // Matlab timestamp of first sample
+    double day;                 // Day part of timestamp
+};
+
+/* Header of each chunk.  This is followed by frame_count lines of data, then
+ * frame_count double timestamps, then if requested frame_count uint32_t id0
+ * values padded to a multiple of 8 bytes. */
+struct stream_chunk_header {
+    char magic[4];              // "CHNK"
+    uint32_t frame_count;       // Number of frames in this chunk
+    uint64_t first_frame;       // Index of first frame in this chunk
+};
+
+/* The index has one entry for each chunk, and is followed by the trailer. */
+struct stream_index_entry {
+    uint64_t offset;            // File offset of chunk header
+    uint64_t first_frame;       // Index of first frame in chunk
+};
+
+struct stream_trailer {
+    uint64_t frame_count;       // Total number of frames captured
+    uint64_t chunk_count;       // Number of entries in index
+    uint64_t index_offset;      // File offset of start of index
+    char magic[8];              // "FAINDEX_"
+};
+
+
+/* Chunk as filled from the network and emptied to file. */
+struct stream_chunk {
+    unsigned int frame_count;
+    uint64_t first_frame;
+    char *data;
+    double *timestamps;
+    uint32_t *id0;
+};
+
+static struct stream_chunk stream_chunks[2];
+static unsigned int chunk_capacity;     // Maximum frames in a chunk
+
+/* Handshake with the writer thread: a chunk is placed in pending_chunk for
+ * writing and is only released when completely written.  Note that we can't
+ * use locking.h here as its psignal() collides with the one in signal.h. */
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stream_signal = PTHREAD_COND_INITIALIZER;
+static struct stream_chunk *pending_chunk = NULL;
+static bool stream_closing = false;     // No more chunks will be written
+static bool stream_write_ok = true;     // Set false on any write failure
+static pthread_t stream_writer_id;
+
+/* Record of chunks written, used to write the index when the capture is
+ * complete. */
+static uint64_t stream_offset = 0;      // Bytes written so far
+static struct stream_index_entry *stream_index = NULL;
+static size_t stream_index_size = 0;
+static size_t stream_index_count = 0;
+
+
+static bool write_stream(const void *data, size_t size)
+{
+    stream_offset += size;
+    return TEST_OK(fwrite(data, 1, size, output_file) == size);
+}
+
+static bool write_stream_padding(size_t size)
+{
+    char padding[8] = { 0 };
+    return write_stream(padding, (8 - size % 8) % 8);
+}
+
+
+/* The header is written as soon as the first timestamp block is known. */
+static bool write_stream_header(double timestamp, double day_zero)
+{
+    uint16_t mask_ids[fa_entry_count];
+    unsigned int id_count =
+        compute_mask_ids(mask_ids, &capture_mask, fa_entry_count);
+    size_t ids_size = id_count * sizeof(uint16_t);
+    uint32_t decimation = get_decimation();
+    struct stream_header header = {
+        .magic = "FASTREAM",
+        .version = STREAM_VERSION,
+        .header_size = (uint32_t) (
+            sizeof(header) + ids_size + (8 - ids_size % 8) % 8),
+        .decimation = decimation,
+        .data_mask = data_mask,
+        .field_count = count_data_bits(data_mask),
+        .id_count = id_count,
+        .flags = save_id0 ? STREAM_FLAG_ID0 : 0,
+        .f_s = sample_frequency / decimation,
+        .timestamp = timestamp,
+        .day = day_zero,
+    };
+    return
+        write_stream(&header, sizeof(header))  &&
+        write_stream(mask_ids, ids_size)  &&
+        write_stream_padding(ids_size);
+}
+
+
+static void add_stream_index(uint64_t offset, uint64_t first_frame)
+{
+    if (stream_index_count >= stream_index_size)
+    {
+        stream_index_size =
+            stream_index_size == 0 ? 1024 :
+            stream_index_size + stream_index_size / 2;
+        stream_index = realloc(stream_index,
+            stream_index_size * sizeof(struct stream_index_entry));
+    }
+    stream_index[stream_index_count++] = (struct stream_index_entry) {
+        .offset = offset, .first_frame = first_frame };
+}
+
+
+static bool write_stream_chunk(struct stream_chunk *chunk)
+{
+    struct stream_chunk_header header = {
+        .magic = "CHNK",
+        .frame_count = chunk->frame_count,
+        .first_frame = chunk->first_frame };
+    size_t id0_size = chunk->frame_count * sizeof(uint32_t);
+    add_stream_index(stream_offset, chunk->first_frame);
+    return
+        write_stream(&header, sizeof(header))  &&
+        write_stream(chunk->data, chunk->frame_count * get_line_size())  &&
+        write_stream(chunk->timestamps, chunk->frame_count * sizeof(double))  &&
+        IF_(save_id0,
+            write_stream(chunk->id0, id0_size)  &&
+            write_stream_padding(id0_size));
+}
+
+
+static bool write_stream_index(uint64_t frames_written)
+{
+    struct stream_trailer trailer = {
+        .frame_count = frames_written,
+        .chunk_count = stream_index_count,
+        .index_offset = stream_offset,
+        .magic = "FAINDEX_" };
+    return
+        write_stream(stream_index,
+            stream_index_count * sizeof(struct stream_index_entry))  &&
+        write_stream(&trailer, sizeof(trailer))  &&
+        TEST_OK(fflush(output_file) == 0);
+}
+
+
+/* Waits for the previous chunk to be written, called with stream_mutex held,
+ * returns false if any write has failed. */
+static bool wait_for_writer(void)
+{
+    while (pending_chunk != NULL)
+        ASSERT_0(pthread_cond_wait(&stream_signal, &stream_mutex));
+    return stream_write_ok;
+}
+
+
+/* Writes each chunk as it is handed over until the stream is closed. */
+static void *stream_writer(void *context)
+{
+    while (true)
+    {
+        ASSERT_0(pthread_mutex_lock(&stream_mutex));
+        while (pending_chunk == NULL  &&  !stream_closing)
+            ASSERT_0(pthread_cond_wait(&stream_signal, &stream_mutex));
+        struct stream_chunk *chunk = pending_chunk;
+        ASSERT_0(pthread_mutex_unlock(&stream_mutex));
+        if (chunk == NULL)
+            break;
+
+        bool ok = write_stream_chunk(chunk);
+        ASSERT_0(pthread_mutex_lock(&stream_mutex));
+        pending_chunk = NULL;
+        stream_write_ok = stream_write_ok  &&  ok;
+        ASSERT_0(pthread_cond_broadcast(&stream_signal));
+        ASSERT_0(pthread_mutex_unlock(&stream_mutex));
+    }
+    return NULL;
+}
+
+
+/* Hands a filled chunk over to the writer thread once the previous chunk has
+ * been written, returns false if any write has failed. */
+static bool queue_stream_chunk(struct stream_chunk *chunk)
+{
+    ASSERT_0(pthread_mutex_lock(&stream_mutex));
+    bool ok = wait_for_writer();
+    if (ok)
+    {
+        pending_chunk = chunk;
+        ASSERT_0(pthread_cond_broadcast(&stream_signal));
+    }
+    ASSERT_0(pthread_mutex_unlock(&stream_mutex));
+    return ok;
+}
+
+
+/* Waits for all outstanding writes and shuts down the writer thread. */
+static bool close_stream_writer(void)
+{
+    ASSERT_0(pthread_mutex_lock(&stream_mutex));
+    bool ok = wait_for_writer();
+    stream_closing = true;
+    ASSERT_0(pthread_cond_broadcast(&stream_signal));
+    ASSERT_0(pthread_mutex_unlock(&stream_mutex));
+    ASSERT_0(pthread_join(stream_writer_id, NULL));
+    return ok;
+}
+
+
+static bool initialise_stream_writer(void)
+{
+    chunk_capacity = (unsigned int) (STREAM_CHUNK_SIZE / get_line_size());
+    if (chunk_capacity == 0)
+        chunk_capacity = 1;
+    for (unsigned int i = 0; i < ARRAY_SIZE(stream_chunks); i ++)
+    {
+        struct stream_chunk *chunk = &stream_chunks[i];
+        chunk->data = malloc(chunk_capacity * get_line_size());
+        chunk->timestamps = malloc(chunk_capacity * sizeof(double));
+        chunk->id0 = malloc(chunk_capacity * sizeof(uint32_t));
+    }
+    return TEST_0(pthread_create(&stream_writer_id, NULL, stream_writer, NULL));
+}
+
+
+/* Reads data from stream into alternate chunks, tagging each line with its
+ * timestamp and id0 value as computed for the current timestamp block. */
+static bool capture_stream_chunks(
+    FILE *stream, time_t local_offset, uint64_t *frames_written)
+{
+    size_t line_size = get_line_size();
+    LINE_READER(reader, stream);
+    unsigned int block_size = timestamp_header.block_size;
+    double *block_timestamps = malloc(block_size * sizeof(double));
+    uint32_t *block_id0 = malloc(block_size * sizeof(uint32_t));
+
+    struct extended_timestamp_id0 block;
+    unsigned int block_offset = timestamp_header.offset;
+    size_t lines_to_timestamp = 0;
+    bool header_written = false;
+
+    unsigned int current = 0;
+    struct stream_chunk *chunk = &stream_chunks[current];
+    *chunk = (struct stream_chunk) { .data = chunk->data,
+        .timestamps = chunk->timestamps, .id0 = chunk->id0 };
+    *frames_written = 0;
+    bool ok = true;
+
+    do {
+        if (lines_to_timestamp == 0)
+        {
+            if (!read_timestamp_block(stream, &block))
+                break;      // End of input
+            if (!header_written)
+            {
+                double timestamp, day_zero;
+                prepare_timestamps(
+                    &timestamp_conversion, &timestamp_header, &block,
+                    local_offset, subtract_day_zero, &timestamp, &day_zero);
+                ok = write_stream_header(timestamp, day_zero);
+                header_written = true;
+                if (!ok)
+                    break;
+            }
+            convert_timestamps(
+                &timestamp_conversion, &block, block_timestamps);
+            if (save_id0)
+                convert_id0(&block, block_id0);
+            lines_to_timestamp = block_size - block_offset;
+            block_offset = 0;
+        }
+        unsigned int position = block_size - (unsigned int) lines_to_timestamp;
+
+        /* Read as much as will fit in the current chunk up to the next
+         * timestamp and the requested sample count. */
+        size_t lines_to_read = chunk_capacity - chunk->frame_count;
+        if (lines_to_read > lines_to_timestamp)
+            lines_to_read = lines_to_timestamp;
+        if (sample_count > 0  &&
+                lines_to_read > sample_count - *frames_written)
+            lines_to_read = (size_t) (sample_count - *frames_written);
+
+        size_t lines_read = read_lines(&reader,
+            chunk->data + chunk->frame_count * line_size, lines_to_read);
+        if (lines_read == 0)
+            break;          // End of input
+        memcpy(chunk->timestamps + chunk->frame_count,
+            block_timestamps + position, lines_read * sizeof(double));
+        if (save_id0)
+            memcpy(chunk->id0 + chunk->frame_count,
+                block_id0 + position, lines_read * sizeof(uint32_t));
+        chunk->frame_count += (unsigned int) lines_read;
+        lines_to_timestamp -= lines_read;
+        *frames_written += lines_read;
+
+        /* Hand over full chunk and carry on filling the other one. */
+        if (chunk->frame_count == chunk_capacity)
+        {
+            ok = queue_stream_chunk(chunk);
+            current = 1 - current;
+            chunk = &stream_chunks[current];
+            chunk->frame_count = 0;
+            chunk->first_frame = *frames_written;
+        }
+
+        if (show_progress)
+            update_progress(*frames_written, line_size);
+    } while (ok  &&  running  &&
+        (sample_count == 0  ||  *frames_written < sample_count));
+
+    if (show_progress)
+        reset_progress();
+    free(block_timestamps);
+    free(block_id0);
+    release_line_reader(&reader);
+    return
+        ok  &&
+        IF_(chunk->frame_count > 0, queue_stream_chunk(chunk))  &&
+        /* If no data was received at all we still need a valid header. */
+        IF_(!header_written, write_stream_header(0, 0));
+}
+
+
+/* Coordination of streamed data capture. */
+static bool capture_stream_data(FILE *stream)
+{
+    uint64_t frames_written = 0;
+    time_t local_offset = offset_matlab_times ? local_time_offset() : 0;
+    bool ok =
+        TEST_OK(READ_ITEM(stream, timestamp_header))  &&
+        TEST_OK_(timestamp_header.offset < timestamp_header.block_size,
+            "Invalid response from server")  &&
+        initialise_stream_writer();
+    if (ok)
+    {
+        ok = capture_stream_chunks(stream, local_offset, &frames_written);
+        ok = close_stream_writer()  &&  ok;
+    }
+    return
+        ok  &&
+        write_stream_index(frames_written);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Parallel capture */
+
+/* The server delivers each read request from a single thread over a single
+ * connection, so a large historical capture can be split across several
+ * connections.  The complete request is first sent with the P option so that
+ * the server resolves the start and sample count and reports the position of
+ * the first sample in its block structure.  The range is then split into
+ * pieces starting on block boundaries, each requested by block position, so
+ * that the pieces join exactly.  Each piece is received on its own thread and
+ * written directly to its place in the output file, with its timestamp blocks
+ * stored at the corresponding place in timestamps_array. */
+
+struct capture_piece {
+    FILE *stream;               // Connection for this piece
+    pthread_t thread;
+    uint64_t first_sample;      // Index of first sample in complete capture
+    uint64_t sample_count;      // Number of samples in this piece
+    unsigned int block;         // Archive block of first sample
+    unsigned int offset;        // Offset into block of first sample
+    size_t first_timestamp;     // Index of first block in timestamps_array
+    uint64_t frames_written;    // Progress, read by main thread
+    bool ok;                    // Result of capture
+};
+
+static off_t data_offset;       // File offset of start of captured data
+static unsigned int pieces_running;
+
+
+/* Asks the server where the requested data starts, also setting sample_count
+ * to the number of samples that would be sent. */
+static bool request_position(struct read_position *position)
+{
+    char start_str[64], end_str[64];
+    format_range(start_str, end_str);
+    FILE *stream;
+    return
+        connect_server(&stream)  &&
+        FINALLY(
+            request_archive_data(stream, start_str, end_str, "P")  &&
+            check_response(stream)  &&
+            TEST_OK(READ_ITEM(stream, sample_count))  &&
+            TEST_OK(READ_ITEM(stream, *position)),
+            // Finally, whether the response was received
+            TEST_OK(fclose(stream) == 0))  &&
+        TEST_OK_(position->block_size > 0  &&
+            position->offset < position->block_size,
+            "Invalid response from server");
+}
+
+
+/* Splits the capture into at most connection_count pieces of whole blocks,
+ * except for the partial blocks at each end.  Returns the number of pieces. */
+static unsigned int plan_pieces(
+    const struct read_position *position, struct capture_piece pieces[])
+{
+    uint64_t block_size = position->block_size;
+    uint64_t total_blocks =
+        (position->offset + sample_count + block_size - 1) / block_size;
+    uint64_t piece_blocks =
+        (total_blocks + connection_count - 1) / connection_count;
+
+    unsigned int count = 0;
+    for (uint64_t block = 0; block < total_blocks; block += piece_blocks)
+    {
+        uint64_t first = block == 0 ? 0 : block * block_size - position->offset;
+        uint64_t last = (block + piece_blocks) * block_size - position->offset;
+        if (last > sample_count)
+            last = sample_count;
+        pieces[count++] = (struct capture_piece) {
+            .first_sample = first,
+            .sample_count = last - first,
+            .block = (unsigned int)
+                ((position->block + block) % position->block_count),
+            .offset = block == 0 ? position->offset : 0,
+            .first_timestamp = (size_t) block,
+        };
+    }
+    return count;
+}
+
+
+/* Writes the matlab header and sizes the timestamp array ready for the pieces
+ * to fill in.  For raw data the captured data starts at the head of the file.
+ */
+static bool prepare_parallel_output(const struct read_position *position)
+{
+    data_offset = 0;
+    if (matlab_format)
+    {
+        timestamp_header = (struct extended_timestamp_header) {
+            .block_size = position->block_size,
+            .offset = position->offset };
+        timestamps_count = (size_t) (
+            (position->offset + sample_count + position->block_size - 1) /
+            position->block_size);
+        timestamps_array_size = timestamps_count;
+        return
+            TEST_OK_(sample_count <= UINT32_MAX,
+                "Too many samples for matlab format capture")  &&
+            TEST_NULL(timestamps_array = calloc(
+                timestamps_count, sizeof(struct extended_timestamp_id0)))  &&
+            write_header((uint32_t) sample_count)  &&
+            TEST_OK(fflush(output_file) == 0)  &&
+            TEST_IO(data_offset = ftello(output_file));
+    }
+    else
+        return true;
+}
+
+
+/* Opens a connection for a single piece and sends its request. */
+static bool request_piece(struct capture_piece *piece)
+{
+    char start_str[64], end_str[64];
+    sprintf(start_str, "B%u.%u", piece->block, piece->offset);
+    sprintf(end_str, "N%"PRIu64, piece->sample_count);
+    return
+        connect_server(&piece->stream)  &&
+        UNLESS(
+            request_archive_data(piece->stream, start_str, end_str, "")  &&
+            check_response(piece->stream),
+            // Close stream if request rejected
+            TEST_OK(fclose(piece->stream) == 0));
+}
+
+
+/* Receives the data for a single piece, writing the data lines to their place
+ * in the output file. */
+static bool receive_piece(struct capture_piece *piece)
+{
+    FILE *stream = piece->stream;
+    LINE_READER(reader, stream);
+    int file = fileno(output_file);
+    size_t line_size = get_line_size();
+    off_t file_offset =
+        data_offset + (off_t) (piece->first_sample * line_size);
+    struct extended_timestamp_id0 *timestamp =
+        &timestamps_array[piece->first_timestamp];
+
+    uint64_t samples;
+    struct extended_timestamp_header header = { .offset = 0 };
+    bool ok =
+        TEST_OK(READ_ITEM(stream, samples))  &&
+        TEST_OK_(samples == piece->sample_count,
+            "Server sent %"PRIu64" samples, expected %"PRIu64,
+            samples, piece->sample_count)  &&
+        IF_(matlab_format,
+            TEST_OK(READ_ITEM(stream, header))  &&
+            TEST_OK_(
+                header.block_size == timestamp_header.block_size  &&
+                header.offset == piece->offset,
+                "Capture piece not aligned with block structure"));
+
+    unsigned int block_offset = header.offset;
+    size_t lines_to_timestamp = 0;
+    uint64_t frames_written = 0;
+    while (ok  &&  running  &&  frames_written < piece->sample_count)
+    {
+        if (matlab_format  &&  lines_to_timestamp == 0)
+        {
+            ok = TEST_OK_(read_timestamp_block(stream, timestamp++),
+                "Unexpected end of data");
+            if (!ok)
+                break;
+            lines_to_timestamp = header.block_size - block_offset;
+            block_offset = 0;
+        }
+
+        size_t lines_to_read = BUFFER_SIZE / line_size;
+        if (matlab_format  &&  lines_to_read > lines_to_timestamp)
+            lines_to_read = lines_to_timestamp;
+        if (lines_to_read > piece->sample_count - frames_written)
+            lines_to_read = (size_t) (piece->sample_count - frames_written);
+
+        char buffer[BUFFER_SIZE];
+        size_t lines_read = read_lines(&reader, buffer, lines_to_read);
+        size_t size = lines_read * line_size;
+        ok =
+            TEST_OK_(lines_read > 0, "Unexpected end of data")  &&
+            TEST_OK(pwrite(file, buffer, size, file_offset) == (ssize_t) size);
+        file_offset += (off_t) size;
+        lines_to_timestamp -= lines_read;
+        frames_written += lines_read;
+        __atomic_store_n(&piece->frames_written, frames_written,
+            __ATOMIC_RELAXED);
+    }
+
+    release_line_reader(&reader);
+    return
+        TEST_OK(fclose(stream) == 0)  &&
+        ok;
+}
+
+
+static void *capture_piece(void *context)
+{
+    struct capture_piece *piece = context;
+    piece->ok = receive_piece(piece);
+    __atomic_sub_fetch(&pieces_running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+/* Shows progress until all pieces are complete and gathers the results. */
+static bool wait_for_pieces(
+    struct capture_piece pieces[], unsigned int piece_count)
+{
+    while (__atomic_load_n(&pieces_running, __ATOMIC_ACQUIRE) > 0)
+    {
+        usleep(100000);
+        if (show_progress)
+        {
+            uint64_t frames_written = 0;
+            for (unsigned int i = 0; i < piece_count; i ++)
+                frames_written += __atomic_load_n(
+                    &pieces[i].frames_written, __ATOMIC_RELAXED);
+            update_progress(frames_written, get_line_size());
+        }
+    }
+    if (show_progress)
+        reset_progress();
+
+    bool ok = true;
+    for (unsigned int i = 0; i < piece_count; i ++)
+    {
+        ASSERT_0(pthread_join(pieces[i].thread, NULL));
+        ok = ok  &&  pieces[i].ok;
+    }
+    return ok;
+}
+
+
+/* Coordination of capture split across several connections. */
+static bool capture_parallel(void)
+{
+    time_t local_offset = offset_matlab_times ? local_time_offset() : 0;
+    struct read_position position;
+    struct capture_piece pieces[MAX_CONNECTIONS];
+    unsigned int piece_count = 0;
+    bool ok =
+        request_position(&position)  &&
+        DO_(piece_count = plan_pieces(&position, pieces))  &&
+        prepare_parallel_output(&position);
+
+    /* Only start receiving once all pieces have been accepted. */
+    unsigned int requested = 0;
+    while (ok  &&  requested < piece_count)
+    {
+        ok = request_piece(&pieces[requested]);
+        if (ok)
+            requested += 1;
+    }
+    if (!ok)
+    {
+        for (unsigned int i = 0; i < requested; i ++)
+            IGNORE(TEST_OK(fclose(pieces[i].stream) == 0));
+        return false;
+    }
+
+    pieces_running = piece_count;
+    for (unsigned int i = 0; i < piece_count; i ++)
+        ASSERT_0(pthread_create(
+            &pieces[i].thread, NULL, capture_piece, &pieces[i]));
+    return
+        wait_for_pieces(pieces, piece_count)  &&
+        IF_(matlab_format,
+            TEST_IO(fseeko(output_file,
+                data_offset + (off_t) (sample_count * get_line_size()),
+                SEEK_SET))  &&
+            write_footer((uint32_t) sample_count, local_offset));
+}
+
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Top level control */
 
@@ -999,9 +1807,21 @@ static bool capture_and_save(FILE *stream)
     return
         IF_(!continuous_capture,
             TEST_OK(READ_ITEM(stream, sample_count)))  &&
+        IF_ELSE(stream_format,
+            capture_stream_data(stream),
         IF_ELSE(matlab_format,
             capture_matlab_data(stream),
-            capture_raw_data(stream));
+            capture_raw_data(stream)));
+}
+
+
+static bool open_output(void)
+{
+    return
+        IF_(output_filename != NULL,
+            TEST_NULL_(
+                output_file = fopen(output_filename, "w"),
+                "Unable to open output file \"%s\"", output_filename));
 }
 
 
@@ -1017,16 +1837,17 @@ int main(int argc, char **argv)
     bool ok =
         parse_args(argc, argv)  &&
         validate_args()  &&
-
-        connect_server(&stream)  &&
-        IF_(output_filename != NULL,
-            TEST_NULL_(
-                output_file = fopen(output_filename, "w"),
-                "Unable to open output file \"%s\"", output_filename))  &&
-        request_data(stream)  &&
-        check_response(stream)  &&
-
-        initialise_signal()  &&
-        capture_and_save(stream);
+        IF_ELSE(connection_count > 1,
+            open_output()  &&
+            initialise_signal()  &&
+            capture_parallel(),
+
+            connect_server(&stream)  &&
+            open_output()  &&
+            request_data(stream)  &&
+            check_response(stream)  &&
+
+            initialise_signal()  &&
+            capture_and_save(stream));
     return ok ? 0 : 1;
 }
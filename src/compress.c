@@ -0,0 +1,329 @@
+/* Delta coding and bit packing of archived FA blocks.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "disk.h"
+
+#include "compress.h"
+
+
+/* Length of the table of bit widths at the start of a packed block. */
+static size_t widths_length(unsigned int count)
+{
+    size_t groups = count / DELTA_GROUP_SIZE;
+    return (2 * groups + 7) & ~(size_t) 7;
+}
+
+
+/* Zig zag coding interleaves positive and negative values so that differences
+ * of small magnitude become small numbers. */
+static inline uint32_t zigzag(uint32_t delta)
+{
+    return (delta << 1) ^ (0U - (delta >> 31));
+}
+
+static inline uint32_t unzigzag(uint32_t value)
+{
+    return (value >> 1) ^ (0U - (value & 1));
+}
+
+static inline unsigned int bit_width(uint32_t value)
+{
+    return value ? 32 - (unsigned int) __builtin_clz(value) : 0;
+}
+
+
+/* Packs a group of values of the given bit width into exactly width words. */
+static void pack_group(
+    const uint32_t values[], unsigned int width, uint64_t *output)
+{
+    uint64_t word = 0;
+    unsigned int bits = 0;
+    for (unsigned int i = 0; i < DELTA_GROUP_SIZE; i ++)
+    {
+        word |= (uint64_t) values[i] << bits;
+        bits += width;
+        if (bits >= 64)
+        {
+            *output++ = word;
+            bits -= 64;
+            /* Carry the bits that didn't fit into the next word. */
+            word = bits > 0 ? (uint64_t) values[i] >> (width - bits) : 0;
+        }
+    }
+}
+
+
+static void unpack_group(
+    const uint64_t *input, unsigned int width, uint32_t values[])
+{
+    uint64_t mask = (1ULL << width) - 1;
+    uint64_t word = 0;
+    unsigned int bits = 0;      // Number of unused bits left in word
+    for (unsigned int i = 0; i < DELTA_GROUP_SIZE; i ++)
+    {
+        if (bits >= width)
+        {
+            values[i] = (uint32_t) (word & mask);
+            word >>= width;
+            bits -= width;
+        }
+        else
+        {
+            uint64_t next = *input++;
+            values[i] = (uint32_t) ((word | (next << bits)) & mask);
+            word = next >> (width - bits);
+            bits = 64 - (width - bits);
+        }
+    }
+}
+
+
+/* Computes the zig zag coded differences for one field of a group of samples,
+ * returning the bit width needed to hold them.  Successive samples are stride
+ * fa_entry values apart. */
+static unsigned int difference_group(
+    const int32_t *input, size_t stride, uint32_t *last, uint32_t values[])
+{
+    uint32_t all_bits = 0;
+    for (unsigned int i = 0; i < DELTA_GROUP_SIZE; i ++)
+    {
+        uint32_t value = (uint32_t) input[2 * stride * i];
+        values[i] = zigzag(value - *last);
+        all_bits |= values[i];
+        *last = value;
+    }
+    return bit_width(all_bits);
+}
+
+static void integrate_group(
+    const uint32_t values[], size_t stride, uint32_t *last, int32_t *output)
+{
+    for (unsigned int i = 0; i < DELTA_GROUP_SIZE; i ++)
+    {
+        *last += unzigzag(values[i]);
+        output[2 * stride * i] = (int32_t) *last;
+    }
+}
+
+
+/* Copies count samples stride fa_entry values apart to or from a contiguous
+ * array, used for data which doesn't compress. */
+static void gather_column(
+    const struct fa_entry *input, size_t stride, unsigned int count,
+    struct fa_entry *output)
+{
+    for (unsigned int i = 0; i < count; i ++)
+        output[i] = input[i * stride];
+}
+
+static void scatter_column(
+    const struct fa_entry *input, size_t stride, unsigned int count,
+    struct fa_entry *output)
+{
+    for (unsigned int i = 0; i < count; i ++)
+        output[i * stride] = input[i];
+}
+
+
+/* Packs a single column of count samples, stride fa_entry values apart.  This
+ * is the common implementation of pack_fa_block() and pack_frames(). */
+static size_t pack_column(
+    const struct fa_entry *input, size_t stride, unsigned int count,
+    void *output)
+{
+    size_t raw_length = count * FA_ENTRY_SIZE;
+    uint8_t *widths = output;
+    size_t length = widths_length(count);
+    memset(widths, 0, length);
+
+    uint32_t last_x = 0, last_y = 0;
+    for (unsigned int g = 0; g < count / DELTA_GROUP_SIZE; g ++)
+    {
+        const struct fa_entry *group = input + g * DELTA_GROUP_SIZE * stride;
+        uint32_t x[DELTA_GROUP_SIZE], y[DELTA_GROUP_SIZE];
+        unsigned int width_x = difference_group(
+            &group->x, stride, &last_x, x);
+        unsigned int width_y = difference_group(
+            &group->y, stride, &last_y, y);
+
+        /* Give up as soon as we know the result will be no smaller than the
+         * original data. */
+        if (length + 8 * (width_x + width_y) >= raw_length)
+        {
+            gather_column(input, stride, count, output);
+            return raw_length;
+        }
+
+        widths[2 * g] = (uint8_t) width_x;
+        widths[2 * g + 1] = (uint8_t) width_y;
+        pack_group(x, width_x, output + length);
+        length += 8 * width_x;
+        pack_group(y, width_y, output + length);
+        length += 8 * width_y;
+    }
+    return length;
+}
+
+
+static bool unpack_column(
+    const void *input, size_t length, unsigned int count,
+    size_t stride, struct fa_entry *output)
+{
+    size_t raw_length = count * FA_ENTRY_SIZE;
+    if (length == raw_length)
+    {
+        scatter_column(input, stride, count, output);
+        return true;
+    }
+
+    const uint8_t *widths = input;
+    size_t offset = widths_length(count);
+    bool ok = TEST_OK_(offset <= length  &&  length % 8 == 0,
+        "Malformed packed FA block");
+
+    uint32_t last_x = 0, last_y = 0;
+    for (unsigned int g = 0; ok  &&  g < count / DELTA_GROUP_SIZE; g ++)
+    {
+        unsigned int width_x = widths[2 * g];
+        unsigned int width_y = widths[2 * g + 1];
+        ok = TEST_OK_(width_x <= 32  &&  width_y <= 32  &&
+            offset + 8 * (width_x + width_y) <= length,
+            "Malformed packed FA block");
+        if (ok)
+        {
+            struct fa_entry *group = output + g * DELTA_GROUP_SIZE * stride;
+            uint32_t values[DELTA_GROUP_SIZE];
+            unpack_group(input + offset, width_x, values);
+            integrate_group(values, stride, &last_x, &group->x);
+            offset += 8 * width_x;
+            unpack_group(input + offset, width_y, values);
+            integrate_group(values, stride, &last_y, &group->y);
+            offset += 8 * width_y;
+        }
+    }
+    return ok;
+}
+
+
+size_t pack_fa_block(
+    const struct fa_entry *input, unsigned int count, void *output)
+{
+    return pack_column(input, 1, count, output);
+}
+
+
+bool unpack_fa_block(
+    const void *input, size_t length, unsigned int count,
+    struct fa_entry *output)
+{
+    return unpack_column(input, length, count, 1, output);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Compressed transfer of frames. */
+
+/* Length of the table of column lengths at the start of the packed frames. */
+static size_t column_table_length(unsigned int field_count)
+{
+    return (sizeof(uint32_t) * field_count + 7) & ~(size_t) 7;
+}
+
+
+size_t packed_frames_size(unsigned int sample_count, unsigned int field_count)
+{
+    return
+        column_table_length(field_count) +
+        (size_t) sample_count * field_count * FA_ENTRY_SIZE;
+}
+
+
+size_t pack_frames(
+    const struct fa_entry *input,
+    unsigned int sample_count, unsigned int field_count, void *output)
+{
+    unsigned int packed_count = sample_count - sample_count % DELTA_GROUP_SIZE;
+    uint32_t *lengths = output;
+    size_t length = column_table_length(field_count);
+    memset(output, 0, length);
+
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        size_t column_length = pack_column(
+            input + i, field_count, packed_count, output + length);
+        lengths[i] = (uint32_t) column_length;
+        length += column_length;
+    }
+
+    /* Any samples left over after the last complete group are sent as they
+     * are. */
+    size_t tail_length =
+        (size_t) (sample_count - packed_count) * field_count * FA_ENTRY_SIZE;
+    memcpy(output + length, input + packed_count * field_count, tail_length);
+    return length + tail_length;
+}
+
+
+bool unpack_frames(
+    const void *input, size_t length,
+    unsigned int sample_count, unsigned int field_count,
+    struct fa_entry *output)
+{
+    unsigned int packed_count = sample_count - sample_count % DELTA_GROUP_SIZE;
+    const uint32_t *lengths = input;
+    size_t offset = column_table_length(field_count);
+    size_t tail_length =
+        (size_t) (sample_count - packed_count) * field_count * FA_ENTRY_SIZE;
+    bool ok = TEST_OK_(offset + tail_length <= length,
+        "Malformed packed frames");
+
+    for (unsigned int i = 0; ok  &&  i < field_count; i ++)
+    {
+        ok =
+            TEST_OK_(lengths[i] <= length - tail_length - offset,
+                "Malformed packed frames")  &&
+            unpack_column(input + offset, lengths[i], packed_count,
+                field_count, output + i);
+        offset += lengths[i];
+    }
+
+    return ok  &&
+        TEST_OK_(offset + tail_length == length, "Malformed packed frames")  &&
+        DO_(memcpy(output + packed_count * field_count,
+            input + offset, tail_length));
+}
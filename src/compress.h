@@ -0,0 +1,75 @@
+/* Header for compression of archived FA blocks.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* FA blocks are stored in compressed archives as follows.  Each block holds
+ * the samples for a single FA id and is divided into groups of DELTA_GROUP_SIZE
+ * samples.  Successive X and Y values are differenced, the differences are zig
+ * zag coded so that small negative numbers become small positive numbers, and
+ * each group is then packed into just enough bits for its largest value.  The
+ * packed block starts with a pair of bit widths for each group, padded to a
+ * multiple of 8 bytes, followed by the packed X and Y values for each group in
+ * turn, each packed into whole 64-bit words. */
+
+/* Packs count samples (a multiple of DELTA_GROUP_SIZE) of a single FA id into
+ * output, which must be 8-byte aligned and have room for count samples, and
+ * returns the number of bytes written.  If the data doesn't compress it is
+ * copied unchanged, and the returned length is then exactly count samples; the
+ * length of compressed data is always smaller than this. */
+size_t pack_fa_block(
+    const struct fa_entry *input, unsigned int count, void *output);
+
+/* Unpacks length bytes of packed data as written by pack_fa_block() into count
+ * samples.  Fails if the packed data is malformed. */
+bool unpack_fa_block(
+    const void *input, size_t length, unsigned int count,
+    struct fa_entry *output);
+
+
+/* A block of frames, each of field_count fa_entry values, is compressed for
+ * transfer to a client by packing each field as a separate column as above.
+ * The packed frames start with a table of the packed length of each column,
+ * padded to a multiple of 8 bytes, followed by the packed columns.  Samples
+ * beyond the last complete group of DELTA_GROUP_SIZE samples are not packed and
+ * follow at the end as ordinary frames. */
+
+/* Returns the largest possible length of packed frames. */
+size_t packed_frames_size(unsigned int sample_count, unsigned int field_count);
+
+/* Packs sample_count frames into output, which must be 8-byte aligned and have
+ * room for packed_frames_size() bytes, returns the number of bytes written. */
+size_t pack_frames(
+    const struct fa_entry *input,
+    unsigned int sample_count, unsigned int field_count, void *output);
+
+/* Unpacks length bytes of frames written by pack_frames().  Fails if the packed
+ * data is malformed. */
+bool unpack_frames(
+    const void *input, size_t length,
+    unsigned int sample_count, unsigned int field_count,
+    struct fa_entry *output);
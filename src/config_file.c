@@ -235,9 +235,57 @@ static bool read_line(
 }
 
 
-bool config_parse_file(
-    const char *file_name,
-    const struct config_entry *config_table, size_t config_size)
+/* Checks whether this line is a section header of the form [section_name],
+ * which is only recognised if section_name is not NULL. */
+static bool parse_section_header(
+    const char *file_name, int line_number, const char *line_buffer,
+    const char *section_name, bool *header)
+{
+    const char *string = line_buffer;
+    skip_whitespace(&string);
+    *header = section_name != NULL  &&  *string == '[';
+    if (!*header)
+        return true;
+
+    push_error_handling();
+    char name[NAME_LENGTH];
+    bool ok =
+        parse_char(&string, '[')  &&
+        parse_name(&string, name, NAME_LENGTH)  &&
+        parse_char(&string, ']')  &&
+        DO_(skip_whitespace(&string))  &&
+        parse_eos(&string)  &&
+        TEST_OK_(strcmp(name, section_name) == 0,
+            "Unknown section [%s]", name);
+
+    char *error = pop_error_handling(!ok);
+    if (!ok)
+        print_error("Error parsing %s, line %d, offset %zd: %s",
+            file_name, line_number, string - line_buffer, error);
+    free(error);
+    return ok;
+}
+
+
+/* Checks that all required entries were present and resets the seen flags
+ * ready for the next section. */
+static bool check_seen(
+    const struct config_entry *config_table, size_t config_size, bool *seen)
+{
+    errno = 0;      // Can linger over into error reporting
+    bool ok = true;
+    for (size_t i = 0; ok  &&  i < config_size; i ++)
+        ok = TEST_OK_(seen[i]  ||  config_table[i].optional,
+            "No value specified for parameter: %s", config_table[i].name);
+    memset(seen, 0, config_size * sizeof(bool));
+    return ok;
+}
+
+
+bool config_parse_sections(
+    const char *file_name, const char *section_name,
+    const struct config_entry *config_table, size_t config_size,
+    bool (*end_section)(void))
 {
     FILE *input = fopen(file_name, "r");
     if (!TEST_NULL_(input, "Unable to open config file \"%s\"", file_name))
@@ -248,27 +296,41 @@ bool config_parse_file(
     bool seen[config_size];
     memset(seen, 0, sizeof(seen));
 
-    /* Process each line in the file. */
+    /* Process each line in the file, completing the current section whenever
+     * a new section header is seen. */
     bool ok = true;
     bool eof = false;
     int line_number = 0;
     while (ok  &&  !eof)
     {
         char line_buffer[LINE_SIZE];
+        bool header = false;
         ok =
             read_line(
                 input, line_buffer, sizeof(line_buffer), &line_number, &eof)  &&
-            do_parse_line(
-                file_name, line_number, line_buffer,
-                config_table, config_size, seen);
+            parse_section_header(
+                file_name, line_number, line_buffer, section_name, &header)  &&
+            IF_ELSE(header,
+                check_seen(config_table, config_size, seen)  &&
+                IF_(end_section, end_section()),
+                do_parse_line(
+                    file_name, line_number, line_buffer,
+                    config_table, config_size, seen));
     }
     fclose(input);
 
-    /* Check that all required entries were present. */
-    errno = 0;      // Can linger over into error reporting
-    for (size_t i = 0; ok  &&  i < config_size; i ++)
-        ok = TEST_OK_(seen[i]  ||  config_table[i].optional,
-            "No value specified for parameter: %s", config_table[i].name);
+    /* Check that all required entries were present in the last section. */
+    return
+        ok  &&
+        check_seen(config_table, config_size, seen)  &&
+        IF_(end_section, end_section());
+}
 
-    return ok;
+
+bool config_parse_file(
+    const char *file_name,
+    const struct config_entry *config_table, size_t config_size)
+{
+    return config_parse_sections(
+        file_name, NULL, config_table, config_size, NULL);
 }
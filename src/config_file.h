@@ -49,6 +49,16 @@ bool config_parse_file(
     const char *file_name, const struct config_entry *config_table,
     size_t config_size);
 
+/* As for config_parse_file, but the file is divided into sections.  The first
+ * section is unlabelled and each subsequent section starts with a line
+ * containing just [section_name].  end_section is called after each section
+ * has been successfully parsed, and the same config_table is then used for the
+ * next section. */
+bool config_parse_sections(
+    const char *file_name, const char *section_name,
+    const struct config_entry *config_table, size_t config_size,
+    bool (*end_section)(void));
+
 #define DECLARE_ARRAY_TYPE(type, type_name) \
     struct type_name##_array \
     { \
@@ -0,0 +1,301 @@
+/* Paged access to double decimated data.
+ *
+ * Copyright (c) 2012 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "list.h"
+#include "locking.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "disk.h"
+#include "transform.h"
+#include "placement.h"
+
+#include "dd_cache.h"
+
+
+DECLARE_LOCKING(cache_lock);
+
+/* Each cache entry holds one page of the DD area in the corresponding page of
+ * the cache buffer.  Unused entries are kept at the tail of the LRU list. */
+struct dd_page {
+    struct dd_page *next;       // Hash chain
+    struct list_head lru;       // Position in list, most recently used first
+    size_t page;                // Page number within DD area
+    bool valid;                 // Set if this entry holds a cached page
+};
+
+static const char *dd_area;         // Mapped DD area, read if not paging
+static int archive_fd = -1;         // Archive opened for direct reads
+static off64_t dd_start;            // Offset of DD area in archive
+static size_t page_size;
+
+static size_t cache_size;           // Configured size, 0 if not paging
+static unsigned int page_count;     // Number of pages in cache
+static unsigned int pages_used;     // Number of pages currently cached
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+
+static char *page_data;             // Cached data, one page per entry
+static struct dd_page *pages;
+static struct dd_page **buckets;
+static unsigned int bucket_mask;    // Number of hash buckets less one
+static LIST_HEAD(lru_list);
+/* Incremented on every invalidation so that pages read while the transform was
+ * rewriting them are not cached. */
+static unsigned int generation;
+
+
+static struct dd_page **find_page(size_t page)
+{
+    struct dd_page **entry =
+        &buckets[((uint32_t) page * 2654435761U) & bucket_mask];
+    while (*entry  &&  (*entry)->page != page)
+        entry = &(*entry)->next;
+    return entry;
+}
+
+static char *page_buffer(const struct dd_page *entry)
+{
+    return page_data + (size_t) (entry - pages) * page_size;
+}
+
+
+/* Unlinks entry from its hash chain and moves it to the tail of the LRU list
+ * ready for reuse. */
+static void discard_page(struct dd_page *entry)
+{
+    *find_page(entry->page) = entry->next;
+    entry->valid = false;
+    list_del(&entry->lru);
+    list_add_tail(&entry->lru, &lru_list);
+    pages_used -= 1;
+}
+
+
+/* If pages first to end-1 are all cached copies the requested range from them
+ * into buffer and returns true.  Called with the cache locked. */
+static bool copy_cached_pages(
+    size_t first, size_t end, size_t offset, size_t length, void *buffer)
+{
+    for (size_t page = first; page < end; page ++)
+        if (*find_page(page) == NULL)
+            return false;
+
+    for (size_t page = first; page < end; page ++)
+    {
+        struct dd_page *entry = *find_page(page);
+        size_t page_start = page * page_size;
+        size_t start = offset > page_start ? offset - page_start : 0;
+        size_t stop = offset + length - page_start;
+        if (stop > page_size)
+            stop = page_size;
+        memcpy(buffer + page_start + start - offset,
+            page_buffer(entry) + start, stop - start);
+        /* Move to the head of the LRU list. */
+        list_del(&entry->lru);
+        list_add(&entry->lru, &lru_list);
+    }
+    return true;
+}
+
+
+/* Adds the pages just read into buffer to the cache, reusing the least recently
+ * used entries.  Called with the cache locked. */
+static void insert_pages(size_t first, size_t end, const char *buffer)
+{
+    for (size_t page = first; page < end; page ++)
+    {
+        /* Another reader may have got here first. */
+        if (*find_page(page))
+            continue;
+
+        struct dd_page *entry =
+            container_of(lru_list.prev, struct dd_page, lru);
+        if (entry->valid)
+            discard_page(entry);
+        memcpy(page_buffer(entry), buffer + (page - first) * page_size,
+            page_size);
+        entry->next = NULL;
+        entry->page = page;
+        entry->valid = true;
+        *find_page(page) = entry;
+        list_del(&entry->lru);
+        list_add(&entry->lru, &lru_list);
+        pages_used += 1;
+    }
+}
+
+
+static bool read_pages(size_t first, size_t length, void *buffer)
+{
+    ssize_t rx = pread(archive_fd, buffer, length,
+        dd_start + (off64_t) (first * page_size));
+    return
+        TEST_IO(rx)  &&
+        TEST_OK_((size_t) rx == length, "Short read from DD area");
+}
+
+
+/* Looks up the requested range, returning true on a hit.  On a miss the current
+ * generation is returned for cache_pages(). */
+static bool lookup_pages(
+    size_t first, size_t end, size_t offset, size_t length, void *buffer,
+    unsigned int *read_generation)
+{
+    bool hit;
+    LOCK(cache_lock);
+    hit = copy_cached_pages(first, end, offset, length, buffer);
+    if (hit)
+        cache_hits += 1;
+    else
+        cache_misses += 1;
+    *read_generation = generation;
+    UNLOCK(cache_lock);
+    return hit;
+}
+
+/* Caches freshly read pages unless they have been invalidated since they were
+ * read. */
+static void cache_pages(
+    size_t first, size_t end, const char *buffer, unsigned int read_generation)
+{
+    LOCK(cache_lock);
+    if (read_generation == generation)
+        insert_pages(first, end, buffer);
+    UNLOCK(cache_lock);
+}
+
+
+bool read_dd_data(size_t offset, size_t length, void *buffer)
+{
+    if (cache_size == 0)
+    {
+        memcpy(buffer, dd_area + offset, length);
+        return true;
+    }
+
+    size_t first = offset / page_size;
+    size_t end = (offset + length + page_size - 1) / page_size;
+    unsigned int read_generation;
+    if (lookup_pages(first, end, offset, length, buffer, &read_generation))
+        return true;
+
+    /* On a miss read all the pages we need in one go and cache them all. */
+    size_t span = (end - first) * page_size;
+    void *pages_read = NULL;
+    bool ok =
+        TEST_0(posix_memalign(&pages_read, page_size, span))  &&
+        read_pages(first, span, pages_read);
+    if (ok)
+    {
+        memcpy(buffer, pages_read + offset - first * page_size, length);
+        cache_pages(first, end, pages_read, read_generation);
+    }
+    free(pages_read);
+    return ok;
+}
+
+
+void invalidate_dd_cache(size_t offset, size_t length)
+{
+    if (cache_size > 0  &&  length > 0)
+    {
+        size_t first = offset / page_size;
+        size_t end = (offset + length + page_size - 1) / page_size;
+        LOCK(cache_lock);
+        for (size_t page = first; page < end; page ++)
+        {
+            struct dd_page *entry = *find_page(page);
+            if (entry)
+                discard_page(entry);
+        }
+        generation += 1;
+        UNLOCK(cache_lock);
+    }
+}
+
+
+bool dd_cache_enabled(void)
+{
+    return cache_size > 0;
+}
+
+
+void get_dd_cache_status(struct dd_cache_status *status)
+{
+    LOCK(cache_lock);
+    *status = (struct dd_cache_status) {
+        .cache_size = cache_size,
+        .pages = pages_used,
+        .hits = cache_hits,
+        .misses = cache_misses,
+    };
+    UNLOCK(cache_lock);
+}
+
+
+bool initialise_dd_cache(const char *archive, size_t cache_size_)
+{
+    const struct disk_header *header = get_header();
+    dd_area = (const char *) get_dd_area();
+    dd_start = (off64_t) header->dd_data_start;
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    cache_size = cache_size_;
+    if (cache_size == 0)
+        return true;
+
+    page_count = (unsigned int) (cache_size / page_size);
+    unsigned int bucket_count = 1;
+    while (bucket_count < page_count)
+        bucket_count <<= 1;
+    bucket_mask = bucket_count - 1;
+    bool ok =
+        TEST_OK_(page_count > 0, "DD cache must hold at least one page")  &&
+        TEST_IO_(
+            archive_fd = open(archive, O_RDONLY | O_DIRECT | O_LARGEFILE),
+            "Unable to open archive file \"%s\"", archive)  &&
+        TEST_NULL(page_data =
+            allocate_buffer((size_t) page_count * page_size))  &&
+        TEST_NULL(pages = calloc(page_count, sizeof(struct dd_page)))  &&
+        TEST_NULL(buckets = calloc(bucket_count, sizeof(struct dd_page *)));
+    for (unsigned int i = 0; ok  &&  i < page_count; i ++)
+        list_add_tail(&pages[i].lru, &lru_list);
+    return ok;
+}
@@ -0,0 +1,61 @@
+/* Paged access to double decimated data.
+ *
+ * Copyright (c) 2012 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Normally the whole DD area, including any higher tiers, is mapped into
+ * memory and read directly.  For a very large archive this can instead be
+ * paged from disk through a cache of a fixed number of pages, discarding the
+ * least recently used pages as necessary, so that the memory used by DD data
+ * no longer grows with the archive.  The transform continues to write DD data
+ * through the memory mapping, but only keeps the pages it is still writing
+ * resident. */
+
+/* Prepares DD access for the given archive file.  If cache_size is zero DD
+ * data is read directly from the mapped DD area, otherwise it is read through
+ * a cache of cache_size bytes. */
+bool initialise_dd_cache(const char *archive, size_t cache_size);
+
+/* Returns true if DD data is being paged through the cache. */
+bool dd_cache_enabled(void);
+
+/* Copies length bytes of DD data starting offset bytes into the DD area into
+ * buffer, reading any pages not in the cache from disk. */
+bool read_dd_data(size_t offset, size_t length, void *buffer);
+
+/* Discards any cached pages overlapping the given range of the DD area.  Must
+ * be called by the transform once it has written to the range. */
+void invalidate_dd_cache(size_t offset, size_t length);
+
+/* Cache statistics for reporting. */
+struct dd_cache_status {
+    size_t cache_size;          // Configured size of cache, 0 if disabled
+    unsigned int pages;         // Number of pages currently cached
+    uint64_t hits;              // Count of reads served from the cache
+    uint64_t misses;            // Count of reads which went to disk
+};
+void get_dd_cache_status(struct dd_cache_status *status);
@@ -35,12 +35,15 @@
 #include <memory.h>
 #include <pthread.h>
 #include <math.h>
+#include <immintrin.h>
 
 #include "error.h"
 #include "buffer.h"
 #include "fa_sniffer.h"
 #include "parse.h"
 #include "config_file.h"
+#include "locking.h"
+#include "placement.h"
 
 #include "decimate.h"
 
@@ -51,22 +54,18 @@ struct fa_entry_double { double  x, y; };
 struct fa_row_int64 { struct fa_entry_int64 row[0]; };
 
 
-/* Incoming buffer of FA blocks and associated reader. */
-static struct reader_state *reader;
-static size_t fa_block_size;
+/* Maximum number of cascaded decimation stages. */
+#define MAX_DECIMATION_STAGES   4
+
+
 static unsigned int fa_entry_count;
 static size_t sizeof_row_int64;
 
 /* Used for event mask accumulation, only active if events_fa_id != -1. */
 static unsigned int events_fa_id;
-static struct fa_entry accumulated_events;
-
-/* Buffer of decimated blocks. */
-static struct buffer *decimation_buffer;
 
-/* Control flags for orderly shutdown of decimation thread. */
+/* Control flag for orderly shutdown of decimation threads. */
 static bool running;
-static pthread_t decimate_id;
 
 
 
@@ -79,17 +78,89 @@ static pthread_t decimate_id;
     ((struct fa_row_int64 *) ((void *) (base) + (offset) * sizeof_row_int64))
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Decimation stages. */
+
+/* The data is decimated by a cascade of one or more stages, each with its own
+ * CIC and compensation filter.  The first stage is fed from the FA buffer and
+ * each subsequent stage from the output buffer of the stage before, so the
+ * lower rate stages cost very little.  Each stage runs in its own thread. */
+
+struct cic_worker;
+
+struct decimation_stage {
+    /* CIC configuration settings read from configuration file. */
+    unsigned int decimation_factor;         // CIC decimation factor
+    struct uint_array comb_orders;          // Array of comb orders
+    struct double_array compensation_filter; // Smoothes out overall response
+    unsigned int filter_decimation;         // Extra decimation at FIR stage
+    unsigned int output_sample_count;       // Samples per output block
+    unsigned int output_block_count;        // Number of buffered blocks
+    unsigned int decimation_threads;        // Threads sharing the CIC
+
+    /* Incoming buffer of blocks and associated reader. */
+    struct reader_state *reader;
+    unsigned int sample_count_in;           // Rows in each input block
+    unsigned int input_decimation;          // FA samples per input row
+
+    /* Workspace initialised from CIC configuration. */
+    unsigned int cic_order;
+    /* One accumulator for each order. */
+    struct fa_row_int64 *cic_accumulators;
+    /* The comb histories are moderately complicated: for each number N[M] =
+     * comb_orders.data[M-1] for M = 1..comb_orders.count we have an array of
+     * NxM histories and an index cycling from 0 to M-1. */
+    struct fa_row_int64 **comb_histories;
+    unsigned int *comb_history_index;
+
+    struct fa_row_int64 *filter_buffer;
+    double filter_scaling;
+    unsigned int group_delay;               // Measured in FA samples
+
+    /* This counter tracks the decimation counter. */
+    unsigned int decimation_counter;
+    /* Tracks position in the compensation filter buffer. */
+    unsigned int filter_index;
+    /* Keeps count of output filter extra decimation. */
+    unsigned int output_counter;
+    /* Filtered output rows for the block being processed are staged here
+     * before being copied to the output buffer together with t0 and events. */
+    struct fa_row *staging_rows;
+    struct fa_entry accumulated_events;
+
+    /* Pool of workers sharing the processing of each block. */
+    struct cic_worker *workers;
+    struct locking worker_lock;
+    bool workers_running;
+    const struct fa_row *worker_block;      // Block currently being processed
+    unsigned int worker_generation;         // Incremented for each new block
+    unsigned int workers_busy;              // Number of workers still working
+
+    /* Buffer of decimated blocks. */
+    struct buffer *decimation_buffer;
+    struct fa_row *block_out;
+    unsigned int out_pointer;
+
+    pthread_t thread;
+};
+
+static struct decimation_stage stages[MAX_DECIMATION_STAGES];
+static unsigned int stage_count;
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* CIC configuration. */
 
 
-/* CIC configuration settings read from configuration file. */
+/* CIC configuration settings read from each section of the configuration file,
+ * copied into the corresponding stage at the end of each section. */
 static unsigned int decimation_factor;          // CIC decimation factor
 static struct uint_array comb_orders;           // Array of comb orders
 static struct double_array compensation_filter; // Smoothes out overall response
-static unsigned int filter_decimation = 1;      // Extra decimation at FIR stage
-static unsigned int output_sample_count = 100;  // Samples per output block
-static unsigned int output_block_count = 50;    // Number of buffered blocks
+static unsigned int filter_decimation;          // Extra decimation at FIR stage
+static unsigned int output_sample_count;        // Samples per output block
+static unsigned int output_block_count;         // Number of buffered blocks
+static unsigned int decimation_threads;         // Threads sharing the CIC
 
 /* Description of settings above to be read from configuration file. */
 static const struct config_entry config_table[] = {
@@ -99,84 +170,290 @@ static const struct config_entry config_table[] = {
     CONFIG(filter_decimation,   parse_uint, OPTIONAL),
     CONFIG(output_sample_count, parse_uint, OPTIONAL),
     CONFIG(output_block_count,  parse_uint, OPTIONAL),
+    CONFIG(decimation_threads,  parse_uint, OPTIONAL),
 };
 
+/* Each section after the first starts with this header. */
+#define CASCADE_SECTION     "cascade"
 
-/* Workspace initialised from CIC configuration. */
-static unsigned int cic_order;
-/* One accumulator for each order. */
-static struct fa_row_int64 *cic_accumulators;
-/* The comb histories are moderately complicated: for each number N[M] =
- * comb_orders.data[M-1] for M = 1..comb_orders.count we have an array of NxM
- * histories and an index cycling from 0 to M-1. */
-static struct fa_row_int64 **comb_histories;
-static unsigned int *comb_history_index;
 
-static struct fa_row_int64 *filter_buffer;
-static double filter_scaling;
-static unsigned int group_delay;
+/* Restores the optional settings to their defaults before each section. */
+static void reset_configuration(void)
+{
+    filter_decimation = 1;
+    output_sample_count = 100;
+    output_block_count = 50;
+    decimation_threads = 1;
+}
 
 
-/* Called after successful parsing of the configuration file. */
-static bool initialise_configuration(void)
+/* Called after successful parsing of each section of the configuration file to
+ * create the corresponding decimation stage. */
+static bool add_stage(void)
 {
+    if (!TEST_OK_(stage_count < MAX_DECIMATION_STAGES,
+            "Too many decimation stages"))
+        return false;
+
+    struct decimation_stage *stage = &stages[stage_count];
+    *stage = (struct decimation_stage) {
+        .decimation_factor = decimation_factor,
+        .comb_orders = comb_orders,
+        .compensation_filter = compensation_filter,
+        .filter_decimation = filter_decimation,
+        .output_sample_count = output_sample_count,
+        .output_block_count = output_block_count,
+        .decimation_threads = decimation_threads,
+    };
+    stage_count += 1;
+    reset_configuration();
+
     /* Accumulate the CIC order from the orders of all the combs. */
-    cic_order = 0;
-    for (unsigned int i = 0; i < comb_orders.count; i ++)
-        cic_order += comb_orders.data[i];
+    stage->cic_order = 0;
+    for (unsigned int i = 0; i < stage->comb_orders.count; i ++)
+        stage->cic_order += stage->comb_orders.data[i];
 
     /* Some sanity checking on parameters. */
-    bool ok =
-        TEST_OK_(decimation_factor > 1, "Invalid decimation factor")  &&
-        TEST_OK_(cic_order > 0, "No CIC stages given")  &&
-        TEST_OK_(compensation_filter.count > 0, "Empty compensation filter")  &&
-        TEST_OK_(filter_decimation > 0, "Invalid filter decimation");
-    if (!ok)
-        return false;
+    return
+        TEST_OK_(stage->decimation_factor > 1, "Invalid decimation factor")  &&
+        TEST_OK_(stage->cic_order > 0, "No CIC stages given")  &&
+        TEST_OK_(stage->compensation_filter.count > 0,
+            "Empty compensation filter")  &&
+        TEST_OK_(stage->filter_decimation > 0, "Invalid filter decimation")  &&
+        TEST_OK_(stage->output_sample_count > 0, "Invalid output sample count");
+}
+
+
+/* Called after successful parsing of the configuration file to allocate the
+ * workspace for each stage. */
+static void initialise_stage(
+    struct decimation_stage *stage, unsigned int input_decimation)
+{
+    stage->input_decimation = input_decimation;
 
     /* One accumulator for each stage. */
-    cic_accumulators = calloc(cic_order, sizeof_row_int64);
+    stage->cic_accumulators = calloc(stage->cic_order, sizeof_row_int64);
     /* Array of history buffers for variable length comb stage. */
-    comb_histories = calloc(comb_orders.count, sizeof(struct fa_row_int64 *));
-    for (unsigned int i = 0; i < comb_orders.count; i ++)
-        comb_histories[i] = calloc(
-            comb_orders.data[i] * (i + 1), sizeof_row_int64);
-    comb_history_index = calloc(comb_orders.count, sizeof(unsigned int));
+    stage->comb_histories =
+        calloc(stage->comb_orders.count, sizeof(struct fa_row_int64 *));
+    for (unsigned int i = 0; i < stage->comb_orders.count; i ++)
+        stage->comb_histories[i] = calloc(
+            stage->comb_orders.data[i] * (i + 1), sizeof_row_int64);
+    stage->comb_history_index =
+        calloc(stage->comb_orders.count, sizeof(unsigned int));
     /* History buffer for compensation filter. */
-    filter_buffer = calloc(compensation_filter.count, sizeof_row_int64);
+    stage->filter_buffer =
+        calloc(stage->compensation_filter.count, sizeof_row_int64);
 
     /* Compute scaling factor for overall unit DC response and group delay for
      * the entire filter chain. */
-    filter_scaling = 0;
+    double filter_scaling = 0;
     unsigned int filter_length = 1 +
-        (compensation_filter.count - 1) * decimation_factor;
-    for (unsigned int i = 0; i < compensation_filter.count; i ++)
-        filter_scaling += compensation_filter.data[i];
-    for (unsigned int i = 0; i < comb_orders.count; i ++)
+        (stage->compensation_filter.count - 1) * stage->decimation_factor;
+    for (unsigned int i = 0; i < stage->compensation_filter.count; i ++)
+        filter_scaling += stage->compensation_filter.data[i];
+    for (unsigned int i = 0; i < stage->comb_orders.count; i ++)
     {
-        for (unsigned int j = 0; j < comb_orders.data[i]; j ++)
-            filter_scaling *= decimation_factor * (i + 1);
-        filter_length +=
-            comb_orders.data[i] * ((i + 1) * decimation_factor - 1);
+        for (unsigned int j = 0; j < stage->comb_orders.data[i]; j ++)
+            filter_scaling *= stage->decimation_factor * (i + 1);
+        filter_length += stage->comb_orders.data[i] *
+            ((i + 1) * stage->decimation_factor - 1);
     }
-    filter_scaling = 1 / filter_scaling;
-    group_delay = filter_length / 2;
+    stage->filter_scaling = 1 / filter_scaling;
+    /* The group delay is converted from input samples to FA samples so that t0
+     * is always in FA sample units. */
+    stage->group_delay = filter_length / 2 * input_decimation;
+}
 
-    return true;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* CIC kernels. */
+
+/* The integrator, comb and filter stages all work independently on every value
+ * in a row, so each stage is written as a kernel over a contiguous array of
+ * count values, with X and Y simply treated as separate values.  AVX2 versions
+ * are selected at startup if the processor supports them. */
+
+struct cic_kernels {
+    /* Integrates 32 bit input into the first 64 bit accumulator. */
+    void (*integrate_input)(
+        int64_t *accumulator, const int32_t *input, unsigned int count);
+    /* Integrates one accumulator into the next. */
+    void (*integrate)(
+        int64_t *accumulator, const int64_t *input, unsigned int count);
+    /* Single comb step: output = input - history, history = input.  Note that
+     * input and output can be the same. */
+    void (*comb)(
+        int64_t *output, const int64_t *input, int64_t *history,
+        unsigned int count);
+    /* Accumulates one tap of the compensation filter. */
+    void (*filter)(
+        double *accumulator, const int64_t *input, double coeff,
+        unsigned int count);
+    /* Scales the filter accumulator into the output row. */
+    void (*store)(
+        int32_t *output, const double *accumulator, double scaling,
+        unsigned int count);
+};
+
+
+static void integrate_input(
+    int64_t *accumulator, const int32_t *input, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i ++)
+        accumulator[i] += input[i];
+}
+
+static void integrate(
+    int64_t *accumulator, const int64_t *input, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i ++)
+        accumulator[i] += input[i];
+}
+
+static void comb_step(
+    int64_t *output, const int64_t *input, int64_t *history,
+    unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        int64_t in = input[i];
+        output[i] = in - history[i];
+        history[i] = in;
+    }
+}
+
+static void filter_tap(
+    double *accumulator, const int64_t *input, double coeff,
+    unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i ++)
+        accumulator[i] += coeff * (double) input[i];
+}
+
+static void store_output(
+    int32_t *output, const double *accumulator, double scaling,
+    unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i ++)
+        output[i] = (int32_t) (scaling * accumulator[i]);
 }
 
 
+/* The AVX2 kernels process four values at a time and pass any remainder to the
+ * generic kernels above. */
+
+__attribute__((target("avx2")))
+static void integrate_input_avx2(
+    int64_t *accumulator, const int32_t *input, unsigned int count)
+{
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i acc = _mm256_loadu_si256((const void *) (accumulator + i));
+        __m256i in = _mm256_cvtepi32_epi64(
+            _mm_loadu_si128((const void *) (input + i)));
+        _mm256_storeu_si256(
+            (void *) (accumulator + i), _mm256_add_epi64(acc, in));
+    }
+    integrate_input(accumulator + i, input + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void integrate_avx2(
+    int64_t *accumulator, const int64_t *input, unsigned int count)
+{
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i acc = _mm256_loadu_si256((const void *) (accumulator + i));
+        __m256i in = _mm256_loadu_si256((const void *) (input + i));
+        _mm256_storeu_si256(
+            (void *) (accumulator + i), _mm256_add_epi64(acc, in));
+    }
+    integrate(accumulator + i, input + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void comb_step_avx2(
+    int64_t *output, const int64_t *input, int64_t *history,
+    unsigned int count)
+{
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i in = _mm256_loadu_si256((const void *) (input + i));
+        __m256i last = _mm256_loadu_si256((const void *) (history + i));
+        _mm256_storeu_si256((void *) (output + i), _mm256_sub_epi64(in, last));
+        _mm256_storeu_si256((void *) (history + i), in);
+    }
+    comb_step(output + i, input + i, history + i, count - i);
+}
+
+/* AVX2 has no conversion from 64 bit integers to doubles, so the conversion is
+ * done a value at a time, but the multiply and accumulate is vectorised. */
+__attribute__((target("avx2,fma")))
+static void filter_tap_avx2(
+    double *accumulator, const int64_t *input, double coeff,
+    unsigned int count)
+{
+    __m256d c = _mm256_set1_pd(coeff);
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d in = _mm256_set_pd(
+            (double) input[i + 3], (double) input[i + 2],
+            (double) input[i + 1], (double) input[i]);
+        __m256d acc = _mm256_loadu_pd(accumulator + i);
+        _mm256_storeu_pd(accumulator + i, _mm256_fmadd_pd(c, in, acc));
+    }
+    filter_tap(accumulator + i, input + i, coeff, count - i);
+}
+
+__attribute__((target("avx2")))
+static void store_output_avx2(
+    int32_t *output, const double *accumulator, double scaling,
+    unsigned int count)
+{
+    __m256d s = _mm256_set1_pd(scaling);
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d acc = _mm256_loadu_pd(accumulator + i);
+        _mm_storeu_si128((void *) (output + i),
+            _mm256_cvttpd_epi32(_mm256_mul_pd(s, acc)));
+    }
+    store_output(output + i, accumulator + i, scaling, count - i);
+}
+
+
+static struct cic_kernels kernels = {
+    .integrate_input = integrate_input,
+    .integrate = integrate,
+    .comb = comb_step,
+    .filter = filter_tap,
+    .store = store_output,
+};
+
+static void initialise_kernels(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")  &&  __builtin_cpu_supports("fma"))
+        kernels = (struct cic_kernels) {
+            .integrate_input = integrate_input_avx2,
+            .integrate = integrate_avx2,
+            .comb = comb_step_avx2,
+            .filter = filter_tap_avx2,
+            .store = store_output_avx2,
+        };
+}
+
+
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data processing. */
 
-/* This counter tracks the decimation counter. */
-static unsigned int decimation_counter;
-/* Tracks position in the compensation filter buffer. */
-static unsigned int filter_index;
-/* Keeps count of output filter extra decimation. */
-static unsigned int output_counter;
-
 
 /* Helper routine for cycling index pointers: advances and returns true iff the
  * index has cycled. */
@@ -193,57 +470,69 @@ static bool advance_index(unsigned int *ix, unsigned int limit)
 }
 
 
-/* Helper macro for repeated pattern in accumulate().  Note that t0 is
- * untouched.  Needs to be a macro because we call this twice, once with 32-bit
- * row_in and the second time with 64-bit. */
-#define ACCUMULATE_ROW(accumulator, row_in) \
-    do for (unsigned int i = 1; i < fa_entry_count; i ++) \
-    { \
-        (accumulator)->row[i].x += (row_in)->row[i].x; \
-        (accumulator)->row[i].y += (row_in)->row[i].y; \
-    } while(0)
+/* The CIC filter state for each value is independent, so the values in each
+ * row can be split among several decimation workers.  Each worker processes the
+ * values from first to first+count-1 (counting X and Y separately) of every row
+ * in the block, following private copies of the filter indexes. */
+struct cic_worker {
+    struct decimation_stage *stage; // Stage this worker belongs to
+    pthread_t thread;
+    unsigned int first;             // First value processed by this worker
+    unsigned int count;             // Number of values processed
+    unsigned int *comb_index;       // Private copy of comb_history_index
+    double *filter_accumulator;     // Workspace for compensation filter
+};
+
+/* Returns the values in row offset of an array of fa_row_int64 rows to be
+ * processed by the given worker. */
+static int64_t *worker_values(
+    struct fa_row_int64 *base, unsigned int offset,
+    const struct cic_worker *worker)
+{
+    return (int64_t *) INDEX_ROW64(base, offset)->row + worker->first;
+}
 
 
 /* Accumulates a single update into the accumulator array for the integrating
  * part of the CIC filter, returns the last row. */
-static const struct fa_row_int64 *accumulate(const struct fa_row *row_in)
+static const int64_t *accumulate(
+    const struct cic_worker *worker, const struct fa_row *row_in)
 {
+    const struct decimation_stage *stage = worker->stage;
+
     /* The first stage converts 32 bit in into 64 bit intermediate results. */
-    struct fa_row_int64 *accumulator = cic_accumulators;
-    ACCUMULATE_ROW(accumulator, row_in);
-    struct fa_row_int64 *last_row = accumulator;
+    int64_t *accumulator = worker_values(stage->cic_accumulators, 0, worker);
+    kernels.integrate_input(accumulator,
+        (const int32_t *) row_in->row + worker->first, worker->count);
 
     /* The remaining rows are all uniform. */
-    for (unsigned int stage = 1; stage < cic_order; stage ++)
+    for (unsigned int order = 1; order < stage->cic_order; order ++)
     {
-        accumulator = INDEX_ROW64(accumulator, 1);
-        ACCUMULATE_ROW(accumulator, last_row);
-        last_row = accumulator;
+        int64_t *next = worker_values(stage->cic_accumulators, order, worker);
+        kernels.integrate(next, accumulator, worker->count);
+        accumulator = next;
     }
-    return last_row;
+    return accumulator;
 }
 
 
 /* Performs repeated comb filter of raw decimated data. */
 static void comb(
-    const struct fa_row_int64 *row_in, struct fa_row_int64 *row_out)
+    struct cic_worker *worker, const int64_t *row_in, int64_t *row_out)
 {
-    for (unsigned int order = 0; order < comb_orders.count; order ++)
+    const struct uint_array *orders = &worker->stage->comb_orders;
+    for (unsigned int order = 0; order < orders->count; order ++)
     {
-        unsigned int N = comb_orders.data[order];
-        struct fa_row_int64 *history =
-            INDEX_ROW64(comb_histories[order], N * comb_history_index[order]);
-        advance_index(&comb_history_index[order], order + 1);
+        unsigned int N = orders->data[order];
+        unsigned int history = N * worker->comb_index[order];
+        advance_index(&worker->comb_index[order], order + 1);
 
         for (unsigned int n = 0; n < N; n ++)
         {
-            for (unsigned int i = 1; i < fa_entry_count; i ++)
-            {
-                struct fa_entry_int64 in = row_in->row[i];
-                row_out->row[i].x = in.x - history->row[i].x;
-                row_out->row[i].y = in.y - history->row[i].y;
-                history->row[i] = in;
-            }
+            kernels.comb(row_out, row_in,
+                worker_values(
+                    worker->stage->comb_histories[order], history + n, worker),
+                worker->count);
 
             /* A couple of tricks here.  On the first pass through row_in and
              * row_out are different, but on all subsequent loops we're
@@ -251,109 +540,271 @@ static void comb(
              * Also, we arrange the histories so that this simple stepping
              * through works correctly. */
             row_in = row_out;
-            history = INDEX_ROW64(history, 1);
         }
     }
 }
 
 
 /* Convolves compensation filter with the waiting output buffer. */
-static void filter_output(struct fa_row *row_out)
+static void filter_output(
+    const struct cic_worker *worker, unsigned int index, struct fa_row *row_out)
 {
-    size_t sizeof_row_double = fa_entry_count * sizeof(struct fa_entry_double);
-    struct fa_entry_double *accumulator = alloca(sizeof_row_double);
-    memset(accumulator, 0, sizeof_row_double);
+    const struct decimation_stage *stage = worker->stage;
+    const struct double_array *filter = &stage->compensation_filter;
+    double *accumulator = worker->filter_accumulator;
+    memset(accumulator, 0, worker->count * sizeof(double));
+    for (unsigned int j = 0; j < filter->count; j ++)
+        kernels.filter(accumulator,
+            worker_values(stage->filter_buffer,
+                (index + j) % filter->count, worker),
+            filter->data[j], worker->count);
+    kernels.store((int32_t *) row_out->row + worker->first,
+        accumulator, stage->filter_scaling, worker->count);
+}
 
-    for (unsigned int j = 0; j < compensation_filter.count; j ++)
+
+/* CIC: repeated integration steps on every input sample, decimate by selected
+ * decimation factor, comb filter of each output sample.  Each filtered output
+ * is written to the next staging row. */
+static void decimate_values(
+    struct cic_worker *worker, const struct fa_row *block_in)
+{
+    const struct decimation_stage *stage = worker->stage;
+    unsigned int decimation = stage->decimation_counter;
+    unsigned int filter = stage->filter_index;
+    unsigned int output = stage->output_counter;
+    memcpy(worker->comb_index, stage->comb_history_index,
+        stage->comb_orders.count * sizeof(unsigned int));
+
+    unsigned int staged = 0;
+    for (unsigned int in = 0; in < stage->sample_count_in; in ++)
     {
-        double coeff = compensation_filter.data[j];
-        struct fa_row_int64 *row =
-            INDEX_ROW64(filter_buffer,
-                (filter_index + j) % compensation_filter.count);
-        for (unsigned int i = 1; i < fa_entry_count; i ++)
+        const int64_t *row = accumulate(worker, block_in);
+        block_in = INDEX_ROW(const, block_in, 1);
+
+        if (advance_index(&decimation, stage->decimation_factor))
         {
-            accumulator[i].x += coeff * (double) row->row[i].x;
-            accumulator[i].y += coeff * (double) row->row[i].y;
-        }
-    }
+            comb(worker, row,
+                worker_values(stage->filter_buffer, filter, worker));
+            advance_index(&filter, stage->compensation_filter.count);
 
-    for (unsigned int i = 1; i < fa_entry_count; i ++)
-    {
-        row_out->row[i].x = (int) (filter_scaling * accumulator[i].x);
-        row_out->row[i].y = (int) (filter_scaling * accumulator[i].y);
+            if (advance_index(&output, stage->filter_decimation))
+            {
+                filter_output(worker, filter,
+                    INDEX_ROW(, stage->staging_rows, staged));
+                staged += 1;
+            }
+        }
     }
 }
 
 
-static void update_t0(struct fa_row *row_out, const struct fa_entry *t0)
+static void update_t0(
+    const struct decimation_stage *stage,
+    struct fa_row *row_out, const struct fa_entry *t0)
 {
-    row_out->row[0].x = t0->x - (int) group_delay;
-    row_out->row[0].y = t0->y - (int) group_delay;
+    row_out->row[0].x = t0->x - (int) stage->group_delay;
+    row_out->row[0].y = t0->y - (int) stage->group_delay;
 }
 
-static void combine_events(const struct fa_row *row_in)
+static void combine_events(
+    struct decimation_stage *stage, const struct fa_row *row_in)
 {
     if (events_fa_id < fa_entry_count)
     {
-        accumulated_events.x |= row_in->row[events_fa_id].x;
-        accumulated_events.y |= row_in->row[events_fa_id].y;
+        stage->accumulated_events.x |= row_in->row[events_fa_id].x;
+        stage->accumulated_events.y |= row_in->row[events_fa_id].y;
     }
 }
 
-static void update_events(struct fa_row *row_out)
+static void update_events(
+    struct decimation_stage *stage, struct fa_row *row_out)
 {
     if (events_fa_id < fa_entry_count)
     {
-        row_out->row[events_fa_id] = accumulated_events;
-        accumulated_events = (struct fa_entry) { 0, 0 };
+        row_out->row[events_fa_id] = stage->accumulated_events;
+        stage->accumulated_events = (struct fa_entry) { 0, 0 };
     }
 }
 
 
-static struct fa_row *block_out;
-static unsigned int out_pointer;
-
-
 /* Advance the output by one row or mark a gap in incoming data. */
-static void advance_write_block(bool gap, uint64_t timestamp)
+static void advance_write_block(
+    struct decimation_stage *stage, bool gap, uint64_t timestamp)
 {
-    if (advance_index(&out_pointer, output_sample_count)  ||  gap)
+    if (advance_index(&stage->out_pointer, stage->output_sample_count)  ||
+        gap)
     {
         /* Ought to correct the timestamp here by the filter group delay and the
          * difference between the two data blocks. */
-        IGNORE(TEST_OK(release_write_block(decimation_buffer, gap, timestamp)));
-        block_out = get_write_block(decimation_buffer);
+        IGNORE(TEST_OK(release_write_block(
+            stage->decimation_buffer, gap, timestamp)));
+        stage->block_out = get_write_block(stage->decimation_buffer);
 
         /* In the presence of a gap we ought to reset all the filters. */
     }
 }
 
 
-/* CIC: repeated integration steps on every input sample, decimate by selected
- * decimation factor, comb filter of each output sample. */
-static void decimate_block(const struct fa_row *block_in, uint64_t timestamp)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Decimation workers. */
+
+/* As for the transform workers in transform.c, the decimation thread itself
+ * takes the first range of values and waits for the other workers to finish
+ * before the output is written.  Each stage has its own pool of workers. */
+
+
+/* Waits for a new block to process, returns false if the pool is stopping. */
+static bool wait_for_block(
+    struct decimation_stage *stage, unsigned int *generation)
+{
+    bool pool_running;
+    LOCK(stage->worker_lock);
+    while (stage->workers_running  &&  stage->worker_generation == *generation)
+        pwait(&stage->worker_lock);
+    *generation = stage->worker_generation;
+    pool_running = stage->workers_running;
+    UNLOCK(stage->worker_lock);
+    return pool_running;
+}
+
+
+static void *worker_thread(void *context)
+{
+    struct cic_worker *worker = context;
+    struct decimation_stage *stage = worker->stage;
+    unsigned int generation = 0;
+    while (wait_for_block(stage, &generation))
+    {
+        decimate_values(worker, stage->worker_block);
+
+        LOCK(stage->worker_lock);
+        stage->workers_busy -= 1;
+        if (stage->workers_busy == 0)
+            pbroadcast(&stage->worker_lock);
+        UNLOCK(stage->worker_lock);
+    }
+    return NULL;
+}
+
+
+static void run_workers(
+    struct decimation_stage *stage, const struct fa_row *block_in)
+{
+    if (stage->decimation_threads > 1)
+    {
+        LOCK(stage->worker_lock);
+        stage->worker_block = block_in;
+        stage->worker_generation += 1;
+        stage->workers_busy = stage->decimation_threads - 1;
+        pbroadcast(&stage->worker_lock);
+        UNLOCK(stage->worker_lock);
+
+        decimate_values(&stage->workers[0], block_in);
+
+        LOCK(stage->worker_lock);
+        while (stage->workers_busy > 0)
+            pwait(&stage->worker_lock);
+        UNLOCK(stage->worker_lock);
+    }
+    else
+        decimate_values(&stage->workers[0], block_in);
+}
+
+
+/* Divides the values of each row after t0 as evenly as possible among the
+ * workers, keeping X and Y of each id together. */
+static bool initialise_workers(struct decimation_stage *stage)
 {
-    unsigned int sample_count_in = (unsigned int) (
-        fa_block_size / fa_entry_count / FA_ENTRY_SIZE);
-    for (unsigned int in = 0; in < sample_count_in; in ++)
+    unsigned int threads = stage->decimation_threads;
+    if (!TEST_OK_(0 < threads  &&  threads < fa_entry_count,
+            "Invalid number of decimation threads"))
+        return false;
+
+    initialise_locking(&stage->worker_lock);
+    stage->workers = calloc(threads, sizeof(struct cic_worker));
+    unsigned int first_id = 1;
+    for (unsigned int i = 0; i < threads; i ++)
+    {
+        unsigned int end_id = 1 + (i + 1) * (fa_entry_count - 1) / threads;
+        struct cic_worker *worker = &stage->workers[i];
+        worker->stage = stage;
+        worker->first = 2 * first_id;
+        worker->count = 2 * (end_id - first_id);
+        worker->comb_index =
+            calloc(stage->comb_orders.count, sizeof(unsigned int));
+        worker->filter_accumulator = calloc(worker->count, sizeof(double));
+        first_id = end_id;
+    }
+
+    /* We need a staging row for each output generated by a single block. */
+    unsigned int staging_count = stage->sample_count_in /
+        (stage->decimation_factor * stage->filter_decimation) + 1;
+    stage->staging_rows =
+        calloc(staging_count, fa_entry_count * FA_ENTRY_SIZE);
+    return true;
+}
+
+
+static bool start_workers(struct decimation_stage *stage)
+{
+    stage->workers_running = true;
+    bool ok = true;
+    for (unsigned int i = 1; ok  &&  i < stage->decimation_threads; i ++)
+        ok = create_pipeline_thread(THREAD_DECIMATE,
+            &stage->workers[i].thread, worker_thread, &stage->workers[i]);
+    return ok;
+}
+
+
+static void terminate_workers(struct decimation_stage *stage)
+{
+    LOCK(stage->worker_lock);
+    stage->workers_running = false;
+    pbroadcast(&stage->worker_lock);
+    UNLOCK(stage->worker_lock);
+    for (unsigned int i = 1; i < stage->decimation_threads; i ++)
+        ASSERT_0(pthread_join(stage->workers[i].thread, NULL));
+}
+
+
+/* Processes the block across all workers and then copies the staged output
+ * rows to the output buffer.  Here we advance the shared filter indexes exactly
+ * as the workers did, and pick up t0 and events from the corresponding input
+ * rows. */
+static void decimate_block(
+    struct decimation_stage *stage,
+    const struct fa_row *block_in, uint64_t timestamp)
+{
+    run_workers(stage, block_in);
+
+    unsigned int staged = 0;
+    for (unsigned int in = 0; in < stage->sample_count_in; in ++)
     {
         const struct fa_entry *t0 = &block_in->row[0];
-        const struct fa_row_int64 *row = accumulate(block_in);
-        combine_events(block_in);
+        combine_events(stage, block_in);
         block_in = INDEX_ROW(const, block_in, 1);
 
-        if (advance_index(&decimation_counter, decimation_factor))
+        if (advance_index(&stage->decimation_counter, stage->decimation_factor))
         {
-            comb(row, INDEX_ROW64(filter_buffer, filter_index));
-            advance_index(&filter_index, compensation_filter.count);
-
-            if (advance_index(&output_counter, filter_decimation))
+            for (unsigned int order = 0;
+                 order < stage->comb_orders.count; order ++)
+                advance_index(&stage->comb_history_index[order], order + 1);
+            advance_index(
+                &stage->filter_index, stage->compensation_filter.count);
+
+            if (advance_index(
+                    &stage->output_counter, stage->filter_decimation))
             {
-                struct fa_row *row_out = INDEX_ROW(, block_out, out_pointer);
-                filter_output(row_out);
-                update_t0(row_out, t0);
-                update_events(row_out);
-                advance_write_block(false, timestamp);
+                struct fa_row *row_out =
+                    INDEX_ROW(, stage->block_out, stage->out_pointer);
+                memcpy(&row_out->row[1],
+                    &INDEX_ROW(const, stage->staging_rows, staged)->row[1],
+                    (fa_entry_count - 1) * FA_ENTRY_SIZE);
+                staged += 1;
+                update_t0(stage, row_out, t0);
+                update_events(stage, row_out);
+                advance_write_block(stage, false, timestamp);
             }
         }
     }
@@ -366,65 +817,118 @@ static void decimate_block(const struct fa_row *block_in, uint64_t timestamp)
 
 static void *decimation_thread(void *context)
 {
-    block_out = get_write_block(decimation_buffer);
+    struct decimation_stage *stage = context;
+    stage->block_out = get_write_block(stage->decimation_buffer);
 
     while (running)
     {
         uint64_t timestamp;
-        const struct fa_row *block_in = get_read_block(reader, &timestamp);
+        const struct fa_row *block_in =
+            get_read_block(stage->reader, &timestamp);
         if (block_in)
         {
-            decimate_block(block_in, timestamp);
-            release_read_block(reader);
+            decimate_block(stage, block_in, timestamp);
+            release_read_block(stage->reader);
         }
         else
             /* Mark a gap if can't get a read block. */
-            advance_write_block(true, timestamp);
+            advance_write_block(stage, true, timestamp);
     }
     return NULL;
 }
 
 
-unsigned int get_decimation_factor(void)
+unsigned int get_decimation_factor(unsigned int stage)
 {
-    return decimation_factor * filter_decimation;
+    if (stage < stage_count)
+        return stages[stage].input_decimation *
+            stages[stage].decimation_factor * stages[stage].filter_decimation;
+    else
+        return 0;
+}
+
+
+unsigned int get_decimation_stage_count(void)
+{
+    return stage_count;
+}
+
+
+struct buffer *get_decimation_buffer(unsigned int stage)
+{
+    return stage < stage_count ? stages[stage].decimation_buffer : NULL;
+}
+
+
+/* Connects the stage to its input buffer and creates its output buffer. */
+static bool open_stage(
+    struct decimation_stage *stage, struct buffer *input,
+    unsigned int input_decimation)
+{
+    stage->sample_count_in = (unsigned int) (
+        buffer_block_size(input) / fa_entry_count / FA_ENTRY_SIZE);
+    initialise_stage(stage, input_decimation);
+    return
+        initialise_workers(stage)  &&
+        DO_(stage->reader = open_reader(input, false))  &&
+        create_buffer(&stage->decimation_buffer,
+            stage->output_sample_count * fa_entry_count * FA_ENTRY_SIZE,
+            stage->output_block_count);
 }
 
 
 bool initialise_decimation(
-    const char *config_file, struct buffer *fa_buffer, struct buffer **buffer,
+    const char *config_file, struct buffer *fa_buffer,
     unsigned int _fa_entry_count, unsigned int _events_fa_id)
 {
-    fa_block_size = buffer_block_size(fa_buffer);
     fa_entry_count = _fa_entry_count;
     events_fa_id = _events_fa_id;
     sizeof_row_int64  = sizeof(struct fa_entry_int64) * fa_entry_count;
+    initialise_kernels();
+    reset_configuration();
 
-    return
-        config_parse_file(
-            config_file, config_table, ARRAY_SIZE(config_table))  &&
-        initialise_configuration()  &&
-        DO_(reader = open_reader(fa_buffer, false))  &&
-        create_buffer(&decimation_buffer,
-            output_sample_count * fa_entry_count * FA_ENTRY_SIZE,
-            output_block_count)  &&
-        DO_(*buffer = decimation_buffer);
+    bool ok = config_parse_sections(
+        config_file, CASCADE_SECTION,
+        config_table, ARRAY_SIZE(config_table), add_stage);
+
+    /* Each stage is fed from the output of the stage before. */
+    struct buffer *input = fa_buffer;
+    unsigned int input_decimation = 1;
+    for (unsigned int i = 0; ok  &&  i < stage_count; i ++)
+    {
+        ok = open_stage(&stages[i], input, input_decimation);
+        input = stages[i].decimation_buffer;
+        input_decimation = get_decimation_factor(i);
+    }
+    return ok;
 }
 
 
 bool start_decimation(void)
 {
     running = true;
-    return TEST_0(pthread_create(&decimate_id, NULL, decimation_thread, NULL));
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < stage_count; i ++)
+        ok =
+            start_workers(&stages[i])  &&
+            create_pipeline_thread(THREAD_DECIMATE,
+                &stages[i].thread, decimation_thread, &stages[i]);
+    return ok;
 }
 
 
 void terminate_decimation(void)
 {
     log_message("Closing decimation");
-    ASSERT_0(pthread_cancel(decimate_id));
     running = false;
-    interrupt_reader(reader);
-    ASSERT_0(pthread_join(decimate_id, NULL));
-    close_reader(reader);
+    for (unsigned int i = 0; i < stage_count; i ++)
+    {
+        struct decimation_stage *stage = &stages[i];
+        ASSERT_0(pthread_cancel(stage->thread));
+        interrupt_reader(stage->reader);
+        ASSERT_0(pthread_join(stage->thread, NULL));
+        terminate_workers(stage);
+        close_reader(stage->reader);
+    }
+    stage_count = 0;
 }
@@ -28,14 +28,26 @@
  *      michael.abbott@diamond.ac.uk
  */
 
+/* Reads the decimation configuration file and creates the configured cascade
+ * of decimation stages, the first fed from fa_buffer and each further stage
+ * from the output of the stage before. */
 bool initialise_decimation(
-    const char *config_file, struct buffer *fa_buffer, struct buffer **buffer,
+    const char *config_file, struct buffer *fa_buffer,
     unsigned int fa_entry_count, unsigned int events_fa_id);
 /* Starting decimation is separated from initialisation so that we can report
  * initialisation errors as soon as possible. */
 bool start_decimation(void);
 
+/* Stops all decimation stages, after which decimation can be initialised
+ * afresh. */
 void terminate_decimation(void);
 
-/* Returns decimation factor, or 0 if decimation not available. */
-unsigned int __const_ get_decimation_factor(void);
+/* Returns the number of decimation stages, 0 if decimation not available. */
+unsigned int __pure get_decimation_stage_count(void);
+
+/* Returns the overall decimation factor from FA data for the given stage, or 0
+ * if this stage is not available. */
+unsigned int __pure get_decimation_factor(unsigned int stage);
+
+/* Returns the output buffer for the given stage, or NULL if not available. */
+struct buffer *__pure get_decimation_buffer(unsigned int stage);
@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -77,6 +78,63 @@ static uint32_t uint_log2(uint32_t value)
 }
 
 
+/* Computes the size of the in memory decimated data area for the given number
+ * of major blocks, allowing for any decimation tiers above DD. */
+static uint64_t dd_area_size(
+    struct disk_header *header, uint32_t major_block_count)
+{
+    uint64_t dd_total_count =
+        (uint64_t) header->dd_sample_count * major_block_count;
+    uint64_t sample_count = dd_total_count;
+    for (unsigned int t = 0; t < header->tier_count; t ++)
+        sample_count += dd_total_count >> tier_decimation_log2(header, t);
+    return round_to_page((size_t) (
+        sample_count * header->archive_mask_count *
+        sizeof(struct decimated_data)));
+}
+
+
+static bool test_tier_decimations(
+    unsigned int tier_count, const uint32_t tier_decimations[])
+{
+    bool ok = TEST_OK_(tier_count <= MAX_DECIMATION_TIERS,
+        "No more than %d further decimation tiers allowed",
+        MAX_DECIMATION_TIERS);
+    for (unsigned int t = 0; ok  &&  t < tier_count; t ++)
+        ok =
+            test_power_of_2(tier_decimations[t], "Tier decimation")  &&
+            TEST_OK_(tier_decimations[t] > 1,
+                "Tier decimation must be greater than 1");
+    return ok;
+}
+
+
+/* Records the names of the stripe files in the header. */
+static bool set_stripe_files(
+    struct disk_header *header,
+    unsigned int stripe_file_count, const char *const stripe_files[])
+{
+    bool ok = TEST_OK_(stripe_file_count < MAX_STRIPES,
+        "No more than %d stripes allowed", MAX_STRIPES);
+    for (unsigned int i = 0; ok  &&  i < stripe_file_count; i ++)
+        ok =
+            TEST_OK_(strlen(stripe_files[i]) < STRIPE_NAME_LENGTH,
+                "Stripe file name \"%s\" too long", stripe_files[i])  &&
+            DO_(strcpy(header->stripe_files[i], stripe_files[i]));
+    header->stripe_file_count = stripe_file_count;
+    return ok;
+}
+
+
+/* Number of major blocks held in the largest stripe. */
+static uint32_t stripe_block_count(
+    struct disk_header *header, uint32_t major_block_count)
+{
+    return (major_block_count + stripe_count(header) - 1) /
+        stripe_count(header);
+}
+
+
 bool initialise_header(
     struct disk_header *header,
     struct filter_mask *archive_mask,
@@ -87,12 +145,22 @@ bool initialise_header(
     uint32_t second_decimation,
     double sample_frequency,
     double timestamp_iir,
-    uint32_t fa_entry_count)
+    uint32_t fa_entry_count,
+    double compression,
+    unsigned int tier_count,
+    const uint32_t tier_decimations[],
+    unsigned int stripe_file_count,
+    const char *const stripe_files[],
+    uint32_t d_format)
 {
     uint32_t archive_mask_count = count_mask_bits(archive_mask, fa_entry_count);
+    if (!test_tier_decimations(tier_count, tier_decimations))
+        return false;
 
     /* Header signature. */
     memset(header, 0, sizeof(*header));
+    if (!set_stripe_files(header, stripe_file_count, stripe_files))
+        return false;
     memcpy(header->signature, DISK_SIGNATURE, sizeof(header->signature));
     header->version = DISK_VERSION;
 
@@ -104,11 +172,16 @@ bool initialise_header(
     header->input_block_size = input_block_size;
     header->fa_entry_count = fa_entry_count;
     header->timestamp_iir = timestamp_iir;
+    header->fa_format = compression > 0 ? FA_FORMAT_DELTA : FA_FORMAT_RAW;
+    header->d_format = d_format;
 
     /* Compute the fixed size parameters describing the data layout. */
     header->major_sample_count = major_sample_count;
     header->d_sample_count = header->major_sample_count / first_decimation;
     header->dd_sample_count = header->d_sample_count / second_decimation;
+    header->tier_count = tier_count;
+    for (unsigned int t = 0; t < tier_count; t ++)
+        header->tier_decimation_log2[t] = uint_log2(tier_decimations[t]);
     header->major_block_size = (uint32_t) (
         archive_mask_count * (
             header->major_sample_count * FA_ENTRY_SIZE +
@@ -118,29 +191,59 @@ bool initialise_header(
      * little tricky, as we have to fit everything into file_size including
      * all the auxiliary data structures.  What makes things more tricky is
      * that both the index and DD data areas are rounded up to a multiple of
-     * page size, so simple division won't quite do the trick. */
+     * page size, so simple division won't quite do the trick.
+     *    For a compressed archive the index also holds the extent and column
+     * tables, and we allow for each major block taking its nominal compressed
+     * size; the major data area then takes whatever space is left.
+     *    If a decimation tier spans several major blocks then the block count
+     * must be a multiple of the span.  If the major data is striped then this
+     * file only holds its share of the major blocks, and each further stripe
+     * file must have room for the same share. */
     uint64_t data_size = file_size - DISK_HEADER_SIZE;
     uint32_t index_block_size = sizeof(struct data_index);
-    uint32_t dd_block_size = (uint32_t) (
+    uint64_t major_block_size = header->major_block_size;
+    if (header->fa_format != FA_FORMAT_RAW)
+    {
+        index_block_size = (uint32_t) (
+            index_block_size + sizeof(struct block_extent) +
+            archive_mask_count * sizeof(uint32_t));
+        size_t fa_size =
+            archive_mask_count * header->major_sample_count * FA_ENTRY_SIZE;
+        major_block_size -= fa_size;
+        major_block_size += (uint64_t) ((double) fa_size / compression);
+    }
+    double dd_block_size = (double) (
         header->dd_sample_count * archive_mask_count *
         sizeof(struct decimated_data));
+    double tier_block_size = 0;
+    for (unsigned int t = 0; t < tier_count; t ++)
+        tier_block_size +=
+            ldexp(dd_block_size, - (int) tier_decimation_log2(header, t));
+    uint32_t dd_sample_log2 = uint_log2(header->dd_sample_count);
+    uint32_t tier_log2 =
+        tier_count > 0 ? tier_decimation_log2(header, tier_count - 1) : 0;
+    uint32_t block_group =
+        tier_log2 > dd_sample_log2 ? 1U << (tier_log2 - dd_sample_log2) : 1;
     /* Start with a simple estimate by division. */
     uint32_t major_block_count =
-        (uint32_t) (data_size / (
-            index_block_size + dd_block_size + header->major_block_size));
+        (uint32_t) ((double) data_size / (
+            index_block_size + dd_block_size + tier_block_size +
+            (double) major_block_size / stripe_count(header)));
+    major_block_count -= major_block_count % block_group;
     uint32_t index_data_size =
         (uint32_t) round_to_page(major_block_count * index_block_size);
-    uint64_t dd_data_size =
-        round_to_page((size_t) major_block_count * dd_block_size);
+    uint64_t dd_data_size = dd_area_size(header, major_block_count);
     /* Now incrementally reduce the major block count until we're good.  In
      * fact, this is only going to happen once at most. */
-    while (index_data_size + dd_data_size +
-           major_block_count * header->major_block_size > data_size)
+    while (major_block_count > 0  &&
+           index_data_size + dd_data_size +
+           stripe_block_count(header, major_block_count) * major_block_size >
+               data_size)
     {
-        major_block_count -= 1;
+        major_block_count -= block_group;
         index_data_size =
             (uint32_t) round_to_page(major_block_count * index_block_size);
-        dd_data_size = round_to_page(major_block_count * dd_block_size);
+        dd_data_size = dd_area_size(header, major_block_count);
     }
 
     /* Finally we can compute the data layout. */
@@ -149,11 +252,25 @@ bool initialise_header(
     header->dd_data_start = header->index_data_start + index_data_size;
     header->dd_data_size = dd_data_size;
     header->dd_total_count = header->dd_sample_count * major_block_count;
+    for (unsigned int t = 0; t < tier_count; t ++)
+        header->tier_total_count[t] =
+            header->dd_total_count >> tier_decimation_log2(header, t);
     header->major_data_start = header->dd_data_start + dd_data_size;
     header->major_block_count = major_block_count;
+    if (header->fa_format == FA_FORMAT_RAW)
+        header->major_data_size =
+            (uint64_t) stripe_block_count(header, major_block_count) *
+            header->major_block_size;
+    else
+    {
+        header->extent_offset = (uint32_t) (
+            major_block_count * sizeof(struct data_index));
+        size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+        uint64_t major_data_size = file_size - header->major_data_start;
+        header->major_data_size = major_data_size - major_data_size % page_size;
+    }
     header->total_data_size =
-        header->major_data_start +
-        (uint64_t) major_block_count * header->major_block_size;
+        header->major_data_start + header->major_data_size;
 
     header->current_major_block = 0;
     /* Compute the nominal time, in microseconds, to capture an entire major
@@ -168,10 +285,134 @@ bool initialise_header(
         test_power_of_2(major_sample_count, "Major sample count")  &&
         TEST_OK_(major_sample_count >= first_decimation * second_decimation,
             "Major sample count must be no smaller than decimation count")  &&
+        TEST_OK_(compression == 0  ||  compression >= 1,
+            "Compression ratio must be at least 1")  &&
         validate_header(header, file_size);
 }
 
 
+/* Checks the layout of major data, which depends on the FA format. */
+static bool validate_major_data(struct disk_header *header)
+{
+    size_t index_size = header->major_block_count * sizeof(struct data_index);
+    size_t table_size = header->major_block_count * (
+        sizeof(struct block_extent) +
+        header->archive_mask_count * sizeof(uint32_t));
+    switch (header->fa_format)
+    {
+        case FA_FORMAT_RAW:
+            return
+                TEST_OK_(header->extent_offset == 0,
+                    "Unexpected extent offset: %"PRIu32,
+                    header->extent_offset)  &&
+                TEST_OK_(
+                    header->major_data_size ==
+                    (uint64_t) stripe_block_count(
+                        header, header->major_block_count) *
+                        header->major_block_size,
+                    "Invalid major data size: "
+                    "%"PRIu64" != %"PRIu32" * %"PRIu32,
+                        header->major_data_size,
+                        stripe_block_count(header, header->major_block_count),
+                        header->major_block_size);
+        case FA_FORMAT_DELTA:
+            return
+                TEST_OK_(header->extent_offset == index_size,
+                    "Invalid extent offset: %"PRIu32" != %zu",
+                    header->extent_offset, index_size)  &&
+                TEST_OK_(
+                    header->index_data_size >= index_size + table_size,
+                    "Index area too small for extents: %"PRIu32" < %zu + %zu",
+                        header->index_data_size, index_size, table_size)  &&
+                TEST_OK_(
+                    header->major_sample_count % DELTA_GROUP_SIZE == 0,
+                    "Major sample count must be a multiple of %d",
+                    DELTA_GROUP_SIZE)  &&
+                TEST_OK_(
+                    header->major_data_size >=
+                    MIN_PACKED_BLOCKS * (uint64_t) header->major_block_size,
+                    "Major data area too small for %d blocks: "
+                    "%"PRIu64" < %"PRIu32,
+                        MIN_PACKED_BLOCKS, header->major_data_size,
+                        header->major_block_size)  &&
+                page_aligned(header->major_data_size, "major data size");
+        default:
+            return FAIL_("Unknown FA format %"PRIu32, header->fa_format);
+    }
+}
+
+
+/* Checks that any stripe files are properly recorded.  Striping relies on the
+ * major blocks being a fixed size, so isn't supported for compressed data. */
+static bool validate_stripes(struct disk_header *header)
+{
+    bool ok =
+        TEST_OK_(header->stripe_file_count < MAX_STRIPES,
+            "Invalid stripe count: %"PRIu32, header->stripe_file_count)  &&
+        TEST_OK_(
+            header->stripe_file_count == 0  ||
+            header->fa_format == FA_FORMAT_RAW,
+            "Striping not supported for compressed archives");
+    for (unsigned int i = 0; ok  &&  i < header->stripe_file_count; i ++)
+        ok = TEST_OK_(
+            strnlen(header->stripe_files[i], STRIPE_NAME_LENGTH) <
+                STRIPE_NAME_LENGTH  &&  header->stripe_files[i][0] != '\0',
+            "Invalid name for stripe %u", i + 1);
+    return ok;
+}
+
+
+/* Checks the decimation tiers above DD and that the DD area has room for them. */
+static bool validate_tiers(struct disk_header *header)
+{
+    bool ok = TEST_OK_(header->tier_count <= MAX_DECIMATION_TIERS,
+        "Invalid decimation tier count: %"PRIu32, header->tier_count);
+    uint32_t decimation_log2 = 0;
+    for (unsigned int t = 0; ok  &&  t < header->tier_count; t ++)
+    {
+        decimation_log2 += header->tier_decimation_log2[t];
+        ok =
+            TEST_OK_(
+                header->tier_decimation_log2[t] > 0  &&  decimation_log2 < 32,
+                "Invalid decimation for tier %u: %"PRIu32,
+                    t, header->tier_decimation_log2[t])  &&
+            TEST_OK_(
+                header->tier_total_count[t] << decimation_log2 ==
+                    header->dd_total_count,
+                "Invalid sample count for tier %u: "
+                "%"PRIu32" << %"PRIu32" != %"PRIu32,
+                    t, header->tier_total_count[t], decimation_log2,
+                    header->dd_total_count);
+    }
+    return ok  &&
+        TEST_OK_(
+            tier_data_offset(header, header->tier_count) *
+                sizeof(struct decimated_data) <= header->dd_data_size,
+            "DD area too small for decimation tiers: %zu * %zd > %"PRIu64,
+                tier_data_offset(header, header->tier_count),
+                sizeof(struct decimated_data), header->dd_data_size);
+}
+
+
+/* A version 5 header has the same layout as the current header up to and
+ * including last_duration, with nothing defined after it.  It describes an
+ * uncompressed archive with no tiers, so is upgraded by filling in the fields
+ * which follow.
+ * If the header is mapped from a writeable archive this upgrades the archive. */
+static void upgrade_header(struct disk_header *header)
+{
+    if (header->version == OLDEST_DISK_VERSION)
+    {
+        size_t start = offsetof(struct disk_header, major_data_size);
+        memset((char *) header + start, 0, sizeof(*header) - start);
+        header->major_data_size =
+            (uint64_t) header->major_block_count * header->major_block_size;
+        header->fa_format = FA_FORMAT_RAW;
+        header->version = DISK_VERSION;
+    }
+}
+
+
 static bool validate_version(struct disk_header *header)
 {
     return
@@ -179,9 +420,12 @@ static bool validate_version(struct disk_header *header)
             strncmp(header->signature, DISK_SIGNATURE,
                 sizeof(header->signature)) == 0,
             "Invalid header signature")  &&
-        TEST_OK_(header->version == DISK_VERSION,
+        TEST_OK_(
+            header->version == DISK_VERSION  ||
+            header->version == OLDEST_DISK_VERSION,
             "Invalid header version %u, expected %u",
-            header->version, DISK_VERSION);
+            header->version, DISK_VERSION)  &&
+        DO_(upgrade_header(header));
 }
 
 
@@ -260,6 +504,7 @@ bool validate_header(struct disk_header *header, uint64_t file_size)
             "DD area too small: %"PRIu32" * %"PRIu32" * %zd > %"PRIu64,
                 header->dd_total_count, header->archive_mask_count,
                 sizeof(struct decimated_data), header->dd_data_size)  &&
+        validate_tiers(header)  &&
 
         TEST_OK_(
             0 < header->timestamp_iir  &&  header->timestamp_iir <= 1,
@@ -291,13 +536,15 @@ bool validate_header(struct disk_header *header, uint64_t file_size)
                 header->dd_data_start, header->dd_data_size)  &&
         TEST_OK_(
             header->total_data_size >=
-            header->major_data_start +
-            (uint64_t) header->major_block_count * header->major_block_size,
-            "Data area too small for data: "
-            "%"PRIu64" < %"PRIu64" + %"PRIu32" * %"PRIu32,
+            header->major_data_start + header->major_data_size,
+            "Data area too small for data: %"PRIu64" < %"PRIu64" + %"PRIu64,
                 header->total_data_size,
-                header->major_data_start,
-                header->major_block_count, header->major_block_size)  &&
+                header->major_data_start, header->major_data_size)  &&
+        validate_major_data(header)  &&
+        validate_stripes(header)  &&
+        TEST_OK_(header->d_format == D_FORMAT_INTERLEAVED  ||
+            header->d_format == D_FORMAT_FIELDS,
+            "Unknown D format %"PRIu32, header->d_format)  &&
         TEST_OK_(
             header->index_data_size >=
             header->major_block_count * sizeof(struct data_index),
@@ -362,7 +609,9 @@ void print_header(FILE *out, struct disk_header *header)
         "Index data from %"PRIu64" for %"PRIu32" bytes\n"
         "DD data starts %"PRIu64" for %"PRIu64" bytes, %"PRIu32" samples,"
             " %"PRIu32" per block\n"
-        "FA+D data from %"PRIu64", %"PRIu32" decimated samples per block\n"
+        "FA+D data from %"PRIu64" for %"PRIu64" bytes,"
+            " %"PRIu32" decimated samples per block\n"
+        "FA data format: %s, D data format: %s\n"
         "Last duration: %"PRIu32" us, or %lg Hz.  Current index: %"PRIu32"\n",
         header->signature, header->version,
         mask_string, format_string,
@@ -377,10 +626,30 @@ void print_header(FILE *out, struct disk_header *header)
         header->index_data_start, header->index_data_size,
         header->dd_data_start, header->dd_data_size, header->dd_total_count,
             header->dd_sample_count,
-        header->major_data_start, header->d_sample_count,
+        header->major_data_start, header->major_data_size,
+            header->d_sample_count,
+        header->fa_format == FA_FORMAT_RAW ? "raw" :
+            header->fa_format == FA_FORMAT_DELTA ?
+                "delta coded (nominal duration)" : "unknown",
+        header->d_format == D_FORMAT_INTERLEAVED ? "interleaved" :
+            header->d_format == D_FORMAT_FIELDS ?
+                "separate fields" : "unknown",
         header->last_duration,
             1e6 * header->major_sample_count / (double) header->last_duration,
             header->current_major_block);
+    if (header->tier_count <= MAX_DECIMATION_TIERS)
+        for (unsigned int t = 0; t < header->tier_count; t ++)
+            fprintf(out,
+                "Decimation tier %u: %"PRIu32" => %"PRIu64", %"PRIu32
+                " samples\n",
+                t + 1, 1U << header->tier_decimation_log2[t],
+                (uint64_t) (first_decimation * second_decimation) <<
+                    tier_decimation_log2(header, t),
+                header->tier_total_count[t]);
+    if (header->stripe_file_count < MAX_STRIPES)
+        for (unsigned int i = 0; i < header->stripe_file_count; i ++)
+            fprintf(out, "Stripe %u: %.*s\n", i + 1,
+                STRIPE_NAME_LENGTH, header->stripe_files[i]);
 }
 
 
@@ -391,6 +660,49 @@ bool lock_archive(int disk_fd)
 }
 
 
+/* Opens and checks a single stripe file, closing it again on failure. */
+static bool open_stripe(
+    const struct disk_header *header, unsigned int stripe, int flags,
+    bool lock, int *stripe_fd)
+{
+    const char *file_name = header->stripe_files[stripe - 1];
+    uint64_t file_size;
+    return
+        TEST_IO_(*stripe_fd = open(file_name, flags),
+            "Unable to open stripe file \"%s\"", file_name)  &&
+        UNLESS(
+            IF_(lock, lock_archive(*stripe_fd))  &&
+            get_filesize(*stripe_fd, &file_size)  &&
+            TEST_OK_(file_size >= header->major_data_size,
+                "Stripe file \"%s\" too small: %"PRIu64" < %"PRIu64,
+                file_name, file_size, header->major_data_size),
+
+            close(*stripe_fd));
+}
+
+
+bool open_stripes(
+    const struct disk_header *header, int flags, bool lock, int stripes[])
+{
+    bool ok = true;
+    unsigned int stripe;
+    for (stripe = 1; ok  &&  stripe < stripe_count(header); stripe ++)
+        ok = open_stripe(header, stripe, flags, lock, &stripes[stripe]);
+    if (!ok)
+        /* Close the stripes opened before the one that failed. */
+        for (unsigned int i = 1; i + 1 < stripe; i ++)
+            close(stripes[i]);
+    return ok;
+}
+
+
+void close_stripes(const struct disk_header *header, int stripes[])
+{
+    for (unsigned int i = 1; i < stripe_count(header); i ++)
+        ASSERT_IO(close(stripes[i]));
+}
+
+
 bool get_filesize(int disk_fd, uint64_t *file_size)
 {
     /* First try blocksize, if that fails try stat: the first works on a
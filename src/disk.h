@@ -35,6 +35,14 @@ struct decimated_data {
 /* A single page is allocated to the disk header. */
 #define DISK_HEADER_SIZE    4096
 
+/* Maximum number of decimation tiers above DD. */
+#define MAX_DECIMATION_TIERS    4
+
+/* Maximum number of files the major data can be striped across, and longest
+ * file name recorded for a stripe. */
+#define MAX_STRIPES             8
+#define STRIPE_NAME_LENGTH      256
+
 
 /* Description of file store layout.
  *
@@ -43,8 +51,10 @@ struct decimated_data {
  *
  *  data_store = disk_header, index, DD_data, FA_data
  *  index = data_index[major_block_count]
- *  DD_data = DD_block[archive_mask_count]
- *  DD_block = decimated_data[dd_sample_count]
+ *  DD_data = DD_block[archive_mask_count], tier_data[tier_count]
+ *  DD_block = decimated_data[dd_total_count]
+ *  tier_data = tier_block[archive_mask_count]
+ *  tier_block = decimated_data[tier_total_count[tier]]
  *  FA_data = major_block[major_block_count]
  *  major_block = FA_block[archive_mask_count], D_block[archive_mask_count]
  *  FA_block = fa_entry[major_sample_count]
@@ -85,10 +95,56 @@ struct decimated_data {
  * d_sample_count = major_sample_count / first_decimation
  * dd_sample_count = d_sample_count / second_decimation
  * dd_total_count = dd_sample_count * major_block_count
+ * tier_total_count[t] = dd_total_count / (tier decimations up to t)
  *
  * Note that major_sample_count must be a multiple of the two decimation factors
  * so that all indexing can be done in multiples of major blocks.  Thus the
  * index is by major block.
+ *
+ * Further decimation tiers can be configured above DD, each decimating the tier
+ * below by a further power of 2.  These are also held in memory, following the
+ * DD blocks.  A tier sample can span several major blocks, in which case
+ * major_block_count is a multiple of the number of blocks spanned, so that the
+ * samples in each tier are still aligned to major blocks.
+ *
+ * If the archive is prepared with fa_format set to FA_FORMAT_DELTA then each FA
+ * block is stored delta coded and bit packed, so major blocks vary in length.
+ * The index area is then extended with a table recording where each major block
+ * is stored and where each of its FA blocks starts, and the major blocks are
+ * packed one after another into FA_data, wrapping round as necessary:
+ *
+ *  index = data_index[major_block_count], extent_table, column_table
+ *  extent_table = block_extent[major_block_count]
+ *  column_table = column_offset[major_block_count][archive_mask_count]
+ *  major_block = D_block[archive_mask_count], packed_FA_block[archive_mask_count]
+ *
+ * Here column_offset is a uint32_t offset of each packed FA block from the
+ * start of its major block.  The D blocks come first so that they remain at a
+ * fixed offset.  An FA block which doesn't compress is stored unchanged and is
+ * recognised by its length.
+ *
+ * An uncompressed archive can also have its major data striped across several
+ * files, normally on separate devices, so that writing and reading can proceed
+ * on all of them at once.  The archive file then holds the header, index and DD
+ * data followed by the first stripe, and the remaining stripes are held from
+ * the start of the files named in the header.  Major blocks are dealt out to
+ * the stripes in turn, so with stripe_count = stripe_file_count + 1:
+ *
+ *  major_block[i] is block i / stripe_count of stripe i % stripe_count
+ *  major_data_size = major_block_size * ceil(major_block_count / stripe_count)
+ *
+ * where major_data_size is now the size of the major data in each stripe.
+ *
+ * If the archive is prepared with d_format set to D_FORMAT_FIELDS then each
+ * field of the decimated data is instead stored as a separate column within
+ * the D block, so that reads of a subset of fields only need to read part of
+ * each block:
+ *
+ *  D_block = mean[d_sample_count], min[d_sample_count],
+ *      max[d_sample_count], std[d_sample_count]
+ *
+ * where each column is an array of fa_entry.  The DD and tier data held in
+ * memory is unaffected.
  */
 
 /* The data is stored on disk in native format: it will be read and written
@@ -130,6 +186,24 @@ struct disk_header {
 
     uint32_t current_major_block;   // This block is being written
     uint32_t last_duration;     // Time for last major block in microseconds
+
+    /* Everything below was added after version 5.  A version 5 header is
+     * upgraded as it is read by upgrade_header(), which sets these fields to
+     * describe an uncompressed and unstriped archive with no decimation tiers
+     * above DD and interleaved D data. */
+    uint64_t major_data_size;   // Size of major data area
+    uint32_t fa_format;         // Format of FA blocks, FA_FORMAT_...
+    uint32_t extent_offset;     // Offset of extent table into index area
+    uint32_t tier_count;        // Number of decimation tiers above DD
+    uint32_t tier_decimation_log2[MAX_DECIMATION_TIERS]; // From tier below
+    uint32_t tier_total_count[MAX_DECIMATION_TIERS]; // Samples in each tier
+
+    /* Files holding the second and subsequent stripes of major data, none for
+     * an upgraded header. */
+    uint32_t stripe_file_count; // Number of stripe files, 0 if not striped
+    char stripe_files[MAX_STRIPES - 1][STRIPE_NAME_LENGTH];
+
+    uint32_t d_format;          // Layout of D blocks, D_FORMAT_...
 };
 
 
@@ -146,8 +220,32 @@ struct data_index {
 };
 
 
+/* Location of a major block in a compressed archive. */
+struct block_extent {
+    uint64_t offset;            // Offset of block into major data area
+    uint32_t length;            // Length of block on disk, 0 if block invalid
+    uint32_t data_length;       // Length of block up to end of last FA block
+};
+
+
 #define DISK_SIGNATURE      "FASNIFF"
-#define DISK_VERSION        5
+#define DISK_VERSION        8
+/* Oldest header version which can be read, by upgrading to DISK_VERSION. */
+#define OLDEST_DISK_VERSION 5
+
+/* Formats for FA data. */
+#define FA_FORMAT_RAW       0   // FA blocks stored as arrays of fa_entry
+#define FA_FORMAT_DELTA     1   // FA blocks delta coded and bit packed
+
+/* Formats for D data. */
+#define D_FORMAT_INTERLEAVED    0   // D blocks stored as decimated_data
+#define D_FORMAT_FIELDS         1   // Each field of D blocks stored separately
+
+/* Packed FA blocks are coded in groups of this many samples, and a compressed
+ * archive needs room for at least MIN_PACKED_BLOCKS uncompressed major blocks
+ * in its major data area. */
+#define DELTA_GROUP_SIZE    64
+#define MIN_PACKED_BLOCKS   4
 
 
 /* Two helper routines for converting sample number (within a major block) and
@@ -168,6 +266,74 @@ static inline size_t __pure d_data_offset(
 }
 
 
+/* Access to the extent and column tables of a compressed archive, which follow
+ * the data index. */
+static inline struct block_extent *block_extents(
+    const struct disk_header *header, struct data_index *data_index)
+{
+    return (void *) ((char *) data_index + header->extent_offset);
+}
+static inline uint32_t *column_offsets(
+    const struct disk_header *header, struct data_index *data_index,
+    unsigned int major_block)
+{
+    return (uint32_t *) &block_extents(header, data_index)[
+        header->major_block_count] +
+        (size_t) major_block * header->archive_mask_count;
+}
+
+/* Access to the decimation tiers above DD.  Returns the total decimation log2
+ * from DD to the given tier, and the offset of the tier data from the start of
+ * the DD area, counted in decimated_data samples. */
+static inline unsigned int tier_decimation_log2(
+    const struct disk_header *header, unsigned int tier)
+{
+    unsigned int result = 0;
+    for (unsigned int t = 0; t <= tier; t ++)
+        result += header->tier_decimation_log2[t];
+    return result;
+}
+static inline size_t tier_data_offset(
+    const struct disk_header *header, unsigned int tier)
+{
+    size_t offset = header->dd_total_count;
+    for (unsigned int t = 0; t < tier; t ++)
+        offset += header->tier_total_count[t];
+    return offset * header->archive_mask_count;
+}
+
+
+/* Striping of major data: the number of stripes and the stripe holding the
+ * given major block.  Stripe 0 is the archive file itself. */
+static inline unsigned int stripe_count(const struct disk_header *header)
+{
+    return header->stripe_file_count + 1;
+}
+static inline unsigned int major_block_stripe(
+    const struct disk_header *header, unsigned int major_block)
+{
+    return major_block % stripe_count(header);
+}
+
+
+/* Returns the offset into its stripe of the given major block. */
+static inline uint64_t major_block_offset(
+    const struct disk_header *header, struct data_index *data_index,
+    unsigned int major_block)
+{
+    if (header->fa_format == FA_FORMAT_RAW)
+    {
+        unsigned int stripe = major_block_stripe(header, major_block);
+        return (stripe == 0 ? header->major_data_start : 0) +
+            (uint64_t) header->major_block_size *
+                (major_block / stripe_count(header));
+    }
+    else
+        return header->major_data_start +
+            block_extents(header, data_index)[major_block].offset;
+}
+
+
 /* Prepare a fresh disk header with the specified parameters:
  *
  *  archive_mask
@@ -186,6 +352,17 @@ static inline size_t __pure d_data_offset(
  *  second_decimation
  *      Data decimation factors.  These determine the data reduction factors for
  *      first and second stages of decimation.
+ *  compression
+ *      If non zero FA data is stored compressed, and the number of major blocks
+ *      is chosen assuming that FA data compresses by this factor.
+ *  tier_count
+ *  tier_decimations
+ *      Decimation factors for any further decimation tiers above DD.
+ *  stripe_file_count
+ *  stripe_files
+ *      Names of any further files across which the major data is striped.
+ *  d_format
+ *      Layout of D blocks, D_FORMAT_INTERLEAVED or D_FORMAT_FIELDS.
  *
  * These parameters determine the layout and operation of the archiver. */
 bool initialise_header(
@@ -198,7 +375,13 @@ bool initialise_header(
     uint32_t second_decimation,
     double sample_frequency,
     double timestamp_iir,
-    uint32_t fa_entry_count);
+    uint32_t fa_entry_count,
+    double compression,
+    unsigned int tier_count,
+    const uint32_t tier_decimations[],
+    unsigned int stripe_file_count,
+    const char *const stripe_files[],
+    uint32_t d_format);
 /* Reads the file size of the given file. */
 bool get_filesize(int disk_fd, uint64_t *file_size);
 /* Checks the given header for consistency. */
@@ -207,3 +390,11 @@ bool validate_header(struct disk_header *header, uint64_t file_size);
 void print_header(FILE *out, struct disk_header *header);
 /* Locks archive for exclusive access. */
 bool lock_archive(int disk_fd);
+/* Opens the stripe files of a striped archive with the given open flags,
+ * checking that each is large enough for its stripe and locking it if lock is
+ * set.  The archive file itself must already be in stripes[0], and the stripe
+ * files are returned in the rest of stripes[]. */
+bool open_stripes(
+    const struct disk_header *header, int flags, bool lock, int stripes[]);
+/* Closes the stripe files opened by open_stripes(), but not stripes[0]. */
+void close_stripes(const struct disk_header *header, int stripes[]);
@@ -48,7 +48,10 @@
 #include "mask.h"
 #include "disk.h"
 #include "transform.h"
+#include "dd_cache.h"
 #include "locking.h"
+#include "placement.h"
+#include "stats.h"
 
 #include "disk_writer.h"
 
@@ -57,8 +60,43 @@
 /* Used to terminate threads. */
 static bool writer_running = true;
 
-/* File handle for writing to disk. */
-static int disk_fd;
+/* File handles for writing to disk, one for each stripe of the archive.  The
+ * first stripe is the archive file itself. */
+static int disk_fd[MAX_STRIPES];
+#define archive_fd  disk_fd[0]
+
+struct write_request {
+    unsigned int stripe;        // Stripe to be written to
+    off64_t offset;
+    void *block;
+    size_t length;
+    uint64_t queued;            // Timestamp when write was scheduled
+    bool started;               // Set when the writer picks up the request
+    bool done;                  // Set when the write is complete
+};
+
+/* Queue of pending write requests.  Each stripe has its own writer, so
+ * requests for different stripes can complete out of order, but a request is
+ * only removed from the head of the queue once it and all older requests are
+ * complete. */
+static struct write_request *write_queue;
+static unsigned int write_queue_depth;
+static unsigned int write_queue_head;   // Index of oldest pending request
+static unsigned int write_queue_count;  // Number of pending requests
+
+/* Read scheduling state. */
+static uint64_t read_bandwidth;     // Read limit in bytes per second or 0
+static double read_tokens;          // Bytes that can be read without waiting
+static uint64_t read_token_time;    // Timestamp of last token update
+static unsigned int next_read_ticket;   // Ticket for next arriving reader
+static unsigned int serving_read_ticket; // Ticket of next reader to admit
+static unsigned int read_waiters;   // Number of readers waiting for admission
+static uint64_t deferred_reads;     // Count of reads held back for writing
+
+/* Read rate is measured over intervals of at least one second. */
+static uint64_t read_window_start;
+static uint64_t read_window_bytes;
+static uint64_t read_rate;          // Bytes per second in last interval
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -69,41 +107,57 @@ static struct disk_header *header;      // Disk header with basic parameters
 static struct data_index *data_index;   // Index of blocks
 static struct decimated_data *dd_data;  // Double decimated data
 
+/* Number of threads warming up the in memory data at startup. */
+static unsigned int warm_up_threads;
+static uint64_t warm_up_done;       // Bytes warmed up so far
+static uint64_t warm_up_total;      // Total bytes to warm up
+
 
 /* Opens and locks the archive for direct IO and maps the three in memory
  * regions directly into memory.  Returns the configured input block size and
  * number of FA ids per capture frame. */
 bool initialise_disk_writer(
     const char *file_name, uint32_t *input_block_size, uint32_t *fa_entry_count,
-    unsigned int events_fa_id)
+    unsigned int events_fa_id, unsigned int transform_threads,
+    unsigned int write_queue_depth_, uint64_t read_bandwidth_,
+    unsigned int warm_up_threads_)
 {
     uint64_t disk_size;
+    write_queue_depth = write_queue_depth_;
+    read_bandwidth = read_bandwidth_;
+    warm_up_threads = warm_up_threads_;
     return
+        TEST_OK_(write_queue_depth > 0, "Write queue depth must be positive")  &&
+        TEST_NULL(write_queue =
+            calloc(write_queue_depth, sizeof(struct write_request)))  &&
         TEST_IO_(
             /* I am told, eg http://lkml.org/lkml/2007/1/10/233, see also
              * http://kerneltrap.org/node/7563, to use madvise() and
              * posix_fadvise() instead of O_DIRECT.  However I'm not persuaded,
              * the pattern of access in this application is specialised enough
              * that I think O_DIRECT is appropriate. */
-            disk_fd = open(file_name, O_RDWR | O_DIRECT | O_LARGEFILE),
+            archive_fd = open(file_name, O_RDWR | O_DIRECT | O_LARGEFILE),
             "Unable to open archive file \"%s\"", file_name)  &&
-        lock_archive(disk_fd)  &&
+        lock_archive(archive_fd)  &&
         TEST_IO(
             header = mmap(NULL, DISK_HEADER_SIZE,
-                PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0))  &&
-        get_filesize(disk_fd, &disk_size)  &&
+                PROT_READ | PROT_WRITE, MAP_SHARED, archive_fd, 0))  &&
+        get_filesize(archive_fd, &disk_size)  &&
         validate_header(header, disk_size)  &&
+        open_stripes(header, O_RDWR | O_DIRECT | O_LARGEFILE, true, disk_fd)  &&
         DO_(*input_block_size = header->input_block_size;
             *fa_entry_count   = header->fa_entry_count)  &&
         TEST_IO(
             data_index = mmap(NULL, (size_t) header->index_data_size,
-                PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd,
+                PROT_READ | PROT_WRITE, MAP_SHARED, archive_fd,
                 (off_t) header->index_data_start))  &&
         TEST_IO(
             dd_data = mmap(NULL, (size_t) header->dd_data_size,
-                PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd,
+                PROT_READ | PROT_WRITE, MAP_SHARED, archive_fd,
                 (off_t) header->dd_data_start))  &&
-        DO_(initialise_transform(header, data_index, dd_data, events_fa_id));
+        initialise_transform(
+            header, data_index, dd_data, events_fa_id, transform_threads,
+            write_queue_depth);
 }
 
 static void close_disk(void)
@@ -113,8 +167,9 @@ static void close_disk(void)
     ASSERT_IO(msync(header, DISK_HEADER_SIZE, MS_ASYNC));
     ASSERT_IO(munmap(dd_data, (size_t) header->dd_data_size));
     ASSERT_IO(munmap(data_index, (size_t) header->index_data_size));
+    close_stripes(header, disk_fd);
     ASSERT_IO(munmap(header, DISK_HEADER_SIZE));
-    ASSERT_IO(close(disk_fd));
+    ASSERT_IO(close(archive_fd));
 }
 
 
@@ -122,19 +177,23 @@ static void close_disk(void)
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Disk writing and read permission thread. */
 
-/* This thread manages writing of blocks to the disk.  Requests for reads are
- * interlocked with this thread so that reading is blocked while a write is
- * currently in progress. */
+/* These threads manage writing of blocks to the disk, one thread for each
+ * stripe of the archive.  Write requests are queued so that the transform
+ * thread only has to wait for the disk when write_queue_depth blocks are
+ * already outstanding, which allows processing to ride out occasional long
+ * disk stalls.  As successive blocks go to successive stripes, a queue at least
+ * as deep as the number of stripes keeps all the disks busy.
+ *
+ * Requests for reads are scheduled against this thread.  Reads normally
+ * proceed alongside writing, but a block can't be read while it is waiting to
+ * be written, and once the oldest pending write has used up half of its
+ * deadline readers are held back until it completes.  Readers are admitted in
+ * order of arrival, and as each client has at most one block read outstanding
+ * this shares the read bandwidth fairly among clients.  Optionally the total
+ * read bandwidth can be limited. */
 
 DECLARE_LOCKING(writer_lock);
 
-/* Current write request. */
-static bool writing_active = false;
-static off64_t writing_offset;
-static void *writing_block;
-static size_t writing_length;
-
-
 /* Ensures entire block is written even if interrupted. */
 static bool do_write(int file, void *buffer, size_t length)
 {
@@ -149,24 +208,63 @@ static bool do_write(int file, void *buffer, size_t length)
     return true;
 }
 
+/* Returns the oldest request for the given stripe which hasn't yet been
+ * started, or NULL if there is none.  Must be called under the lock. */
+static struct write_request *find_write(unsigned int stripe)
+{
+    for (unsigned int i = 0; i < write_queue_count; i ++)
+    {
+        struct write_request *request =
+            &write_queue[(write_queue_head + i) % write_queue_depth];
+        if (request->stripe == stripe  &&  !request->started)
+            return request;
+    }
+    return NULL;
+}
+
+/* Waits for a write request for the given stripe, returns NULL if the writer
+ * has been stopped and there is nothing left to write to this stripe.  The
+ * request stays in the queue until it is complete. */
+static struct write_request *wait_for_write(unsigned int stripe)
+{
+    struct write_request *request;
+    LOCK(writer_lock);
+    while (request = find_write(stripe),  writer_running  &&  !request)
+        pwait(&writer_lock);
+    if (request)
+        request->started = true;
+    UNLOCK(writer_lock);
+    return request;
+}
+
+static void complete_write(struct write_request *request)
+{
+    LOCK(writer_lock);
+    request->done = true;
+    while (write_queue_count > 0  &&  write_queue[write_queue_head].done)
+    {
+        write_queue_head = (write_queue_head + 1) % write_queue_depth;
+        write_queue_count -= 1;
+    }
+    pbroadcast(&writer_lock);
+    UNLOCK(writer_lock);
+}
+
 static void *writer_thread(void *context)
 {
+    unsigned int stripe = (unsigned int) (uintptr_t) context;
+    int file = disk_fd[stripe];
+    /* On shutdown we carry on until the queue has been drained. */
     bool ok = true;
-    while (ok  &&  writer_running)
+    struct write_request *request;
+    while (ok  &&  (request = wait_for_write(stripe)))
     {
-        LOCK(writer_lock);
-        while (writer_running  &&  !writing_active)
-            pwait(&writer_lock);
-        UNLOCK(writer_lock);
-
-        ok = writing_active  &&
-            TEST_IO(lseek(disk_fd, writing_offset, SEEK_SET))  &&
-            do_write(disk_fd, writing_block, writing_length);
-
-        LOCK(writer_lock);
-        writing_active = false;
-        pbroadcast(&writer_lock);
-        UNLOCK(writer_lock);
+        uint64_t start = start_latency();
+        ok =
+            TEST_IO(lseek(file, request->offset, SEEK_SET))  &&
+            do_write(file, request->block, request->length);
+        record_latency(LATENCY_MAJOR_WRITE, start);
+        complete_write(request);
     }
     return NULL;
 }
@@ -179,28 +277,317 @@ static void stop_writer_thread(void)
     UNLOCK(writer_lock);
 }
 
-void schedule_write(off64_t offset, void *block, size_t length)
+void schedule_write(
+    unsigned int stripe, off64_t offset, void *block, size_t length)
 {
     LOCK(writer_lock);
-    while (writing_active)
+    while (write_queue_count >= write_queue_depth)
         pwait(&writer_lock);
-    writing_offset = offset;
-    writing_block = block;
-    writing_length = length;
-    writing_active = true;
+    unsigned int tail =
+        (write_queue_head + write_queue_count) % write_queue_depth;
+    write_queue[tail] = (struct write_request) {
+        .stripe = stripe, .offset = offset, .block = block, .length = length,
+        .queued = get_timestamp() };
+    write_queue_count += 1;
     pbroadcast(&writer_lock);
     UNLOCK(writer_lock);
 }
 
-void request_read(void)
+/* Each write must complete before its buffer is needed again, which is after
+ * write_queue_depth further blocks have been assembled.  Once half of this time
+ * has gone the writer is given the disk to itself. */
+static bool write_urgent(uint64_t now)
 {
-    LOCK(writer_lock);
-    while (writing_active)
+    if (write_queue_count == 0)
+        return false;
+    else
+    {
+        uint64_t age = now - write_queue[write_queue_head].queued;
+        uint64_t deadline =
+            (uint64_t) write_queue_depth * header->last_duration;
+        return 2 * age > deadline;
+    }
+}
+
+/* Checks whether major_block is still waiting to be written. */
+static bool write_pending(unsigned int major_block)
+{
+    unsigned int stripe = major_block_stripe(header, major_block);
+    off64_t offset =
+        (off64_t) major_block_offset(header, data_index, major_block);
+    for (unsigned int i = 0; i < write_queue_count; i ++)
+    {
+        const struct write_request *request =
+            &write_queue[(write_queue_head + i) % write_queue_depth];
+        if (!request->done  &&
+            request->stripe == stripe  &&  request->offset == offset)
+            return true;
+    }
+    return false;
+}
+
+/* Tops up the read bandwidth allowance.  We allow at most one second's worth
+ * of reading to accumulate, but always enough for the requested block. */
+static void update_read_tokens(uint64_t now, size_t length)
+{
+    if (read_bandwidth > 0  &&  now > read_token_time)
+    {
+        uint64_t elapsed = now - read_token_time;
+        if (elapsed > 1000000)
+            elapsed = 1000000;
+        read_tokens += 1e-6 * (double) elapsed * (double) read_bandwidth;
+        double limit = (double) (
+            read_bandwidth > length ? read_bandwidth : length);
+        if (read_tokens > limit)
+            read_tokens = limit;
+    }
+    read_token_time = now;
+}
+
+/* Returns 0 if the given reader can be admitted now, otherwise returns the
+ * number of microseconds to wait for bandwidth, or -1 if we must wait for the
+ * writer or another reader. */
+static long read_delay(
+    unsigned int ticket, unsigned int major_block, size_t length,
+    uint64_t now, bool *deferred)
+{
+    if (ticket != serving_read_ticket  ||  write_pending(major_block))
+        return -1;
+    else if (write_urgent(now))
+    {
+        *deferred = true;
+        return -1;
+    }
+    else
+    {
+        update_read_tokens(now, length);
+        if (read_bandwidth == 0  ||  read_tokens >= (double) length)
+            return 0;
+        else
+            return (long) (
+                1e6 * ((double) length - read_tokens) /
+                (double) read_bandwidth) + 1;
+    }
+}
+
+/* Records the admitted read for rate measurement. */
+static void account_read(uint64_t now, size_t length)
+{
+    if (read_bandwidth > 0)
+        read_tokens -= (double) length;
+    read_window_bytes += length;
+    if (now - read_window_start >= 1000000)
+    {
+        read_rate = read_window_bytes * 1000000 / (now - read_window_start);
+        read_window_start = now;
+        read_window_bytes = 0;
+    }
+}
+
+static void wait_read_delay(long delay)
+{
+    if (delay < 0)
         pwait(&writer_lock);
+    else
+    {
+        if (delay > 1000000)
+            delay = 1000000;
+        pwait_timeout(&writer_lock,
+            (int) (delay / 1000000), 1000 * (delay % 1000000));
+    }
+}
+
+/* Waits, with writer_lock held, until the reader can be admitted. */
+static void admit_reader(unsigned int major_block, size_t length)
+{
+    unsigned int ticket = next_read_ticket ++;
+    bool deferred = false;
+    read_waiters += 1;
+    for (;;)
+    {
+        uint64_t now = get_timestamp();
+        long delay = read_delay(ticket, major_block, length, now, &deferred);
+        if (delay == 0)
+        {
+            account_read(now, length);
+            break;
+        }
+        wait_read_delay(delay);
+    }
+    if (deferred)
+        deferred_reads += 1;
+    read_waiters -= 1;
+    serving_read_ticket += 1;
+    pbroadcast(&writer_lock);
+}
+
+void request_read(unsigned int major_block, size_t length)
+{
+    uint64_t start = start_latency();
+    LOCK(writer_lock);
+    admit_reader(major_block, length);
+    UNLOCK(writer_lock);
+    record_latency(LATENCY_READ_WAIT, start);
+}
+
+void get_io_status(struct io_status *status)
+{
+    uint64_t warmed = __atomic_load_n(&warm_up_done, __ATOMIC_RELAXED);
+    LOCK(writer_lock);
+    uint64_t now = get_timestamp();
+    *status = (struct io_status) {
+        .writes_pending = write_queue_count,
+        .write_queue_depth = write_queue_depth,
+        .write_urgent = write_urgent(now),
+        .read_waiters = read_waiters,
+        .read_rate =
+            now - read_window_start > 2000000 ? 0 : read_rate,
+        .read_bandwidth = read_bandwidth,
+        .deferred_reads = deferred_reads,
+        .warm_up_done = warmed,
+        .warm_up_total = warm_up_total,
+    };
     UNLOCK(writer_lock);
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Warm-up of in memory data. */
+
+/* After a restart the index and DD area are only faulted in from disk as they
+ * are touched, so the first overview requests are very slow.  To avoid this a
+ * few background threads read the whole area in while the archiver carries on
+ * normally.  The work is divided into units: first the index, then segments of
+ * major blocks, starting with the most recent and working backwards, each
+ * covering the corresponding DD and tier data for every id. */
+
+/* Each segment covers about this many bytes of DD data for each id. */
+#define WARM_UP_SEGMENT_SIZE    (1 << 20)
+
+static pthread_t *warm_up_ids;
+static unsigned int warm_up_segment_blocks; // Major blocks in each segment
+static unsigned int warm_up_units;          // Index plus number of segments
+static unsigned int warm_up_first_segment;  // Segment holding current block
+static unsigned int warm_up_next_unit;      // Next unit to be warmed up
+static unsigned int warm_up_units_done;
+static uint64_t warm_up_start;              // Time warm-up started
+
+
+/* Asks for the given area to be read in and then touches every page to make
+ * sure it's mapped. */
+static void warm_up_range(const void *start, size_t length)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t) start & ~(page_size - 1);
+    uintptr_t end = (uintptr_t) start + length;
+    IGNORE(TEST_IO(madvise((void *) first, end - first, MADV_WILLNEED)));
+    for (uintptr_t page = first; writer_running  &&  page < end;
+         page += page_size)
+        (void) *(volatile const char *) page;
+    __atomic_add_fetch(&warm_up_done, length, __ATOMIC_RELAXED);
+}
+
+
+/* Warms up the DD data for major blocks first to end in every id, together
+ * with the corresponding tier data. */
+static void warm_up_segment(unsigned int first, unsigned int end)
+{
+    size_t id_count = header->archive_mask_count;
+    uint64_t dd_first = (uint64_t) first * header->dd_sample_count;
+    uint64_t dd_end = (uint64_t) end * header->dd_sample_count;
+    for (size_t i = 0; writer_running  &&  i < id_count; i ++)
+        warm_up_range(
+            dd_data + i * header->dd_total_count + dd_first,
+            (size_t) (dd_end - dd_first) * sizeof(struct decimated_data));
+
+    for (unsigned int t = 0; t < header->tier_count; t ++)
+    {
+        unsigned int log2 = tier_decimation_log2(header, t);
+        const struct decimated_data *tier =
+            dd_data + tier_data_offset(header, t);
+        uint64_t tier_first = dd_first >> log2;
+        uint64_t tier_end = dd_end >> log2;
+        for (size_t i = 0; writer_running  &&  i < id_count; i ++)
+            warm_up_range(
+                tier + i * header->tier_total_count[t] + tier_first,
+                (size_t) (tier_end - tier_first) *
+                    sizeof(struct decimated_data));
+    }
+}
+
+
+static void *warm_up_thread(void *context)
+{
+    unsigned int segments = warm_up_units - 1;
+    unsigned int unit;
+    while (writer_running  &&
+        (unit = __atomic_fetch_add(
+            &warm_up_next_unit, 1, __ATOMIC_RELAXED)) < warm_up_units)
+    {
+        if (unit == 0)
+            warm_up_range(data_index, (size_t) header->index_data_size);
+        else
+        {
+            /* Work backwards from the segment holding the current block. */
+            unsigned int segment =
+                (warm_up_first_segment + segments - (unit - 1)) % segments;
+            unsigned int first = segment * warm_up_segment_blocks;
+            unsigned int end = first + warm_up_segment_blocks;
+            if (end > header->major_block_count)
+                end = header->major_block_count;
+            warm_up_segment(first, end);
+        }
+
+        if (__atomic_add_fetch(&warm_up_units_done, 1, __ATOMIC_RELAXED) ==
+                warm_up_units)
+            log_message("In memory data warmed up in %.1f s",
+                1e-6 * (double) (get_timestamp() - warm_up_start));
+    }
+    return NULL;
+}
+
+
+/* If DD data is paged through the DD cache only the index is warmed up. */
+static bool start_warm_up(void)
+{
+    bool paged = dd_cache_enabled();
+    uint64_t dd_size = header->dd_total_count;
+    for (unsigned int t = 0; t < header->tier_count; t ++)
+        dd_size += header->tier_total_count[t];
+    dd_size *= header->archive_mask_count * sizeof(struct decimated_data);
+    warm_up_total = header->index_data_size + (paged ? 0 : dd_size);
+
+    unsigned int block_bytes =
+        header->dd_sample_count * (unsigned int) sizeof(struct decimated_data);
+    warm_up_segment_blocks = WARM_UP_SEGMENT_SIZE / block_bytes;
+    if (warm_up_segment_blocks == 0)
+        warm_up_segment_blocks = 1;
+    unsigned int segments =
+        (header->major_block_count + warm_up_segment_blocks - 1) /
+        warm_up_segment_blocks;
+    warm_up_units = paged ? 1 : 1 + segments;
+    warm_up_first_segment =
+        header->current_major_block / warm_up_segment_blocks;
+    warm_up_start = get_timestamp();
+
+    warm_up_ids = calloc(warm_up_threads, sizeof(pthread_t));
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < warm_up_threads; i ++)
+        ok = TEST_0(pthread_create(
+            &warm_up_ids[i], NULL, warm_up_thread, NULL));
+    return ok;
+}
+
+
+static void stop_warm_up(void)
+{
+    for (unsigned int i = 0; i < warm_up_threads; i ++)
+        ASSERT_0(pthread_join(warm_up_ids[i], NULL));
+    free(warm_up_ids);
+}
+
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Data processing thread. */
 
@@ -237,15 +624,23 @@ bool disk_writer_enabled(void)
 /* Disk writing initialisation and startup.                                  */
 
 static pthread_t transform_id;
-static pthread_t writer_id;
+static pthread_t writer_ids[MAX_STRIPES];
 
 
 bool start_disk_writer(struct buffer *buffer)
 {
     reader = open_reader(buffer, true);
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < stripe_count(header); i ++)
+        ok = create_pipeline_thread(
+            THREAD_WRITER, &writer_ids[i], writer_thread,
+            (void *) (uintptr_t) i);
     return
-        TEST_0(pthread_create(&writer_id, NULL, writer_thread, NULL))  &&
-        TEST_0(pthread_create(&transform_id, NULL, transform_thread, NULL));
+        ok  &&
+        start_transform_workers()  &&
+        create_pipeline_thread(
+            THREAD_TRANSFORM, &transform_id, transform_thread, NULL)  &&
+        IF_(warm_up_threads > 0, start_warm_up());
 }
 
 
@@ -255,7 +650,11 @@ void terminate_disk_writer(void)
     stop_writer_thread();
     interrupt_reader(reader);
     ASSERT_0(pthread_join(transform_id, NULL));
-    ASSERT_0(pthread_join(writer_id, NULL));
+    terminate_transform_workers();
+    for (unsigned int i = 0; i < stripe_count(header); i ++)
+        ASSERT_0(pthread_join(writer_ids[i], NULL));
+    if (warm_up_threads > 0)
+        stop_warm_up();
     close_reader(reader);
     close_disk();
 
@@ -28,11 +28,18 @@
  */
 
 /* First stage of disk writer initialisation: opens the archive file and loads
- * the header into memory.  Can be called before initialising buffers. */
+ * the header into memory.  Can be called before initialising buffers.  Block
+ * processing is shared among transform_threads threads, up to
+ * write_queue_depth blocks can be queued for writing, and reading from disk is
+ * limited to read_bandwidth bytes per second unless this is zero.  Once
+ * started, warm_up_threads threads read the in memory data in from disk in the
+ * background, most recent first. */
 bool initialise_disk_writer(
     const char *file_name,
     uint32_t *input_block_size, uint32_t *fa_entry_count,
-    unsigned int events_fa_id);
+    unsigned int events_fa_id, unsigned int transform_threads,
+    unsigned int write_queue_depth, uint64_t read_bandwidth,
+    unsigned int warm_up_threads);
 /* Starts writing files to disk.  Must be called after initialising the buffer
  * layer. */
 bool start_disk_writer(struct buffer *buffer);
@@ -47,11 +54,28 @@ bool disk_writer_enabled(void);
 
 /* Methods for access to writer thread. */
 
-/* Asks the writer thread to write out the given block.  If a previously
- * requested write is still in progress then this blocks until the write has
- * completed. */
-void schedule_write(off64_t offset, void *block, size_t length);
+/* Asks the writer thread for the given stripe to write out the given block at
+ * offset into the stripe.  If the write queue is full then this blocks until
+ * the oldest queued write has completed. */
+void schedule_write(
+    unsigned int stripe, off64_t offset, void *block, size_t length);
 
-/* Requests permission to perform a read, blocks while an outstanding write is
- * in progress. */
-void request_read(void);
+/* Requests permission to read length bytes from the given major block.  Blocks
+ * while that block is waiting to be written, while the writer needs the disk to
+ * meet its deadline, while earlier readers are waiting, or until enough read
+ * bandwidth is available. */
+void request_read(unsigned int major_block, size_t length);
+
+/* Snapshot of disk scheduler state for reporting. */
+struct io_status {
+    unsigned int writes_pending;    // Major blocks waiting to be written
+    unsigned int write_queue_depth; // Maximum number of queued writes
+    bool write_urgent;              // Set if readers are held back for writer
+    unsigned int read_waiters;      // Readers waiting to be admitted
+    uint64_t read_rate;             // Measured read rate in bytes per second
+    uint64_t read_bandwidth;        // Configured read limit, or 0 for none
+    uint64_t deferred_reads;        // Reads held back for the writer
+    uint64_t warm_up_done;          // Bytes of in memory data warmed up
+    uint64_t warm_up_total;         // Total bytes of in memory data
+};
+void get_io_status(struct io_status *status);
@@ -0,0 +1,829 @@
+/* Offline bulk export of archived data.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Exports a range of archived data for selected ids straight from the archive
+ * file into one raw column file per id, without going through the archiver.
+ * The header, index and DD data are mapped as by the archiver itself, and the
+ * major blocks are divided among a number of threads, each reading runs of
+ * adjacent columns with large O_DIRECT reads. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "disk.h"
+#include "parse.h"
+#include "compress.h"
+
+
+/* If the archiver is running the oldest blocks are about to be overwritten, so
+ * we leave this many of them alone. */
+#define INDEX_SKIP      2
+
+/* O_DIRECT transfers must be aligned to this. */
+#define DIRECT_ALIGN    4096
+
+/* Runs of adjacent columns are read in transfers of up to this size. */
+#define MAX_READ_SIZE   (32 << 20)
+
+
+/*****************************************************************************/
+/*                               Option Parsing                              */
+/*****************************************************************************/
+
+enum export_type { EXPORT_FA, EXPORT_D, EXPORT_DD };
+
+static char *argv0;
+
+static const char *archive_name;
+static const char *output_dir;
+static const char *mask_string;
+static enum export_type export_type = EXPORT_FA;
+static unsigned int thread_count = 4;
+static bool start_given = false;
+static bool end_given = false;
+static uint64_t start_time;
+static uint64_t end_time;
+static bool quiet = false;
+
+
+static void usage(void)
+{
+    printf(
+"Usage: %s [options] <archive> <output-dir>\n"
+"\n"
+"Exports archived data straight from the archive file, writing one raw column\n"
+"file for each exported FA id into <output-dir>.\n"
+"\n"
+"Options:\n"
+"   -s:  Specify FA ids to export, default all archived ids.\n"
+"   -f:  Data to export: F for full rate data (default), D for decimated data\n"
+"        or DD for double decimated data.\n"
+"   -b:  Start time as yyyy-mm-ddThh:mm:ss[.nnn][Z], default earliest data.\n"
+"   -e:  End time in the same format, default latest data.\n"
+"   -t:  Number of export threads, default %u.\n"
+"   -q   Don't report export summary.\n"
+        , argv0, thread_count);
+}
+
+
+static bool parse_export_type(const char **string, enum export_type *type)
+{
+    if (read_char(string, 'F'))
+        *type = EXPORT_FA;
+    else if (read_char(string, 'D'))
+        *type = read_char(string, 'D') ? EXPORT_DD : EXPORT_D;
+    else
+        return FAIL_("Expected F, D or DD");
+    return true;
+}
+
+
+static bool parse_export_time(const char **string, uint64_t *timestamp)
+{
+    struct timespec ts;
+    return
+        parse_datetime(string, &ts)  &&
+        DO_(*timestamp =
+            (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000);
+}
+
+
+static bool process_opts(int *argc, char ***argv)
+{
+    argv0 = (*argv)[0];
+    bool ok = true;
+    while (ok)
+    {
+        switch (getopt(*argc, *argv, "+hs:f:b:e:t:q"))
+        {
+            case 'h':
+                usage();
+                exit(0);
+            case 's':   mask_string = optarg;                       break;
+            case 'f':
+                ok = DO_PARSE("export type",
+                    parse_export_type, optarg, &export_type);
+                break;
+            case 'b':
+                ok = DO_PARSE("start time",
+                    parse_export_time, optarg, &start_time);
+                start_given = true;
+                break;
+            case 'e':
+                ok = DO_PARSE("end time",
+                    parse_export_time, optarg, &end_time);
+                end_given = true;
+                break;
+            case 't':
+                ok =
+                    DO_PARSE("thread count",
+                        parse_uint, optarg, &thread_count)  &&
+                    TEST_OK_(thread_count > 0, "Need at least one thread");
+                break;
+            case 'q':   quiet = true;                               break;
+            case '?':
+            default:
+                fprintf(stderr, "Try `%s -h` for usage\n", argv0);
+                return false;
+            case -1:
+                *argc -= optind;
+                *argv += optind;
+                return true;
+        }
+    }
+    return false;
+}
+
+
+static bool process_args(int argc, char **argv)
+{
+    return
+        process_opts(&argc, &argv)  &&
+        TEST_OK_(argc == 2, "Wrong number of arguments.  Try -h for help")  &&
+        DO_(archive_name = argv[0]; output_dir = argv[1])  &&
+        TEST_OK_(!start_given  ||  !end_given  ||  start_time < end_time,
+            "Start time must precede end time");
+}
+
+
+
+/*****************************************************************************/
+/*                              Archive Access                               */
+/*****************************************************************************/
+
+static int archive_fds[MAX_STRIPES];
+static struct disk_header *header;
+static struct data_index *data_index;
+static const struct decimated_data *dd_data;
+/* Set if the archiver is running on this archive. */
+static bool archive_live;
+
+
+/* Opens the archive and all its stripes for reading with O_DIRECT, falling
+ * back to ordinary reads on file systems which don't support it. */
+static bool open_archive(void)
+{
+    int flags = O_RDONLY | O_DIRECT | O_LARGEFILE;
+    archive_fds[0] = open(archive_name, flags);
+    if (archive_fds[0] < 0  &&  errno == EINVAL)
+    {
+        flags &= ~O_DIRECT;
+        archive_fds[0] = open(archive_name, flags);
+    }
+    uint64_t file_size;
+    return
+        TEST_IO_(archive_fds[0],
+            "Unable to open archive \"%s\"", archive_name)  &&
+        /* The archiver holds an exclusive lock on its archive. */
+        DO_(archive_live = flock(archive_fds[0], LOCK_SH | LOCK_NB) != 0)  &&
+        /* The header is mapped privately so that validate_header() can
+         * upgrade an older header without touching the archive.  A live
+         * archive has already been upgraded by the archiver, so the mapping
+         * is never written and continues to track the archiver. */
+        TEST_IO(
+            header = mmap(NULL, DISK_HEADER_SIZE,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE, archive_fds[0], 0))  &&
+        get_filesize(archive_fds[0], &file_size)  &&
+        validate_header(header, file_size)  &&
+        open_stripes(header, flags, false, archive_fds)  &&
+        TEST_IO(
+            data_index = mmap(NULL, (size_t) header->index_data_size,
+                PROT_READ, MAP_SHARED, archive_fds[0],
+                (off_t) header->index_data_start))  &&
+        TEST_IO(
+            dd_data = mmap(NULL, (size_t) header->dd_data_size,
+                PROT_READ, MAP_SHARED, archive_fds[0],
+                (off_t) header->dd_data_start));
+}
+
+
+/* Reads at least length bytes from offset, returns false on error or if the
+ * file is too short. */
+static bool read_at(int file, void *buffer, size_t length, uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t rx = pread(file, buffer, length, (off_t) offset);
+        if (!TEST_IO(rx)  ||  !TEST_OK_(rx > 0, "Unexpected end of archive"))
+            return false;
+        buffer += rx;
+        length -= (size_t) rx;
+        offset += (uint64_t) rx;
+    }
+    return true;
+}
+
+static bool write_at(int file, const void *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t tx = pwrite(file, buffer, length, offset);
+        if (!TEST_IO(tx))
+            return false;
+        buffer += tx;
+        length -= (size_t) tx;
+        offset += tx;
+    }
+    return true;
+}
+
+
+
+/*****************************************************************************/
+/*                              Export Planning                              */
+/*****************************************************************************/
+
+/* Each exported id has its archive column and output file. */
+static unsigned int id_count;
+static unsigned int export_ids[MAX_FA_ENTRY_COUNT];
+static int output_fds[MAX_FA_ENTRY_COUNT];
+
+/* Runs of adjacent archive columns, split so that each run can be read in a
+ * single transfer.  Here input is the archive column and output the index
+ * into export_ids. */
+static unsigned int run_count;
+static struct id_run column_runs[MAX_FA_ENTRY_COUNT];
+
+/* Each exported block records a snapshot of its index entry, and for a
+ * compressed archive of its extent and column offsets, together with the range
+ * of samples to be exported and where they go in the output files. */
+struct export_block {
+    unsigned int major_block;
+    unsigned int position;          // Position counting from oldest block
+    struct data_index index;
+    struct block_extent extent;
+    uint32_t *columns;
+    unsigned int first;             // First sample exported
+    unsigned int count;             // Number of samples exported
+    uint64_t output;                // Sample offset into output files
+};
+
+static unsigned int block_count;
+static struct export_block *blocks;
+static uint32_t *column_snapshot;
+static uint64_t total_samples;
+
+
+/* Number of samples and size of each sample in a major block of the selected
+ * type. */
+static unsigned int block_samples(void)
+{
+    switch (export_type)
+    {
+        case EXPORT_FA: return header->major_sample_count;
+        case EXPORT_D:  return header->d_sample_count;
+        case EXPORT_DD: return header->dd_sample_count;
+        default:        ASSERT_FAIL();
+    }
+}
+
+static size_t sample_size(void)
+{
+    return export_type == EXPORT_FA ?
+        FA_ENTRY_SIZE : sizeof(struct decimated_data);
+}
+
+/* Size of a single column of the selected type as stored in a major block. */
+static size_t column_size(void)
+{
+    return block_samples() * sample_size();
+}
+
+
+/* Converts the selected ids into archive columns. */
+static bool compute_export_ids(void)
+{
+    struct filter_mask mask;
+    unsigned int fa_entry_count = header->fa_entry_count;
+    bool ok = IF_ELSE(mask_string,
+        DO_PARSE("id mask", parse_mask, mask_string, fa_entry_count, &mask),
+        DO_(mask = header->archive_mask));
+
+    unsigned int column = 0;
+    for (unsigned int id = 0; ok  &&  id < fa_entry_count; id ++)
+    {
+        bool archived = test_mask_bit(&header->archive_mask, id);
+        if (test_mask_bit(&mask, id))
+        {
+            ok = TEST_OK_(archived, "FA id %u not in archive", id);
+            export_ids[id_count] = id;
+            column_runs[id_count] = (struct id_run) {
+                .input = column, .output = id_count, .count = 1 };
+            id_count += 1;
+        }
+        if (archived)
+            column += 1;
+    }
+
+    /* Merge adjacent columns into runs, so long as the uncompressed run fits
+     * into a single transfer; a packed run is never longer. */
+    unsigned int max_run = MAX_READ_SIZE / (unsigned int) column_size();
+    if (max_run == 0)
+        max_run = 1;
+    for (unsigned int i = 0; ok  &&  i < id_count; i ++)
+    {
+        struct id_run *run = run_count > 0 ? &column_runs[run_count - 1] : NULL;
+        if (run  &&  run->count < max_run  &&
+            run->input + run->count == column_runs[i].input)
+            run->count += 1;
+        else
+            column_runs[run_count++] = column_runs[i];
+    }
+    return ok;
+}
+
+
+/* Returns the index of the first sample of a block of samples starting at
+ * timestamp no earlier than the given time, assuming samples are equally
+ * spaced over the block duration. */
+static unsigned int sample_at(
+    const struct data_index *ix, uint64_t timestamp, unsigned int samples)
+{
+    if (timestamp <= ix->timestamp)
+        return 0;
+    else if (timestamp - ix->timestamp >= ix->duration)
+        return samples;
+    else
+        return (unsigned int) (
+            ((timestamp - ix->timestamp) * samples + ix->duration - 1) /
+            ix->duration);
+}
+
+
+static bool block_valid(unsigned int major_block)
+{
+    return
+        data_index[major_block].duration > 0  &&
+        IF_(header->fa_format != FA_FORMAT_RAW,
+            block_extents(header, data_index)[major_block].length > 0);
+}
+
+
+/* Walks the archive from the oldest block to the newest complete block and
+ * records every block overlapping the requested time range. */
+static bool plan_export(void)
+{
+    unsigned int N = header->major_block_count;
+    unsigned int current = header->current_major_block;
+    unsigned int samples = block_samples();
+    unsigned int skip = archive_live ? INDEX_SKIP : 0;
+    unsigned int M = header->archive_mask_count;
+    bool packed = header->fa_format != FA_FORMAT_RAW;
+
+    bool ok =
+        TEST_NULL(blocks = calloc(N, sizeof(struct export_block)))  &&
+        IF_(packed  &&  export_type == EXPORT_FA,
+            TEST_NULL(column_snapshot =
+                calloc((size_t) N * M, sizeof(uint32_t))));
+    uint32_t *columns = column_snapshot;
+    for (unsigned int position = 0; ok  &&  position + 1 < N; position ++)
+    {
+        unsigned int major_block = (current + 1 + position) % N;
+        if (!block_valid(major_block))
+            continue;
+        else if (skip > 0)
+        {
+            skip -= 1;
+            continue;
+        }
+
+        struct export_block *block = &blocks[block_count];
+        *block = (struct export_block) {
+            .major_block = major_block,
+            .position = position,
+            .index = data_index[major_block],
+        };
+        unsigned int first = start_given ?
+            sample_at(&block->index, start_time, samples) : 0;
+        unsigned int end = end_given ?
+            sample_at(&block->index, end_time, samples) : samples;
+        if (first < end)
+        {
+            block->first = first;
+            block->count = end - first;
+            block->output = total_samples;
+            if (packed)
+                block->extent = block_extents(header, data_index)[major_block];
+            if (packed  &&  export_type == EXPORT_FA)
+            {
+                block->columns = columns;
+                memcpy(columns, column_offsets(header, data_index, major_block),
+                    M * sizeof(uint32_t));
+                columns += M;
+            }
+            total_samples += block->count;
+            block_count += 1;
+        }
+    }
+    return
+        ok  &&
+        TEST_OK_(block_count > 0, "No archived data in requested range");
+}
+
+
+/* Checks that none of the exported blocks was overwritten by the archiver
+ * while we were reading it. */
+static bool check_overwrite(void)
+{
+    unsigned int N = header->major_block_count;
+    const struct export_block *oldest = &blocks[0];
+    /* Number of blocks written since we started, given that the oldest block
+     * was position blocks after the current block at the time. */
+    unsigned int advanced =
+        (header->current_major_block + N + 1 + oldest->position -
+            oldest->major_block) % N;
+    bool ok = advanced <= oldest->position;
+    for (unsigned int i = 0; ok  &&  i < block_count; i ++)
+        ok =
+            data_index[blocks[i].major_block].timestamp ==
+                blocks[i].index.timestamp  &&
+            block_valid(blocks[i].major_block);
+    return TEST_OK_(ok, "Archive overwritten during export");
+}
+
+
+
+/*****************************************************************************/
+/*                                 Exporting                                 */
+/*****************************************************************************/
+
+/* Per thread buffers. */
+struct scratch {
+    void *read;                     // Aligned buffer for O_DIRECT reads
+    size_t read_size;
+    void *convert;                  // Unpacked FA column or D samples
+};
+
+
+/* Reads length bytes from offset in the given file, rounding the transfer out
+ * to whole aligned pages for O_DIRECT, and returns a pointer to the requested
+ * data in the scratch buffer. */
+static bool read_direct(
+    int file, uint64_t offset, size_t length,
+    struct scratch *scratch, const void **data)
+{
+    uint64_t start = offset & ~(uint64_t) (DIRECT_ALIGN - 1);
+    size_t span = (size_t) (offset - start) + length;
+    span = (span + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+    return
+        TEST_OK_(span <= scratch->read_size, "Corrupt block extent")  &&
+        read_at(file, scratch->read, span, start)  &&
+        DO_(*data = scratch->read + (offset - start));
+}
+
+
+/* Writes the exported samples of one column to its output file. */
+static bool write_column(
+    const struct export_block *block, unsigned int output, const void *column)
+{
+    size_t size = sample_size();
+    return write_at(output_fds[output],
+        column + block->first * size, block->count * size,
+        (off_t) (block->output * size));
+}
+
+
+/* Offset into its stripe of the given block. */
+static uint64_t block_offset(const struct export_block *block)
+{
+    if (header->fa_format == FA_FORMAT_RAW)
+        return major_block_offset(header, data_index, block->major_block);
+    else
+        return header->major_data_start + block->extent.offset;
+}
+
+static int block_file(const struct export_block *block)
+{
+    return archive_fds[major_block_stripe(header, block->major_block)];
+}
+
+
+/* Full rate data stored uncompressed. */
+static bool export_fa_run(
+    const struct export_block *block, const struct id_run *run,
+    struct scratch *scratch)
+{
+    size_t size = column_size();
+    const void *data;
+    bool ok = read_direct(block_file(block),
+        block_offset(block) + run->input * size, run->count * size,
+        scratch, &data);
+    for (unsigned int i = 0; ok  &&  i < run->count; i ++)
+        ok = write_column(block, run->output + i, data + i * size);
+    return ok;
+}
+
+
+/* Returns the offset of a packed column from the start of its block. */
+static uint32_t packed_column(
+    const struct export_block *block, unsigned int column)
+{
+    return column < header->archive_mask_count ?
+        block->columns[column] : block->extent.data_length;
+}
+
+/* Full rate data stored packed: the run is read in one go and each column
+ * unpacked in turn. */
+static bool export_packed_fa_run(
+    const struct export_block *block, const struct id_run *run,
+    struct scratch *scratch)
+{
+    uint32_t start = packed_column(block, run->input);
+    uint32_t end = packed_column(block, run->input + run->count);
+    const void *data;
+    bool ok =
+        TEST_OK_(start <= end  &&  end <= block->extent.length,
+            "Corrupt block extent")  &&
+        read_direct(block_file(block),
+            block_offset(block) + start, end - start, scratch, &data);
+    for (unsigned int i = 0; ok  &&  i < run->count; i ++)
+    {
+        uint32_t column = packed_column(block, run->input + i);
+        uint32_t length = packed_column(block, run->input + i + 1) - column;
+        ok =
+            unpack_fa_block(data + (column - start), length,
+                header->major_sample_count, scratch->convert)  &&
+            write_column(block, run->output + i, scratch->convert);
+    }
+    return ok;
+}
+
+
+/* Reassembles D samples from separately stored field columns. */
+static const void *interleave_d_fields(
+    const struct export_block *block, const struct fa_entry *fields,
+    struct scratch *scratch)
+{
+    unsigned int samples = header->d_sample_count;
+    struct decimated_data *output = scratch->convert;
+    for (unsigned int i = block->first; i < block->first + block->count; i ++)
+        output[i] = (struct decimated_data) {
+            .mean = fields[i],
+            .min  = fields[samples + i],
+            .max  = fields[2 * samples + i],
+            .std  = fields[3 * samples + i],
+        };
+    return output;
+}
+
+/* Decimated data follows the FA data in an uncompressed archive and precedes
+ * it in a compressed archive. */
+static bool export_d_run(
+    const struct export_block *block, const struct id_run *run,
+    struct scratch *scratch)
+{
+    uint64_t offset = block_offset(block);
+    if (header->fa_format == FA_FORMAT_RAW)
+        offset += (uint64_t) header->archive_mask_count *
+            header->major_sample_count * FA_ENTRY_SIZE;
+
+    size_t size = column_size();
+    const void *data;
+    bool ok = read_direct(block_file(block),
+        offset + run->input * size, run->count * size, scratch, &data);
+    for (unsigned int i = 0; ok  &&  i < run->count; i ++)
+    {
+        const void *column = data + i * size;
+        if (header->d_format == D_FORMAT_FIELDS)
+            column = interleave_d_fields(block, column, scratch);
+        ok = write_column(block, run->output + i, column);
+    }
+    return ok;
+}
+
+
+/* Double decimated data is already mapped into memory. */
+static bool export_dd_run(
+    const struct export_block *block, const struct id_run *run,
+    struct scratch *scratch)
+{
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < run->count; i ++)
+        ok = write_column(block, run->output + i,
+            dd_data + (size_t) (run->input + i) * header->dd_total_count +
+                (size_t) block->major_block * header->dd_sample_count);
+    return ok;
+}
+
+
+static bool export_block(
+    const struct export_block *block, struct scratch *scratch)
+{
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < run_count; i ++)
+        switch (export_type)
+        {
+            case EXPORT_FA:
+                if (header->fa_format == FA_FORMAT_RAW)
+                    ok = export_fa_run(block, &column_runs[i], scratch);
+                else
+                    ok = export_packed_fa_run(block, &column_runs[i], scratch);
+                break;
+            case EXPORT_D:
+                ok = export_d_run(block, &column_runs[i], scratch);
+                break;
+            case EXPORT_DD:
+                ok = export_dd_run(block, &column_runs[i], scratch);
+                break;
+        }
+    return ok;
+}
+
+
+/* Blocks are handed out to the export threads in turn.  After any failure the
+ * remaining blocks are abandoned. */
+static unsigned int next_block;
+static bool export_failed;
+
+static void *export_thread(void *context)
+{
+    unsigned int max_run = 0;
+    for (unsigned int i = 0; i < run_count; i ++)
+        if (column_runs[i].count > max_run)
+            max_run = column_runs[i].count;
+
+    struct scratch scratch = {
+        .read_size = max_run * column_size() + 2 * DIRECT_ALIGN };
+    bool ok =
+        TEST_0(posix_memalign(&scratch.read, DIRECT_ALIGN, scratch.read_size))
+        &&  TEST_NULL(scratch.convert = malloc(column_size()));
+    while (ok  &&  !__atomic_load_n(&export_failed, __ATOMIC_RELAXED))
+    {
+        unsigned int i = __atomic_fetch_add(&next_block, 1, __ATOMIC_RELAXED);
+        if (i >= block_count)
+            break;
+        ok = export_block(&blocks[i], &scratch);
+    }
+    if (!ok)
+        __atomic_store_n(&export_failed, true, __ATOMIC_RELAXED);
+
+    free(scratch.read);
+    free(scratch.convert);
+    return NULL;
+}
+
+
+static bool run_export_threads(void)
+{
+    pthread_t threads[thread_count];
+    unsigned int started = 0;
+    bool ok = true;
+    for (; ok  &&  started < thread_count; started ++)
+        ok = TEST_0(pthread_create(
+            &threads[started], NULL, export_thread, NULL));
+    if (!ok)
+    {
+        started -= 1;
+        __atomic_store_n(&export_failed, true, __ATOMIC_RELAXED);
+    }
+    for (unsigned int i = 0; i < started; i ++)
+        ASSERT_0(pthread_join(threads[i], NULL));
+    return ok  &&  !export_failed;
+}
+
+
+
+/*****************************************************************************/
+/*                               Output Files                                */
+/*****************************************************************************/
+
+static const char *type_name(void)
+{
+    static const char *names[] = {
+        [EXPORT_FA] = "fa", [EXPORT_D] = "d", [EXPORT_DD] = "dd" };
+    return names[export_type];
+}
+
+
+static bool open_output_files(void)
+{
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < id_count; i ++)
+    {
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s/%s-%u.raw",
+            output_dir, type_name(), export_ids[i]);
+        ok = TEST_IO_(
+            output_fds[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0664),
+            "Unable to create \"%s\"", name);
+    }
+    return ok;
+}
+
+
+/* The index file lists each exported block, one line per block, recording
+ * where its samples start in the column files and its index entry. */
+static bool write_index_file(void)
+{
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s/%s-index.txt", output_dir, type_name());
+    FILE *index;
+    bool ok = TEST_NULL_(index = fopen(name, "w"), "Unable to create \"%s\"",
+        name);
+    if (ok)
+    {
+        fprintf(index,
+            "# offset first count timestamp duration id_zero\n");
+        for (unsigned int i = 0; i < block_count; i ++)
+        {
+            const struct export_block *block = &blocks[i];
+            fprintf(index, "%"PRIu64" %u %u %"PRIu64" %u %u\n",
+                block->output, block->first, block->count,
+                block->index.timestamp, block->index.duration,
+                block->index.id_zero);
+        }
+        ok = TEST_IO(fclose(index));
+    }
+    return ok;
+}
+
+
+static bool close_output_files(void)
+{
+    bool ok = true;
+    for (unsigned int i = 0; i < id_count; i ++)
+        ok = TEST_IO(close(output_fds[i]))  &&  ok;
+    return ok;
+}
+
+
+static double get_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (!process_args(argc, argv))
+        /* For argument errors return 1. */
+        return 1;
+
+    double start = get_seconds();
+    bool ok =
+        open_archive()  &&
+        compute_export_ids()  &&
+        plan_export()  &&
+        open_output_files()  &&
+        FINALLY(
+            run_export_threads(),
+            close_output_files())  &&
+        IF_(archive_live, check_overwrite())  &&
+        write_index_file();
+
+    if (ok  &&  !quiet)
+    {
+        double seconds = get_seconds() - start;
+        double bytes = (double) total_samples * (double) sample_size() * id_count;
+        printf("Exported %"PRIu64" samples of %u ids from %u blocks "
+            "in %.2f s, %.1f MB/s\n",
+            total_samples, id_count, block_count, seconds,
+            bytes / seconds / 1e6);
+    }
+    return ok ? 0 : 2;
+}
@@ -28,6 +28,8 @@
  *      michael.abbott@diamond.ac.uk
  */
 
-/* Sniffer interface for gigabit ethernet. */
+/* Sniffer interface for gigabit ethernet.  If interface is NULL datagrams are
+ * received on a normal UDP socket, otherwise they are captured through a packet
+ * ring on the named interface, which needs CAP_NET_RAW. */
 const struct sniffer_context *initialise_gigabit(
-    unsigned int fa_entry_count, int port);
+    unsigned int fa_entry_count, int port, const char *interface);
@@ -52,6 +52,75 @@
 #include "mask.h"
 
 
+unsigned int compute_id_runs(
+    const struct filter_mask *mask, unsigned int fa_entry_count,
+    unsigned int exclude_id, struct id_run runs[])
+{
+    unsigned int run_count = 0;
+    unsigned int output = 0;
+    for (unsigned int id = 0; id < fa_entry_count; id ++)
+        if (test_mask_bit(mask, id))
+        {
+            /* A run is only extended if both input and output ids are
+             * consecutive, so an excluded id also breaks the run. */
+            struct id_run *last = run_count > 0 ? &runs[run_count - 1] : NULL;
+            if (id != exclude_id)
+            {
+                if (last  &&  last->input + last->count == id  &&
+                    last->output + last->count == output)
+                    last->count += 1;
+                else
+                    runs[run_count++] = (struct id_run) {
+                        .input = id, .output = output, .count = 1 };
+            }
+            output += 1;
+        }
+    return run_count;
+}
+
+
+unsigned int compute_index_runs(
+    const uint16_t index[], unsigned int count, struct id_run runs[])
+{
+    unsigned int run_count = 0;
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        struct id_run *last = run_count > 0 ? &runs[run_count - 1] : NULL;
+        if (last  &&  last->input + last->count == index[i])
+            last->count += 1;
+        else
+            runs[run_count++] = (struct id_run) {
+                .input = index[i], .output = i, .count = 1 };
+    }
+    return run_count;
+}
+
+
+void gather_frames(
+    const struct id_run runs[], unsigned int run_count, size_t entry_size,
+    const void *input, size_t input_frame_size,
+    void *output, size_t output_frame_size, unsigned int frame_count)
+{
+    for (unsigned int f = 0; f < frame_count; f ++)
+    {
+        for (unsigned int i = 0; i < run_count; i ++)
+        {
+            const struct id_run *run = &runs[i];
+            void *to = output + run->output * entry_size;
+            const void *from = input + run->input * entry_size;
+            /* Isolated FA entries are common enough to be worth a fixed size
+             * copy, which compiles to a single move. */
+            if (run->count == 1  &&  entry_size == FA_ENTRY_SIZE)
+                memcpy(to, from, FA_ENTRY_SIZE);
+            else
+                memcpy(to, from, run->count * entry_size);
+        }
+        input += input_frame_size;
+        output += output_frame_size;
+    }
+}
+
+
 unsigned int count_mask_bits(
     const struct filter_mask *mask, unsigned int fa_entry_count)
 {
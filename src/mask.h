@@ -85,6 +85,56 @@ bool parse_mask(
     const char **string, unsigned int fa_entry_count, struct filter_mask *mask);
 
 
+/* A mask is compiled into a gather plan, a list of runs of consecutive ids, for
+ * extracting the selected ids from each frame.  This replaces testing the mask
+ * bit by bit for every frame by a handful of block copies. */
+
+/* A run of consecutive selected ids. */
+struct id_run {
+    unsigned int input;         // First input id in this run
+    unsigned int output;        // Output index of first id
+    unsigned int count;         // Number of consecutive ids in run
+};
+
+/* Computes the runs of consecutive ids in mask, omitting exclude_id (pass -1 to
+ * omit nothing).  The runs array must have room for fa_entry_count runs, and
+ * the number of runs is returned. */
+unsigned int compute_id_runs(
+    const struct filter_mask *mask, unsigned int fa_entry_count,
+    unsigned int exclude_id, struct id_run runs[]);
+
+/* Computes the runs of consecutive values in a list of count input indexes,
+ * where output i takes input index[i].  The runs array must have room for
+ * count runs, and the number of runs is returned. */
+unsigned int compute_index_runs(
+    const uint16_t index[], unsigned int count, struct id_run runs[]);
+
+/* Restricts run to output indexes in the range first_id to first_id+id_count-1,
+ * returning false if nothing is left. */
+static inline bool clip_id_run(
+    const struct id_run *run, unsigned int first_id, unsigned int id_count,
+    struct id_run *result)
+{
+    unsigned int start = run->output > first_id ? run->output : first_id;
+    unsigned int end = run->output + run->count;
+    if (end > first_id + id_count)
+        end = first_id + id_count;
+    *result = (struct id_run) {
+        .input = run->input + start - run->output,
+        .output = start,
+        .count = end > start ? end - start : 0 };
+    return end > start;
+}
+
+/* Copies frame_count frames from input to output following the given runs, for
+ * entries of entry_size bytes: each run copies count entries from entry input
+ * of each input frame to entry output of the corresponding output frame. */
+void gather_frames(
+    const struct id_run runs[], unsigned int run_count, size_t entry_size,
+    const void *input, size_t input_frame_size,
+    void *output, size_t output_frame_size, unsigned int frame_count);
+
+
 /* Loads table of FA ids from given file.  Can be called with NULL file name, in
  * which case the table is initialised to empty. */
 bool load_fa_ids(const char *filename, uint32_t fa_entry_count);
@@ -0,0 +1,304 @@
+/* Memory and thread placement for the data pipeline.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "error.h"
+#include "parse.h"
+
+#include "placement.h"
+
+
+/* Size of a hugepage.  We only use the default size of 2MB, which is all that
+ * MAP_HUGETLB gives us without further flags. */
+#define HUGEPAGE_SIZE   (2 * 1024 * 1024)
+
+/* Largest NUMA node we can bind to. */
+#define MAX_NUMA_NODE   63
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Buffer placement. */
+
+static bool use_hugepages;
+static bool lock_buffers;
+static int numa_node = -1;
+
+/* Memory locks are not inherited across fork(), so allocated buffers are
+ * remembered here and only locked once the archiver has daemonised. */
+struct allocation {
+    struct allocation *next;
+    void *buffer;
+    size_t size;
+};
+static struct allocation *allocations;
+
+
+bool configure_memory(bool hugepages, bool lock, int node)
+{
+    use_hugepages = hugepages;
+    lock_buffers = lock;
+    numa_node = node;
+    return TEST_OK_(-1 <= node  &&  node <= MAX_NUMA_NODE,
+        "Invalid NUMA node %d", node);
+}
+
+
+/* Tries for an explicit hugepage mapping first, which needs hugepages to be
+ * reserved, otherwise falls back to an ordinary mapping and asks for
+ * transparent hugepages instead. */
+static void *map_buffer(size_t *size)
+{
+    static bool hugepages_missing = false;  // Only report this once
+    if (use_hugepages)
+    {
+        size_t huge_size =
+            (*size + HUGEPAGE_SIZE - 1) & ~(size_t) (HUGEPAGE_SIZE - 1);
+        void *buffer = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer != MAP_FAILED)
+        {
+            *size = huge_size;
+            return buffer;
+        }
+        if (!hugepages_missing)
+            log_message(
+                "Hugepages not available, using transparent hugepages");
+        hugepages_missing = true;
+    }
+
+    void *buffer = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer != MAP_FAILED  &&  use_hugepages)
+        IGNORE(TEST_IO(madvise(buffer, *size, MADV_HUGEPAGE)));
+    return buffer;
+}
+
+
+/* The buffer is bound to the node before it is touched, so that all of its
+ * pages are allocated there. */
+static bool bind_buffer(void *buffer, size_t size)
+{
+    unsigned long node_mask = 1UL << numa_node;
+    return TEST_IO_(syscall(SYS_mbind,
+            buffer, size, MPOL_BIND, &node_mask, MAX_NUMA_NODE + 2, 0),
+        "Unable to bind buffer to NUMA node %d", numa_node);
+}
+
+
+void *allocate_buffer(size_t size)
+{
+    void *buffer = map_buffer(&size);
+    bool ok =
+        TEST_IO(buffer)  &&
+        IF_(numa_node >= 0, bind_buffer(buffer, size));
+    if (ok)
+    {
+        struct allocation *allocation = malloc(sizeof(struct allocation));
+        *allocation = (struct allocation) {
+            .next = allocations, .buffer = buffer, .size = size };
+        allocations = allocation;
+        return buffer;
+    }
+    else
+    {
+        if (buffer != MAP_FAILED)
+            IGNORE(TEST_IO(munmap(buffer, size)));
+        return NULL;
+    }
+}
+
+
+bool lock_allocated_buffers(void)
+{
+    bool ok = true;
+    for (struct allocation *allocation = allocations;
+         ok  &&  lock_buffers  &&  allocation; allocation = allocation->next)
+        ok = TEST_IO_(mlock(allocation->buffer, allocation->size),
+            "Unable to lock buffer in memory");
+    return ok;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Thread placement. */
+
+struct thread_placement {
+    bool set_affinity;          // Set if cpus is to be applied
+    cpu_set_t cpus;
+    bool set_policy;            // Set if policy and priority are to be applied
+    int policy;
+    int priority;
+};
+
+static struct thread_placement placements[THREAD_CLASS_COUNT];
+
+static const char *thread_names[] = {
+    [THREAD_SNIFFER] = "sniffer",
+    [THREAD_TRANSFORM] = "transform",
+    [THREAD_WRITER] = "writer",
+    [THREAD_DECIMATE] = "decimate",
+};
+
+static const struct { const char *name; int policy; } policy_names[] = {
+    { "other", SCHED_OTHER },
+    { "fifo",  SCHED_FIFO },
+    { "rr",    SCHED_RR },
+};
+
+
+/* Parses one of the names in the given table, which must be followed by one of
+ * the given terminators. */
+static bool parse_name(
+    const char **string, const char *const names[], size_t name_count,
+    const char *terminators, size_t *ix)
+{
+    size_t length = strcspn(*string, terminators);
+    for (size_t i = 0; i < name_count; i ++)
+        if (strlen(names[i]) == length  &&
+            strncmp(*string, names[i], length) == 0)
+        {
+            *ix = i;
+            *string += length;
+            return true;
+        }
+    return FAIL_("Unknown name");
+}
+
+
+static bool parse_cpus(const char **string, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    bool ok = true;
+    do {
+        unsigned int first, last;
+        ok =
+            parse_uint(string, &first)  &&
+            DO_(last = first)  &&
+            IF_(read_char(string, '-'),
+                parse_uint(string, &last))  &&
+            TEST_OK_(first <= last  &&  last < CPU_SETSIZE,
+                "Invalid CPU range");
+        for (unsigned int cpu = first; ok  &&  cpu <= last; cpu ++)
+            CPU_SET(cpu, cpus);
+    } while (ok  &&  read_char(string, ','));
+    return ok;
+}
+
+
+static bool parse_policy(
+    const char **string, struct thread_placement *placement)
+{
+    const char *names[ARRAY_SIZE(policy_names)];
+    for (size_t i = 0; i < ARRAY_SIZE(policy_names); i ++)
+        names[i] = policy_names[i].name;
+
+    size_t ix = 0;
+    placement->priority = 0;
+    bool ok =
+        parse_name(string, names, ARRAY_SIZE(names), ":", &ix)  &&
+        DO_(placement->policy = policy_names[ix].policy)  &&
+        IF_(read_char(string, ':'),
+            parse_int(string, &placement->priority))  &&
+        TEST_OK_(
+            sched_get_priority_min(placement->policy) <= placement->priority  &&
+            placement->priority <= sched_get_priority_max(placement->policy),
+            "Invalid priority for policy");
+    placement->set_policy = ok;
+    return ok;
+}
+
+
+bool parse_thread_placement(const char **string)
+{
+    size_t ix = 0;
+    struct thread_placement placement = {};
+    bool ok =
+        parse_name(string, thread_names, THREAD_CLASS_COUNT, "=", &ix)  &&
+        parse_char(string, '=')  &&
+        IF_(**string != ':'  &&  **string != '\0',
+            parse_cpus(string, &placement.cpus)  &&
+            DO_(placement.set_affinity = true))  &&
+        IF_(read_char(string, ':'),
+            parse_policy(string, &placement));
+    if (ok)
+        placements[ix] = placement;
+    return ok;
+}
+
+
+void set_default_thread_policy(
+    enum pipeline_thread thread_class, int policy, int priority)
+{
+    struct thread_placement *placement = &placements[thread_class];
+    if (!placement->set_policy)
+    {
+        placement->set_policy = true;
+        placement->policy = policy;
+        placement->priority = priority;
+    }
+}
+
+
+bool create_pipeline_thread(
+    enum pipeline_thread thread_class, pthread_t *thread,
+    void *(*start_routine)(void *), void *context)
+{
+    const struct thread_placement *placement = &placements[thread_class];
+    pthread_attr_t attr;
+    bool ok =
+        TEST_0(pthread_attr_init(&attr))  &&
+        IF_(placement->set_affinity,
+            TEST_0(pthread_attr_setaffinity_np(
+                &attr, sizeof(cpu_set_t), &placement->cpus)))  &&
+        IF_(placement->set_policy,
+            TEST_0(pthread_attr_setinheritsched(
+                &attr, PTHREAD_EXPLICIT_SCHED))  &&
+            TEST_0(pthread_attr_setschedpolicy(&attr, placement->policy))  &&
+            TEST_0(pthread_attr_setschedparam(&attr,
+                &(struct sched_param) {
+                    .sched_priority = placement->priority })))  &&
+        TEST_0_(pthread_create(thread, &attr, start_routine, context),
+            "Unable to create %s thread with requested placement",
+            thread_names[thread_class]);
+    ASSERT_0(pthread_attr_destroy(&attr));
+    return ok;
+}
@@ -0,0 +1,77 @@
+/* Memory and thread placement for the data pipeline.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Large buffers can be backed by hugepages, locked in memory and bound to a
+ * NUMA node, and each class of pipeline thread can be pinned to a set of CPUs
+ * and run with its own scheduling policy.  All of this is optional and by
+ * default buffers and threads are created normally. */
+
+/* Configures placement of buffers allocated by allocate_buffer().  Set
+ * numa_node to -1 for no binding.  Must be called before any buffers are
+ * allocated. */
+bool configure_memory(bool hugepages, bool lock, int numa_node);
+
+/* Allocates a large page aligned buffer according to the configured memory
+ * placement, returns NULL on failure.  The buffer is initially zero. */
+void *allocate_buffer(size_t size);
+
+/* Locks all allocated buffers in memory if configured.  As locks do not
+ * survive fork() this must be called after daemonising. */
+bool lock_allocated_buffers(void);
+
+
+/* Each class of pipeline thread is placed separately. */
+enum pipeline_thread {
+    THREAD_SNIFFER,         // Sniffer thread reading FA data
+    THREAD_TRANSFORM,       // Transform thread and its workers
+    THREAD_WRITER,          // Disk writer thread
+    THREAD_DECIMATE,        // Decimation threads and their workers
+    THREAD_CLASS_COUNT
+};
+
+/* Parses a thread placement of the form
+ *
+ *  placement = name "=" cpus [ ":" policy [ ":" priority ] ]
+ *  cpus = cpu-range [ "," cpu-range ]*
+ *  cpu-range = cpu [ "-" cpu ]
+ *  policy = "other" | "fifo" | "rr"
+ *
+ * where name is one of sniffer, transform, writer or decimate.  An empty cpu
+ * set leaves the affinity unchanged. */
+bool parse_thread_placement(const char **string);
+
+/* Sets the scheduling policy for a class of thread, unless one has already been
+ * configured.  Used for the sniffer -r option. */
+void set_default_thread_policy(
+    enum pipeline_thread thread_class, int policy, int priority);
+
+/* Creates a thread of the given class with its configured placement. */
+bool create_pipeline_thread(
+    enum pipeline_thread thread_class, pthread_t *thread,
+    void *(*start_routine)(void *), void *context);
@@ -35,10 +35,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "error.h"
 #include "list.h"
 #include "locking.h"
+#include "stats.h"
 
 #include "pool.h"
 
@@ -46,70 +48,287 @@
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Buffer pool. */
 
+/* Buffers come in a handful of size classes matched to the blocks read for each
+ * data source, so that a read of a single id of decimated data doesn't tie up
+ * as much memory as a full FA block read.  Buffers are allocated on demand up
+ * to a fixed memory limit, and released buffers are kept on the free list of
+ * their class for reuse: if the limit is reached then free buffers of other
+ * classes are released to make room.
+ *
+ * A reader which can't be served at once joins a bounded admission queue,
+ * ordered by priority and then by arrival, and waits for buffers to be
+ * returned.  Only the reader at the head of the queue is served, so that a
+ * large request can't be starved by a stream of small ones. */
+
+#define MAX_POOL_CLASSES    8
+#define MAX_POOL_WAITERS    16      // Readers which can queue for buffers
+#define POOL_WAIT_TIMEOUT   10      // Seconds to wait before giving up
+
 DECLARE_LOCKING(buffer_lock);
 
+struct pool_class {
+    size_t buffer_size;             // Size of buffers in this class
+    struct pool_entry *free_list;   // Buffers available for reuse
+    unsigned int free_count;        // Number of buffers on free list
+};
+
 struct pool_entry {
     struct pool_entry *next;
+    struct pool_class *pool_class;  // Class this buffer belongs to
     char buffer[];
 };
 
-static unsigned int pool_size;
-static struct pool_entry *buffer_pool = NULL;
+struct pool_waiter {
+    struct list_head list;
+    int priority;
+};
+
+static struct pool_class pool_classes[MAX_POOL_CLASSES];
+static unsigned int pool_class_count;
+static size_t pool_limit;           // Maximum memory allocated to buffers
+static size_t pool_allocated;       // Memory allocated, including free lists
+static LIST_HEAD(pool_waiters);     // Queue of readers waiting for buffers
+static unsigned int pool_waiter_count;
 
 size_t pooled_buffer_size;
 
 
+/* Returns the smallest class with buffers of at least size bytes. */
+static struct pool_class *find_pool_class(size_t size)
+{
+    for (unsigned int i = 0; i < pool_class_count; i ++)
+        if (pool_classes[i].buffer_size >= size)
+            return &pool_classes[i];
+    return NULL;
+}
 
-bool lock_buffers(struct read_buffers *buffers, unsigned int count)
+
+/* Releases free buffers from all other classes until length bytes more can be
+ * allocated. */
+static void reclaim_buffers(const struct pool_class *keep, size_t length)
 {
-    bool ok;
-    LOCK(buffer_lock);
-    ok = TEST_OK_(count <= pool_size, "Read too busy");
-    if (ok)
+    for (unsigned int i = 0;
+         pool_allocated + length > pool_limit  &&  i < pool_class_count; i ++)
     {
-        pool_size -= count;
-        buffers->buffers = malloc(count * sizeof(void *));
-        buffers->count = count;
-        for (unsigned int i = 0; i < count; i ++)
+        struct pool_class *pool_class = &pool_classes[i];
+        while (pool_class != keep  &&  pool_class->free_list  &&
+               pool_allocated + length > pool_limit)
         {
-            struct pool_entry *entry = buffer_pool;
-            buffer_pool = entry->next;
-            buffers->buffers[i] = entry->buffer;
+            struct pool_entry *entry = pool_class->free_list;
+            pool_class->free_list = entry->next;
+            pool_class->free_count -= 1;
+            pool_allocated -= pool_class->buffer_size;
+            free(entry);
         }
     }
-    UNLOCK(buffer_lock);
-    return ok;
 }
 
 
-void unlock_buffers(struct read_buffers *buffers)
+/* Returns the first count buffers in buffers to the free lists of their
+ * classes.  Called with buffer_lock held. */
+static void return_buffers(struct read_buffers *buffers, unsigned int count)
 {
-    LOCK(buffer_lock);
-    for (unsigned int i = 0; i < buffers->count; i ++)
+    for (unsigned int i = 0; i < count; i ++)
     {
         /* Recover the pool_entry address and chain back onto free list. */
         struct pool_entry *entry =
             container_of(buffers->buffers[i], struct pool_entry, buffer[0]);
-        entry->next = buffer_pool;
-        buffer_pool = entry;
+        struct pool_class *pool_class = entry->pool_class;
+        entry->next = pool_class->free_list;
+        pool_class->free_list = entry;
+        pool_class->free_count += 1;
     }
-    pool_size += buffers->count;
-    UNLOCK(buffer_lock);
-    free(buffers->buffers);
 }
 
 
-void initialise_buffer_pool(size_t buffer_size, unsigned int count)
+/* Result of trying to take buffers from the pool. */
+enum lock_result {
+    LOCK_BUSY,                  // Not enough buffers available yet
+    LOCK_DONE,                  // Buffers taken
+    LOCK_FAILED,                // Memory allocation failed
+};
+
+/* Takes count buffers from the given class if possible, allocating new buffers
+ * as required.  If an allocation fails any buffers already taken are given
+ * back.  Called with buffer_lock held. */
+static enum lock_result try_lock_buffers(
+    struct pool_class *pool_class,
+    struct read_buffers *buffers, unsigned int count)
 {
-    pooled_buffer_size = buffer_size;
+    unsigned int new_count =
+        count > pool_class->free_count ? count - pool_class->free_count : 0;
+    size_t length = new_count * pool_class->buffer_size;
+    size_t reclaimable = 0;
+    for (unsigned int i = 0; i < pool_class_count; i ++)
+        if (&pool_classes[i] != pool_class)
+            reclaimable +=
+                pool_classes[i].free_count * pool_classes[i].buffer_size;
+    if (pool_allocated + length > pool_limit + reclaimable)
+        return LOCK_BUSY;
+
+    reclaim_buffers(pool_class, length);
+    if (!TEST_NULL(buffers->buffers = malloc(count * sizeof(void *))))
+        return LOCK_FAILED;
+    buffers->count = count;
     for (unsigned int i = 0; i < count; i ++)
     {
-        struct pool_entry *entry =
-            malloc(sizeof(struct pool_entry) + buffer_size);
-        entry->next = buffer_pool;
-        buffer_pool = entry;
+        struct pool_entry *entry = pool_class->free_list;
+        if (entry)
+        {
+            pool_class->free_list = entry->next;
+            pool_class->free_count -= 1;
+        }
+        else if (TEST_NULL(entry = malloc(
+                    sizeof(struct pool_entry) + pool_class->buffer_size)))
+        {
+            entry->pool_class = pool_class;
+            pool_allocated += pool_class->buffer_size;
+        }
+        else
+        {
+            return_buffers(buffers, i);
+            free(buffers->buffers);
+            buffers->buffers = NULL;
+            buffers->count = 0;
+            return LOCK_FAILED;
+        }
+        buffers->buffers[i] = entry->buffer;
+    }
+    return LOCK_DONE;
+}
+
+
+bool lock_buffers(struct read_buffers *buffers, unsigned int count, size_t size)
+{
+    struct pool_class *pool_class = find_pool_class(size);
+    ASSERT_OK(pool_class);
+    enum lock_result result;
+    LOCK(buffer_lock);
+    result = try_lock_buffers(pool_class, buffers, count);
+    UNLOCK(buffer_lock);
+    return
+        result != LOCK_FAILED  &&
+        TEST_OK_(result == LOCK_DONE, "Read too busy");
+}
+
+
+/* Adds waiter to the admission queue behind all waiters of the same or higher
+ * priority. */
+static void add_waiter(struct pool_waiter *waiter)
+{
+    struct list_head *before = &pool_waiters;
+    list_for_each_entry(struct pool_waiter, list, entry, &pool_waiters)
+        if (entry->priority < waiter->priority)
+        {
+            before = &entry->list;
+            break;
+        }
+    list_add_tail(&waiter->list, before);
+    pool_waiter_count += 1;
+}
+
+static void remove_waiter(struct pool_waiter *waiter)
+{
+    list_del(&waiter->list);
+    pool_waiter_count -= 1;
+    /* The next waiter may now be able to proceed. */
+    pbroadcast(&buffer_lock);
+}
+
+
+/* Waits in the admission queue until we're at the head and our buffers can be
+ * allocated, or until we time out.  Called with buffer_lock held. */
+static bool wait_for_buffers(
+    struct pool_class *pool_class,
+    struct read_buffers *buffers, unsigned int count, int priority)
+{
+    struct pool_waiter waiter = { .priority = priority };
+    bool ok = TEST_OK_(pool_waiter_count < MAX_POOL_WAITERS, "Read too busy");
+    if (ok)
+    {
+        add_waiter(&waiter);
+        time_t deadline = time(NULL) + POOL_WAIT_TIMEOUT;
+        enum lock_result result = LOCK_BUSY;
+        while (ok  &&  result == LOCK_BUSY)
+        {
+            if (pool_waiters.next == &waiter.list)
+                result = try_lock_buffers(pool_class, buffers, count);
+            if (result == LOCK_BUSY)
+            {
+                time_t now = time(NULL);
+                ok = TEST_OK_(now < deadline, "Read too busy");
+                if (ok)
+                    pwait_timeout(&buffer_lock, (int) (deadline - now), 0);
+            }
+        }
+        ok = ok  &&  result == LOCK_DONE;
+        remove_waiter(&waiter);
     }
-    pool_size = count;
+    return ok;
+}
+
+
+bool queue_lock_buffers(
+    struct read_buffers *buffers, unsigned int count, size_t size,
+    int priority)
+{
+    struct pool_class *pool_class = find_pool_class(size);
+    ASSERT_OK(pool_class);
+    bool ok;
+    LOCK(buffer_lock);
+    ok = TEST_OK_(count * pool_class->buffer_size <= pool_limit,
+        "Read too large for buffer pool");
+    if (ok)
+    {
+        enum lock_result result = pool_waiters.next == &pool_waiters ?
+            try_lock_buffers(pool_class, buffers, count) : LOCK_BUSY;
+        ok =
+            result != LOCK_FAILED  &&
+            IF_(result == LOCK_BUSY,
+                wait_for_buffers(pool_class, buffers, count, priority));
+    }
+    UNLOCK(buffer_lock);
+    return ok;
+}
+
+
+void unlock_buffers(struct read_buffers *buffers)
+{
+    LOCK(buffer_lock);
+    return_buffers(buffers, buffers->count);
+    if (buffers->count > 0  &&  pool_waiter_count > 0)
+        pbroadcast(&buffer_lock);
+    UNLOCK(buffer_lock);
+    free(buffers->buffers);
+}
+
+
+static int compare_size(const void *a, const void *b)
+{
+    size_t size_a = *(const size_t *) a;
+    size_t size_b = *(const size_t *) b;
+    return size_a < size_b ? -1 : size_a > size_b ? 1 : 0;
+}
+
+void initialise_buffer_pool(
+    const size_t buffer_sizes[], unsigned int size_count, size_t limit)
+{
+    ASSERT_OK(0 < size_count  &&  size_count <= MAX_POOL_CLASSES);
+    size_t sizes[MAX_POOL_CLASSES];
+    memcpy(sizes, buffer_sizes, size_count * sizeof(size_t));
+    qsort(sizes, size_count, sizeof(size_t), compare_size);
+
+    /* Merge classes of identical size. */
+    pool_class_count = 0;
+    for (unsigned int i = 0; i < size_count; i ++)
+        if (pool_class_count == 0  ||
+            pool_classes[pool_class_count - 1].buffer_size != sizes[i])
+            pool_classes[pool_class_count++] = (struct pool_class) {
+                .buffer_size = sizes[i] };
+
+    pooled_buffer_size = sizes[size_count - 1];
+    pool_limit = limit;
+    pool_allocated = 0;
 }
 
 
@@ -120,7 +339,7 @@ void initialise_buffer_pool(size_t buffer_size, unsigned int count)
 bool allocate_write_buffer(struct write_buffer *buffer, unsigned int count)
 {
     return
-        lock_buffers(&buffer->buffers, count)  &&
+        lock_buffers(&buffer->buffers, count, pooled_buffer_size)  &&
         TEST_NULL(buffer->out_pointers = calloc(count, sizeof(size_t)));
 }
 
@@ -139,6 +358,7 @@ bool flush_buffer(struct write_buffer *buffer)
         TEST_write_(
             buffer->file, buffer->buffers.buffers[0], buffer->out_pointers[0],
             "Error writing to client")  &&
+        DO_(account_client_bytes(buffer->out_pointers[0]))  &&
         DO_(buffer->out_pointers[0] = 0));
 }
 
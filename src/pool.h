@@ -42,15 +42,26 @@ struct read_buffers {
     struct read_buffers bufs = { .count = 0, .buffers = NULL }
 
 
-/* Allocates the requested number of buffers, fails if none available. */
-bool lock_buffers(struct read_buffers *buffers, unsigned int count);
+/* Allocates count buffers each of at least size bytes, which must be no larger
+ * than pooled_buffer_size.  Fails at once if the buffers aren't available. */
+bool lock_buffers(
+    struct read_buffers *buffers, unsigned int count, size_t size);
+/* As for lock_buffers(), but if the pool is busy waits in a bounded queue for
+ * buffers to become available, where callers with higher priority are served
+ * first.  Fails if the queue is full or the wait times out. */
+bool queue_lock_buffers(
+    struct read_buffers *buffers, unsigned int count, size_t size,
+    int priority);
 /* Releases previously allocated buffer block.  Safe to call if count==0. */
 void unlock_buffers(struct read_buffers *buffers);
 
-/* Called at startup to initialise the buffer pool. */
-void initialise_buffer_pool(size_t buffer_size, unsigned int count);
+/* Called at startup to initialise the buffer pool with a size class for each
+ * of the given buffer sizes.  At most limit bytes will be allocated to buffers
+ * at any time. */
+void initialise_buffer_pool(
+    const size_t buffer_sizes[], unsigned int size_count, size_t limit);
 
-/* Records the size of buffers allocated by lock_buffers(). */
+/* Records the size of the largest buffer class, used for write buffers. */
 extern size_t pooled_buffer_size;
 
 
@@ -74,8 +74,17 @@ static uint32_t second_decimation = 256;
 static double sample_frequency = 10072.4;
 static bool dry_run = false;
 static bool quiet_allocate = false;
+static bool fill_file = false;
 static uint32_t fa_entry_count = 256;
 static double timestamp_iir = 0.1;
+static double compression = 0;
+static unsigned int tier_count = 0;
+static uint32_t tier_decimations[MAX_DECIMATION_TIERS];
+/* Stripe files given with -S, replaced by their full paths once opened. */
+static unsigned int stripe_file_count = 0;
+static const char *stripe_files[MAX_STRIPES - 1];
+static char stripe_paths[MAX_STRIPES - 1][PATH_MAX];
+static uint32_t d_format = D_FORMAT_INTERLEAVED;
 
 /* Options for read only operation. */
 static bool read_only = false;
@@ -111,8 +120,19 @@ static void usage(void)
 "   -D:  Specify second decimation factor.  The default value is %"PRIu32".\n"
 "   -f:  Specify nominal sample frequency.  The default is %.1fHz.\n"
 "   -T:  Specify timestamp IIR factor.  The default is %g.\n"
+"   -z:  Store FA data compressed.  The number of major blocks is computed\n"
+"        assuming FA data compresses by the given ratio, for example 2.5.\n"
+"   -P:  Specify further decimation tiers above DD as a comma separated list\n"
+"        of decimation factors, each relative to the tier below.\n"
+"   -S:  Stripe FA data across the given file.  Can be repeated for up to\n"
+"        %d further files, each of which will be sized to hold its share of\n"
+"        the FA data.\n"
+"   -c   Store each field of decimated data in a separate column, so that\n"
+"        reads of selected fields of D data can read less from disk.\n"
 "   -n   Print file header but don't actually write anything.\n"
-"   -q   Use faster but quiet mechanism for allocating file buffer.\n"
+"   -F   Write zeros to the whole file instead of just allocating it.\n"
+"   -q   If the file system can't allocate the file use a faster but quiet\n"
+"        mechanism for writing zeros to it.  Has no effect with -F.\n"
 "\n"
 "File size can be followed by one of K, M, G or T to specify sizes in\n"
 "kilo, mega, giga or terabytes, and similarly block sizes can be followed\n"
@@ -131,7 +151,21 @@ static void usage(void)
         , argv0, argv0,
         input_block_size, major_sample_count,
         first_decimation, second_decimation,
-        sample_frequency, timestamp_iir);
+        sample_frequency, timestamp_iir, MAX_STRIPES - 1);
+}
+
+
+/* tiers = decimation [ "," tiers ] . */
+static bool parse_tiers(const char **string, unsigned int *count)
+{
+    unsigned int n = 0;
+    bool ok = parse_uint32(string, &tier_decimations[n++]);
+    while (ok  &&  read_char(string, ','))
+        ok =
+            TEST_OK_(n < MAX_DECIMATION_TIERS, "Too many decimation tiers")  &&
+            parse_uint32(string, &tier_decimations[n++]);
+    *count = n;
+    return ok;
 }
 
 
@@ -141,7 +175,7 @@ static bool process_opts(int *argc, char ***argv)
     bool ok = true;
     while (ok)
     {
-        switch (getopt(*argc, *argv, "+hs:N:I:M:d:D:f:T:nq"))
+        switch (getopt(*argc, *argv, "+hs:N:I:M:d:D:f:T:z:P:S:cnFq"))
         {
             case 'h':
                 usage();
@@ -178,7 +212,23 @@ static bool process_opts(int *argc, char ***argv)
                 ok = DO_PARSE("timestamp IIR",
                     parse_double, optarg, &timestamp_iir);
                 break;
+            case 'z':
+                ok = DO_PARSE("compression ratio",
+                    parse_double, optarg, &compression);
+                break;
+            case 'P':
+                ok = DO_PARSE("decimation tiers",
+                    parse_tiers, optarg, &tier_count);
+                break;
+            case 'S':
+                ok =
+                    TEST_OK_(stripe_file_count < MAX_STRIPES - 1,
+                        "Too many stripe files")  &&
+                    DO_(stripe_files[stripe_file_count++] = optarg);
+                break;
+            case 'c':   d_format = D_FORMAT_FIELDS;                 break;
             case 'n':   dry_run = true;                             break;
+            case 'F':   fill_file = true;                           break;
             case 'q':   quiet_allocate = true;                      break;
             case '?':
             default:
@@ -274,11 +324,14 @@ static bool prepare_new_header(struct disk_header *header)
             &archive_mask, file_size,
             input_block_size, major_sample_count,
             first_decimation, second_decimation, sample_frequency,
-            timestamp_iir, fa_entry_count)  &&
+            timestamp_iir, fa_entry_count, compression,
+            tier_count, tier_decimations, stripe_file_count, stripe_files,
+            d_format)  &&
         DO_(print_header(stdout, header));
 }
 
-static bool write_new_header(int file_fd, size_t *written)
+static bool write_new_header(
+    int file_fd, size_t *written, uint64_t *stripe_size)
 {
     struct disk_header *header;
     bool ok =
@@ -288,7 +341,8 @@ static bool write_new_header(int file_fd, size_t *written)
         TEST_IO(lseek(file_fd, 0, SEEK_SET))  &&
         TEST_write(file_fd, header, DISK_HEADER_SIZE)  &&
         reset_index(file_fd, header->index_data_size)  &&
-        DO_(*written = DISK_HEADER_SIZE + header->index_data_size);
+        DO_(*written = DISK_HEADER_SIZE + header->index_data_size;
+            *stripe_size = header->major_data_size);
     free(header);
     return ok;
 }
@@ -308,13 +362,13 @@ static void show_progress(unsigned int n, unsigned int final_n)
 
 
 /* Verbose and slower near equivalent to posix_fallocate(). */
-static bool fill_zeros(int file_fd, size_t written)
+static bool fill_zeros(int file_fd, uint64_t start, uint64_t end)
 {
     uint32_t block_size = 512*K;
     void *zeros = valloc(block_size);
     memset(zeros, 0, block_size);
 
-    uint64_t size_left = file_size - written;
+    uint64_t size_left = end - start;
     unsigned int final_n = (unsigned int) (size_left / block_size);
     bool ok = true;
     for (unsigned int n = 0; ok  &&  size_left >= block_size;
@@ -331,6 +385,101 @@ static bool fill_zeros(int file_fd, size_t written)
 }
 
 
+/* Writes zeros to the rest of the file when the file system can't allocate it,
+ * either with posix_fallocate(), which then writes the file itself, or with
+ * fill_zeros() if we're to show progress. */
+static bool write_zeros(int file_fd, uint64_t start, uint64_t end)
+{
+    if (quiet_allocate)
+        /* posix_fallocate is marginally faster but shows no sign of
+         * progress. */
+        return TEST_0(posix_fallocate(
+            file_fd, (off64_t) start, (off64_t) (end - start)));
+    else
+        /* If we use full_zeros we can show progress to the user. */
+        return fill_zeros(file_fd, start, end);
+}
+
+
+/* Allocates the rest of the file.  Normally we just ask the file system to
+ * allocate unwritten extents, which takes seconds even for a very large file.
+ * This is safe because the freshly reset index marks every block as unwritten,
+ * so no reader will look at the data until it has been written, and in any case
+ * unwritten extents read back as zeros.  If the file system can't do this we
+ * fall back to writing zeros, which can take hours. */
+static bool allocate_file(int file_fd, uint64_t start, uint64_t end)
+{
+    if (fill_file)
+        /* posix_fallocate() would only allocate unwritten extents here, so
+         * always write the zeros ourself. */
+        return fill_zeros(file_fd, start, end);
+    else if (fallocate(file_fd, 0,
+            (off64_t) start, (off64_t) (end - start)) == 0)
+        return true;
+    else if (errno == EOPNOTSUPP)
+    {
+        printf("File system can't allocate file, writing zeros instead\n");
+        return write_zeros(file_fd, start, end);
+    }
+    else
+        return FAIL_("Unable to allocate file");
+}
+
+
+/* Opens or creates the stripe files and replaces their names by full paths, as
+ * the archiver may well be run from a different directory. */
+static bool open_stripe_files(int open_flags, int stripe_fds[])
+{
+    bool ok = true;
+    unsigned int i;
+    for (i = 0; ok  &&  i < stripe_file_count; i ++)
+        ok =
+            TEST_IO_(stripe_fds[i] = open(stripe_files[i], open_flags, 0664),
+                "Unable to write to stripe file \"%s\"", stripe_files[i])  &&
+            UNLESS(
+                lock_archive(stripe_fds[i])  &&
+                TEST_NULL_(realpath(stripe_files[i], stripe_paths[i]),
+                    "Unable to resolve path to \"%s\"", stripe_files[i]),
+                close(stripe_fds[i]))  &&
+            DO_(stripe_files[i] = stripe_paths[i]);
+    if (!ok)
+        /* Close the files opened before the one that failed. */
+        for (unsigned int j = 0; j + 1 < i; j ++)
+            close(stripe_fds[j]);
+    return ok;
+}
+
+static void close_stripe_files(int stripe_fds[])
+{
+    for (unsigned int i = 0; i < stripe_file_count; i ++)
+        TEST_IO(close(stripe_fds[i]));
+}
+
+/* Each stripe file needs room for stripe_size bytes of FA data.  A stripe held
+ * in an ordinary file is resized to fit, but a block device must already be
+ * large enough. */
+static bool allocate_stripe_files(int stripe_fds[], uint64_t stripe_size)
+{
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < stripe_file_count; i ++)
+    {
+        struct stat st;
+        uint64_t size;
+        ok =
+            TEST_IO(fstat(stripe_fds[i], &st))  &&
+            IF_ELSE(S_ISREG(st.st_mode),
+                TEST_IO(ftruncate(stripe_fds[i], 0))  &&
+                allocate_file(stripe_fds[i], 0, stripe_size),
+            // else
+                get_filesize(stripe_fds[i], &size)  &&
+                TEST_OK_(size >= stripe_size,
+                    "Stripe device \"%s\" too small: "
+                    "%"PRIu64" < %"PRIu64, stripe_files[i], size, stripe_size));
+    }
+    return ok;
+}
+
+
 static void print_timestamp(time_t timestamp)
 {
     struct tm tm;
@@ -426,6 +575,25 @@ static bool prepare_dry_run(void)
 }
 
 
+/* Writes the header and allocates the archive, creating any stripe files with
+ * the given open flags. */
+static bool write_archive(int file_fd, int stripe_flags)
+{
+    int stripe_fds[MAX_STRIPES - 1];
+    size_t written;
+    uint64_t stripe_size;
+    return
+        open_stripe_files(stripe_flags, stripe_fds)  &&
+        FINALLY(
+            write_new_header(file_fd, &written, &stripe_size)  &&
+            IF_(file_size_given,
+                allocate_file(file_fd, written, file_size))  &&
+            allocate_stripe_files(stripe_fds, stripe_size),
+
+            DO_(close_stripe_files(stripe_fds)));
+}
+
+
 /* Actually do the work of creating a header and initialising the data store (if
  * required). */
 static bool prepare_create(void)
@@ -434,7 +602,6 @@ static bool prepare_create(void)
     int open_flags =
         (file_size_given ? O_CREAT | O_TRUNC : 0) |
         (quiet_allocate ? 0 : O_DIRECT) | O_WRONLY;
-    size_t written;
     return
         TEST_IO_(file_fd = open(file_name, open_flags, 0664),
             "Unable to write to file \"%s\"", file_name)  &&
@@ -442,16 +609,7 @@ static bool prepare_create(void)
             lock_archive(file_fd)  &&
             IF_(!file_size_given,
                 get_filesize(file_fd, &file_size))  &&
-            write_new_header(file_fd, &written)  &&
-            IF_(file_size_given,
-                IF_ELSE(quiet_allocate,
-                    /* posix_fallocate is marginally faster but shows no sign of
-                     * progress. */
-                    TEST_0(posix_fallocate(
-                        file_fd, (off64_t) written,
-                        (off64_t) (file_size - written))),
-                    /* If we use full_zeros we can show progress to the user. */
-                    fill_zeros(file_fd, written))),
+            write_archive(file_fd, (open_flags & ~O_TRUNC) | O_CREAT),
 
         TEST_IO(close(file_fd)));
 }
@@ -39,6 +39,9 @@
 #include <errno.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/uio.h>
 
 #include "error.h"
 #include "fa_sniffer.h"
@@ -52,6 +55,10 @@
 #include "socket_server.h"
 #include "list.h"
 #include "pool.h"
+#include "block_cache.h"
+#include "dd_cache.h"
+#include "compress.h"
+#include "accum.h"
 
 #include "reader.h"
 
@@ -62,6 +69,7 @@
  * archive file. */
 static const char *archive_filename;
 static unsigned int fa_entry_count;         // Read from header at startup
+static size_t page_size;                    // Alignment for partial reads
 
 
 
@@ -76,14 +84,29 @@ struct iter_mask {
 
 
 struct reader {
-    /* Reads the requested block from archive into buffer, samples_per_fa_block
-     * samples will be returned:
-     *  archive         File handle of archive to read
+    /* Reads the requested block from archive for every id in iter into the
+     * corresponding read buffers.  Each buffer has room for
+     * samples_per_fa_block samples, but only the samples from first to
+     * first+count-1 are guaranteed to be valid:
+     *  reader          This reader
+     *  archive         File handles of archive stripes to read
      *  block           Major block to start reading
-     *  id              FA id to read
-     *  *buffer         Data written here, must be correct size */
+     *  first, count    Range of samples in block wanted
+     *  data_mask       Mask of decimated fields wanted (ignored for FA)
+     *  iter            Archive indexes of FA ids to read
+     *  read_buffers    Data written here, one buffer per id */
     bool (*read_block)(
-        int archive, unsigned int block, unsigned int id, void *buffer);
+        const struct reader *reader,
+        const int archive[], unsigned int block,
+        unsigned int first, unsigned int count, unsigned int data_mask,
+        const struct iter_mask *iter, struct read_buffers *read_buffers);
+    /* Advises that the first count samples of the given block will be read
+     * shortly so that the disk can get on with it while the current block is
+     * sent.  Can be NULL. */
+    void (*prefetch_block)(
+        const int archive[], unsigned int block,
+        unsigned int count, unsigned int data_mask,
+        const struct iter_mask *iter);
     /* Writes the given lines from a list of buffers to an output buffer:
      *  line_count      Number of samples to be written
      *  field_count     Number of FA ids per sample
@@ -95,6 +118,12 @@ struct reader {
         unsigned int line_count, unsigned int field_count,
         struct read_buffers *read_buffers, unsigned int offset,
         unsigned int data_mask, void *output);
+    /* Accumulates line_count samples from offset in each read buffer into the
+     * corresponding accumulator, used for bucket aggregation. */
+    void (*accum_lines)(
+        unsigned int line_count, unsigned int field_count,
+        struct read_buffers *read_buffers, unsigned int offset,
+        struct fa_accum accums[]);
     /* The size of a single output value.  For decimated data the output size
      * depends on the selected data mask, which is of course meaningless for FA
      * data. */
@@ -102,6 +131,49 @@ struct reader {
 
     unsigned int decimation_log2;       // FA samples per read sample
     unsigned int samples_per_fa_block;  // Samples in a single FA block
+    size_t sample_size;                 // Size of each sample read
+    /* For the higher decimation tiers a single block of samples can span
+     * several major blocks, in which case blocks are read in aligned groups of
+     * this many major blocks. */
+    unsigned int block_group_log2;
+    /* Set if the major block still being assembled can be read, so that reads
+     * can run right up to the latest data. */
+    bool live;
+    /* Decimated data held in the DD area: DD or a higher tier. */
+    size_t area_offset;                 // Start of data for this reader
+    unsigned int area_count;            // Samples for each id in area
+};
+
+
+enum send_timestamp {
+    SEND_NOTHING = 0,               // Don't send timestamp with data
+    SEND_BASIC,                     // Send timestamp at start of data
+    SEND_EXTENDED,                  // Send timestamp with each data block
+    SEND_AT_END,                    // Aggregate timestamp data and send at end
+};
+
+
+/* Result of parsing a read command. */
+struct read_parse {
+    struct filter_mask read_mask;   // List of BPMs to be read
+    uint64_t samples;               // Requested number of samples
+    uint64_t start;                 // Data start (in microseconds into epoch)
+    bool start_at_block;            // Start given as block and offset instead
+    unsigned int start_block;       // Major block of first sample
+    unsigned int start_offset;      // Offset of first sample in block
+    uint64_t end;                   // Data end (alternative to count)
+    unsigned int buckets;           // Number of aggregated buckets or 0
+    const struct reader *reader;    // Interpretation of data source
+    unsigned int data_mask;         // Data mask for D and DD data
+    bool send_sample_count;         // Send sample count at start
+    bool send_all_data;             // Don't bail out if insufficient data
+    enum send_timestamp send_timestamp; // Send timestamp configuration
+    bool send_id0;                  // Send id0 (with timestamp data)
+    bool only_contiguous;           // Only contiguous data acceptable
+    bool check_id0;                 // Consider id0 gap as a gap
+    bool send_position;             // Send position of start instead of data
+    bool compress;                  // Send data as compressed chunks
+    unsigned int priority;          // Priority when queueing for buffers
 };
 
 
@@ -136,6 +208,14 @@ static unsigned int round_up(uint64_t a, uint64_t b)
 }
 
 
+/* Returns the number of samples to read from a block with available samples
+ * left when count samples remain to be sent. */
+static unsigned int samples_wanted(unsigned int available, uint64_t count)
+{
+    return count < available ? (unsigned int) count : available;
+}
+
+
 /* Checks that the run of samples from (ix_start,offset) has no gaps.  Here the
  * start is an index block, but the offset is an offset in data points. */
 static bool check_run(
@@ -144,12 +224,13 @@ static bool check_run(
 {
     /* Compute the total number of index blocks that will need to be read. */
     unsigned int blocks = round_up(
-        offset + samples, reader->samples_per_fa_block);
+        offset + samples, reader->samples_per_fa_block) <<
+            reader->block_group_log2;
     unsigned int blocks_requested = blocks;
     /* Check whether they represent a contiguous data block. */
     return TEST_OK_(!find_gap(check_id0, &ix_start, &blocks),
         "Only %"PRIu64" contiguous samples available",
-        (uint64_t) (blocks_requested - blocks) *
+        ((uint64_t) (blocks_requested - blocks) >> reader->block_group_log2) *
             reader->samples_per_fa_block - offset);
 }
 
@@ -165,7 +246,7 @@ static bool compute_end_samples(
 
     bool ok =
         timestamp_to_end(
-            end, all_data, start_block, &end_block, &end_offset)  &&
+            end, all_data, reader->live, start_block, &end_block, &end_offset)  &&
         TEST_OK(start_block != end_block  ||  start_offset <= end_offset);
     if (ok)
     {
@@ -184,24 +265,83 @@ static bool compute_end_samples(
 }
 
 
+/* For readers which read groups of major blocks the starting block is moved
+ * back to the start of its group, taking care to skip a group which is still
+ * incomplete because it contains the current block, and the FA offset and
+ * available counts are adjusted to match.  On entry *samples_available counts
+ * FA samples from (*block, *offset). */
+static bool align_block_group(
+    const struct reader *reader, uint64_t *samples_available,
+    unsigned int *block, unsigned int *offset)
+{
+    const struct disk_header *header = get_header();
+    unsigned int N = header->major_block_count;
+    unsigned int group = 1U << reader->block_group_log2;
+    unsigned int extra = *block & (group - 1);
+    unsigned int start = *block - extra;
+    uint64_t fa_offset = (uint64_t) extra * header->major_sample_count + *offset;
+    if ((header->current_major_block + N - start) % N < extra)
+    {
+        /* Skip to the start of the next group. */
+        uint64_t skip = (uint64_t) group * header->major_sample_count -
+            fa_offset;
+        if (!TEST_OK_(*samples_available > skip, "No data in selected range"))
+            return false;
+        *samples_available -= skip;
+        start = (start + group) % N;
+        fa_offset = 0;
+    }
+    *block = start;
+    *offset = (unsigned int) fa_offset;
+    /* Count available samples from the start of the first read sample. */
+    *samples_available += fa_offset & ((1U << reader->decimation_log2) - 1);
+    return true;
+}
+
+
+/* An explicit starting block is only meaningful for readers which advance
+ * one major block at a time, and the offset is given in units of the reader. */
+static bool block_start(
+    const struct reader *reader, const struct read_parse *parse,
+    uint64_t *available, unsigned int *ix_block, unsigned int *offset)
+{
+    *ix_block = parse->start_block;
+    *offset = parse->start_offset << reader->decimation_log2;
+    return
+        TEST_OK_(reader->block_group_log2 == 0,
+            "Block start not supported for this data")  &&
+        TEST_OK_(parse->start_offset < reader->samples_per_fa_block,
+            "Start offset %u out of range", parse->start_offset)  &&
+        block_to_start(*ix_block, *offset, reader->live, available);
+}
+
+
 /* Given start and an optional end timestamp computes the starting block and
  * first sample offset.  If an end timestamp is given it is used to compute the
  * number of samples.  Both *samples and *offset are in units for the
  * appropriate data to be read. */
 static bool compute_start(
-    const struct reader *reader,
-    uint64_t start, uint64_t end, bool all_data,
+    const struct reader *reader, const struct read_parse *parse,
     uint64_t *samples, unsigned int *ix_block, unsigned int *offset)
 {
+    uint64_t start = parse->start;
+    uint64_t end = parse->end;
+    bool all_data = parse->send_all_data;
     uint64_t available;
     return
         /* Convert requested timestamp into a starting index block and FA offset
-         * into that block. */
-        timestamp_to_start(start, all_data, &available, ix_block, offset)  &&
+         * into that block, unless the block was given explicitly. */
+        IF_ELSE(parse->start_at_block,
+            block_start(reader, parse, &available, ix_block, offset),
+            timestamp_to_start(
+                start, all_data, reader->live, &available, ix_block, offset))  &&
         IF_(end != 0,
-            TEST_OK_(start < end, "Time range runs backwards")  &&
+            TEST_OK_(parse->start_at_block  ||  start < end,
+                "Time range runs backwards")  &&
             compute_end_samples(
                 reader, end, *ix_block, *offset, all_data, samples))  &&
+        IF_(reader->block_group_log2 > 0,
+            align_block_group(reader, &available, ix_block, offset))  &&
         /* Convert offset and available counts into numbers appropriate for our
          * current data type. */
         DO_(available >>= reader->decimation_log2;
@@ -222,14 +362,6 @@ static bool compute_start(
 /* Timestamp support. */
 
 
-enum send_timestamp {
-    SEND_NOTHING = 0,               // Don't send timestamp with data
-    SEND_BASIC,                     // Send timestamp at start of data
-    SEND_EXTENDED,                  // Send timestamp with each data block
-    SEND_AT_END,                    // Aggregate timestamp data and send at end
-};
-
-
 struct ts_buffer {
     uint32_t count;                 // Number of timestamps actually written
     bool send_id0;                  // Set if id0s is in use
@@ -290,8 +422,9 @@ static bool send_timestamp_header(
     struct write_buffer *buffer, const struct reader *reader,
     unsigned int ix_block, unsigned int offset)
 {
-    const struct data_index *data_index = read_index(ix_block);
-    uint32_t id0 = data_index->id_zero + offset;
+    struct data_index data_index;
+    read_index(ix_block, &data_index);
+    uint32_t id0 = data_index.id_zero + offset;
 
     switch (send_timestamp)
     {
@@ -306,12 +439,12 @@ static bool send_timestamp_header(
             /* For basic timestamps we just send the timestamp of the first
              * sample at the head of the data, possibly followed by id0. */
             uint64_t timestamp =
-                data_index->timestamp +
+                data_index.timestamp +
                 /* A note on this calculation: both ix_offset and duration both
                  * comfortably fit into 32 bits, so this is a sensible way of
                  * computing the timestamp within the selected block. */
-                (uint64_t) offset * data_index->duration /
-                    reader->samples_per_fa_block;
+                ((uint64_t) offset * data_index.duration <<
+                    reader->block_group_log2) / reader->samples_per_fa_block;
             return
                 BUFFER_ITEM(buffer, timestamp)  &&
                 IF_(send_id0, BUFFER_ITEM(buffer, id0));
@@ -334,28 +467,31 @@ static bool send_timestamp_header(
 
 
 /* For extended timestamps we write the timestamp and duration at the head of
- * each block, or possibly delayed to the end of the transfer. */
+ * each block, or possibly delayed to the end of the transfer.  For a group of
+ * major blocks the duration is extrapolated from the first block. */
 static bool send_extended_timestamp(
     enum send_timestamp send_timestamp,
     struct ts_buffer *ts_buffer, struct write_buffer *buffer,
-    unsigned int ix_block)
+    const struct reader *reader, unsigned int ix_block)
 {
-    const struct data_index *data_index = read_index(ix_block);
+    struct data_index data_index;
+    read_index(ix_block, &data_index);
+    uint32_t duration = data_index.duration << reader->block_group_log2;
     ts_buffer->count += 1;
     switch (send_timestamp)
     {
         case SEND_EXTENDED:
             return
-                BUFFER_ITEM(buffer, data_index->timestamp)  &&
-                BUFFER_ITEM(buffer, data_index->duration)  &&
+                BUFFER_ITEM(buffer, data_index.timestamp)  &&
+                BUFFER_ITEM(buffer, duration)  &&
                 IF_(ts_buffer->send_id0,
-                    BUFFER_ITEM(buffer, data_index->id_zero));
+                    BUFFER_ITEM(buffer, data_index.id_zero));
         case SEND_AT_END:
             return
-                BUFFER_ITEM(&ts_buffer->timestamps, data_index->timestamp)  &&
-                BUFFER_ITEM(&ts_buffer->durations,  data_index->duration)  &&
+                BUFFER_ITEM(&ts_buffer->timestamps, data_index.timestamp)  &&
+                BUFFER_ITEM(&ts_buffer->durations,  duration)  &&
                 IF_(ts_buffer->send_id0,
-                    BUFFER_ITEM(&ts_buffer->id0s, data_index->id_zero));
+                    BUFFER_ITEM(&ts_buffer->id0s, data_index.id_zero));
         default:
             return true;
     }
@@ -386,29 +522,83 @@ static void release_timestamp_buffer(struct ts_buffer *ts_buffer)
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Data transfer control. */
-
-/* Result of parsing a read command. */
-struct read_parse {
-    struct filter_mask read_mask;   // List of BPMs to be read
-    uint64_t samples;               // Requested number of samples
-    uint64_t start;                 // Data start (in microseconds into epoch)
-    uint64_t end;                   // Data end (alternative to count)
-    const struct reader *reader;    // Interpretation of data source
-    unsigned int data_mask;         // Data mask for D and DD data
-    bool send_sample_count;         // Send sample count at start
-    bool send_all_data;             // Don't bail out if insufficient data
-    enum send_timestamp send_timestamp; // Send timestamp configuration
-    bool send_id0;                  // Send id0 (with timestamp data)
-    bool only_contiguous;           // Only contiguous data acceptable
-    bool check_id0;                 // Consider id0 gap as a gap
+/* Compressed transfer. */
+
+/* When compression is requested lines are written to a private buffer and sent
+ * in compressed chunks, see compress.h.  Chunks never cross a major block, so
+ * any extended timestamps are still sent between chunks. */
+struct pack_buffer {
+    unsigned int line_count;        // Maximum number of lines in a chunk
+    unsigned int field_count;       // Number of fa_entry values in each line
+    struct fa_entry *lines;         // Lines waiting to be packed, or NULL
+    void *packed;                   // Packed chunk
 };
 
 
+/* Chunks are sized to hold about a pool buffer's worth of lines, but must be
+ * long enough for at least one group of packed samples. */
+static bool allocate_pack_buffer(
+    const struct read_parse *parse, const struct iter_mask *iter,
+    struct pack_buffer *pack)
+{
+    size_t line_size_out =
+        iter->count * parse->reader->output_size(parse->data_mask);
+    unsigned int line_count =
+        (unsigned int) (pooled_buffer_size / line_size_out);
+    line_count -= line_count % DELTA_GROUP_SIZE;
+    if (line_count == 0)
+        line_count = DELTA_GROUP_SIZE;
+
+    pack->line_count = line_count;
+    pack->field_count = (unsigned int) (line_size_out / FA_ENTRY_SIZE);
+    return
+        TEST_NULL(pack->lines = malloc(line_count * line_size_out))  &&
+        TEST_NULL(pack->packed = malloc(
+            packed_frames_size(line_count, pack->field_count)));
+}
+
+
+static void release_pack_buffer(struct pack_buffer *pack)
+{
+    free(pack->lines);
+    free(pack->packed);
+}
+
+
+/* Packs the given number of lines from the pack buffer and writes the chunk to
+ * the output buffer.  The packed data can be larger than a single pooled
+ * buffer, so is written in pieces. */
+static bool write_packed_lines(
+    struct write_buffer *out_buffer, const struct pack_buffer *pack,
+    unsigned int line_count)
+{
+    size_t length =
+        pack_frames(pack->lines, line_count, pack->field_count, pack->packed);
+    struct compressed_chunk chunk = {
+        .sample_count = line_count,
+        .length = (uint32_t) length };
+    bool ok = BUFFER_ITEM(out_buffer, chunk);
+    for (size_t offset = 0; ok  &&  offset < length;
+         offset += pooled_buffer_size)
+    {
+        size_t to_write = length - offset;
+        if (to_write > pooled_buffer_size)
+            to_write = pooled_buffer_size;
+        ok = write_buffer(out_buffer, pack->packed + offset, to_write);
+    }
+    return ok;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Data transfer control. */
+
 static bool transfer_data(
     const struct read_parse *parse, struct read_buffers *read_buffers,
-    int archive, struct write_buffer *out_buffer, struct iter_mask *iter,
-    struct ts_buffer *ts_buffer,
+    const int archive[], struct write_buffer *out_buffer,
+    struct iter_mask *iter,
+    struct ts_buffer *ts_buffer, const struct pack_buffer *pack,
     unsigned int ix_block, unsigned int offset, uint64_t count)
 {
     const struct reader *reader = parse->reader;
@@ -419,32 +609,54 @@ static bool transfer_data(
     while (ok  &&  count > 0)
     {
         ok = send_extended_timestamp(
-            parse->send_timestamp, ts_buffer, out_buffer, ix_block);
+            parse->send_timestamp, ts_buffer, out_buffer, reader, ix_block);
 
         /* Read a single timeframe for each id from the archive.  This is
-         * normally a single large disk IO block per BPM id. */
-        for (unsigned int i = 0; ok  &&  i < iter->count; i ++)
-            ok = reader->read_block(
-                archive, ix_block, iter->index[i], read_buffers->buffers[i]);
+         * normally a single large disk IO block per BPM id, but all the ids
+         * are read together, and only as much as we need is read. */
+        unsigned int samples_read = reader->samples_per_fa_block;
+        ok = ok  &&  reader->read_block(reader, archive, ix_block,
+            offset, samples_wanted(samples_read - offset, count),
+            parse->data_mask, iter, read_buffers);
+
+        /* If we'll be coming back for more then let the disk start on the next
+         * block while we send this one. */
+        unsigned int next_block = ix_block + (1U << reader->block_group_log2);
+        if (next_block >= header->major_block_count)
+            next_block = 0;
+        if (ok  &&  reader->prefetch_block  &&
+            count > samples_read - offset)
+            reader->prefetch_block(archive, next_block,
+                samples_wanted(samples_read, count - (samples_read - offset)),
+                parse->data_mask, iter);
 
         /* Transpose the read data into output lines and write out in buffer
          * sized chunks. */
-        unsigned int samples_read = reader->samples_per_fa_block;
         while (ok  &&  offset < samples_read  &&  count > 0)
         {
-            /* Ensure we get enough workspace to write a least a single line!
-             * Alas, can fail if writing fails. */
-            size_t buf_length;
-            void *line_buffer =
-                get_buffer(out_buffer, line_size_out, &buf_length);
-            ok = line_buffer != NULL;
-            if (!ok)
-                break;
-
-            /* Enough lines to fill the write buffer, so long as we don't write
-             * more than requested and we don't exhaust the read blocks. */
-            unsigned int line_count =
-                (unsigned int) (buf_length / line_size_out);
+            void *line_buffer;
+            unsigned int line_count;
+            if (pack->lines)
+            {
+                /* Compressed lines are written to our own buffer first. */
+                line_buffer = pack->lines;
+                line_count = pack->line_count;
+            }
+            else
+            {
+                /* Ensure we get enough workspace to write a least a single
+                 * line!  Alas, can fail if writing fails. */
+                size_t buf_length;
+                line_buffer =
+                    get_buffer(out_buffer, line_size_out, &buf_length);
+                ok = line_buffer != NULL;
+                if (!ok)
+                    break;
+                line_count = (unsigned int) (buf_length / line_size_out);
+            }
+
+            /* Enough lines to fill the buffer, so long as we don't write more
+             * than requested and we don't exhaust the read blocks. */
             if (count < line_count)
                 line_count = (unsigned int) count;
             if (offset + line_count > samples_read)
@@ -453,15 +665,16 @@ static bool transfer_data(
             reader->write_lines(
                 line_count, iter->count,
                 read_buffers, offset, parse->data_mask, line_buffer);
-            release_buffer(out_buffer, line_count * line_size_out);
+            if (pack->lines)
+                ok = write_packed_lines(out_buffer, pack, line_count);
+            else
+                release_buffer(out_buffer, line_count * line_size_out);
 
             count -= line_count;
             offset += line_count;
         }
 
-        ix_block += 1;
-        if (ix_block >= header->major_block_count)
-            ix_block = 0;
+        ix_block = next_block;
         offset = 0;
     }
 
@@ -471,120 +684,729 @@ static bool transfer_data(
 }
 
 
+/* For decimated data the data mask selects individual data fields that are
+ * going to be emitted, so we count them here. */
+static size_t d_output_size(unsigned int data_mask)
+{
+    unsigned int count =
+        ((data_mask >> 0) & 1) + ((data_mask >> 1) & 1) +
+        ((data_mask >> 2) & 1) + ((data_mask >> 3) & 1);
+    return count * FA_ENTRY_SIZE;
+}
+
+
+/* Writes the fields of data selected by data_mask to output, returning the
+ * updated output pointer. */
+static struct fa_entry *write_decimated_fields(
+    const struct decimated_data *data, unsigned int data_mask,
+    struct fa_entry *output)
+{
+    if (data_mask & 1)  *output++ = data->mean;
+    if (data_mask & 2)  *output++ = data->min;
+    if (data_mask & 4)  *output++ = data->max;
+    if (data_mask & 8)  *output++ = data->std;
+    return output;
+}
+
+
+/* Aggregates count samples into the requested number of buckets and writes a
+ * single line of decimated data for each bucket.  Bucket b covers the samples
+ * from b*count/buckets up to the start of the next bucket, so every bucket
+ * contains at least one sample. */
+static bool transfer_buckets(
+    const struct read_parse *parse, struct read_buffers *read_buffers,
+    const int archive[], struct write_buffer *out_buffer,
+    struct iter_mask *iter,
+    struct fa_accum accums[], uint64_t buckets,
+    unsigned int ix_block, unsigned int offset, uint64_t count)
+{
+    const struct reader *reader = parse->reader;
+    const struct disk_header *header = get_header();
+    size_t line_size_out = iter->count * d_output_size(parse->data_mask);
+
+    for (unsigned int i = 0; i < iter->count; i ++)
+        initialise_accum(&accums[i]);
+    uint64_t bucket = 0;                // Bucket being accumulated
+    uint64_t bucket_start = 0;          // First sample of current bucket
+    uint64_t bucket_end = count / buckets;
+    uint64_t sample = 0;                // Samples accumulated so far
+
+    bool ok = true;
+    while (ok  &&  sample < count)
+    {
+        unsigned int samples_read = reader->samples_per_fa_block;
+        /* All decimated fields are needed for aggregation. */
+        ok = reader->read_block(reader, archive, ix_block,
+            offset, samples_wanted(samples_read - offset, count - sample),
+            15, iter, read_buffers);
+
+        unsigned int next_block = ix_block + (1U << reader->block_group_log2);
+        if (next_block >= header->major_block_count)
+            next_block = 0;
+        if (ok  &&  reader->prefetch_block  &&
+            count - sample > samples_read - offset)
+            reader->prefetch_block(archive, next_block,
+                samples_wanted(samples_read,
+                    count - sample - (samples_read - offset)),
+                15, iter);
+
+        while (ok  &&  offset < samples_read  &&  sample < count)
+        {
+            /* Accumulate as much of the current bucket as this block holds. */
+            unsigned int line_count = samples_read - offset;
+            if (bucket_end - sample < line_count)
+                line_count = (unsigned int) (bucket_end - sample);
+            reader->accum_lines(
+                line_count, iter->count, read_buffers, offset, accums);
+            sample += line_count;
+            offset += line_count;
+
+            if (sample == bucket_end)
+            {
+                /* Bucket complete, write out one aggregated line. */
+                size_t buf_length;
+                struct fa_entry *output =
+                    get_buffer(out_buffer, line_size_out, &buf_length);
+                ok = output != NULL;
+                if (!ok)
+                    break;
+
+                unsigned int bucket_count =
+                    (unsigned int) (bucket_end - bucket_start);
+                for (unsigned int i = 0; i < iter->count; i ++)
+                {
+                    struct decimated_data result;
+                    compute_count_result(&accums[i], bucket_count, &result);
+                    output = write_decimated_fields(
+                        &result, parse->data_mask, output);
+                    initialise_accum(&accums[i]);
+                }
+                release_buffer(out_buffer, line_size_out);
+
+                bucket += 1;
+                bucket_start = bucket_end;
+                bucket_end = (bucket + 1) * count / buckets;
+            }
+        }
+
+        ix_block = next_block;
+        offset = 0;
+    }
+    return ok;
+}
+
+
 static bool read_data(
     int scon, const char *client_name, const struct read_parse *parse)
 {
     unsigned int ix_block, offset;      // Index of first point to send
     struct iter_mask iter = { 0 };      // List of IDs to read
-    int archive = -1;                   // Archive file for reading FA or D data
+    int archive[MAX_STRIPES];           // Archive files for reading FA or D data
+    bool archive_open = false;
     uint64_t samples = parse->samples;  // Number of samples to return
+    uint64_t buckets = parse->buckets;  // Number of buckets to return, if any
+    struct fa_accum *accums = NULL;     // Bucket accumulators, one for each ID
 
     /* Three lots of buffers from the pool: read buffers, write buffer and an
      * optional timestamp buffer. */
     ALLOCATE_READ_BUFFERS(read_buffers);    // Array of buffers, one for each ID
     ALLOCATE_WRITE_BUFFER(out_buffer, scon);  // Buffered writes
     ALLOCATE_TS_BUFFER(ts_buffer);      // For timestamps at end
+    struct pack_buffer pack = { .lines = NULL, .packed = NULL };
 
     bool ok =
         /* Convert timestamps into index block, offset and sample count. */
-        compute_start(
-            parse->reader, parse->start, parse->end, parse->send_all_data,
-            &samples, &ix_block, &offset)  &&
+        compute_start(parse->reader, parse, &samples, &ix_block, &offset)  &&
+        /* We can't send more buckets than there are samples. */
+        IF_(buckets > samples, DO_(buckets = samples))  &&
         /* If contiguous data requested ensure there are no gaps. */
         IF_(parse->only_contiguous,
             check_run(parse->reader,
                 parse->check_id0, ix_block, offset, samples))  &&
         /* Prepare the iteration mask for efficient data delivery. */
         mask_to_archive(&parse->read_mask, &iter)  &&
-        /* Capture all the buffers needed.  This can fail if there are too many
-         * readers trying to run at once. */
-        lock_buffers(&read_buffers, iter.count)  &&
+        IF_(buckets > 0,
+            TEST_NULL(accums = malloc(iter.count * sizeof(struct fa_accum))))  &&
+        /* Capture all the buffers needed, queueing for the read buffers if
+         * other readers are using the pool.  This can fail if there are too
+         * many readers trying to run at once. */
+        queue_lock_buffers(&read_buffers, iter.count,
+            parse->reader->samples_per_fa_block * parse->reader->sample_size,
+            (int) parse->priority)  &&
         allocate_write_buffer(&out_buffer, 1)  &&
         allocate_timestamp_buffer(
             parse->send_timestamp, parse->send_id0, &ts_buffer,
             parse->reader->samples_per_fa_block, samples)  &&
+        IF_(parse->compress, allocate_pack_buffer(parse, &iter, &pack))  &&
         /* Finally we're ready to go. */
-        TEST_IO(archive = open(archive_filename, O_RDONLY));
+        TEST_IO(archive[0] = open(archive_filename, O_RDONLY))  &&
+        UNLESS(
+            open_stripes(get_header(), O_RDONLY, false, archive),
+            close(archive[0]))  &&
+        DO_(archive_open = true);
     bool write_ok = report_socket_error(scon, client_name, ok);
 
     if (ok  &&  write_ok)
     {
         write_ok =
             IF_(parse->send_sample_count,
-                BUFFER_ITEM(&out_buffer, samples))  &&
+                IF_ELSE(buckets > 0,
+                    BUFFER_ITEM(&out_buffer, buckets),
+                    BUFFER_ITEM(&out_buffer, samples)))  &&
             send_timestamp_header(
                 parse->send_timestamp, parse->send_id0, &out_buffer,
                 parse->reader, ix_block, offset)  &&
-            transfer_data(
-                parse, &read_buffers, archive, &out_buffer,
-                &iter, &ts_buffer, ix_block, offset, samples)  &&
+            IF_ELSE(buckets > 0,
+                transfer_buckets(
+                    parse, &read_buffers, archive, &out_buffer,
+                    &iter, accums, buckets, ix_block, offset, samples),
+                transfer_data(
+                    parse, &read_buffers, archive, &out_buffer,
+                    &iter, &ts_buffer, &pack, ix_block, offset, samples))  &&
             flush_buffer(&out_buffer);
     }
 
+    free(accums);
+    release_pack_buffer(&pack);
     release_timestamp_buffer(&ts_buffer);
     release_write_buffer(&out_buffer);
     unlock_buffers(&read_buffers);
-    if (archive != -1)
-        TEST_IO(close(archive));
+    if (archive_open)
+    {
+        close_stripes(get_header(), archive);
+        TEST_IO(close(archive[0]));
+    }
 
     return write_ok;
 }
 
+/* Responds to a read request with the P option by sending just the position of
+ * the first sample instead of any data.  A client can use this to split a large
+ * request into pieces which start on block boundaries and join exactly. */
+static bool read_position(
+    int scon, const char *client_name, const struct read_parse *parse)
+{
+    unsigned int ix_block, offset;
+    uint64_t samples = parse->samples;
+    ALLOCATE_WRITE_BUFFER(out_buffer, scon);
+
+    bool ok =
+        compute_start(parse->reader, parse, &samples, &ix_block, &offset)  &&
+        TEST_OK_(parse->reader->block_group_log2 == 0,
+            "Start position not supported for this data")  &&
+        IF_(parse->only_contiguous,
+            check_run(parse->reader,
+                parse->check_id0, ix_block, offset, samples))  &&
+        allocate_write_buffer(&out_buffer, 1);
+    bool write_ok = report_socket_error(scon, client_name, ok);
+
+    if (ok  &&  write_ok)
+    {
+        struct read_position position = {
+            .block = ix_block,
+            .offset = offset,
+            .block_size = parse->reader->samples_per_fa_block,
+            .block_count = get_header()->major_block_count,
+        };
+        write_ok =
+            IF_(parse->send_sample_count, BUFFER_ITEM(&out_buffer, samples))  &&
+            BUFFER_ITEM(&out_buffer, position)  &&
+            flush_buffer(&out_buffer);
+    }
+
+    release_write_buffer(&out_buffer);
+    return write_ok;
+}
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Format specific definitions. */
 
-/* Forward declaration of the three reader definitions. */
+/* Forward declaration of the reader definitions. */
 static struct reader fa_reader;
 static struct reader d_reader;
 static struct reader dd_reader;
+static struct reader tier_readers[MAX_DECIMATION_TIERS]; // Set up at startup
 
 
-static bool read_fa_block(
-    int archive, unsigned int major_block, unsigned int id, void *block)
+/* Gathers runs of ids which are consecutive in the archive, and therefore
+ * adjacent on disk, into single IO vectors.  Returns the number of ids in the
+ * run starting at iter->index[start], and fills in iov if not NULL. */
+static unsigned int gather_id_run(
+    const struct iter_mask *iter, unsigned int start, size_t block_size,
+    struct read_buffers *read_buffers, struct iovec iov[])
+{
+    unsigned int first = iter->index[start];
+    unsigned int n = 0;
+    while (start + n < iter->count  &&  n < IOV_MAX  &&
+           iter->index[start + n] == first + n)
+    {
+        if (iov)
+            iov[n] = (struct iovec) {
+                .iov_base = read_buffers->buffers[start + n],
+                .iov_len = block_size };
+        n += 1;
+    }
+    return n;
+}
+
+/* Reads the given IO vector in full, allowing for short reads. */
+static bool read_iov(int archive, struct iovec *iov, int count, off64_t offset)
+{
+    bool ok = true;
+    while (ok  &&  count > 0)
+    {
+        ssize_t rx = preadv(archive, iov, count, offset);
+        ok = TEST_IO(rx)  &&  TEST_OK_(rx > 0, "Unexpected end of archive");
+        if (ok)
+        {
+            offset += rx;
+            size_t length = (size_t) rx;
+            while (count > 0  &&  length >= iov->iov_len)
+            {
+                length -= iov->iov_len;
+                iov += 1;
+                count -= 1;
+            }
+            if (count > 0)
+            {
+                iov->iov_base += length;
+                iov->iov_len -= length;
+            }
+        }
+    }
+    return ok;
+}
+
+/* Gathers the blocks for the ids in iter which are not in the block cache into
+ * a list of misses, copying the rest from the cache.  Returns the number of
+ * misses. */
+static unsigned int find_misses(
+    enum cache_source source, unsigned int major_block, size_t block_size,
+    const struct iter_mask *iter, struct read_buffers *read_buffers,
+    struct iter_mask *misses, struct read_buffers *miss_read)
+{
+    miss_read->count = 0;
+    for (unsigned int i = 0; i < iter->count; i ++)
+        if (!lookup_cached_block(source, major_block, iter->index[i],
+                read_buffers->buffers[i], block_size))
+        {
+            misses->index[miss_read->count] = iter->index[i];
+            miss_read->buffers[miss_read->count] = read_buffers->buffers[i];
+            miss_read->count += 1;
+        }
+    misses->count = miss_read->count;
+    return misses->count;
+}
+
+static void cache_misses(
+    enum cache_source source, unsigned int major_block, size_t block_size,
+    const struct iter_mask *misses, struct read_buffers *miss_read,
+    unsigned int generation)
+{
+    for (unsigned int i = 0; i < misses->count; i ++)
+        cache_block(source, major_block, misses->index[i],
+            miss_read->buffers[i], block_size, generation);
+}
+
+
+/* A read of a short time window or of a subset of D fields only needs part of
+ * each block, which we describe as a short list of byte ranges. */
+#define MAX_BLOCK_RANGES    4
+
+struct block_part {
+    unsigned int count;         // Number of ranges to read, 0 for whole block
+    struct byte_range {
+        size_t start;
+        size_t length;
+    } ranges[MAX_BLOCK_RANGES];
+};
+
+/* Adds the range of bytes for samples first to first+count-1 of a column of
+ * samples of sample_size bytes starting at base.  The range is widened to page
+ * boundaries, and merged with the previous range if they meet. */
+static void add_block_range(
+    struct block_part *part, size_t base, size_t sample_size,
+    unsigned int first, unsigned int count)
+{
+    size_t begin = (base + first * sample_size) & ~(page_size - 1);
+    size_t end = (base + (first + count) * sample_size + page_size - 1) &
+        ~(page_size - 1);
+    struct byte_range *last =
+        part->count > 0 ? &part->ranges[part->count - 1] : NULL;
+    if (last  &&  begin <= last->start + last->length)
+    {
+        if (end > last->start + last->length)
+            last->length = end - last->start;
+    }
+    else
+        part->ranges[part->count++] = (struct byte_range) {
+            .start = begin, .length = end - begin };
+}
+
+/* Clips the ranges to the block, and if they still cover most of the block
+ * arranges to read the whole block instead so that it can be read together
+ * with its neighbours and cached. */
+static void finish_block_part(struct block_part *part, size_t block_size)
+{
+    size_t total = 0;
+    for (unsigned int i = 0; i < part->count; i ++)
+    {
+        struct byte_range *range = &part->ranges[i];
+        if (range->start + range->length > block_size)
+            range->length = block_size - range->start;
+        total += range->length;
+    }
+    if (2 * total > block_size)
+        part->count = 0;
+}
+
+/* Computes the part of a block of samples to read. */
+static void sample_block_part(
+    size_t block_size, size_t sample_size,
+    unsigned int first, unsigned int count, struct block_part *part)
+{
+    part->count = 0;
+    add_block_range(part, 0, sample_size, first, count);
+    finish_block_part(part, block_size);
+}
+
+static size_t block_part_length(const struct block_part *part, size_t block_size)
+{
+    if (part->count == 0)
+        return block_size;
+    else
+    {
+        size_t length = 0;
+        for (unsigned int i = 0; i < part->count; i ++)
+            length += part->ranges[i].length;
+        return length;
+    }
+}
+
+
+/* Reads block_size bytes for each id in iter where the block for archive index
+ * id starts at offset + id * block_size.  Blocks are taken from the block cache
+ * where possible, and the remaining adjacent blocks are read together with a
+ * single preadv() call.  If only part of each block is wanted then only that
+ * part of each missing block is read, and the blocks are not cached. */
+static bool read_id_blocks(
+    int archive, enum cache_source source, unsigned int major_block,
+    off64_t offset, size_t block_size, const struct block_part *part,
+    const struct iter_mask *iter, struct read_buffers *read_buffers)
+{
+    unsigned int generation = block_cache_generation(major_block);
+    struct iter_mask misses;
+    void *miss_buffers[MAX_FA_ENTRY_COUNT];
+    struct read_buffers miss_read = { .buffers = miss_buffers };
+    if (find_misses(source, major_block, block_size,
+            iter, read_buffers, &misses, &miss_read) == 0)
+        return true;
+
+    request_read(major_block,
+        misses.count * block_part_length(part, block_size));
+    bool ok = true;
+    if (part->count > 0)
+        for (unsigned int i = 0; ok  &&  i < misses.count; i ++)
+            for (unsigned int j = 0; ok  &&  j < part->count; j ++)
+            {
+                const struct byte_range *range = &part->ranges[j];
+                struct iovec iov = {
+                    .iov_base = miss_buffers[i] + range->start,
+                    .iov_len = range->length };
+                ok = read_iov(archive, &iov, 1, offset + (off64_t) (
+                    block_size * misses.index[i] + range->start));
+            }
+    else
+    {
+        for (unsigned int i = 0; ok  &&  i < misses.count; )
+        {
+            struct iovec iov[IOV_MAX];
+            unsigned int n =
+                gather_id_run(&misses, i, block_size, &miss_read, iov);
+            ok = read_iov(archive, iov, (int) n,
+                offset + (off64_t) (block_size * misses.index[i]));
+            i += n;
+        }
+
+        if (ok)
+            cache_misses(source, major_block, block_size,
+                &misses, &miss_read, generation);
+    }
+    return ok;
+}
+
+static void prefetch_id_blocks(
+    int archive, off64_t offset, size_t block_size,
+    const struct block_part *part, const struct iter_mask *iter)
+{
+    for (unsigned int i = 0; i < iter->count; )
+    {
+        off64_t start = offset + (off64_t) (block_size * iter->index[i]);
+        if (part->count > 0)
+        {
+            for (unsigned int j = 0; j < part->count; j ++)
+                IGNORE(TEST_0(posix_fadvise(archive,
+                    start + (off64_t) part->ranges[j].start,
+                    (off64_t) part->ranges[j].length, POSIX_FADV_WILLNEED)));
+            i += 1;
+        }
+        else
+        {
+            unsigned int n = gather_id_run(iter, i, block_size, NULL, NULL);
+            IGNORE(TEST_0(posix_fadvise(archive,
+                start, (off64_t) (block_size * n), POSIX_FADV_WILLNEED)));
+            i += n;
+        }
+    }
+}
+
+
+static size_t fa_block_size(void)
 {
     const struct disk_header *header = get_header();
-    size_t fa_block_size = FA_ENTRY_SIZE * header->major_sample_count;
-    off64_t offset = (off64_t) (
-        header->major_data_start +
-        (uint64_t) header->major_block_size * major_block +
-        fa_block_size * id);
-    return
-        DO_(request_read())  &&
-        TEST_IO(lseek(archive, offset, SEEK_SET))  &&
-        TEST_read(archive, block, fa_block_size);
+    return FA_ENTRY_SIZE * header->major_sample_count;
 }
 
-static bool read_d_block(
-    int archive, unsigned int major_block, unsigned int id, void *block)
+static size_t d_block_size(void)
 {
     const struct disk_header *header = get_header();
-    size_t fa_block_size = FA_ENTRY_SIZE * header->major_sample_count;
-    size_t d_block_size =
-        sizeof(struct decimated_data) * header->d_sample_count;
-    off64_t offset = (off64_t) (
-        header->major_data_start +
-        (uint64_t) header->major_block_size * major_block +
-        header->archive_mask_count * fa_block_size +
-        d_block_size * id);
-    return
-        DO_(request_read())  &&
-        TEST_IO(lseek(archive, offset, SEEK_SET))  &&
-        TEST_read(archive, block, d_block_size);
+    return sizeof(struct decimated_data) * header->d_sample_count;
 }
 
-static bool read_dd_block(
-    int archive, unsigned int major_block, unsigned int id, void *block)
+/* Offsets of the first FA and D blocks in the given major block.  In a
+ * compressed archive the D blocks come first and FA blocks are located through
+ * the column table. */
+static off64_t fa_block_offset(unsigned int major_block)
+{
+    return (off64_t) get_block_offset(major_block);
+}
+
+static off64_t d_block_offset(unsigned int major_block)
 {
     const struct disk_header *header = get_header();
-    size_t offset =
-        header->dd_total_count * id +
-        dd_reader.samples_per_fa_block * major_block;
+    if (header->fa_format == FA_FORMAT_RAW)
+        return fa_block_offset(major_block) +
+            (off64_t) (header->archive_mask_count * fa_block_size());
+    else
+        return (off64_t) get_block_offset(major_block);
+}
 
-    const struct decimated_data *dd_area = get_dd_area();
-    memcpy(block, dd_area + offset,
-        sizeof(struct decimated_data) * dd_reader.samples_per_fa_block);
-    return true;
+
+/* Computes the offset into the archive and the length of the packed FA blocks
+ * for count consecutive archive indexes starting at id. */
+static void packed_fa_extent(
+    unsigned int major_block, unsigned int id, unsigned int count,
+    off64_t *offset, size_t *length)
+{
+    const struct disk_header *header = get_header();
+    const uint32_t *columns = read_column_offsets(major_block);
+    unsigned int end_id = id + count;
+    uint32_t end = end_id < header->archive_mask_count ?
+        columns[end_id] : read_extent(major_block)->data_length;
+    *offset = fa_block_offset(major_block) + columns[id];
+    *length = end - columns[id];
+}
+
+
+/* For a compressed archive each run of adjacent packed blocks is read in one
+ * go into a scratch buffer and then unpacked into the read buffers. */
+static bool read_packed_fa_block(
+    int archive, unsigned int major_block, const struct iter_mask *iter,
+    struct read_buffers *read_buffers)
+{
+    size_t block_size = fa_block_size();
+    unsigned int generation = block_cache_generation(major_block);
+    struct iter_mask misses;
+    void *miss_buffers[MAX_FA_ENTRY_COUNT];
+    struct read_buffers miss_read = { .buffers = miss_buffers };
+    if (find_misses(CACHE_FA, major_block, block_size,
+            iter, read_buffers, &misses, &miss_read) == 0)
+        return true;
+
+    /* Account for the bytes we will actually read. */
+    size_t total_length = 0;
+    for (unsigned int i = 0; i < misses.count; )
+    {
+        unsigned int n = gather_id_run(&misses, i, block_size, NULL, NULL);
+        off64_t offset;
+        size_t length;
+        packed_fa_extent(major_block, misses.index[i], n, &offset, &length);
+        total_length += length;
+        i += n;
+    }
+    request_read(major_block, total_length);
+
+    unsigned int sample_count = get_header()->major_sample_count;
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < misses.count; )
+    {
+        unsigned int n = gather_id_run(&misses, i, block_size, NULL, NULL);
+        off64_t offset;
+        size_t length;
+        packed_fa_extent(major_block, misses.index[i], n, &offset, &length);
+
+        void *packed = malloc(length);
+        struct iovec iov = { .iov_base = packed, .iov_len = length };
+        ok = TEST_NULL(packed)  &&  read_iov(archive, &iov, 1, offset);
+        for (unsigned int j = 0; ok  &&  j < n; j ++)
+        {
+            unsigned int id = misses.index[i + j];
+            off64_t id_offset;
+            size_t id_length;
+            packed_fa_extent(major_block, id, 1, &id_offset, &id_length);
+            ok = unpack_fa_block(
+                packed + (id_offset - offset), id_length,
+                sample_count, miss_buffers[i + j]);
+        }
+        free(packed);
+        i += n;
+    }
+
+    if (ok)
+        cache_misses(CACHE_FA, major_block, block_size,
+            &misses, &miss_read, generation);
+    return ok;
+}
+
+static void prefetch_packed_fa_block(
+    int archive, unsigned int major_block, const struct iter_mask *iter)
+{
+    size_t block_size = fa_block_size();
+    for (unsigned int i = 0; i < iter->count; )
+    {
+        unsigned int n = gather_id_run(iter, i, block_size, NULL, NULL);
+        off64_t offset;
+        size_t length;
+        packed_fa_extent(major_block, iter->index[i], n, &offset, &length);
+        IGNORE(TEST_0(posix_fadvise(archive,
+            offset, (off64_t) length, POSIX_FADV_WILLNEED)));
+        i += n;
+    }
+}
+
+
+/* Returns the file handle of the stripe holding the given major block.  As
+ * successive blocks are on successive stripes, prefetching the next block
+ * while reading the current one keeps several disks busy at once. */
+static int stripe_file(const int archive[], unsigned int major_block)
+{
+    return archive[major_block_stripe(get_header(), major_block)];
+}
+
+/* The block being assembled is copied straight from memory, otherwise packed
+ * FA blocks are always read and unpacked in full. */
+static bool read_fa_block(
+    const struct reader *reader, const int archive[], unsigned int major_block,
+    unsigned int first, unsigned int count, unsigned int data_mask,
+    const struct iter_mask *iter, struct read_buffers *read_buffers)
+{
+    bool copied;
+    if (!read_live_fa_block(major_block, first, count,
+            iter->count, iter->index, read_buffers->buffers, &copied))
+        return false;
+    else if (copied)
+        return true;
+    else if (get_header()->fa_format == FA_FORMAT_RAW)
+    {
+        struct block_part part;
+        sample_block_part(fa_block_size(), FA_ENTRY_SIZE, first, count, &part);
+        return read_id_blocks(
+            stripe_file(archive, major_block), CACHE_FA, major_block,
+            fa_block_offset(major_block), fa_block_size(), &part,
+            iter, read_buffers);
+    }
+    else
+        return read_packed_fa_block(
+            archive[0], major_block, iter, read_buffers);
+}
+
+static void prefetch_fa_block(
+    const int archive[], unsigned int major_block,
+    unsigned int count, unsigned int data_mask,
+    const struct iter_mask *iter)
+{
+    if (get_header()->fa_format == FA_FORMAT_RAW)
+    {
+        struct block_part part;
+        sample_block_part(fa_block_size(), FA_ENTRY_SIZE, 0, count, &part);
+        prefetch_id_blocks(
+            stripe_file(archive, major_block),
+            fa_block_offset(major_block), fa_block_size(), &part, iter);
+    }
+    else
+        prefetch_packed_fa_block(archive[0], major_block, iter);
+}
+
+
+/* If D fields are stored separately then only the columns for the fields in
+ * data_mask are read. */
+static void d_block_part(
+    unsigned int first, unsigned int count, unsigned int data_mask,
+    struct block_part *part)
+{
+    const struct disk_header *header = get_header();
+    if (header->d_format == D_FORMAT_FIELDS)
+    {
+        size_t column_size = FA_ENTRY_SIZE * header->d_sample_count;
+        part->count = 0;
+        for (unsigned int field = 0; field < 4; field ++)
+            if ((data_mask >> field) & 1)
+                add_block_range(
+                    part, field * column_size, FA_ENTRY_SIZE, first, count);
+        finish_block_part(part, d_block_size());
+    }
+    else
+        sample_block_part(d_block_size(),
+            sizeof(struct decimated_data), first, count, part);
+}
+
+static bool read_d_block(
+    const struct reader *reader, const int archive[], unsigned int major_block,
+    unsigned int first, unsigned int count, unsigned int data_mask,
+    const struct iter_mask *iter, struct read_buffers *read_buffers)
+{
+    struct block_part part;
+    d_block_part(first, count, data_mask, &part);
+    return read_id_blocks(
+        stripe_file(archive, major_block), CACHE_D, major_block,
+        d_block_offset(major_block), d_block_size(), &part,
+        iter, read_buffers);
+}
+
+static void prefetch_d_block(
+    const int archive[], unsigned int major_block,
+    unsigned int count, unsigned int data_mask,
+    const struct iter_mask *iter)
+{
+    struct block_part part;
+    d_block_part(0, count, data_mask, &part);
+    prefetch_id_blocks(
+        stripe_file(archive, major_block),
+        d_block_offset(major_block), d_block_size(), &part, iter);
+}
+
+/* Reads DD or higher tier data from the DD area, either straight from memory
+ * or through the DD cache.  The requested block is always the first block of a
+ * group. */
+static bool read_dd_block(
+    const struct reader *reader, const int archive[], unsigned int major_block,
+    unsigned int first, unsigned int count, unsigned int data_mask,
+    const struct iter_mask *iter, struct read_buffers *read_buffers)
+{
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < iter->count; i ++)
+    {
+        size_t offset = reader->area_offset +
+            (size_t) reader->area_count * iter->index[i] +
+            reader->samples_per_fa_block *
+                (major_block >> reader->block_group_log2);
+        ok = read_dd_data(
+            sizeof(struct decimated_data) * offset,
+            sizeof(struct decimated_data) * reader->samples_per_fa_block,
+            read_buffers->buffers[i]);
+    }
+    return ok;
 }
 
 
@@ -613,54 +1435,124 @@ static void d_write_lines(
         for (unsigned int i = 0; i < field_count; i ++)
         {
             /* Each input buffer is an array of decimated_data structures which
-             * we index by offset, but we then cast this to an array of fa_entry
-             * structures to allow the individual fields to be selected by the
-             * data_mask. */
-            struct fa_entry *input = (struct fa_entry *)
-                &((struct decimated_data *) read_buffers->buffers[i])[offset];
-            if (data_mask & 1)  *output++ = input[0];
-            if (data_mask & 2)  *output++ = input[1];
-            if (data_mask & 4)  *output++ = input[2];
-            if (data_mask & 8)  *output++ = input[3];
+             * we index by offset, the individual fields are then selected by
+             * the data_mask. */
+            output = write_decimated_fields(
+                &((struct decimated_data *) read_buffers->buffers[i])[offset],
+                data_mask, output);
         }
         offset += 1;
     }
 }
 
 
-static size_t fa_output_size(unsigned int data_mask)
+static void fa_accum_lines(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset,
+    struct fa_accum accums[])
 {
-    return FA_ENTRY_SIZE;
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        const struct fa_entry *input =
+            (struct fa_entry *) read_buffers->buffers[i] + offset;
+        for (unsigned int l = 0; l < line_count; l ++)
+            accum_xy(&accums[i], &input[l]);
+    }
 }
 
-/* For decimated data the data mask selects individual data fields that are
- * going to be emitted, so we count them here. */
-static size_t d_output_size(unsigned int data_mask)
+static void d_accum_lines(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset,
+    struct fa_accum accums[])
 {
-    unsigned int count =
-        ((data_mask >> 0) & 1) + ((data_mask >> 1) & 1) +
-        ((data_mask >> 2) & 1) + ((data_mask >> 3) & 1);
-    return count * FA_ENTRY_SIZE;
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        const struct decimated_data *input =
+            (struct decimated_data *) read_buffers->buffers[i] + offset;
+        for (unsigned int l = 0; l < line_count; l ++)
+            accum_decimated(&accums[i], &input[l]);
+    }
+}
+
+
+/* If D fields are stored separately each D block holds four columns of
+ * d_sample_count values, one for each field. */
+static void d_fields_write_lines(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset,
+    unsigned int data_mask, void *p)
+{
+    struct fa_entry *output = (struct fa_entry *) p;
+    unsigned int column = get_header()->d_sample_count;
+    for (unsigned int l = 0; l < line_count; l ++)
+    {
+        for (unsigned int i = 0; i < field_count; i ++)
+        {
+            const struct fa_entry *input =
+                (struct fa_entry *) read_buffers->buffers[i] + offset;
+            for (unsigned int field = 0; field < 4; field ++)
+                if ((data_mask >> field) & 1)
+                    *output++ = input[field * column];
+        }
+        offset += 1;
+    }
+}
+
+static void d_fields_accum_lines(
+    unsigned int line_count, unsigned int field_count,
+    struct read_buffers *read_buffers, unsigned int offset,
+    struct fa_accum accums[])
+{
+    unsigned int column = get_header()->d_sample_count;
+    for (unsigned int i = 0; i < field_count; i ++)
+    {
+        const struct fa_entry *input =
+            (struct fa_entry *) read_buffers->buffers[i] + offset;
+        for (unsigned int l = 0; l < line_count; l ++)
+        {
+            struct decimated_data value = {
+                .mean = input[l],
+                .min = input[column + l],
+                .max = input[2 * column + l],
+                .std = input[3 * column + l] };
+            accum_decimated(&accums[i], &value);
+        }
+    }
+}
+
+
+static size_t fa_output_size(unsigned int data_mask)
+{
+    return FA_ENTRY_SIZE;
 }
 
 
 static struct reader fa_reader = {
     .read_block = read_fa_block,
+    .prefetch_block = prefetch_fa_block,
     .write_lines = fa_write_lines,
+    .accum_lines = fa_accum_lines,
     .output_size = fa_output_size,
     .decimation_log2 = 0,
+    .sample_size = FA_ENTRY_SIZE,
+    .live = true,
 };
 
 static struct reader d_reader = {
     .read_block = read_d_block,
+    .prefetch_block = prefetch_d_block,
     .write_lines = d_write_lines,
+    .accum_lines = d_accum_lines,
     .output_size = d_output_size,
+    .sample_size = sizeof(struct decimated_data),
 };
 
 static struct reader dd_reader = {
     .read_block = read_dd_block,
     .write_lines = d_write_lines,
+    .accum_lines = d_accum_lines,
     .output_size = d_output_size,
+    .sample_size = sizeof(struct decimated_data),
 };
 
 
@@ -678,13 +1570,24 @@ static struct reader dd_reader = {
  * The syntax is very simple (no spaces allowed):
  *
  *  read-request = "R" source "M" filter-mask start end options
- *  source = "F" | "D" [ "D" ] [ "F" data-mask ]
+ *  source = "F" | "D" [ "D" { "D" } ] [ "F" data-mask ]
  *  data-mask = integer
- *  start = time-or-seconds
- *  end = "N" samples | "E" time-or-seconds
+ *  start = time-or-seconds | "B" block "." offset
+ *  end = "N" samples | "E" time-or-seconds [ "K" buckets ]
  *  time-or-seconds = "T" date-time | "S" seconds [ "." nanoseconds ]
  *  samples = integer
+ *  buckets = integer
  *  options = [ "N" ] [ "A" ] [ "T" [ "E" | "A" ] ] [ "Z" ] [ "C" [ "Z" ] ]
+ *      [ "P" ] [ "X" ]
+ *
+ * Each further "D" after "DD" selects the next decimation tier above DD, if
+ * configured.
+ *
+ * If buckets are requested the requested time range is divided into the given
+ * number of buckets and a single decimated sample is returned for each bucket,
+ * aggregated from the coarsest source which still has at least one sample per
+ * bucket.  In this case the source only determines the data mask, with all
+ * fields returned for "F", and extended timestamps are not supported.
  *
  * The options can only appear in the order given and have the following
  * meanings:
@@ -697,9 +1600,31 @@ static struct reader dd_reader = {
  *  Z   Send id0 with data at the same time as the timestamp (or at start)
  *  C   Ensure no gaps in selected dataset, fail if any
  *  CZ  Include gaps generated by id0 in gap check
+ *  P   Send only the sample count and position of the first sample
+ *  X   Send data as compressed chunks, see compress.h
+ *
+ * A start of the form "B" block "." offset names a major block and an offset
+ * into it in units of the selected source, as returned by the P option.  This
+ * is only supported for FA and D data.
  */
 
-/* source = "F" | "D" [ "D" ] [ "F" data-mask ] . */
+/* Counts any further "D" characters after "DD" to select a decimation tier. */
+static bool parse_tier(const char **string, const struct reader **reader)
+{
+    unsigned int tier = 0;
+    while (read_char(string, 'D'))
+        tier += 1;
+    if (tier == 0)
+        return DO_(*reader = &dd_reader);
+    else
+        return
+            TEST_OK_(tier <= get_header()->tier_count,
+                "Decimation tier %u not available", tier)  &&
+            DO_(*reader = &tier_readers[tier - 1]);
+}
+
+
+/* source = "F" | "D" [ "D" { "D" } ] [ "F" data-mask ] . */
 static bool parse_source(const char **string, struct read_parse *parse)
 {
     if (read_char(string, 'F'))
@@ -711,7 +1636,10 @@ static bool parse_source(const char **string, struct read_parse *parse)
     {
         parse->data_mask = 15;      // Default to all fields if no mask
         if (read_char(string, 'D'))
-            parse->reader = &dd_reader;
+        {
+            if (!parse_tier(string, &parse->reader))
+                return false;
+        }
         else
             parse->reader = &d_reader;
         if (read_char(string, 'F'))
@@ -743,23 +1671,46 @@ static bool parse_time_or_seconds(const char **string, uint64_t *microseconds)
 }
 
 
-/* end = "N" samples | "E" time-or-seconds . */
-static bool parse_end(const char **string, uint64_t *end, uint64_t *samples)
+/* start = time-or-seconds | "B" block "." offset . */
+static bool parse_start(const char **string, struct read_parse *parse)
 {
-    *end = 0;
-    *samples = 0;
+    parse->start = 0;
+    parse->start_at_block = read_char(string, 'B');
+    if (parse->start_at_block)
+        return
+            parse_uint(string, &parse->start_block)  &&
+            parse_char(string, '.')  &&
+            parse_uint(string, &parse->start_offset);
+    else
+        return parse_time_or_seconds(string, &parse->start);
+}
+
+
+/* end = "N" samples | "E" time-or-seconds [ "K" buckets ] . */
+static bool parse_end(const char **string, struct read_parse *parse)
+{
+    parse->end = 0;
+    parse->samples = 0;
+    parse->buckets = 0;
     if (read_char(string, 'N'))
         return
-            parse_uint64(string, samples)  &&
-            TEST_OK_(*samples > 0, "No samples requested");
+            parse_uint64(string, &parse->samples)  &&
+            TEST_OK_(parse->samples > 0, "No samples requested");
     else if (read_char(string, 'E'))
-        return parse_time_or_seconds(string, end);
+        return
+            parse_time_or_seconds(string, &parse->end)  &&
+            IF_(read_char(string, 'K'),
+                parse_uint(string, &parse->buckets)  &&
+                TEST_OK_(parse->buckets > 0, "No buckets requested"));
     else
         return FAIL_("Expected count or end time");
 }
 
 
-/* options = [ "N" ] [ "A" ] [ "T" [ "E" | "A" ] ] [ "C" ] [ "Z" ] . */
+/* options =
+ *      [ "N" ] [ "A" ] [ "T" [ "E" | "A" ] ] [ "C" ] [ "Z" ] [ "P" ] [ "X" ]
+ *      [ "Q" priority ] .
+ */
 static bool parse_options(const char **string, struct read_parse *parse)
 {
     parse->send_sample_count = read_char(string, 'N');
@@ -773,7 +1724,10 @@ static bool parse_options(const char **string, struct read_parse *parse)
     parse->send_id0          = read_char(string, 'Z');
     parse->only_contiguous   = read_char(string, 'C');
     parse->check_id0 = parse->only_contiguous && read_char(string, 'Z');
-    return true;
+    parse->send_position     = read_char(string, 'P');
+    parse->compress          = read_char(string, 'X');
+    parse->priority = 0;
+    return IF_(read_char(string, 'Q'), parse_uint(string, &parse->priority));
 }
 
 
@@ -785,8 +1739,8 @@ static bool parse_read_request(const char **string, struct read_parse *parse)
         parse_source(string, parse)  &&
         parse_char(string, 'M')  &&
         parse_mask(string, fa_entry_count, &parse->read_mask)  &&
-        parse_time_or_seconds(string, &parse->start)  &&
-        parse_end(string, &parse->end, &parse->samples)  &&
+        parse_start(string, parse)  &&
+        parse_end(string, parse)  &&
         parse_options(string, parse);
 }
 
@@ -796,39 +1750,203 @@ static bool parse_read_request(const char **string, struct read_parse *parse)
 /* Read processing. */
 
 
+/* For bucket aggregation we choose the coarsest data source which still has at
+ * least one sample for each bucket over the requested range.  The decimation
+ * factors increase with each successive reader, so we keep the last which
+ * qualifies, falling back to FA data if all are too coarse. */
+static bool select_bucket_reader(struct read_parse *parse)
+{
+    const struct disk_header *header = get_header();
+    uint64_t fa_samples;
+    unsigned int ix_block, offset;
+    bool ok =
+        TEST_OK_(parse->send_timestamp == SEND_NOTHING  ||
+            parse->send_timestamp == SEND_BASIC,
+            "Extended timestamps not supported with buckets")  &&
+        TEST_OK_(!parse->send_position,
+            "Start position not supported with buckets")  &&
+        TEST_OK_(!parse->compress,
+            "Compression not supported with buckets")  &&
+        compute_start(&fa_reader, parse, &fa_samples, &ix_block, &offset);
+    if (ok)
+    {
+        if (parse->reader == &fa_reader)
+            parse->data_mask = 15;
+
+        const struct reader *readers[MAX_DECIMATION_TIERS + 3] = {
+            &fa_reader, &d_reader, &dd_reader };
+        unsigned int reader_count = 3;
+        for (unsigned int t = 0; t < header->tier_count; t ++)
+            readers[reader_count++] = &tier_readers[t];
+
+        parse->reader = &fa_reader;
+        for (unsigned int i = 0; i < reader_count; i ++)
+            if ((fa_samples >> readers[i]->decimation_log2) >= parse->buckets)
+                parse->reader = readers[i];
+    }
+    return ok;
+}
+
+
 /* Convert timestamp into block index. */
 bool process_read(int scon, const char *client_name, const char *buf)
 {
     struct read_parse parse;
     push_error_handling();      // Popped by report_socket_error()
-    if (DO_PARSE("read request", parse_read_request, buf, &parse))
-        return read_data(scon, client_name, &parse);
+    if (DO_PARSE("read request", parse_read_request, buf, &parse)  &&
+        IF_(parse.buckets > 0, select_bucket_reader(&parse)))
+        return IF_ELSE(parse.send_position,
+            read_position(scon, client_name, &parse),
+            read_data(scon, client_name, &parse));
     else
         return report_socket_error(scon, client_name, false);
 }
 
 
-bool initialise_reader(const char *archive)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Long term statistics. */
+
+/* Statistics over a time range are computed by merging the per block summaries
+ * maintained by the transform, so they cover whole major blocks.  The syntax
+ * is:
+ *
+ *  statistics-request = "Q" "M" filter-mask time-or-seconds
+ *      "E" time-or-seconds
+ *
+ * The response is a struct statistics_header followed by a struct
+ * id_statistics for each id in the mask, in ascending order. */
+static bool parse_statistics_request(
+    const char **string, struct filter_mask *mask,
+    uint64_t *start, uint64_t *end)
+{
+    return
+        parse_char(string, 'Q')  &&
+        parse_char(string, 'M')  &&
+        parse_mask(string, fa_entry_count, mask)  &&
+        parse_time_or_seconds(string, start)  &&
+        parse_char(string, 'E')  &&
+        parse_time_or_seconds(string, end)  &&
+        TEST_OK_(*start < *end, "Empty time range");
+}
+
+
+static void compute_id_statistics(
+    const struct block_statistics *stats, uint64_t samples,
+    struct id_statistics *result)
+{
+    double mean_x = (double) stats->sum_x / (double) samples;
+    double mean_y = (double) stats->sum_y / (double) samples;
+    double var_x = stats->sum_sq_x / (double) samples - mean_x * mean_x;
+    double var_y = stats->sum_sq_y / (double) samples - mean_y * mean_y;
+    *result = (struct id_statistics) {
+        .min_x = stats->min.x, .max_x = stats->max.x,
+        .min_y = stats->min.y, .max_y = stats->max.y,
+        .mean_x = mean_x, .mean_y = mean_y,
+        .std_x = var_x > 0 ? sqrt(var_x) : 0,
+        .std_y = var_y > 0 ? sqrt(var_y) : 0 };
+}
+
+
+bool process_statistics(int scon, const char *client_name, const char *buf)
+{
+    struct filter_mask mask;
+    uint64_t start, end;
+    struct iter_mask iter;
+    struct block_statistics *stats = NULL;
+    uint64_t samples, range_start, range_end;
+
+    push_error_handling();      // Popped by report_socket_error()
+    bool ok =
+        DO_PARSE("statistics request",
+            parse_statistics_request, buf, &mask, &start, &end)  &&
+        mask_to_archive(&mask, &iter)  &&
+        DO_(stats = calloc(iter.count, sizeof(struct block_statistics)))  &&
+        read_long_term_statistics(
+            start, end, iter.count, iter.index, stats,
+            &samples, &range_start, &range_end);
+    bool write_ok = report_socket_error(scon, client_name, ok);
+
+    if (ok  &&  write_ok)
+    {
+        struct statistics_header header = {
+            .start = range_start, .end = range_end, .samples = samples };
+        size_t length = iter.count * sizeof(struct id_statistics);
+        struct id_statistics *result = malloc(length);
+        for (unsigned int i = 0; i < iter.count; i ++)
+            compute_id_statistics(&stats[i], samples, &result[i]);
+        write_ok =
+            TEST_write(scon, &header, sizeof(header))  &&
+            TEST_write(scon, result, length);
+        free(result);
+    }
+
+    free(stats);
+    return write_ok;
+}
+
+
+
+bool initialise_reader(
+    const char *archive, size_t cache_size, size_t dd_cache_size)
 {
     const struct disk_header *header = get_header();
 
     archive_filename = archive;
     fa_entry_count = header->fa_entry_count;
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
 
     /* Initialise dynamic part of reader structures. */
     fa_reader.samples_per_fa_block  = header->major_sample_count;
 
     d_reader.decimation_log2        = header->first_decimation_log2;
     d_reader.samples_per_fa_block   = header->d_sample_count;
+    if (header->d_format == D_FORMAT_FIELDS)
+    {
+        d_reader.write_lines        = d_fields_write_lines;
+        d_reader.accum_lines        = d_fields_accum_lines;
+    }
 
     dd_reader.decimation_log2 =
         header->first_decimation_log2 + header->second_decimation_log2;
     dd_reader.samples_per_fa_block  = header->dd_sample_count;
+    dd_reader.area_offset           = 0;
+    dd_reader.area_count            = header->dd_total_count;
 
-    /* Make the buffer size large enough for a complete FA major block for one
-     * BPM id, allocate enough buffers to allow one user to capture a complete
-     * set of ids. */
+    /* Each higher tier either has a power of 2 samples per major block or
+     * spans a power of 2 major blocks with each sample. */
+    for (unsigned int t = 0; t < header->tier_count; t ++)
+    {
+        struct reader *reader = &tier_readers[t];
+        unsigned int tier_log2 = tier_decimation_log2(header, t);
+        unsigned int dd_sample_log2 =
+            (unsigned int) __builtin_ctz(header->dd_sample_count);
+        *reader = dd_reader;
+        reader->decimation_log2 += tier_log2;
+        if (tier_log2 < dd_sample_log2)
+            reader->samples_per_fa_block = header->dd_sample_count >> tier_log2;
+        else
+        {
+            reader->samples_per_fa_block = 1;
+            reader->block_group_log2 = tier_log2 - dd_sample_log2;
+        }
+        reader->area_offset = tier_data_offset(header, t);
+        reader->area_count = header->tier_total_count[t];
+    }
+
+    /* One buffer size class for the blocks read by each reader.  The largest
+     * holds a complete FA major block for one BPM id, and the pool has room
+     * for enough of these to allow one user to capture a complete set of
+     * ids. */
+    size_t buffer_sizes[MAX_DECIMATION_TIERS + 3] = {
+        fa_block_size(), d_block_size(),
+        dd_reader.samples_per_fa_block * dd_reader.sample_size };
+    unsigned int size_count = 3;
+    for (unsigned int t = 0; t < header->tier_count; t ++)
+        buffer_sizes[size_count++] =
+            tier_readers[t].samples_per_fa_block * tier_readers[t].sample_size;
     initialise_buffer_pool(
-        FA_ENTRY_SIZE * header->major_sample_count, fa_entry_count);
-    return true;
+        buffer_sizes, size_count, fa_entry_count * fa_block_size());
+    return
+        initialise_block_cache(cache_size, header->major_block_count)  &&
+        initialise_dd_cache(archive, dd_cache_size);
 }
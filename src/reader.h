@@ -32,7 +32,16 @@
  * The first character in the buffer is R. */
 bool process_read(int scon, const char *client_name, const char *buf);
 
-bool initialise_reader(const char *archive);
+/* Processes a Q command requesting long term statistics for a set of ids over
+ * a time range. */
+bool process_statistics(int scon, const char *client_name, const char *buf);
+
+/* Prepares for reading from archive, with a shared cache of cache_size bytes
+ * for recently read blocks, or no cache if zero.  If dd_cache_size is non-zero
+ * DD data is paged from disk through a cache of this size instead of being
+ * read from memory. */
+bool initialise_reader(
+    const char *archive, size_t cache_size, size_t dd_cache_size);
 
 
 /* Timestamp header when sending extended data. */
@@ -41,6 +50,22 @@ struct extended_timestamp_header {
     uint32_t offset;            // Offset into block of first sample sent
 } __attribute__((packed));
 
+/* Position of the first sample sent in response to the P option, which allows
+ * a range to be split into pieces starting on block boundaries. */
+struct read_position {
+    uint32_t block;             // Major block containing first sample
+    uint32_t offset;            // Offset into block of first sample
+    uint32_t block_size;        // Number of samples in each major block
+    uint32_t block_count;       // Number of major blocks in archive
+} __attribute__((packed));
+
+/* Header of each chunk of compressed data, sent in place of the frames when
+ * compression is requested.  The packed frames follow, see compress.h. */
+struct compressed_chunk {
+    uint32_t sample_count;      // Number of frames in this chunk
+    uint32_t length;            // Length of packed frames following
+} __attribute__((packed));
+
 /* Timestamp sent at head of each block. */
 struct extended_timestamp {
     uint64_t timestamp;         // Start of block in microseconds
@@ -51,3 +76,18 @@ struct extended_timestamp_id0 {
     uint32_t duration;          // Duration of block in microseconds
     uint32_t id_zero;           // CC cycle number
 } __attribute__((packed));
+
+/* Response to a long term statistics request: the time range actually covered,
+ * which is rounded out to whole major blocks, and the number of FA samples
+ * covered, followed by an id_statistics for each requested id. */
+struct statistics_header {
+    uint64_t start;             // Start of first block in microseconds
+    uint64_t end;               // End of last block in microseconds
+    uint64_t samples;           // Number of FA samples summarised
+} __attribute__((packed));
+struct id_statistics {
+    int32_t min_x, max_x;
+    int32_t min_y, max_y;
+    double mean_x, mean_y;
+    double std_x, std_y;
+} __attribute__((packed));
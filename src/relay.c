@@ -0,0 +1,272 @@
+/* Relay of the live data stream from an upstream archiver.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "parse.h"
+#include "sniffer.h"
+#include "buffer.h"
+#include "reader.h"
+
+#include "relay.h"
+
+
+/* Default port of the upstream archiver. */
+#define DEFAULT_PORT    8888
+
+/* If nothing arrives from upstream for this long the connection is treated as
+ * lost and will be reconnected. */
+#define TIMEOUT_SECS    5
+
+
+static char *upstream_host;
+static int upstream_port = DEFAULT_PORT;
+static unsigned int fa_entry_count;
+
+/* Connection to upstream, or -1 if not connected.  We connect lazily on the
+ * first read after a reset so that a missing upstream behaves like any other
+ * sniffer failure. */
+static int relay_socket = -1;
+static bool interrupted = false;
+
+/* Upstream data arrives in blocks of upstream_block_size rows, each preceded by
+ * its start timestamp and duration.  We keep track of where we are in the
+ * current upstream block so that timestamps can be computed for blocks of our
+ * own size. */
+static unsigned int upstream_block_size;
+static unsigned int rows_left;          // Rows still to read in current block
+static struct extended_timestamp block_timestamp;
+
+
+static bool connect_upstream(void)
+{
+    struct sockaddr_in s_in = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t) upstream_port)
+    };
+    struct timeval rx_timeout = { .tv_sec = TIMEOUT_SECS, .tv_usec = 0 };
+    struct hostent *hostent;
+    int sock;
+    bool ok =
+        TEST_NULL_(
+            hostent = gethostbyname(upstream_host),
+            "Unable to resolve upstream \"%s\"", upstream_host)  &&
+        DO_(memcpy(
+            &s_in.sin_addr.s_addr, hostent->h_addr,
+            (size_t) hostent->h_length))  &&
+        TEST_IO(sock = socket(AF_INET, SOCK_STREAM, 0))  &&
+        UNLESS(
+            TEST_IO(setsockopt(
+                sock, SOL_SOCKET, SO_RCVTIMEO,
+                &rx_timeout, sizeof(rx_timeout)))  &&
+            TEST_IO_(
+                connect(sock, (struct sockaddr *) &s_in, sizeof(s_in)),
+                "Unable to connect to upstream %s:%d",
+                upstream_host, upstream_port),
+
+            // Close sock if connect failed
+            TEST_IO(close(sock)));
+    if (ok)
+        relay_socket = sock;
+    return ok;
+}
+
+
+/* After sending the subscription the upstream server responds with a single
+ * null character on success, otherwise with an error message. */
+static bool check_response(void)
+{
+    char response[256];
+    bool ok = TEST_read_(relay_socket, response, 1, "No response from upstream");
+    if (ok  &&  response[0] != '\0')
+    {
+        ssize_t rx = ensure_read(
+            relay_socket, response + 1, sizeof(response) - 2);
+        response[rx > 0 ? rx + 1 : 1] = '\0';
+        ok = FAIL_("Upstream subscription refused: %s", response);
+    }
+    return ok;
+}
+
+
+/* We subscribe to the full set of ids with extended timestamps, so the data
+ * arrives exactly as upstream captured it together with its timing. */
+static bool subscribe_upstream(void)
+{
+    char request[64];
+    int length = snprintf(request, sizeof(request),
+        "S0-%uTEU\n", fa_entry_count - 1);
+    struct extended_timestamp_header header;
+    bool ok =
+        connect_upstream()  &&
+        TEST_write_(relay_socket, request, (size_t) length,
+            "Unable to send subscription")  &&
+        check_response()  &&
+        TEST_read_(relay_socket, &header, sizeof(header),
+            "Unable to read subscription header")  &&
+        TEST_OK_(header.block_size > 0, "Invalid upstream block size");
+    if (ok)
+    {
+        upstream_block_size = header.block_size;
+        rows_left = 0;
+        log_message("Relaying data from %s:%d", upstream_host, upstream_port);
+    }
+    return ok;
+}
+
+
+static void close_upstream(void)
+{
+    if (relay_socket >= 0)
+    {
+        IGNORE(TEST_IO(close(relay_socket)));
+        relay_socket = -1;
+    }
+}
+
+
+/* Reads the requested number of rows, crossing upstream block boundaries as
+ * necessary.  The timestamp returned is interpolated to the end of the last
+ * row read, which is the convention used by the sniffer device. */
+static bool read_relay_block(
+    struct fa_row *rows, size_t size, uint64_t *timestamp)
+{
+    if (interrupted)
+        return false;
+    if (relay_socket < 0  &&  !subscribe_upstream())
+    {
+        close_upstream();
+        return false;
+    }
+
+    size_t row_size = fa_entry_count * FA_ENTRY_SIZE;
+    size_t row_count = size / row_size;
+    void *buffer = rows;
+    bool ok = true;
+    while (ok  &&  row_count > 0)
+    {
+        if (rows_left == 0)
+        {
+            ok = TEST_read_(relay_socket,
+                &block_timestamp, sizeof(block_timestamp),
+                "Lost connection to upstream");
+            rows_left = upstream_block_size;
+        }
+        if (ok)
+        {
+            size_t to_read = row_count < rows_left ? row_count : rows_left;
+            ok = TEST_read_(relay_socket, buffer, to_read * row_size,
+                "Lost connection to upstream");
+            buffer += to_read * row_size;
+            row_count -= to_read;
+            rows_left -= (unsigned int) to_read;
+        }
+    }
+
+    if (ok  &&  !interrupted)
+        *timestamp = block_timestamp.timestamp +
+            (uint64_t) block_timestamp.duration *
+                (upstream_block_size - rows_left) / upstream_block_size;
+    else
+        close_upstream();
+    return ok  &&  !interrupted;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Sniffer interface. */
+
+static bool reset_relay(void)
+{
+    close_upstream();
+    interrupted = false;
+    return true;
+}
+
+static bool read_relay_status(struct fa_status *status)
+{
+    errno = 0;
+    return FAIL_("Sniffer status unavailable in relay mode");
+}
+
+/* Shutting down the socket wakes up any read in progress. */
+static bool interrupt_relay(void)
+{
+    interrupted = true;
+    int sock = relay_socket;
+    return IF_(sock >= 0, TEST_IO(shutdown(sock, SHUT_RDWR)));
+}
+
+static const struct sniffer_context sniffer_relay = {
+    .reset = reset_relay,
+    .read = read_relay_block,
+    .status = read_relay_status,
+    .interrupt = interrupt_relay,
+};
+
+
+/* upstream = server [ ":" port ] . */
+static bool parse_upstream(const char *upstream)
+{
+    upstream_host = strdup(upstream);
+    char *colon = strchr(upstream_host, ':');
+    if (colon)
+    {
+        *colon = '\0';
+        return
+            DO_PARSE("upstream port", parse_int, colon + 1, &upstream_port)  &&
+            TEST_OK_(0 < upstream_port  &&  upstream_port < 65536,
+                "Invalid upstream port %d", upstream_port);
+    }
+    else
+        return true;
+}
+
+
+const struct sniffer_context *initialise_relay(
+    const char *upstream, unsigned int _fa_entry_count)
+{
+    fa_entry_count = _fa_entry_count;
+    bool ok =
+        parse_upstream(upstream)  &&
+        TEST_OK_(*upstream_host != '\0', "No upstream server specified");
+    return ok ? &sniffer_relay : NULL;
+}
@@ -50,39 +50,84 @@
 #include "replay.h"
 
 
-static unsigned int *column_index;  // Converts FA id to data column
+/* Nominal interval between replayed rows in nanoseconds. */
+#define ROW_INTERVAL    100000
+
+
+/* Each replay file is mapped into memory in its entirety and the files are
+ * replayed one after another in a continuous cycle. */
+struct replay_file {
+    unsigned int *column_index;     // Converts FA id to data column
+    unsigned int row_count;         // Number of rows available for replay
+    char *first_row;                // Pointer to first row of data
+    unsigned int row_size;          // Length of an individual row
+    // Converts data to fa_entry
+    void (*convert_row)(
+        const struct replay_file *file, const void *data, struct fa_row *row);
+};
+
+static struct replay_file replay_files[MAX_REPLAY_FILES];
+static unsigned int replay_file_count;
 static unsigned int fa_entry_count;
 
-static unsigned int replay_row_count; // Number of rows available for replay
-static char *replay_first_row;      // Pointer to first row of data
+static struct replay_file *replay_file; // File currently being replayed
 static unsigned int replay_index;   // Count of row currently being read
 static void *replay_row;            // Pointer to row being read
-static unsigned int replay_row_size; // Length of an individual row
-static int32_t replay_id0_start;    // Reset id0 to this at start of cycle
 static int32_t replay_id0;          // Current value of id0
-static void (*convert_row)(struct fa_row *row); // Converts data to fa_entry
 static bool interrupted = false;    // Used to implement interrupt functionality
 
+/* Replay is paced at replay_speed times the normal rate, or if replay_speed is
+ * zero as fast as the readers of replay_buffer can keep up. */
+static double replay_speed;
+static struct buffer *replay_buffer;
+static uint64_t replay_timestamp;   // Timestamp when not replaying in real time
+
 static struct timespec next_sleep;  // Used for uniform sleep intervals
 
 
-/* Advances target by requested number of nanoseconds (will silently go wrong
- * if duration >= 1s) and waits for it to come around. */
-static void sleep_until(unsigned int duration)
+/* Advances target by requested number of nanoseconds and waits for it to come
+ * around. */
+static void sleep_until(uint64_t duration)
 {
-    next_sleep.tv_nsec += (long) duration;
-    if (next_sleep.tv_nsec >= 1000000000)
-    {
-        next_sleep.tv_nsec -= 1000000000;
-        next_sleep.tv_sec += 1;
-    }
+    duration += (uint64_t) next_sleep.tv_nsec;
+    next_sleep.tv_sec += (time_t) (duration / 1000000000);
+    next_sleep.tv_nsec = (long) (duration % 1000000000);
     IGNORE(TEST_0(clock_nanosleep(
         CLOCK_MONOTONIC, TIMER_ABSTIME, &next_sleep, NULL)));
 }
 
+/* Unthrottled replay waits until every reader has at least half the buffer
+ * free before writing the next block. */
+static void wait_for_readers(void)
+{
+    unsigned int limit = (unsigned int) buffer_block_count(replay_buffer) / 2;
+    while (!interrupted  &&  get_reader_backlog(replay_buffer) > limit)
+        usleep(100);
+}
+
+/* Moves on to the next row, continuing with the next file at the end of each
+ * file.  As id0 carries on counting there is no gap between files. */
+static void advance_row(void)
+{
+    replay_index += 1;
+    if (replay_index < replay_file->row_count)
+        replay_row += replay_file->row_size;
+    else
+    {
+        replay_file += 1;
+        if (replay_file >= &replay_files[replay_file_count])
+            replay_file = replay_files;
+        replay_row = replay_file->first_row;
+        replay_index = 0;
+    }
+    replay_id0 += 1;
+}
+
 static bool read_replay_block(
     struct fa_row *rows, size_t size, uint64_t *timestamp)
 {
+    if (replay_speed == 0)
+        wait_for_readers();
     if (interrupted)
         return false;
 
@@ -91,27 +136,24 @@ static bool read_replay_block(
     {
         rows->row[0].x = replay_id0;
         rows->row[0].y = replay_id0;
-        convert_row(rows);
-
-        replay_index += 1;
-        if (replay_index < replay_row_count)
-        {
-            replay_row += replay_row_size;
-            replay_id0 += 1;
-        }
-        else
-        {
-            replay_row = replay_first_row;
-            replay_index = 0;
-            replay_id0 = replay_id0_start;
-        }
+        replay_file->convert_row(replay_file, replay_row, rows);
+        advance_row();
 
         rows = (void *) rows + fa_entry_count * FA_ENTRY_SIZE;
     }
 
-    // 100us = 100,000ns per row
-    sleep_until((unsigned int) (100000 * row_count));
-    *timestamp = get_timestamp();
+    if (replay_speed > 0)
+        sleep_until((uint64_t) ((double) (ROW_INTERVAL * row_count) /
+            replay_speed));
+    if (replay_speed == 1)
+        *timestamp = get_timestamp();
+    else
+    {
+        /* Timestamps advance at the normal rate so that the archive sees the
+         * data as if it had arrived in real time. */
+        replay_timestamp += ROW_INTERVAL / 1000 * row_count;
+        *timestamp = replay_timestamp;
+    }
     return true;
 }
 
@@ -121,12 +163,14 @@ static bool read_replay_block(
  * support a variety of conversions. */
 
 #define DEFINE_CONVERT(type) \
-    static void convert_xy_##type(struct fa_row *row) \
+    static void convert_xy_##type( \
+        const struct replay_file *file, const void *data, struct fa_row *row) \
     { \
         struct fa_entry *entry = &row->row[1]; \
         for (unsigned int j = 1; j < fa_entry_count; j ++) \
         { \
-            type *field = &((type *) replay_row)[2 * column_index[j]]; \
+            const type *field = \
+                &((const type *) data)[2 * file->column_index[j]]; \
             entry->x = (int32_t) field[0]; \
             entry->y = (int32_t) field[1]; \
             entry ++; \
@@ -140,7 +184,8 @@ DEFINE_CONVERT(double)
 static const struct convert
 {
     int data_type;
-    void (*convert)(struct fa_row *row);
+    void (*convert)(
+        const struct replay_file *file, const void *data, struct fa_row *row);
     size_t data_size;
 } convert_type[] = {
     { miINT16,  convert_xy_int16_t, sizeof(int16_t) },
@@ -148,12 +193,13 @@ static const struct convert
     { miDOUBLE, convert_xy_double,  sizeof(double) },
 };
 
-static bool convert_datatype(int data_type, size_t *data_size)
+static bool convert_datatype(
+    struct replay_file *file, int data_type, size_t *data_size)
 {
     for (unsigned int i = 0; i < ARRAY_SIZE(convert_type); i ++)
         if (convert_type[i].data_type == data_type)
         {
-            convert_row = convert_type[i].convert;
+            file->convert_row = convert_type[i].convert;
             *data_size  = convert_type[i].data_size;
             return true;
         }
@@ -164,43 +210,41 @@ static bool convert_datatype(int data_type, size_t *data_size)
 /* Prepares data array for replay.  The data has either two or three dimensions,
  * indexed as data[xy, fa_id, time]. */
 static void prepare_data_array(
-    const struct matlab_matrix *data, size_t data_size, unsigned int *columns)
+    struct replay_file *file, const struct matlab_matrix *data,
+    size_t data_size, unsigned int *columns)
 {
     *columns = data->dim_count > 2 ? data->dims[1] : 1;
 
-    replay_row_count = data->dim_count > 2 ? data->dims[2] : data->dims[1];
-    replay_first_row = data->real.start;
-    replay_index = 0;
-    replay_row = replay_first_row;
-    replay_row_size = *columns * 2 * (unsigned int) data_size;
+    file->row_count = data->dim_count > 2 ? data->dims[2] : data->dims[1];
+    file->first_row = data->real.start;
+    file->row_size = *columns * 2 * (unsigned int) data_size;
 
     /* Create a default column index by just cycling through the available
      * columns. */
-    column_index = calloc(fa_entry_count, sizeof(unsigned int));
+    file->column_index = calloc(fa_entry_count, sizeof(unsigned int));
     for (unsigned int i = 1; i < fa_entry_count; i ++)
-        column_index[i] = i % *columns;
-
-    /* By default replay id0 will start at zero. */
-    replay_id0_start = 0;
-    replay_id0 = replay_id0_start;
+        file->column_index[i] = i % *columns;
 }
 
 /* If an ids array has been given use this to ensure the correct FA ids are
  * replayed in the correct columns. */
 static void prepare_index_array(
-    const struct matlab_matrix *ids, unsigned int columns)
+    struct replay_file *file, const struct matlab_matrix *ids,
+    unsigned int columns)
 {
     /* Use ids to replace column entries. */
     uint8_t *id_array = (uint8_t *) ids->real.start;
     for (unsigned int i = 0; i < columns; i ++)
         if (id_array[i] < fa_entry_count)
-            column_index[id_array[i]] = i;
+            file->column_index[id_array[i]] = i;
 }
 
-static void prepare_id0(const struct matlab_matrix *id0)
+/* Only the id0 of the first file is used, after which id0 simply counts. */
+static void prepare_id0(
+    struct replay_file *file, const struct matlab_matrix *id0)
 {
-    replay_id0_start = ((int32_t *) id0->real.start)[0];
-    replay_id0 = replay_id0_start;
+    if (file == replay_files)
+        replay_id0 = ((int32_t *) id0->real.start)[0];
 }
 
 
@@ -222,7 +266,8 @@ static bool check_dimensions(
 }
 
 /* Searches matlab file for the arrays we need. */
-static bool prepare_replay_data(struct region *region)
+static bool prepare_replay_data(
+    struct replay_file *file, struct region *region)
 {
     bool found_data, found_ids, found_id0;
     struct matlab_matrix data, ids, id0;
@@ -233,8 +278,8 @@ static bool prepare_replay_data(struct region *region)
         find_matrix_by_name(region, "data", &found_data, &data)  &&
         TEST_OK_(found_data, "No data element in replay file")  &&
         check_dimensions("data", &data, 3, 2)  &&
-        convert_datatype(data.data_type, &data_size)  &&
-        DO_(prepare_data_array(&data, data_size, &columns))  &&
+        convert_datatype(file, data.data_type, &data_size)  &&
+        DO_(prepare_data_array(file, &data, data_size, &columns))  &&
 
         /* Prepare and validate the array of ids. */
         find_matrix_by_name(region, "ids",  &found_ids, &ids)  &&
@@ -242,14 +287,14 @@ static bool prepare_replay_data(struct region *region)
             check_dimensions("ids", &ids, 2, 1)  &&
             TEST_OK_(ids.dims[1] == columns, "Ids don't match data")  &&
             TEST_OK_(ids.data_type == miUINT8, "Bad datatype for ids")  &&
-            DO_(prepare_index_array(&ids, columns)))  &&
+            DO_(prepare_index_array(file, &ids, columns)))  &&
 
         /* Prepare id0 if present. */
         find_matrix_by_name(region, "id0", &found_id0, &id0)  &&
         IF_(found_id0,
             check_dimensions("id0", &id0, 2, 1)  &&
             TEST_OK_(id0.data_type == miINT32, "Bad datatype for id0")  &&
-            DO_(prepare_id0(&id0)));
+            DO_(prepare_id0(file, &id0)));
 
     return ok;
 }
@@ -283,20 +328,43 @@ static const struct sniffer_context sniffer_replay = {
 };
 
 
-const struct sniffer_context *initialise_replay(
-    const char *replay_filename, unsigned int _fa_entry_count)
+static bool load_replay_file(
+    struct replay_file *replay, const char *replay_filename)
 {
-    fa_entry_count = _fa_entry_count;
-
     int file;
     struct region region;
-    bool ok =
+    return
         TEST_IO_(file = open(replay_filename, O_RDONLY),
             "Unable to open replay file \"%s\"", replay_filename)  &&
         /* For simplicity, just map the entire file into memory! */
         map_matlab_file(file, &region)  &&
-        prepare_replay_data(&region)  &&
+        prepare_replay_data(replay, &region);
+}
 
+
+const struct sniffer_context *initialise_replay(
+    const char *const replay_filenames[], unsigned int file_count,
+    unsigned int _fa_entry_count, double speed, struct buffer *buffer)
+{
+    fa_entry_count = _fa_entry_count;
+    replay_file_count = file_count;
+    replay_speed = speed;
+    replay_buffer = buffer;
+
+    /* By default replay id0 will start at zero. */
+    replay_id0 = 0;
+    bool ok =
+        TEST_OK_(0 < file_count  &&  file_count <= MAX_REPLAY_FILES,
+            "Invalid number of replay files")  &&
+        TEST_OK_(speed >= 0, "Invalid replay speed");
+    for (unsigned int i = 0; ok  &&  i < file_count; i ++)
+        ok = load_replay_file(&replay_files[i], replay_filenames[i]);
+
+    replay_file = replay_files;
+    replay_index = 0;
+    replay_row = replay_file->first_row;
+    replay_timestamp = get_timestamp();
+    ok = ok  &&
         /* Finally prepare the replay sleep target.  This ensures we pace the
          * data correctly. */
         TEST_IO(clock_gettime(CLOCK_MONOTONIC, &next_sleep));
@@ -27,6 +27,12 @@
  *      michael.abbott@diamond.ac.uk
  */
 
-/* Sniffer interface for replay. */
+/* Maximum number of files which can be replayed in turn. */
+#define MAX_REPLAY_FILES    16
+
+/* Sniffer interface for replay.  The given files are replayed in turn in a
+ * continuous cycle at speed times the normal FA rate, or as fast as the readers
+ * of buffer can accept the data if speed is zero. */
 const struct sniffer_context *initialise_replay(
-    const char *replay_filename, unsigned int fa_entry_count);
+    const char *const replay_filenames[], unsigned int file_count,
+    unsigned int fa_entry_count, double speed, struct buffer *buffer);
@@ -0,0 +1,119 @@
+/* Archiver request formatting and timestamp conversion.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "matlab.h"
+#include "reader.h"
+
+#include "request.h"
+
+
+void format_read_source(
+    char *source, enum data_format data_format, unsigned int dd_tier,
+    unsigned int data_mask)
+{
+    switch (data_format)
+    {
+        case DATA_FA:   sprintf(source, "F");                   break;
+        case DATA_D:    sprintf(source, "DF%u",  data_mask);    break;
+        case DATA_DD:
+        {
+            /* Each higher tier is selected by a further D. */
+            char *s = source + sprintf(source, "DD");
+            for (unsigned int t = 0; t < dd_tier; t ++)
+                *s++ = 'D';
+            sprintf(s, "F%u", data_mask);
+            break;
+        }
+    }
+}
+
+
+time_t local_time_offset(void)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    return timegm(&tm) - now;
+}
+
+
+/* First we need to compute the starting timestamp and day_zero and then from
+ * this the timestamp offset used in the conversion below. */
+void prepare_timestamps(
+    struct timestamp_conversion *conversion,
+    const struct extended_timestamp_header *header,
+    const struct extended_timestamp_id0 *first_block,
+    time_t local_offset, bool subtract_day_zero,
+    double *timestamp, double *day_zero)
+{
+    conversion->block_size = header->block_size;
+    /* Matlab epoch in archive units, taking the local offset into account. */
+    conversion->offset = (uint64_t) 1000000 *
+        ((uint64_t) local_offset + (uint64_t) SECS_PER_DAY * MATLAB_EPOCH);
+    /* Timestamp of first point in captured data in archive epoch. */
+    uint64_t start_ts =
+        first_block->timestamp +
+        (uint64_t) first_block->duration * header->offset / header->block_size;
+    /* Can now compute timestamp and day */
+    *timestamp =
+        1e-6 / SECS_PER_DAY * (double) (start_ts + conversion->offset);
+    *day_zero = floor(*timestamp);
+
+    if (subtract_day_zero)
+        conversion->offset -= (uint64_t) (1e6 * SECS_PER_DAY * *day_zero);
+}
+
+
+void convert_timestamps(
+    const struct timestamp_conversion *conversion,
+    const struct extended_timestamp_id0 *block, double *result)
+{
+    unsigned int block_size = conversion->block_size;
+    double scaling = 1e-6 / SECS_PER_DAY;
+    double increment = (scaling * block->duration) / block_size;
+    double timestamp =
+        scaling * (double) (block->timestamp + conversion->offset);
+    double delta = 0.0;     // Separate accumulator to improve precision
+
+    for (unsigned int i = 0; i < block_size; i ++)
+    {
+        result[i] = timestamp + delta;
+        delta += increment;
+    }
+}
@@ -0,0 +1,71 @@
+/* Archiver request formatting and timestamp conversion.
+ *
+ * Copyright (c) 2026 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* These helpers are shared between fa-capture and the fa_load MEX file so that
+ * both format archive requests and convert returned timestamps identically. */
+
+enum data_format { DATA_FA, DATA_D, DATA_DD };
+
+/* Space needed for the data source returned by format_read_source(). */
+#define READ_SOURCE_BYTES   16
+
+/* Formats the data source part of an R command: F for FA data, D for the first
+ * decimation, or DD followed by dd_tier further Ds for double decimated data
+ * and higher tiers.  Decimated data is followed by its field mask. */
+void format_read_source(
+    char *source, enum data_format data_format, unsigned int dd_tier,
+    unsigned int data_mask);
+
+/* Computes the offset from local time to UTC.  This is needed to fix up matlab
+ * timestamps. */
+time_t local_time_offset(void);
+
+
+/* Conversion of extended timestamp blocks into Matlab timestamps for each
+ * sample, in days since the Matlab epoch or since day zero. */
+struct timestamp_conversion {
+    unsigned int block_size;    // Number of samples in each timestamp block
+    uint64_t offset;            // Added to server timestamps before scaling
+};
+
+/* Prepares timestamp conversion from the extended timestamp header and the
+ * first timestamp block received, returning the timestamp of the first sample
+ * and its day.  If subtract_day_zero is set converted timestamps are relative
+ * to day_zero. */
+void prepare_timestamps(
+    struct timestamp_conversion *conversion,
+    const struct extended_timestamp_header *header,
+    const struct extended_timestamp_id0 *first_block,
+    time_t local_offset, bool subtract_day_zero,
+    double *timestamp, double *day_zero);
+
+/* Computes the timestamps of all block_size samples in one block. */
+void convert_timestamps(
+    const struct timestamp_conversion *conversion,
+    const struct extended_timestamp_id0 *block, double *result);
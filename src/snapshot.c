@@ -0,0 +1,679 @@
+/* Triggered snapshots of the live FA data stream
+ *
+ * Copyright (c) 2012 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "buffer.h"
+#include "parse.h"
+#include "socket_server.h"
+#include "disk.h"
+#include "transform.h"
+#include "locking.h"
+#include "list.h"
+
+#include "snapshot.h"
+
+
+/* Default snapshot window and number of snapshots kept. */
+#define DEFAULT_WINDOW          10000
+#define DEFAULT_SNAPSHOTS       8
+
+#define MAX_TRIGGERS            16
+/* Trigger index recorded for snapshots fired by the TF command. */
+#define EXTERNAL_TRIGGER        MAX_TRIGGERS
+
+#define WRITE_BUFFER_SIZE       (1 << 16)
+
+
+/* Block buffer for full resolution FA data. */
+static struct buffer *fa_block_buffer;
+static unsigned int fa_entry_count;
+static unsigned int frame_count;        // Number of frames in each block
+
+/* Set if snapshots have been configured on the command line. */
+static bool snapshots_enabled;
+/* Snapshot window in samples and number of snapshots kept. */
+static unsigned int pre_samples = DEFAULT_WINDOW;
+static unsigned int post_samples = DEFAULT_WINDOW;
+static unsigned int max_snapshots = DEFAULT_SNAPSHOTS;
+/* The window is captured in whole buffer blocks either side of the block
+ * containing the trigger. */
+static unsigned int pre_blocks;
+static unsigned int post_blocks;
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Trigger definitions. */
+
+enum trigger_type {
+    TRIGGER_EVENTS,                 // Any of mask set in event id
+    TRIGGER_THRESHOLD,              // Position of id beyond limit
+};
+
+struct trigger {
+    enum trigger_type type;
+    unsigned int id;                // FA id tested by this trigger
+    uint32_t mask;                  // Event bits for events trigger
+    uint32_t limit;                 // Threshold for threshold trigger
+    bool armed;                     // Cleared while trigger condition holds
+};
+
+static struct trigger triggers[MAX_TRIGGERS];
+static unsigned int trigger_count;
+
+/* Set by the TF command, consumed by the snapshot thread. */
+static bool external_trigger;
+
+
+static uint32_t magnitude(int32_t x)
+{
+    return x < 0 ? - (uint32_t) x : (uint32_t) x;
+}
+
+
+/* Searches the block for the first sample satisfying the trigger condition,
+ * returns false if there is none. */
+static bool test_trigger(
+    const struct trigger *trigger, const struct fa_entry *block,
+    unsigned int *frame)
+{
+    const struct fa_entry *entry = block + trigger->id;
+    for (unsigned int f = 0; f < frame_count; f ++)
+    {
+        bool fired;
+        if (trigger->type == TRIGGER_EVENTS)
+            fired = (((uint32_t) entry->x | (uint32_t) entry->y) &
+                trigger->mask) != 0;
+        else
+            fired =
+                magnitude(entry->x) > trigger->limit  ||
+                magnitude(entry->y) > trigger->limit;
+        if (fired)
+        {
+            *frame = f;
+            return true;
+        }
+        entry += fa_entry_count;
+    }
+    return false;
+}
+
+
+/* Checks all the triggers against the block, returning the earliest triggering
+ * sample.  A trigger which fires is disarmed until a block is seen in which it
+ * doesn't fire, so that a condition which persists only fires once.  The
+ * external trigger is only consumed if wanted is set. */
+static bool check_triggers(
+    const struct fa_entry *block, bool wanted,
+    unsigned int *trigger, unsigned int *frame)
+{
+    bool fired = false;
+    *frame = frame_count;
+    for (unsigned int i = 0; i < trigger_count; i ++)
+    {
+        unsigned int f;
+        bool test = test_trigger(&triggers[i], block, &f);
+        if (test  &&  triggers[i].armed  &&  f < *frame)
+        {
+            *trigger = i;
+            *frame = f;
+            fired = true;
+        }
+        triggers[i].armed = !test;
+    }
+
+    if (wanted  &&  !fired  &&
+        __atomic_exchange_n(&external_trigger, false, __ATOMIC_ACQ_REL))
+    {
+        *trigger = EXTERNAL_TRIGGER;
+        *frame = 0;
+        fired = true;
+    }
+    return wanted  &&  fired;
+}
+
+
+/* Formats trigger in the syntax used to define it. */
+static void format_trigger(unsigned int trigger, char *string, size_t length)
+{
+    if (trigger == EXTERNAL_TRIGGER)
+        snprintf(string, length, "external");
+    else if (triggers[trigger].type == TRIGGER_EVENTS)
+        snprintf(string, length, "E%"PRIu32, triggers[trigger].mask);
+    else
+        snprintf(string, length, "B%u:%"PRIu32,
+            triggers[trigger].id, triggers[trigger].limit);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Snapshot store. */
+
+struct snapshot {
+    struct list_head list;          // Position in list of stored snapshots
+    unsigned int id;                // Identifies snapshot to clients
+    unsigned int references;        // Store and clients fetching snapshot
+    unsigned int trigger;           // Index of trigger or EXTERNAL_TRIGGER
+    uint64_t timestamp;             // Timestamp of first sample
+    uint32_t sample_count;          // Number of samples captured so far
+    uint32_t trigger_offset;        // Index of triggering sample
+    struct fa_entry *data;          // Captured frames
+};
+
+/* The store holds the most recent max_snapshots snapshots, oldest first.  A
+ * snapshot evicted from the store while a client is fetching it is released
+ * when the fetch completes. */
+DECLARE_LOCKING(store_lock);
+static LIST_HEAD(snapshot_list);
+static unsigned int snapshot_count;
+static unsigned int last_snapshot_id;
+
+
+/* Drops a reference to the snapshot, called with store_lock held. */
+static void release_snapshot(struct snapshot *snapshot)
+{
+    snapshot->references -= 1;
+    if (snapshot->references == 0)
+    {
+        free(snapshot->data);
+        free(snapshot);
+    }
+}
+
+
+/* Adds a newly captured snapshot to the store, evicting the oldest snapshot
+ * if the store is full. */
+static void store_snapshot(struct snapshot *snapshot)
+{
+    LOCK(store_lock);
+    snapshot->id = ++ last_snapshot_id;
+    snapshot->references = 1;
+    list_add_tail(&snapshot->list, &snapshot_list);
+    snapshot_count += 1;
+    if (snapshot_count > max_snapshots)
+    {
+        struct snapshot *oldest =
+            container_of(snapshot_list.next, struct snapshot, list);
+        list_del(&oldest->list);
+        snapshot_count -= 1;
+        release_snapshot(oldest);
+    }
+    UNLOCK(store_lock);
+}
+
+
+/* Looks up the snapshot with the given id and takes a reference to it.  The
+ * result is returned through a pointer, as the compiler warns that a local
+ * variable updated under LOCK might be clobbered. */
+static void find_snapshot(unsigned int id, struct snapshot **result)
+{
+    *result = NULL;
+    LOCK(store_lock);
+    list_for_each_entry(struct snapshot, list, snapshot, &snapshot_list)
+        if (snapshot->id == id)
+        {
+            snapshot->references += 1;
+            *result = snapshot;
+            break;
+        }
+    UNLOCK(store_lock);
+}
+
+
+static void put_snapshot(struct snapshot *snapshot)
+{
+    LOCK(store_lock);
+    release_snapshot(snapshot);
+    UNLOCK(store_lock);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Snapshot capture. */
+
+/* The snapshot thread reads the FA buffer like any other reader, testing each
+ * block against the triggers.  When a trigger fires the blocks before the
+ * trigger are copied out of the buffer through a history reader, and the
+ * following blocks are collected as they arrive.  A gap in the data ends the
+ * snapshot early, and data before a gap in the history is discarded. */
+
+static struct reader_state *trigger_reader;
+static pthread_t snapshot_thread_id;
+static bool snapshot_running;
+
+/* Snapshot being captured, or NULL, and number of blocks still wanted. */
+static struct snapshot *capture;
+static unsigned int capture_blocks;
+
+
+/* Estimated duration of a block in microseconds. */
+static uint64_t block_duration(void)
+{
+    const struct disk_header *header = get_header();
+    return (uint64_t) frame_count * header->last_duration /
+        header->major_sample_count;
+}
+
+
+static void append_block(const void *block, uint64_t timestamp)
+{
+    /* Buffered timestamps mark the end of each block. */
+    if (capture->sample_count == 0)
+        capture->timestamp = timestamp - block_duration();
+    memcpy(capture->data + capture->sample_count * fa_entry_count,
+        block, buffer_block_size(fa_block_buffer));
+    capture->sample_count += frame_count;
+}
+
+
+/* Copies the blocks before the block now being read into the snapshot. */
+static void copy_history(void)
+{
+    unsigned int backlog = pre_blocks;
+    struct reader_state *history =
+        open_history_reader(trigger_reader, &backlog);
+    for (unsigned int i = 0; i < backlog; )
+    {
+        uint64_t timestamp;
+        const void *block = get_read_block(history, &timestamp);
+        if (block)
+        {
+            append_block(block, timestamp);
+            i += 1;
+            if (!release_read_block(history))
+            {
+                /* Overwritten while copying, we're too far behind. */
+                capture->sample_count = 0;
+                break;
+            }
+        }
+        else
+            /* A gap: only keep the data after the gap. */
+            capture->sample_count = 0;
+    }
+    close_reader(history);
+}
+
+
+static void start_capture(
+    const void *block, uint64_t timestamp,
+    unsigned int trigger, unsigned int frame)
+{
+    capture = malloc(sizeof(struct snapshot));
+    if (!TEST_NULL(capture))
+        return;
+    capture->data = malloc(
+        (pre_blocks + 1 + post_blocks) * buffer_block_size(fa_block_buffer));
+    if (!TEST_NULL(capture->data))
+    {
+        free(capture);
+        capture = NULL;
+        return;
+    }
+
+    capture->trigger = trigger;
+    capture->sample_count = 0;
+    copy_history();
+    capture->trigger_offset = capture->sample_count + frame;
+    append_block(block, timestamp);
+    capture_blocks = post_blocks;
+}
+
+
+static void discard_capture(void)
+{
+    if (capture)
+    {
+        log_message("Snapshot capture overrun, discarded");
+        free(capture->data);
+        free(capture);
+        capture = NULL;
+    }
+}
+
+
+static void complete_capture(void)
+{
+    char trigger[32];
+    format_trigger(capture->trigger, trigger, sizeof(trigger));
+    store_snapshot(capture);
+    log_message("Snapshot %u captured, trigger %s, %"PRIu32" samples",
+        capture->id, trigger, capture->sample_count);
+    capture = NULL;
+}
+
+
+static void *snapshot_thread(void *context)
+{
+    while (snapshot_running)
+    {
+        uint64_t timestamp;
+        const struct fa_entry *block =
+            get_read_block(trigger_reader, &timestamp);
+        if (block)
+        {
+            unsigned int trigger = 0, frame = 0;
+            if (check_triggers(block, capture == NULL, &trigger, &frame))
+                start_capture(block, timestamp, trigger, frame);
+            else if (capture)
+            {
+                append_block(block, timestamp);
+                capture_blocks -= 1;
+            }
+
+            if (!release_read_block(trigger_reader))
+                discard_capture();
+            else if (capture  &&  capture_blocks == 0)
+                complete_capture();
+        }
+        else if (capture)
+            /* A gap in the data ends the snapshot early. */
+            complete_capture();
+    }
+    discard_capture();
+    return NULL;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Snapshot commands. */
+
+
+/* Formats the list of snapshots into a string, one line per snapshot. */
+static void format_snapshot_list(char *string, size_t length)
+{
+    *string = '\0';
+    LOCK(store_lock);
+    char *s = string;
+    list_for_each_entry(struct snapshot, list, snapshot, &snapshot_list)
+    {
+        char trigger[32];
+        format_trigger(snapshot->trigger, trigger, sizeof(trigger));
+        s += snprintf(s, length - (size_t) (s - string),
+            "%u %"PRIu64".%06"PRIu64" %"PRIu32" %"PRIu32" %s\n",
+            snapshot->id,
+            snapshot->timestamp / 1000000, snapshot->timestamp % 1000000,
+            snapshot->sample_count, snapshot->trigger_offset, trigger);
+    }
+    UNLOCK(store_lock);
+}
+
+
+static bool send_snapshot_list(int scon)
+{
+    size_t length = 128 * max_snapshots + 2;
+    char *string = malloc(length);
+    format_snapshot_list(string, length - 1);
+    strcat(string, "\n");
+    bool ok = TEST_write_(
+        scon, string, strlen(string), "Unable to write snapshot list");
+    free(string);
+    return ok;
+}
+
+
+/* Sends the selected ids of the snapshot, preceded by its header.  The ids are
+ * gathered into a buffer in chunks unless all ids are wanted. */
+static bool send_snapshot(
+    int scon, const struct snapshot *snapshot, const struct filter_mask *mask)
+{
+    struct snapshot_header header = {
+        .sample_count = snapshot->sample_count,
+        .trigger_offset = snapshot->trigger_offset,
+        .timestamp = snapshot->timestamp };
+    bool ok = TEST_write(scon, &header, sizeof(header));
+
+    unsigned int id_count = count_mask_bits(mask, fa_entry_count);
+    size_t frame_size = FA_ENTRY_SIZE * fa_entry_count;
+    if (ok  &&  id_count == fa_entry_count)
+        return TEST_write_(scon, snapshot->data,
+            snapshot->sample_count * frame_size, "Unable to write snapshot");
+
+    struct id_run runs[MAX_FA_ENTRY_COUNT];
+    unsigned int run_count =
+        compute_id_runs(mask, fa_entry_count, (unsigned int) -1, runs);
+    size_t out_frame_size = FA_ENTRY_SIZE * id_count;
+    unsigned int chunk = (unsigned int) (WRITE_BUFFER_SIZE / out_frame_size);
+    char buffer[WRITE_BUFFER_SIZE];
+    for (unsigned int i = 0; ok  &&  i < snapshot->sample_count; i += chunk)
+    {
+        unsigned int count = snapshot->sample_count - i;
+        if (count > chunk)
+            count = chunk;
+        gather_frames(runs, run_count, FA_ENTRY_SIZE,
+            snapshot->data + i * fa_entry_count, frame_size,
+            buffer, out_frame_size, count);
+        ok = TEST_write_(scon, buffer, count * out_frame_size,
+            "Unable to write snapshot");
+    }
+    return ok;
+}
+
+
+struct snapshot_parse {
+    char command;                   // One of L, F or R
+    unsigned int id;                // Snapshot to fetch
+    struct filter_mask mask;        // Ids to fetch
+};
+
+static void set_all_ids(struct filter_mask *mask)
+{
+    for (unsigned int id = 0; id < fa_entry_count; id ++)
+        set_mask_bit(mask, id);
+}
+
+
+/* A snapshot command is one of:
+ *
+ *  snapshot = "T" ( "L" | "F" | "R" id [ "M" mask ] )
+ *
+ *  L   Lists available snapshots, oldest first, one per line, followed by a
+ *      blank line.  Each line gives the snapshot id, the timestamp of its first
+ *      sample, its sample count, the index of the triggering sample and the
+ *      trigger, either "external" or as specified on the command line.
+ *  F   Fires the external trigger.  A snapshot will be captured around the
+ *      next block received unless a snapshot is already being captured.
+ *  R   Fetches the given snapshot, all ids or those in the given mask.  The
+ *      response is a struct snapshot_header followed by the data.
+ *
+ * Each command responds with a null byte or an error message. */
+static bool parse_snapshot_command(
+    const char **string, struct snapshot_parse *parse)
+{
+    memset(&parse->mask, 0, sizeof(parse->mask));
+    bool ok = parse_char(string, 'T');
+    parse->command = **string;
+    return
+        ok  &&
+        IF_ELSE(read_char(string, 'R'),
+            parse_uint(string, &parse->id)  &&
+            IF_ELSE(read_char(string, 'M'),
+                parse_mask(string, fa_entry_count, &parse->mask),
+                DO_(set_all_ids(&parse->mask))),
+        // else
+            TEST_OK_(read_char(string, 'L')  ||  read_char(string, 'F'),
+                "Unknown snapshot command"));
+}
+
+
+bool process_snapshot(int scon, const char *client_name, const char *buf)
+{
+    push_error_handling();
+
+    struct snapshot_parse parse;
+    struct snapshot *snapshot = NULL;
+    bool parse_ok =
+        TEST_OK_(snapshots_enabled, "Snapshots not enabled")  &&
+        DO_PARSE("snapshot command", parse_snapshot_command, buf, &parse)  &&
+        IF_(parse.command == 'R',
+            DO_(find_snapshot(parse.id, &snapshot))  &&
+            TEST_NULL_(snapshot, "Snapshot %u not available", parse.id));
+    bool ok = report_socket_error(scon, client_name, parse_ok);
+
+    if (parse_ok  &&  ok)
+    {
+        switch (parse.command)
+        {
+            case 'L':
+                ok = send_snapshot_list(scon);
+                break;
+            case 'F':
+                log_message("Snapshot trigger from %s", client_name);
+                __atomic_store_n(&external_trigger, true, __ATOMIC_RELEASE);
+                break;
+            case 'R':
+                ok = send_snapshot(scon, snapshot, &parse.mask);
+                break;
+        }
+    }
+
+    if (snapshot)
+        put_snapshot(snapshot);
+    return ok;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Initialisation and shutdown. */
+
+
+bool parse_snapshot_window(const char **string)
+{
+    snapshots_enabled = true;
+    return
+        parse_uint(string, &pre_samples)  &&
+        parse_char(string, ',')  &&
+        parse_uint(string, &post_samples)  &&
+        IF_(read_char(string, ','),
+            parse_uint(string, &max_snapshots)  &&
+            TEST_OK_(max_snapshots > 0, "Must keep at least one snapshot"));
+}
+
+
+bool parse_snapshot_trigger(const char **string)
+{
+    struct trigger *trigger = &triggers[trigger_count];
+    trigger->armed = true;
+    snapshots_enabled = true;
+    return
+        TEST_OK_(trigger_count < MAX_TRIGGERS, "Too many snapshot triggers")  &&
+        IF_ELSE(read_char(string, 'E'),
+            DO_(trigger->type = TRIGGER_EVENTS)  &&
+            parse_uint32(string, &trigger->mask),
+        // else
+        IF_ELSE(read_char(string, 'B'),
+            DO_(trigger->type = TRIGGER_THRESHOLD)  &&
+            parse_uint(string, &trigger->id)  &&
+            parse_char(string, ':')  &&
+            parse_uint32(string, &trigger->limit),
+        // else
+            FAIL_("Unknown trigger type")))  &&
+        DO_(trigger_count += 1);
+}
+
+
+/* Checks the triggers against the FA ids now that these are known. */
+static bool check_trigger_ids(unsigned int events_fa_id)
+{
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < trigger_count; i ++)
+    {
+        struct trigger *trigger = &triggers[i];
+        if (trigger->type == TRIGGER_EVENTS)
+        {
+            trigger->id = events_fa_id;
+            ok = TEST_OK_(events_fa_id < fa_entry_count,
+                "Event id must be specified for event trigger");
+        }
+        else
+            ok = TEST_OK_(trigger->id < fa_entry_count,
+                "Trigger id %u out of range", trigger->id);
+    }
+    return ok;
+}
+
+
+bool initialise_snapshot(
+    struct buffer *fa_buffer, unsigned int _fa_entry_count,
+    unsigned int events_fa_id)
+{
+    fa_block_buffer = fa_buffer;
+    fa_entry_count = _fa_entry_count;
+    frame_count = (unsigned int) (
+        buffer_block_size(fa_buffer) / fa_entry_count / FA_ENTRY_SIZE);
+    pre_blocks = (pre_samples + frame_count - 1) / frame_count;
+    post_blocks = (post_samples + frame_count - 1) / frame_count;
+    return
+        IF_(snapshots_enabled,
+            check_trigger_ids(events_fa_id)  &&
+            /* Leave half the buffer spare so that the history is still there
+             * by the time the trigger has been seen. */
+            TEST_OK_(pre_blocks <= buffer_block_count(fa_buffer) / 2,
+                "Snapshot window too long for buffer"));
+}
+
+
+bool start_snapshot(void)
+{
+    if (!snapshots_enabled)
+        return true;
+
+    snapshot_running = true;
+    trigger_reader = open_reader(fa_block_buffer, false);
+    return TEST_0(pthread_create(
+        &snapshot_thread_id, NULL, snapshot_thread, NULL));
+}
+
+
+void terminate_snapshot(void)
+{
+    if (snapshots_enabled)
+    {
+        snapshot_running = false;
+        interrupt_reader(trigger_reader);
+        ASSERT_0(pthread_join(snapshot_thread_id, NULL));
+        close_reader(trigger_reader);
+    }
+}
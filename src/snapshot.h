@@ -0,0 +1,66 @@
+/* Triggered snapshots of the live FA data stream
+ *
+ * Copyright (c) 2012 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Instead of clients keeping full rate subscriptions open just in case an
+ * interesting event occurs, the archiver can watch the live data stream for
+ * triggers and keep a snapshot of the data around each trigger.  A trigger can
+ * be a set of bits in the event id, a BPM position beyond a threshold, or an
+ * external command from a client.  Each snapshot covers a window before and
+ * after the triggering sample, and the most recent snapshots are held in memory
+ * for clients to list and fetch. */
+
+/* Each fetched snapshot starts with this header, followed by sample_count
+ * frames of the requested ids. */
+struct snapshot_header {
+    uint32_t sample_count;      // Number of samples in snapshot
+    uint32_t trigger_offset;    // Index of the triggering sample
+    uint64_t timestamp;         // Timestamp of first sample
+};
+
+/* Parses the snapshot window specification for the command line:
+ *      window = pre "," post [ "," count ]
+ * where pre and post are the number of samples captured before and after each
+ * trigger and count is the number of snapshots kept. */
+bool parse_snapshot_window(const char **string);
+/* Parses and adds a snapshot trigger for the command line:
+ *      trigger = "E" mask | "B" id ":" limit
+ * An E trigger fires on any event id sample with any of the bits in mask set,
+ * a B trigger fires when either coordinate of FA id exceeds limit in
+ * magnitude. */
+bool parse_snapshot_trigger(const char **string);
+
+/* Process snapshot command. */
+bool process_snapshot(int scon, const char *client_name, const char *buf);
+
+/* Snapshots are only captured if a window or a trigger was configured. */
+bool initialise_snapshot(
+    struct buffer *fa_buffer, unsigned int fa_entry_count,
+    unsigned int events_fa_id);
+bool start_snapshot(void);
+void terminate_snapshot(void);
@@ -37,6 +37,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
@@ -49,6 +50,8 @@
 #include "fa_sniffer.h"
 #include "sniffer.h"
 #include "replay.h"
+#include "placement.h"
+#include "stats.h"
 
 
 /* This is where the sniffer data will be written. */
@@ -69,8 +72,10 @@ static void *sniffer_thread(void *context)
         {
             void *buffer = get_write_block(fa_block_buffer);
             uint64_t timestamp;
+            uint64_t start = start_latency();
             sniffer_ok = sniffer_context->read(
                 buffer, fa_block_size, &timestamp);
+            record_latency(LATENCY_SNIFFER_READ, start);
 
             /* Ignore any error generated by releasing the write block, apart
              * from logging it -- any error here will generate a gap which will
@@ -132,6 +137,7 @@ static bool ioctl_ok;
 static int ioctl_version = 0;
 
 #define IOCTL_TIMESTAMP_VERSION     2   // Supports timestamp interrogation
+#define IOCTL_RING_VERSION          3   // Supports mapped DMA ring
 
 
 static bool reset_sniffer_device(void)
@@ -192,8 +198,89 @@ static const struct sniffer_context sniffer_device = {
     .interrupt = interrupt_sniffer_device,
 };
 
+
+/* If the driver supports it we map its ring of DMA blocks directly and copy
+ * completed blocks straight out of the ring.  The completion timestamps are
+ * also in the ring, so we only need to call into the driver when the ring is
+ * empty. */
+
+static struct fa_ring_info ring_info;
+static struct fa_ring_header *ring_header;
+static const void *ring_data;
+static uint32_t ring_consumer;      // Count of blocks consumed since restart
+
+
+static bool reset_sniffer_ring(void)
+{
+    /* Restarting the device resets both ring counts. */
+    ring_consumer = 0;
+    return reset_sniffer_device();
+}
+
+/* Waits for the next block in the ring to be completed, fails silently if the
+ * data stream has halted, as for read(). */
+static bool wait_sniffer_ring(void)
+{
+    uint32_t producer =
+        __atomic_load_n(&ring_header->producer, __ATOMIC_ACQUIRE);
+    return
+        producer != ring_consumer  ||
+        ioctl(fa_sniffer, FASNIF_IOCTL_RING_WAIT, &producer) == 0;
+}
+
+static bool read_sniffer_ring(
+    struct fa_row *rows, size_t length, uint64_t *timestamp)
+{
+    void *buffer = rows;
+    for (; length > 0; length -= ring_info.block_size)
+    {
+        if (!wait_sniffer_ring())
+            return false;
+
+        size_t slot = ring_consumer % ring_info.block_count;
+        memcpy(buffer,
+            ring_data + slot * ring_info.block_size, ring_info.block_size);
+        *timestamp = ring_header->timestamps[slot];
+        buffer += ring_info.block_size;
+
+        /* Hand the slot back to the driver. */
+        ring_consumer += 1;
+        __atomic_store_n(
+            &ring_header->consumer, ring_consumer, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+static const struct sniffer_context sniffer_ring = {
+    .reset = reset_sniffer_ring,
+    .read = read_sniffer_ring,
+    .status = read_sniffer_status,
+    .interrupt = interrupt_sniffer_device,
+};
+
+/* Maps the driver's ring, returns false if it cannot be used for our block
+ * size. */
+static bool map_sniffer_ring(size_t block_size)
+{
+    void *ring_map;
+    return
+        TEST_IO(ioctl(fa_sniffer, FASNIF_IOCTL_GET_RING_INFO, &ring_info))  &&
+        TEST_OK_(ring_info.block_size > 0  &&
+            block_size % ring_info.block_size == 0,
+            "Block size %zu not a multiple of ring block size %u",
+            block_size, ring_info.block_size)  &&
+        TEST_IO(ring_map = mmap(
+            NULL, ring_info.map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fa_sniffer, 0))  &&
+        DO_(
+            ring_header = ring_map;
+            ring_data = ring_map + ring_info.data_offset;
+            ring_consumer = ring_header->consumer);
+}
+
+
 const struct sniffer_context *initialise_sniffer_device(
-    const char *device_name, unsigned int fa_entry_count)
+    const char *device_name, unsigned int fa_entry_count, size_t block_size)
 {
     fa_sniffer_device = device_name;
     bool ok = TEST_IO_(
@@ -223,7 +310,18 @@ const struct sniffer_context *initialise_sniffer_device(
     }
     else
         ok = ok  &&  TEST_OK_(fa_entry_count == 256, "Invalid FA entry count");
-    return ok ? &sniffer_device : NULL;
+
+    if (!ok)
+        return NULL;
+    else if (ioctl_version >= IOCTL_RING_VERSION  &&
+             map_sniffer_ring(block_size))
+    {
+        log_message("Using sniffer DMA ring: %u blocks of %u bytes",
+            ring_info.block_count, ring_info.block_size);
+        return &sniffer_ring;
+    }
+    else
+        return &sniffer_device;
 }
 
 
@@ -270,21 +368,13 @@ void configure_sniffer(
 
 bool start_sniffer(bool boost_priority)
 {
-    pthread_attr_t attr;
-    return
-        TEST_0(pthread_attr_init(&attr))  &&
-        IF_(boost_priority,
-            /* If requested boost the thread priority and configure FIFO
-             * scheduling to ensure that this thread gets absolute maximum
-             * priority. */
-            TEST_0(pthread_attr_setinheritsched(
-                &attr, PTHREAD_EXPLICIT_SCHED))  &&
-            TEST_0(pthread_attr_setschedpolicy(&attr, SCHED_FIFO))  &&
-            TEST_0(pthread_attr_setschedparam(
-                &attr, &(struct sched_param) { .sched_priority = 1 })))  &&
-        TEST_0_(pthread_create(&sniffer_id, &attr, sniffer_thread, NULL),
-            "Priority boosting requires real time thread support")  &&
-        TEST_0(pthread_attr_destroy(&attr));
+    /* If requested boost the thread priority and configure FIFO scheduling to
+     * ensure that this thread gets absolute maximum priority, unless a policy
+     * has been configured explicitly. */
+    if (boost_priority)
+        set_default_thread_policy(THREAD_SNIFFER, SCHED_FIFO, 1);
+    return create_pipeline_thread(
+        THREAD_SNIFFER, &sniffer_id, sniffer_thread, NULL);
 }
 
 void terminate_sniffer(void)
@@ -37,8 +37,10 @@ struct sniffer_context
     bool (*interrupt)(void);
 };
 
+/* Uses the driver's mapped DMA ring if available and compatible with
+ * block_size, otherwise falls back to reading the device. */
 const struct sniffer_context *initialise_sniffer_device(
-    const char *device_name, unsigned int fa_entry_count);
+    const char *device_name, unsigned int fa_entry_count, size_t block_size);
 const struct sniffer_context *initialise_empty_sniffer(void);
 
 struct buffer;
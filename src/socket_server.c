@@ -37,6 +37,9 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
@@ -57,10 +60,17 @@
 #include "list.h"
 #include "disk_writer.h"
 #include "subscribe.h"
+#include "block_cache.h"
+#include "dd_cache.h"
+#include "stats.h"
+#include "snapshot.h"
 
 #include "socket_server.h"
 
 
+/* Limit on the number of readers of each buffer reported by CH command. */
+#define MAX_REPORTED_READERS    256
+
 /* String used to report protocol version in response to CV command. */
 #define PROTOCOL_VERSION    "1.1"
 
@@ -95,6 +105,7 @@ struct client_info
     struct timespec ts;             // Time client connection completed
     char name[64];                  // Socket address of client
     char buf[256];                  // Command sent by client
+    uint64_t bytes_sent;            // Data sent to client so far
 };
 
 /* Macro for walking lists of client_info structures. */
@@ -183,6 +194,24 @@ static bool process_error(int scon, const char *client_name, const char *buf)
 }
 
 
+/* Called for subscription on a persistent connection. */
+static bool process_persistent_subscribe(
+    int scon, const char *client_name, const char *buf)
+{
+    return report_error(
+        scon, client_name, "Subscription not allowed on persistent connection");
+}
+
+
+/* The K command is handled by the connection, which is made persistent, so
+ * there is nothing more to do here. */
+static bool process_keep_alive(
+    int scon, const char *client_name, const char *buf)
+{
+    return true;
+}
+
+
 /* Sets socket receive and transmit timeouts.  Used so we don't have threads
  * hanging waiting for users to complete sending their commands and to receive
  * their data.  See socket(7) for documentation of SO_RCVTIMEO option. */
@@ -326,6 +355,56 @@ static bool report_clients(int scon)
 }
 
 
+/* Writes the latency histograms followed by throughput and occupancy figures,
+ * one item per line, terminated by a blank line. */
+static bool write_statistics(int scon)
+{
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < LATENCY_STAGE_COUNT; i ++)
+    {
+        struct latency_histogram histogram;
+        get_latency_histogram(i, &histogram);
+        char string[24 * HISTOGRAM_BUCKETS + 128];
+        char *s = string + sprintf(string,
+            "latency %s %"PRIu64" %"PRIu64" %"PRIu64, latency_stage_name(i),
+            histogram.count, histogram.total, histogram.maximum);
+        for (unsigned int b = 0; b < HISTOGRAM_BUCKETS; b ++)
+            s += sprintf(s, " %"PRIu64, histogram.buckets[b]);
+        ok = write_string(scon, "%s\n", string);
+    }
+
+    LIST_HEAD(clients);
+    copy_clients(&clients);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for_clients(client, &clients)
+    {
+        if (!ok)
+            break;
+        double elapsed = (double) (now.tv_sec - client->ts.tv_sec) +
+            1e-9 * (double) (now.tv_nsec - client->ts.tv_nsec);
+        ok = write_string(scon, "client %s %"PRIu64" %.0f\n",
+            client->name, client->bytes_sent,
+            elapsed > 0 ? (double) client->bytes_sent / elapsed : 0);
+    }
+    delete_clients(&clients);
+
+    for (unsigned int i = 0; ok  &&  i <= get_decimation_stage_count(); i ++)
+    {
+        struct buffer *buffer =
+            i == 0 ? fa_block_buffer : get_decimation_buffer(i - 1);
+        unsigned int occupancy[MAX_REPORTED_READERS];
+        unsigned int count =
+            get_reader_occupancy(buffer, occupancy, MAX_REPORTED_READERS);
+        for (unsigned int r = 0; ok  &&  r < count; r ++)
+            ok = write_string(scon, "reader %u %u %u %zu\n",
+                i, r, occupancy[r], buffer_block_count(buffer));
+    }
+
+    return ok  &&  write_string(scon, "\n");
+}
+
+
 static bool write_index_timestamp(int scon, uint64_t timestamp)
 {
     timestamp = timestamp_to_index_ts(timestamp);
@@ -343,32 +422,90 @@ static bool write_mask(int scon)
 }
 
 
+/* Writes the decimation factor of each tier above DD relative to the tier
+ * below, as a space separated list on a single line. */
+static bool write_tiers(int scon)
+{
+    const struct disk_header *header = get_header();
+    char string[16 * MAX_DECIMATION_TIERS + 2];
+    char *s = string;
+    for (unsigned int t = 0; t < header->tier_count; t ++)
+        s += sprintf(s, "%s%"PRIu32,
+            t > 0 ? " " : "", 1U << header->tier_decimation_log2[t]);
+    sprintf(s, "\n");
+    return write_string(scon, "%s", string);
+}
+
+
+/* Writes the overall decimation factor of each live decimation stage. */
+static bool write_stages(int scon)
+{
+    unsigned int count = get_decimation_stage_count();
+    char string[16 * count + 2];
+    char *s = string;
+    for (unsigned int i = 0; i < count; i ++)
+        s += sprintf(s, "%s%u", i > 0 ? " " : "", get_decimation_factor(i));
+    sprintf(s, "\n");
+    return write_string(scon, "%s", string);
+}
+
+
+static bool write_cache_status(int scon)
+{
+    struct block_cache_status status;
+    get_block_cache_status(&status);
+    return write_string(scon, "%zu %zu %u %"PRIu64" %"PRIu64"\n",
+        status.cache_size, status.cache_used, status.entries,
+        status.hits, status.misses);
+}
+
+
+static bool write_dd_cache_status(int scon)
+{
+    struct dd_cache_status status;
+    get_dd_cache_status(&status);
+    return write_string(scon, "%zu %u %"PRIu64" %"PRIu64"\n",
+        status.cache_size, status.pages, status.hits, status.misses);
+}
+
+
 static bool write_status(int scon, const char *client_name)
 {
     struct fa_status status;
+    struct io_status io_status;
+    get_io_status(&io_status);
     return CATCH_ERROR(scon, client_name,
         get_sniffer_status(&status),
-        write_string(scon, "%u %u %u %u %u %u %u %u\n",
+        write_string(scon, "%u %u %u %u %u %u %u %u "
+            "%u %u %d %u %"PRIu64" %"PRIu64" %"PRIu64" "
+            "%"PRIu64" %"PRIu64"\n",
             status.status, status.partner,
             status.last_interrupt, status.frame_errors,
             status.soft_errors, status.hard_errors,
-            status.running, status.overrun));
+            status.running, status.overrun,
+            io_status.writes_pending, io_status.write_queue_depth,
+            io_status.write_urgent, io_status.read_waiters,
+            io_status.read_rate, io_status.read_bandwidth,
+            io_status.deferred_reads,
+            io_status.warm_up_done, io_status.warm_up_total));
 }
 
 
 
 /* The C command prefix is followed by a sequence of one letter commands, and
- * each letter receives a one line response (except for the I command).  The
- * following commands are supported:
+ * each letter receives a one line response (except for the I and H commands).
+ * The following commands are supported:
  *
  *  F   Returns current sample frequency
  *  d   Returns first decimation
  *  D   Returns second decimation
+ *  P   Returns decimation factors of any further tiers above DD
  *  T   Returns earliest available timestamp
  *  U   Returns the latest available timestamp
  *  V   Returns protocol identification string
  *  M   Returns configured capture mask
  *  C   Returns live decimation factor if available
+ *  A   Returns decimation factors of all cascaded live decimation stages
  *  K   Returns FA sample count
  *  S   Returns detailed sniffer status.  The numbers returned are:
  *          hardware link status        1 => ok, 2, 3 => link fault
@@ -379,10 +516,36 @@ static bool write_status(int scon, const char *client_name)
  *          hard error count
  *          run state                   1 => Currently fetching data
  *          overrun                     1 => Halted due to buffer overrun
+ *      followed by the state of the disk scheduler:
+ *          writes pending              Major blocks queued for writing
+ *          write queue depth           Maximum number of queued blocks
+ *          write urgent                1 => Readers held back for writer
+ *          read waiters                Readers waiting for admission
+ *          read rate                   Bytes per second read from disk
+ *          read bandwidth              Read limit, 0 => no limit
+ *          deferred reads              Count of reads held back for writer
+ *      followed by progress warming up the in memory data:
+ *          bytes warmed up             Index and DD data read in so far
+ *          total bytes                 Size of index and DD data
  *  E   Returns event mask FA id or -1 if not specied
  *  N   Returns server name configured on startup
+ *  B   Returns block cache status: configured size, bytes in use, number of
+ *      cached blocks, hit count and miss count
+ *  G   Returns DD cache status: configured size, number of cached pages, hit
+ *      count and miss count
  *  I   Returns list of all conected clients, one client per line.
  *  L   Returns list of FA ids and their descriptions
+ *  H   Returns performance statistics, one item per line terminated by a
+ *      blank line.  Each line starts with a keyword:
+ *          latency name count total maximum bucket*32
+ *              Histogram of durations in microseconds for each stage of
+ *              processing.  Bucket 0 counts durations under 1us, bucket n
+ *              counts durations from 2^(n-1) to 2^n-1 us.
+ *          client name bytes rate
+ *              Data sent to each client and mean bytes per second
+ *          reader buffer index occupancy blocks
+ *              Blocks waiting to be read by each reader of the FA buffer
+ *              (buffer 0) or of each decimation stage (buffers 1 on)
  */
 static bool process_command(int scon, const char *client_name, const char *buf)
 {
@@ -403,6 +566,9 @@ static bool process_command(int scon, const char *client_name, const char *buf)
                 ok = write_string(scon,
                      "%"PRIu32"\n", 1 << header->second_decimation_log2);
                 break;
+            case 'P':
+                ok = write_tiers(scon);
+                break;
             case 'T':
                 ok = write_index_timestamp(scon, 1);
                 break;
@@ -416,11 +582,20 @@ static bool process_command(int scon, const char *client_name, const char *buf)
                 ok = write_mask(scon);
                 break;
             case 'C':
-                ok = write_string(scon, "%u\n", get_decimation_factor());
+                ok = write_string(scon, "%u\n", get_decimation_factor(0));
+                break;
+            case 'A':
+                ok = write_stages(scon);
                 break;
             case 'S':
                 ok = write_status(scon, client_name);
                 break;
+            case 'B':
+                ok = write_cache_status(scon);
+                break;
+            case 'G':
+                ok = write_dd_cache_status(scon);
+                break;
             case 'I':
                 ok = report_clients(scon);
                 break;
@@ -436,6 +611,9 @@ static bool process_command(int scon, const char *client_name, const char *buf)
             case 'L':
                 ok = write_fa_ids(scon, &header->archive_mask);
                 break;
+            case 'H':
+                ok = write_statistics(scon);
+                break;
             default:
                 ok = report_error(scon, client_name, "Unknown command");
                 break;
@@ -481,6 +659,9 @@ static const struct command_table {
     { 'R', process_read },
     { 'S', process_subscribe },
     { 'D', process_debug_command },
+    { 'T', process_snapshot },
+    { 'Q', process_statistics },
+    { 'K', process_keep_alive },
     { 0,   process_error }
 };
 
@@ -513,103 +694,450 @@ static void get_client_name(int scon, char *client_name)
 }
 
 
-/* Reads from the given socket until one of the following is encountered: a
- * newline (the preferred case), end of input, end of buffer or an error.  The
- * newline and anything following is discarded. */
-static bool read_line(int sock, struct client_info *client)
-{
-    char *buf = client->buf;
-    size_t buflen = sizeof(client->buf) - 1;    // Allow for '\0'
-    ssize_t rx;
-    while (
-        TEST_OK_(buflen > 0, "Read buffer exhausted")  &&
-        TEST_IO_(rx = read(sock, buf, buflen), "Socket read failed")  &&
-        TEST_OK_(rx > 0, "End of file on input"))
-    {
-        char *newline = memchr(buf, '\n', (size_t) rx);
-        if (newline)
-        {
-            *newline = '\0';
-            return true;
-        }
-
-        buflen -= (size_t) rx;
-        buf += rx;
-    }
-
-    /* On failure report what we managed to read before failing. */
-    *buf = '\0';
-    log_message("Client %s sent: \"%s\"", client->name, client->buf);
-    return false;
-}
-
-
 /* Command successfully read, dispatch it to the appropriate handler. */
-static void dispatch_command(
-    int scon, const char *client_name, const char *buf)
+static bool dispatch_command(
+    int scon, const char *client_name, const char *buf, bool keep_alive)
 {
     log_message("Client %s command: \"%s\"", client_name, buf);
     command_t command = lookup_command(buf[0]);
+    /* A subscription never completes, so would stall the connection. */
+    if (keep_alive  &&  buf[0] == 'S')
+        command = process_persistent_subscribe;
     bool ok = command(scon, client_name, buf);
     char *error_message = pop_error_handling(!ok);
     if (!ok)
         log_message("Client %s error: %s", client_name, error_message);
     free(error_message);
+    return ok;
 }
 
 
-static void *process_connection(void *context)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Connection handling. */
+
+/* All incoming connections are handled by a single server thread using epoll
+ * until a complete command has been read, so idle or slow clients cost no more
+ * than a file handle.  The command is then handed on: subscriptions, which run
+ * until the client disconnects, are each given their own thread, and all other
+ * commands are queued for a fixed pool of worker threads.  Apart from short
+ * error messages the server thread never writes to a client, so a client slow
+ * to read its response only holds up the thread sending it.
+ *
+ * Normally the connection is closed once its command has completed, but after
+ * a K command the connection is persistent: each response is written into a
+ * pipe and relayed to the client by a separate thread as a sequence of frames
+ * each prefixed by its length, so no response is ever held in full.  Once the
+ * response has been terminated by an empty frame the connection is handed back
+ * to the server thread to wait for the next command.  Commands can be
+ * pipelined, any input following the current command is retained for the
+ * next. */
+
+/* Time allowed for a client to send its command. */
+#define COMMAND_TIMEOUT     1
+/* Time a persistent connection may wait between commands. */
+#define KEEP_ALIVE_TIMEOUT  60
+/* Largest frame sent in a response on a persistent connection. */
+#define RESPONSE_FRAME_SIZE 65536
+
+struct connection {
+    struct list_head list;          // Position in reading or work queue
+    int scon;                       // Connected socket
+    bool keep_alive;                // Set for persistent connection
+    time_t deadline;                // Time by which command must be complete
+    size_t rx_length;               // Number of bytes in rx_buf
+    char rx_buf[256];               // Received input not yet processed
+    struct client_info *client;     // Client information and command buffer
+};
+
+
+/* Connections waiting for their command, only touched by the server thread. */
+static LIST_HEAD(reading_connections);
+
+/* Connections with complete commands waiting for a worker thread. */
+DECLARE_LOCKING(work_lock);
+static LIST_HEAD(work_queue);
+static unsigned int worker_count;
+static pthread_t *workers;
+
+/* Persistent connections handed back to the server thread, also guarded by
+ * work_lock.  The server thread is woken by writing to resume_event. */
+static LIST_HEAD(resumed_connections);
+static int resume_event;
+
+
+/* Closes the connection and releases all its resources. */
+static void close_connection(struct connection *connection)
 {
-    int scon = (int) (intptr_t) context;
-    struct client_info *client = add_client();
+    IGNORE(TEST_IO(close(connection->scon)));
+    remove_client(connection->client);
+    free(connection);
+}
 
-    /* Retrieve client address so we can log all messages associated with this
-     * client with the appropriate address. */
-    get_client_name(scon, client->name);
 
-    /* Read the command, required to be one line terminated by \n, and dispatch
-     * to the appropriate handler.  Any errors are handled locally and are
-     * reported below. */
-    push_error_handling();
-    bool ok =
-        set_socket_cork(scon, true)  &&
-        set_socket_timeout(scon, 1, 10)  &&
-        read_line(scon, client);
+/* Relays a response from the pipe to the client as a sequence of frames each
+ * prefixed by its 64-bit length.  If writing to the client fails the pipe is
+ * closed early, so that the command fails in turn. */
+struct relay {
+    int scon;                       // Client socket
+    int response;                   // Read end of response pipe
+    bool ok;                        // Set if the entire response was sent
+};
+
+static void *relay_response(void *context)
+{
+    struct relay *relay = context;
+    void *frame = malloc(RESPONSE_FRAME_SIZE);
+    ssize_t length = RESPONSE_FRAME_SIZE;
+    bool ok = TEST_NULL(frame);
+    while (ok  &&  length == RESPONSE_FRAME_SIZE)
+    {
+        length = ensure_read(relay->response, frame, RESPONSE_FRAME_SIZE);
+        uint64_t frame_length = (uint64_t) length;
+        ok =
+            TEST_IO(length)  &&
+            IF_(length > 0,
+                TEST_write_(relay->scon, &frame_length, sizeof(frame_length),
+                    "Unable to write response")  &&
+                TEST_write_(relay->scon, frame, (size_t) length,
+                    "Unable to write response"));
+    }
+    IGNORE(TEST_IO(close(relay->response)));
+    free(frame);
+    relay->ok = ok;
+    return NULL;
+}
 
+
+/* Runs the command on a persistent connection with its response streamed by
+ * relay_response(), and terminates the response with an empty frame.  Returns
+ * false if the connection can't be used for another command: as the client
+ * can only recognise the end of a response by its empty frame, a response cut
+ * short by a failed command is followed by closing the connection. */
+static bool run_persistent_command(struct connection *connection)
+{
+    int scon = connection->scon;
+    int response[2];
+    struct relay relay = { .scon = scon };
+    pthread_t relay_thread;
+    bool ok =
+        TEST_IO(pipe2(response, O_CLOEXEC))  &&
+        DO_(relay.response = response[0])  &&
+        UNLESS(
+            TEST_0(pthread_create(
+                &relay_thread, NULL, relay_response, &relay)),
+            close(response[0]);  close(response[1]));
     if (ok)
-        /* Past this point only dispatch_command() can communicate with the
-         * client, any further errors it needs to handle. */
-        dispatch_command(scon, client->name, client->buf);
+    {
+        push_error_handling();
+        ok = dispatch_command(response[1], connection->client->name,
+            connection->client->buf, true);
+        IGNORE(TEST_IO(close(response[1])));
+        ASSERT_0(pthread_join(relay_thread, NULL));
+
+        uint64_t end_frame = 0;
+        ok = ok  &&  relay.ok  &&
+            TEST_write_(scon, &end_frame, sizeof(end_frame),
+                "Unable to write response")  &&
+            /* Toggling the cork flushes the response to the client. */
+            set_socket_cork(scon, false)  &&
+            set_socket_cork(scon, true);
+    }
+    return ok;
+}
+
+
+/* Hands a persistent connection back to the server thread to wait for its
+ * next command.  Can be called from any thread. */
+static void resume_connection(struct connection *connection)
+{
+    LOCK(work_lock);
+    list_add_tail(&connection->list, &resumed_connections);
+    UNLOCK(work_lock);
+    uint64_t event = 1;
+    IGNORE(TEST_write(resume_event, &event, sizeof(event)));
+}
+
+
+/* Processes the completed command and either closes the connection or, if it
+ * is persistent and the response was sent, returns it to the server. */
+static void complete_connection(struct connection *connection)
+{
+    int scon = connection->scon;
+    bool keep_alive = false;
+    set_client_byte_counter(&connection->client->bytes_sent);
+    if (connection->keep_alive)
+        keep_alive = run_persistent_command(connection);
     else
-        /* Any errors seen at this stage are reported back to the client. */
-        pop_client_error(scon, client->name);
+    {
+        push_error_handling();
+        dispatch_command(
+            scon, connection->client->name, connection->client->buf, false);
+    }
+    set_client_byte_counter(NULL);
 
-    /* Uncork the socket before closing to ensure any remaining data is sent.
-     * It seems that if we close the socket with cork enabled and unread
-     * incoming data then the tail end of the sent data stream can be lost. */
-    set_socket_cork(scon, false);
-    IGNORE(TEST_IO(close(scon)));
+    if (keep_alive)
+        resume_connection(connection);
+    else
+    {
+        /* Uncork the socket before closing to ensure any remaining data is
+         * sent.  It seems that if we close the socket with cork enabled and
+         * unread incoming data then the tail end of the sent data stream can
+         * be lost. */
+        set_socket_cork(scon, false);
+        close_connection(connection);
+    }
+}
+
+
+/* Reports error to client and closes a connection which is still waiting for
+ * its command.  Closing the socket also removes it from epoll.  A persistent
+ * connection is simply closed, as an unframed message would be misread. */
+static void reject_connection(
+    struct connection *connection, const char *message)
+{
+    struct client_info *client = connection->client;
+    list_del(&connection->list);
+    if (connection->keep_alive)
+        log_message("Client %s closed: %s", client->name, message);
+    else
+    {
+        log_message("Client %s sent: \"%s\"", client->name, client->buf);
+
+        push_error_handling();
+        FAIL_("%s", message);
+        IGNORE(TEST_IO(fcntl(connection->scon, F_SETFL, 0)));
+        pop_client_error(connection->scon, client->name);
+        set_socket_cork(connection->scon, false);
+    }
+    close_connection(connection);
+}
 
-    remove_client(client);
+
+static void *subscription_thread(void *context)
+{
+    complete_connection(context);
     return NULL;
 }
 
+static void *worker_thread(void *context)
+{
+    while (true)
+    {
+        struct connection *connection;
+        LOCK(work_lock);
+        while (work_queue.next == &work_queue)
+            pwait(&work_lock);
+        connection = container_of(work_queue.next, struct connection, list);
+        list_del(&connection->list);
+        UNLOCK(work_lock);
+
+        /* The K command makes the connection persistent, and is itself
+         * answered with an empty response. */
+        if (connection->client->buf[0] == 'K')
+            connection->keep_alive = true;
+        complete_connection(connection);
+    }
+    return NULL;
+}
+
+
+/* Called when a complete command has been received, hands the connection on as
+ * appropriate.  From here on the socket is used in blocking mode. */
+static void start_command(int epoll_fd, struct connection *connection)
+{
+    list_del(&connection->list);
+    IGNORE(TEST_IO(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->scon, NULL)));
+    IGNORE(TEST_IO(fcntl(connection->scon, F_SETFL, 0)));
+
+    /* Subscriptions run until the client disconnects, so each has its own
+     * thread; on a persistent connection a subscription is instead rejected by
+     * a worker like any other command. */
+    if (connection->client->buf[0] == 'S'  &&  !connection->keep_alive)
+    {
+        /* Note that we need to create the spawned threads with DETACHED
+         * attribute, otherwise we accumlate internal joinable state
+         * information and eventually run out of resources. */
+        pthread_attr_t attr;
+        pthread_t thread;
+        ASSERT_0(pthread_attr_init(&attr));
+        ASSERT_0(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+        push_error_handling();
+        if (TEST_0(pthread_create(
+                &thread, &attr, subscription_thread, connection)))
+            pop_error_handling(false);
+        else
+        {
+            pop_client_error(connection->scon, connection->client->name);
+            set_socket_cork(connection->scon, false);
+            close_connection(connection);
+        }
+        ASSERT_0(pthread_attr_destroy(&attr));
+    }
+    else
+    {
+        LOCK(work_lock);
+        list_add_tail(&connection->list, &work_queue);
+        psignal(&work_lock);
+        UNLOCK(work_lock);
+    }
+}
+
+
+/* Checks for a complete command in the receive buffer.  The received text up to
+ * any newline is copied to the client buffer, and if the command is complete
+ * it is removed from the receive buffer together with its newline. */
+static bool extract_command(struct connection *connection)
+{
+    char *rx_buf = connection->rx_buf;
+    char *newline = memchr(rx_buf, '\n', connection->rx_length);
+    size_t length =
+        newline ? (size_t) (newline - rx_buf) : connection->rx_length;
+    memcpy(connection->client->buf, rx_buf, length);
+    connection->client->buf[length] = '\0';
+    if (newline)
+    {
+        connection->rx_length -= length + 1;
+        memmove(rx_buf, newline + 1, connection->rx_length);
+    }
+    return newline != NULL;
+}
+
+
+/* Reads whatever is available from the client.  The command is required to be
+ * one line terminated by \n.  Anything following is discarded unless the
+ * connection is persistent. */
+static void read_command(int epoll_fd, struct connection *connection)
+{
+    char *buf = connection->rx_buf + connection->rx_length;
+    size_t buflen = sizeof(connection->rx_buf) - 1 - connection->rx_length;
+    ssize_t rx = read(connection->scon, buf, buflen);
+    if (rx < 0  &&  (errno == EAGAIN  ||  errno == EINTR))
+        return;
+    else if (rx < 0)
+        reject_connection(connection, "Socket read failed");
+    else if (rx == 0)
+        reject_connection(connection, "End of file on input");
+    else
+    {
+        connection->rx_length += (size_t) rx;
+        if (extract_command(connection))
+            start_command(epoll_fd, connection);
+        else if (connection->rx_length >= sizeof(connection->rx_buf) - 1)
+            reject_connection(connection, "Read buffer exhausted");
+    }
+}
+
+
+/* Adds connection to the list of connections waiting for a command. */
+static bool wait_for_command(
+    int epoll_fd, struct connection *connection, time_t timeout)
+{
+    connection->deadline = time(NULL) + timeout;
+    list_add_tail(&connection->list, &reading_connections);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+    return
+        TEST_IO(fcntl(connection->scon, F_SETFL, O_NONBLOCK))  &&
+        TEST_IO(epoll_ctl(
+            epoll_fd, EPOLL_CTL_ADD, connection->scon, &event));
+}
+
+
+static void accept_connection(int epoll_fd, int sock)
+{
+    int scon;
+    if (TEST_IO(scon = accept(sock, NULL, NULL)))
+    {
+        struct connection *connection = malloc(sizeof(struct connection));
+        *connection = (struct connection) {
+            .scon = scon, .rx_length = 0, .client = add_client() };
+        INIT_LIST_HEAD(&connection->list);
+
+        /* Retrieve client address so we can log all messages associated with
+         * this client with the appropriate address. */
+        get_client_name(scon, connection->client->name);
+
+        if (!(
+                set_socket_cork(scon, true)  &&
+                set_socket_timeout(scon, 1, 10)  &&
+                wait_for_command(epoll_fd, connection, COMMAND_TIMEOUT)))
+            reject_connection(connection, "Unable to accept connection");
+    }
+}
+
+
+/* Returns persistent connections handed back by resume_connection() to the
+ * reading list.  Commands already pipelined by the client are started
+ * immediately. */
+static void restart_connections(int epoll_fd)
+{
+    uint64_t events;
+    IGNORE(TEST_read(resume_event, &events, sizeof(events)));
+
+    while (true)
+    {
+        struct connection *connection = NULL;
+        LOCK(work_lock);
+        if (resumed_connections.next != &resumed_connections)
+        {
+            connection = container_of(
+                resumed_connections.next, struct connection, list);
+            list_del(&connection->list);
+        }
+        UNLOCK(work_lock);
+        if (connection == NULL)
+            break;
+
+        if (!wait_for_command(epoll_fd, connection, KEEP_ALIVE_TIMEOUT))
+            reject_connection(connection, "Unable to resume connection");
+        else if (extract_command(connection))
+            start_command(epoll_fd, connection);
+    }
+}
+
+
+/* Closes connections that have taken too long to send their command. */
+static void expire_connections(void)
+{
+    time_t now = time(NULL);
+    struct list_head *entry = reading_connections.next;
+    while (entry != &reading_connections)
+    {
+        struct connection *connection =
+            container_of(entry, struct connection, list);
+        entry = entry->next;
+        if (now > connection->deadline)
+            reject_connection(connection, "Timeout reading command");
+    }
+}
+
 
 static void *run_server(void *context)
 {
     int sock = (int)(intptr_t) context;
-    /* Note that we need to create the spawned threads with DETACHED attribute,
-     * otherwise we accumlate internal joinable state information and eventually
-     * run out of resources. */
-    pthread_attr_t attr;
-    ASSERT_0(pthread_attr_init(&attr));
-    ASSERT_0(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+    int epoll_fd;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event resume = {
+        .events = EPOLLIN, .data.ptr = &resumed_connections };
+    bool ok =
+        TEST_IO(epoll_fd = epoll_create1(EPOLL_CLOEXEC))  &&
+        TEST_IO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event))  &&
+        TEST_IO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, resume_event, &resume));
 
-    int scon;
-    pthread_t thread;
-    while (TEST_IO(scon = accept(sock, NULL, NULL)))
-        IGNORE(TEST_0(pthread_create(&thread, &attr,
-            process_connection, (void *)(intptr_t) scon)));
+    while (ok)
+    {
+        struct epoll_event events[64];
+        int count = epoll_wait(
+            epoll_fd, events, ARRAY_SIZE(events), 1000 * COMMAND_TIMEOUT);
+        ok = count >= 0  ||  TEST_OK(errno == EINTR);
+        for (int i = 0; i < count; i ++)
+            if (events[i].data.ptr == NULL)
+                accept_connection(epoll_fd, sock);
+            else if (events[i].data.ptr == &resumed_connections)
+                restart_connections(epoll_fd);
+            else
+                read_command(epoll_fd, events[i].data.ptr);
+        expire_connections();
+    }
     return NULL;
 }
 
@@ -618,15 +1146,16 @@ static pthread_t server_thread;
 static int server_socket;
 
 bool initialise_server(
-    struct buffer *fa_buffer, struct buffer *decimated,
-    unsigned int _events_fa_id, const char *_server_name,
-    const char *bind_address, int port, bool extra, bool reuseaddr)
+    struct buffer *fa_buffer, unsigned int _events_fa_id, const char *_server_name,
+    const char *bind_address, int port, bool extra, bool reuseaddr,
+    unsigned int _worker_count)
 {
-    initialise_subscribe(fa_buffer, decimated);
+    initialise_subscribe(fa_buffer);
     fa_block_buffer = fa_buffer;
     events_fa_id = _events_fa_id;
     server_name = _server_name;
     debug_commands = extra;
+    worker_count = _worker_count;
 
     struct sockaddr_in sin = {
         .sin_family = AF_INET,
@@ -645,14 +1174,22 @@ bool initialise_server(
         TEST_IO_(
             bind(server_socket, (struct sockaddr *) &sin, sizeof(sin)),
             "Unable to bind to server socket")  &&
-        TEST_IO(listen(server_socket, 5))  &&
+        TEST_OK_(worker_count > 0, "Must have at least one server thread")  &&
+        TEST_IO(resume_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))  &&
+        TEST_IO(listen(server_socket, 64))  &&
         DO_(log_message("Server listening on port %d", port));
 }
 
 bool start_server(void)
 {
-    return TEST_0(pthread_create(
-        &server_thread, NULL, run_server, (void *) (intptr_t) server_socket));
+    workers = malloc(worker_count * sizeof(pthread_t));
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < worker_count; i ++)
+        ok = TEST_0(pthread_create(&workers[i], NULL, worker_thread, NULL));
+    return
+        ok  &&
+        TEST_0(pthread_create(
+            &server_thread, NULL, run_server, (void *) (intptr_t) server_socket));
 }
 
 
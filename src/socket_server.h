@@ -28,9 +28,9 @@
  */
 
 bool initialise_server(
-    struct buffer *fa_buffer, struct buffer *decimated,
-    unsigned int events_fa_id, const char *server_name,
-    const char *bind_address, int port, bool extra, bool reuseaddr);
+    struct buffer *fa_buffer, unsigned int events_fa_id, const char *server_name,
+    const char *bind_address, int port, bool extra, bool reuseaddr,
+    unsigned int worker_count);
 bool start_server(void);
 void terminate_server(void);
 
@@ -0,0 +1,707 @@
+/* Shared computation of power spectra for subscribers.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Each spectrum engine runs its own thread reading from the selected data
+ * buffer.  Samples for the active ids are gathered into segments, and when a
+ * segment is complete the FFTs for all active ids are shared among a pool of
+ * worker threads, after which the averaged power spectra are published to the
+ * subscribers. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <math.h>
+#include <complex.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+#include "buffer.h"
+#include "locking.h"
+#include "list.h"
+
+#include "spectrum.h"
+
+
+static struct buffer *fa_block_buffer;
+static struct buffer *decimated_block_buffer;
+static unsigned int fa_entry_count;
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* FFT plans. */
+
+/* The FFT twiddle factors, bit reversal permutation and window are computed
+ * once for each engine and reused for every segment. */
+struct fft_plan {
+    unsigned int length_log2;
+    double complex *twiddles;   // exp(-2 pi i k / N) for k < N/2
+    unsigned int *reverse;      // Bit reversal permutation
+    double *window;             // Hann window
+    double scaling;             // Converts |FFT|^2 to one sided power
+};
+
+
+static void initialise_plan(struct fft_plan *plan, unsigned int length_log2)
+{
+    unsigned int N = 1U << length_log2;
+    plan->length_log2 = length_log2;
+    plan->twiddles = malloc(N / 2 * sizeof(double complex));
+    plan->reverse = malloc(N * sizeof(unsigned int));
+    plan->window = malloc(N * sizeof(double));
+
+    for (unsigned int k = 0; k < N / 2; k ++)
+        plan->twiddles[k] = cexp(-2 * M_PI * I * k / N);
+    for (unsigned int i = 0; i < N; i ++)
+    {
+        unsigned int r = 0;
+        for (unsigned int b = 0; b < length_log2; b ++)
+            r |= ((i >> b) & 1) << (length_log2 - 1 - b);
+        plan->reverse[i] = r;
+    }
+
+    double window_power = 0;
+    for (unsigned int i = 0; i < N; i ++)
+    {
+        plan->window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / N);
+        window_power += plan->window[i] * plan->window[i];
+    }
+    /* By Parseval the sum of |FFT|^2 over all N bins is N times the windowed
+     * signal power, and we fold the negative frequencies onto the positive. */
+    plan->scaling = 2 / (N * window_power);
+}
+
+
+static void release_plan(struct fft_plan *plan)
+{
+    free(plan->twiddles);
+    free(plan->reverse);
+    free(plan->window);
+}
+
+
+/* In place radix 2 decimation in time FFT. */
+static void fft(const struct fft_plan *plan, double complex *data)
+{
+    unsigned int N = 1U << plan->length_log2;
+    for (unsigned int i = 0; i < N; i ++)
+    {
+        unsigned int r = plan->reverse[i];
+        if (i < r)
+        {
+            double complex t = data[i];
+            data[i] = data[r];
+            data[r] = t;
+        }
+    }
+
+    for (unsigned int half = 1; half < N; half <<= 1)
+    {
+        unsigned int step = N / (2 * half);
+        for (unsigned int i = 0; i < N; i += 2 * half)
+            for (unsigned int k = 0; k < half; k ++)
+            {
+                double complex t =
+                    plan->twiddles[k * step] * data[i + k + half];
+                data[i + k + half] = data[i + k] - t;
+                data[i + k] += t;
+            }
+    }
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Spectrum engines. */
+
+/* State for each id computed by an engine.  The samples and power arrays are
+ * only touched by the engine and its workers, the published spectrum is
+ * protected by the engine lock. */
+struct id_spectrum {
+    struct fa_entry *samples;       // Samples for the current segment
+    double *power;                  // Accumulated X,Y power for each bin
+    struct spectrum_bin *published; // Last published spectrum
+    unsigned int sequence;          // Sequence number of published spectrum
+};
+
+struct spectrum_engine {
+    struct list_head list;
+    bool decimated;
+    unsigned int length_log2;
+    unsigned int averages;
+    unsigned int subscribers;
+
+    struct locking lock;
+    bool running;                   // Cleared to stop the engine thread
+    unsigned int sequence;          // Incremented for each published spectrum
+    uint64_t timestamp;             // Timestamp of last published spectrum
+    unsigned int users[MAX_FA_ENTRY_COUNT]; // Subscribers for each id
+    struct id_spectrum *ids[MAX_FA_ENTRY_COUNT];
+
+    /* The following are only used by the engine thread and its workers. */
+    pthread_t thread;
+    struct reader_state *reader;
+    struct fft_plan plan;
+    unsigned int active[MAX_FA_ENTRY_COUNT];    // Ids being computed
+    unsigned int active_count;
+    unsigned int next_active;       // Next active id for a worker to compute
+    unsigned int segment_offset;    // Samples gathered into current segment
+    unsigned int segment_count;     // Segments accumulated into current power
+};
+
+DECLARE_LOCKING(engines_lock);
+static LIST_HEAD(spectrum_engines);
+static bool spectrum_running = true;
+
+
+static double abs2(double complex z)
+{
+    return creal(z) * creal(z) + cimag(z) * cimag(z);
+}
+
+
+/* Windows the X and Y samples of one segment as a single complex signal, and
+ * separates the two transforms using the symmetry of real transforms before
+ * accumulating their powers. */
+static void compute_id_spectrum(
+    struct spectrum_engine *engine, struct id_spectrum *id,
+    double complex *workspace)
+{
+    const struct fft_plan *plan = &engine->plan;
+    unsigned int N = 1U << plan->length_log2;
+    for (unsigned int i = 0; i < N; i ++)
+        workspace[i] = plan->window[i] *
+            ((double) id->samples[i].x + I * (double) id->samples[i].y);
+    fft(plan, workspace);
+
+    for (unsigned int k = 0; k < N / 2; k ++)
+    {
+        double complex z = workspace[k];
+        double complex w = conj(workspace[(N - k) & (N - 1)]);
+        double complex x = 0.5 * (z + w);
+        double complex y = -0.5 * I * (z - w);
+        double scaling = k == 0 ? plan->scaling / 2 : plan->scaling;
+        id->power[2 * k]     += scaling * abs2(x);
+        id->power[2 * k + 1] += scaling * abs2(y);
+    }
+}
+
+
+/* Computes active ids for an engine until there are none left, called by the
+ * engine thread and by every pool worker. */
+static void compute_spectra(struct spectrum_engine *engine)
+{
+    double complex *workspace =
+        malloc(sizeof(double complex) << engine->length_log2);
+    for (;;)
+    {
+        unsigned int i = __sync_fetch_and_add(&engine->next_active, 1);
+        if (i >= engine->active_count)
+            break;
+        compute_id_spectrum(
+            engine, engine->ids[engine->active[i]], workspace);
+    }
+    free(workspace);
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Spectrum worker pool. */
+
+/* The FFTs for a segment are independent for each id, so are shared among a
+ * pool of worker threads together with the engine thread itself.  Only one
+ * engine uses the pool at a time, any others wait their turn. */
+
+static unsigned int worker_count;   // Number of workers, including the engine
+static pthread_t *workers;
+
+DECLARE_LOCKING(pool_lock);
+static bool workers_running;
+static struct spectrum_engine *pool_engine; // Engine using the pool, or NULL
+static unsigned int pool_generation;    // Incremented for each new segment
+static unsigned int workers_busy;       // Number of workers still working
+
+
+/* Waits for a new segment to process, returns false if the pool is stopping
+ * and there is no more work. */
+static bool wait_for_engine(
+    unsigned int *generation, struct spectrum_engine **engine)
+{
+    bool have_engine;
+    LOCK(pool_lock);
+    while (workers_running  &&  pool_generation == *generation)
+        pwait(&pool_lock);
+    have_engine = pool_generation != *generation;
+    *generation = pool_generation;
+    *engine = pool_engine;
+    UNLOCK(pool_lock);
+    return have_engine;
+}
+
+
+static void *worker_thread(void *context)
+{
+    unsigned int generation = 0;
+    struct spectrum_engine *engine;
+    while (wait_for_engine(&generation, &engine))
+    {
+        compute_spectra(engine);
+
+        LOCK(pool_lock);
+        workers_busy -= 1;
+        if (workers_busy == 0)
+            pbroadcast(&pool_lock);
+        UNLOCK(pool_lock);
+    }
+    return NULL;
+}
+
+
+/* Computes the spectra of the current segment for all active ids. */
+static void run_spectra(struct spectrum_engine *engine)
+{
+    engine->next_active = 0;
+
+    bool use_pool;
+    LOCK(pool_lock);
+    while (pool_engine != NULL)
+        pwait(&pool_lock);
+    use_pool = workers_running  &&  worker_count > 1;
+    if (use_pool)
+    {
+        pool_engine = engine;
+        pool_generation += 1;
+        workers_busy = worker_count - 1;
+        pbroadcast(&pool_lock);
+    }
+    UNLOCK(pool_lock);
+
+    compute_spectra(engine);
+
+    if (use_pool)
+    {
+        LOCK(pool_lock);
+        while (workers_busy > 0)
+            pwait(&pool_lock);
+        pool_engine = NULL;
+        pbroadcast(&pool_lock);
+        UNLOCK(pool_lock);
+    }
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Engine thread. */
+
+
+static struct id_spectrum *create_id_spectrum(unsigned int length_log2)
+{
+    unsigned int N = 1U << length_log2;
+    struct id_spectrum *id = malloc(sizeof(struct id_spectrum));
+    id->samples = malloc(N * sizeof(struct fa_entry));
+    id->power = malloc(N * sizeof(double));
+    id->published = malloc(N / 2 * sizeof(struct spectrum_bin));
+    id->sequence = 0;
+    return id;
+}
+
+static void release_id_spectrum(struct id_spectrum *id)
+{
+    free(id->samples);
+    free(id->power);
+    free(id->published);
+    free(id);
+}
+
+
+/* Updates the set of active ids from the subscriber counts, called at the
+ * start of each averaging cycle so that every published spectrum is a complete
+ * average.  State for newly active ids is created here. */
+static void update_active(struct spectrum_engine *engine)
+{
+    LOCK(engine->lock);
+    engine->active_count = 0;
+    for (unsigned int id = 0; id < fa_entry_count; id ++)
+        if (engine->users[id] > 0)
+        {
+            if (engine->ids[id] == NULL)
+                engine->ids[id] = create_id_spectrum(engine->length_log2);
+            engine->active[engine->active_count++] = id;
+        }
+    UNLOCK(engine->lock);
+
+    for (unsigned int i = 0; i < engine->active_count; i ++)
+        memset(engine->ids[engine->active[i]]->power, 0,
+            sizeof(double) << engine->length_log2);
+}
+
+
+/* Copies samples for the active ids from frame_count frames into the current
+ * segment, returning the number of frames consumed. */
+static unsigned int gather_samples(
+    struct spectrum_engine *engine,
+    const struct fa_entry *frames, unsigned int frame_count)
+{
+    unsigned int count = (1U << engine->length_log2) - engine->segment_offset;
+    if (count > frame_count)
+        count = frame_count;
+    for (unsigned int i = 0; i < engine->active_count; i ++)
+    {
+        unsigned int id = engine->active[i];
+        struct fa_entry *samples =
+            engine->ids[id]->samples + engine->segment_offset;
+        for (unsigned int f = 0; f < count; f ++)
+            samples[f] = frames[f * fa_entry_count + id];
+    }
+    engine->segment_offset += count;
+    return count;
+}
+
+
+/* Publishes the averaged spectra and wakes up all waiting subscribers. */
+static void publish_spectra(struct spectrum_engine *engine, uint64_t timestamp)
+{
+    unsigned int bins = 1U << (engine->length_log2 - 1);
+    LOCK(engine->lock);
+    engine->sequence += 1;
+    engine->timestamp = timestamp;
+    for (unsigned int i = 0; i < engine->active_count; i ++)
+    {
+        struct id_spectrum *id = engine->ids[engine->active[i]];
+        for (unsigned int k = 0; k < bins; k ++)
+            id->published[k] = (struct spectrum_bin) {
+                .x = (float) (id->power[2 * k] / engine->averages),
+                .y = (float) (id->power[2 * k + 1] / engine->averages) };
+        id->sequence = engine->sequence;
+    }
+    pbroadcast(&engine->lock);
+    UNLOCK(engine->lock);
+}
+
+
+static void process_engine_block(
+    struct spectrum_engine *engine, const struct fa_entry *frames,
+    unsigned int frame_count, uint64_t timestamp)
+{
+    while (frame_count > 0)
+    {
+        if (engine->segment_offset == 0  &&  engine->segment_count == 0)
+            update_active(engine);
+
+        unsigned int count = gather_samples(engine, frames, frame_count);
+        frames += count * fa_entry_count;
+        frame_count -= count;
+
+        if (engine->segment_offset == 1U << engine->length_log2)
+        {
+            run_spectra(engine);
+            engine->segment_offset = 0;
+            engine->segment_count += 1;
+            if (engine->segment_count == engine->averages)
+            {
+                publish_spectra(engine, timestamp);
+                engine->segment_count = 0;
+            }
+        }
+    }
+}
+
+
+/* On any gap in the data stream the partial spectrum is discarded. */
+static void reset_engine(struct spectrum_engine *engine)
+{
+    engine->segment_offset = 0;
+    engine->segment_count = 0;
+}
+
+
+static void *engine_thread(void *context)
+{
+    struct spectrum_engine *engine = context;
+    unsigned int frame_count = (unsigned int) (
+        reader_block_size(engine->reader) / fa_entry_count / FA_ENTRY_SIZE);
+    while (engine->running)
+    {
+        uint64_t timestamp;
+        const struct fa_entry *block =
+            get_read_block(engine->reader, &timestamp);
+        if (block)
+        {
+            process_engine_block(engine, block, frame_count, timestamp);
+            if (!release_read_block(engine->reader))
+                reset_engine(engine);
+        }
+        else
+            reset_engine(engine);
+    }
+    return NULL;
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Engine management. */
+
+
+static struct spectrum_engine *create_engine(
+    bool decimated, unsigned int length_log2, unsigned int averages)
+{
+    struct spectrum_engine *engine = calloc(1, sizeof(struct spectrum_engine));
+    engine->decimated = decimated;
+    engine->length_log2 = length_log2;
+    engine->averages = averages;
+    engine->running = true;
+    initialise_locking(&engine->lock);
+    initialise_plan(&engine->plan, length_log2);
+    engine->reader = open_reader(
+        decimated ? decimated_block_buffer : fa_block_buffer, false);
+
+    if (TEST_0(pthread_create(&engine->thread, NULL, engine_thread, engine)))
+        list_add(&engine->list, &spectrum_engines);
+    else
+    {
+        close_reader(engine->reader);
+        release_plan(&engine->plan);
+        free(engine);
+        engine = NULL;
+    }
+    return engine;
+}
+
+
+static void stop_engine(struct spectrum_engine *engine)
+{
+    LOCK(engine->lock);
+    engine->running = false;
+    pbroadcast(&engine->lock);
+    UNLOCK(engine->lock);
+    interrupt_reader(engine->reader);
+}
+
+
+static void destroy_engine(struct spectrum_engine *engine)
+{
+    stop_engine(engine);
+    ASSERT_0(pthread_join(engine->thread, NULL));
+    close_reader(engine->reader);
+    for (unsigned int id = 0; id < fa_entry_count; id ++)
+        if (engine->ids[id])
+            release_id_spectrum(engine->ids[id]);
+    release_plan(&engine->plan);
+    free(engine);
+}
+
+
+/* Looks for an existing engine, called with engines_lock held. */
+static struct spectrum_engine *find_engine(
+    bool decimated, unsigned int length_log2, unsigned int averages)
+{
+    list_for_each_entry(
+        struct spectrum_engine, list, engine, &spectrum_engines)
+        if (engine->decimated == decimated  &&
+            engine->length_log2 == length_log2  &&
+            engine->averages == averages)
+            return engine;
+    return NULL;
+}
+
+
+static void update_users(
+    struct spectrum_engine *engine, const struct filter_mask *mask, int delta)
+{
+    LOCK(engine->lock);
+    for (unsigned int id = 0; id < fa_entry_count; id ++)
+        if (test_mask_bit(mask, id))
+            engine->users[id] += (unsigned int) delta;
+    UNLOCK(engine->lock);
+}
+
+
+/* Finds or creates the requested engine, called with engines_lock held. */
+static struct spectrum_engine *get_engine(
+    bool decimated, unsigned int length_log2, unsigned int averages)
+{
+    struct spectrum_engine *engine = NULL;
+    if (TEST_OK_(spectrum_running, "Spectrum service stopped"))
+    {
+        engine = find_engine(decimated, length_log2, averages);
+        if (engine == NULL)
+            engine = create_engine(decimated, length_log2, averages);
+        if (engine)
+            engine->subscribers += 1;
+    }
+    return engine;
+}
+
+
+struct spectrum_engine *join_spectrum(
+    bool decimated, unsigned int length_log2, unsigned int averages,
+    const struct filter_mask *mask)
+{
+    struct spectrum_engine *engine;
+    LOCK(engines_lock);
+    engine = get_engine(decimated, length_log2, averages);
+    UNLOCK(engines_lock);
+
+    if (engine)
+        update_users(engine, mask, 1);
+    return engine;
+}
+
+
+void leave_spectrum(
+    struct spectrum_engine *engine, const struct filter_mask *mask)
+{
+    update_users(engine, mask, -1);
+
+    bool last;
+    LOCK(engines_lock);
+    engine->subscribers -= 1;
+    last = engine->subscribers == 0;
+    if (last)
+        list_del(&engine->list);
+    UNLOCK(engines_lock);
+
+    if (last)
+        destroy_engine(engine);
+}
+
+
+/* Checks whether a spectrum newer than sequence is available for every id in
+ * mask, called with the engine locked. */
+static bool spectrum_ready(
+    struct spectrum_engine *engine, const struct filter_mask *mask,
+    unsigned int sequence)
+{
+    if (engine->sequence == sequence)
+        return false;
+    for (unsigned int id = 0; id < fa_entry_count; id ++)
+        if (test_mask_bit(mask, id)  &&  (
+                engine->ids[id] == NULL  ||
+                engine->ids[id]->sequence != engine->sequence))
+            return false;
+    return true;
+}
+
+
+static void copy_spectra(
+    struct spectrum_engine *engine, const struct filter_mask *mask,
+    struct spectrum_bin *output)
+{
+    unsigned int bins = 1U << (engine->length_log2 - 1);
+    for (unsigned int id = 0; id < fa_entry_count; id ++)
+        if (test_mask_bit(mask, id))
+        {
+            memcpy(output, engine->ids[id]->published,
+                bins * sizeof(struct spectrum_bin));
+            output += bins;
+        }
+}
+
+
+bool wait_spectrum(
+    struct spectrum_engine *engine, const struct filter_mask *mask,
+    unsigned int *sequence, uint64_t *timestamp, struct spectrum_bin *output)
+{
+    bool ok;
+    LOCK(engine->lock);
+    while (engine->running  &&  !spectrum_ready(engine, mask, *sequence))
+        pwait(&engine->lock);
+    ok = engine->running;
+    if (ok)
+    {
+        *sequence = engine->sequence;
+        *timestamp = engine->timestamp;
+        copy_spectra(engine, mask, output);
+    }
+    UNLOCK(engine->lock);
+    return TEST_OK_(ok, "Spectrum stopped");
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Initialisation and shutdown. */
+
+
+bool initialise_spectrum(
+    struct buffer *fa_buffer, struct buffer *decimated_buffer,
+    unsigned int fa_entry_count_, unsigned int thread_count)
+{
+    fa_block_buffer = fa_buffer;
+    decimated_block_buffer = decimated_buffer;
+    fa_entry_count = fa_entry_count_;
+    worker_count = thread_count;
+    workers = calloc(worker_count, sizeof(pthread_t));
+    return TEST_OK_(thread_count > 0, "Must have at least one spectrum thread");
+}
+
+
+bool start_spectrum(void)
+{
+    workers_running = true;
+    bool ok = true;
+    for (unsigned int i = 1; ok  &&  i < worker_count; i ++)
+        ok = TEST_0(pthread_create(&workers[i], NULL, worker_thread, NULL));
+    return ok;
+}
+
+
+/* Stops all running engines, any remaining subscribers will then see their
+ * spectrum stop and leave.  Called with engines_lock held. */
+static void stop_all_engines(void)
+{
+    spectrum_running = false;
+    list_for_each_entry(
+        struct spectrum_engine, list, engine, &spectrum_engines)
+        stop_engine(engine);
+}
+
+
+void terminate_spectrum(void)
+{
+    LOCK(engines_lock);
+    stop_all_engines();
+    UNLOCK(engines_lock);
+
+    LOCK(pool_lock);
+    workers_running = false;
+    pbroadcast(&pool_lock);
+    UNLOCK(pool_lock);
+    for (unsigned int i = 1; i < worker_count; i ++)
+        ASSERT_0(pthread_join(workers[i], NULL));
+}
@@ -0,0 +1,73 @@
+/* Shared computation of power spectra for subscribers.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Power spectra are computed on the server from the live data stream so that
+ * spectrum viewers don't each need to subscribe to full rate data.  Each
+ * spectrum is the average of a number of Hann windowed segments of the
+ * requested length.  Subscribers asking for the same data source, segment
+ * length and averaging share a single spectrum engine, and each id is only
+ * computed once however many subscribers ask for it. */
+
+#define MIN_SPECTRUM_LENGTH_LOG2    4
+#define MAX_SPECTRUM_LENGTH_LOG2    14
+
+/* A single spectrum bin for both X and Y.  A spectrum of segment length N is
+ * sent as N/2 bins from DC up to just below the Nyquist frequency, scaled so
+ * that the sum over all bins is the mean square of the windowed signal. */
+struct spectrum_bin {
+    float x, y;
+};
+
+struct spectrum_engine;
+
+/* Joins or creates the spectrum engine for the given parameters and adds the
+ * ids in mask to the ids it computes. */
+struct spectrum_engine *join_spectrum(
+    bool decimated, unsigned int length_log2, unsigned int averages,
+    const struct filter_mask *mask);
+/* Releases the ids in mask and leaves the engine, which is destroyed when its
+ * last subscriber leaves. */
+void leave_spectrum(
+    struct spectrum_engine *engine, const struct filter_mask *mask);
+
+/* Waits for a spectrum newer than *sequence containing all the ids in mask and
+ * copies their spectra into output in ascending id order, N/2 bins for each
+ * id.  The timestamp of the last sample of the spectrum is returned.  Returns
+ * false if the spectrum engine is stopped. */
+bool wait_spectrum(
+    struct spectrum_engine *engine, const struct filter_mask *mask,
+    unsigned int *sequence, uint64_t *timestamp, struct spectrum_bin *output);
+
+/* Configures the data sources and the number of threads used to compute
+ * spectra.  The decimated buffer can be NULL. */
+bool initialise_spectrum(
+    struct buffer *fa_buffer, struct buffer *decimated_buffer,
+    unsigned int fa_entry_count, unsigned int thread_count);
+bool start_spectrum(void);
+void terminate_spectrum(void);
@@ -0,0 +1,120 @@
+/* Lock free pipeline performance statistics.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "error.h"
+
+#include "stats.h"
+
+
+static struct latency_histogram histograms[LATENCY_STAGE_COUNT];
+
+/* Counter for the client served by this thread. */
+static __thread uint64_t *client_byte_counter;
+
+
+uint64_t start_latency(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return 1000000 * (uint64_t) now.tv_sec + (uint64_t) now.tv_nsec / 1000;
+}
+
+
+/* Returns the histogram bucket for a duration: one more than the position of
+ * the most significant bit, limited to the available buckets. */
+static unsigned int __const_ histogram_bucket(uint64_t duration)
+{
+    unsigned int bucket =
+        duration == 0 ? 0 : 64 - (unsigned int) __builtin_clzll(duration);
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+
+void record_latency(enum latency_stage stage, uint64_t start)
+{
+    uint64_t duration = start_latency() - start;
+    struct latency_histogram *histogram = &histograms[stage];
+
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total, duration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(
+        &histogram->buckets[histogram_bucket(duration)], 1, __ATOMIC_RELAXED);
+
+    uint64_t maximum = __atomic_load_n(&histogram->maximum, __ATOMIC_RELAXED);
+    while (duration > maximum  &&
+        !__atomic_compare_exchange_n(&histogram->maximum, &maximum, duration,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+void get_latency_histogram(
+    enum latency_stage stage, struct latency_histogram *histogram)
+{
+    struct latency_histogram *source = &histograms[stage];
+    histogram->count = __atomic_load_n(&source->count, __ATOMIC_RELAXED);
+    histogram->total = __atomic_load_n(&source->total, __ATOMIC_RELAXED);
+    histogram->maximum = __atomic_load_n(&source->maximum, __ATOMIC_RELAXED);
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i ++)
+        histogram->buckets[i] =
+            __atomic_load_n(&source->buckets[i], __ATOMIC_RELAXED);
+}
+
+
+const char *latency_stage_name(enum latency_stage stage)
+{
+    static const char *names[] = {
+        [LATENCY_SNIFFER_READ] = "sniffer_read",
+        [LATENCY_TRANSFORM_BLOCK] = "transform_block",
+        [LATENCY_MAJOR_WRITE] = "major_write",
+        [LATENCY_READ_WAIT] = "read_wait",
+    };
+    return names[stage];
+}
+
+
+void set_client_byte_counter(uint64_t *counter)
+{
+    client_byte_counter = counter;
+}
+
+
+void account_client_bytes(size_t length)
+{
+    if (client_byte_counter)
+        __atomic_add_fetch(client_byte_counter, length, __ATOMIC_RELAXED);
+}
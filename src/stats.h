@@ -0,0 +1,71 @@
+/* Lock free pipeline performance statistics.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Each instrumented stage of the processing pipeline records a histogram of
+ * durations in microseconds.  Bucket 0 counts durations under 1us and bucket n
+ * counts durations in the range 2^(n-1) to 2^n-1 us, with the last bucket also
+ * counting anything longer.  Histograms are updated with atomic operations
+ * only, so recording a duration never blocks the hot path. */
+
+#define HISTOGRAM_BUCKETS   32
+
+enum latency_stage {
+    LATENCY_SNIFFER_READ,       // Sniffer reading one FA block
+    LATENCY_TRANSFORM_BLOCK,    // Transform processing one FA block
+    LATENCY_MAJOR_WRITE,        // Writing one major block to disk
+    LATENCY_READ_WAIT,          // Archive reader waiting for admission
+    LATENCY_STAGE_COUNT
+};
+
+struct latency_histogram {
+    uint64_t count;             // Number of durations recorded
+    uint64_t total;             // Sum of all durations in us
+    uint64_t maximum;           // Longest duration seen in us
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+
+/* Returns monotonic start time for a later call to record_latency(). */
+uint64_t start_latency(void);
+/* Records the time since start in the histogram for stage. */
+void record_latency(enum latency_stage stage, uint64_t start);
+
+/* Returns a snapshot of the histogram for stage.  As the histogram is updated
+ * while being read the fields may be very slightly inconsistent. */
+void get_latency_histogram(
+    enum latency_stage stage, struct latency_histogram *histogram);
+/* Returns short identifying name for stage. */
+const char *latency_stage_name(enum latency_stage stage);
+
+
+/* Each thread serving a client can set a counter to be incremented by every
+ * successful write of data to the client.  Set to NULL when done. */
+void set_client_byte_counter(uint64_t *counter);
+/* Adds length to the current thread's client byte counter, if any. */
+void account_client_bytes(size_t length);
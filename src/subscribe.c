@@ -35,6 +35,9 @@
 #include <stddef.h>
 #include <inttypes.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #include "error.h"
 #include "fa_sniffer.h"
@@ -46,18 +49,24 @@
 #include "disk.h"
 #include "transform.h"
 #include "decimate.h"
+#include "locking.h"
+#include "list.h"
+#include "spectrum.h"
+#include "stats.h"
+#include "compress.h"
 
 #include "subscribe.h"
 
 
 /* Block buffer for full resolution FA data. */
 static struct buffer *fa_block_buffer;
-/* Block buffer for decimated FA data. */
-static struct buffer *decimated_buffer;
 
 
 #define WRITE_BUFFER_SIZE       (1 << 16)
 
+/* Limit on the number of blocks a lagging subscriber is stepped over. */
+#define MAX_LAG_STRIDE          64
+
 
 
 /* Same options as for reader. */
@@ -73,10 +82,39 @@ struct subscribe_parse {
     enum send_timestamp send_timestamp; // Timestamp options
     bool want_t0;                   // Set if T0 should be sent
     bool uncork;                    // Set if stream should be uncorked
-    bool decimated;                 // Source of data (FA or decimated)
+    bool compress;                  // Send data as compressed chunks
+    bool skip_lag;                  // Skip blocks rather than underrun
+    bool statistics;                // Send live D statistics
+    unsigned int decimation;        // Source of data, 0 for FA, else stage + 1
+    unsigned int spectrum_log2;     // Spectrum segment length, 0 if none
+    unsigned int averages;          // Segments averaged for each spectrum
 };
 
 
+/* spectrum = "P" length [ "A" averages ] . */
+static bool parse_spectrum(const char **string, struct subscribe_parse *parse)
+{
+    unsigned int length;
+    parse->averages = 1;
+    bool ok =
+        parse_uint(string, &length)  &&
+        TEST_OK_(
+            length >= 1U << MIN_SPECTRUM_LENGTH_LOG2  &&
+            length <= 1U << MAX_SPECTRUM_LENGTH_LOG2  &&
+            (length & (length - 1)) == 0,
+            "Invalid spectrum length %u", length)  &&
+        IF_(read_char(string, 'A'),
+            parse_uint(string, &parse->averages)  &&
+            TEST_OK_(parse->averages > 0, "Invalid spectrum averaging"))  &&
+        TEST_OK_(parse->send_timestamp != SEND_EXTENDED  &&  !parse->want_t0,
+            "Extended timestamps and T0 not supported with spectrum")  &&
+        TEST_OK_(!parse->compress, "Compression not supported with spectrum")  &&
+        TEST_OK_(!parse->skip_lag, "Skipping not supported with spectrum");
+    parse->spectrum_log2 = (unsigned int) __builtin_ctz(length);
+    return ok;
+}
+
+
 static bool parse_options(const char **string, struct subscribe_parse *parse)
 {
     parse->send_timestamp =
@@ -84,16 +122,47 @@ static bool parse_options(const char **string, struct subscribe_parse *parse)
             read_char(string, 'E') ? SEND_EXTENDED : SEND_BASIC : SEND_NOTHING;
     parse->want_t0   = read_char(string, 'Z');
     parse->uncork    = read_char(string, 'U');
-    parse->decimated = read_char(string, 'D');
+    parse->compress  = read_char(string, 'X');
+    parse->skip_lag  = read_char(string, 'L');
+    parse->statistics = read_char(string, 'S');
+    parse->decimation = 0;
+    while (!parse->statistics  &&  read_char(string, 'D'))
+        parse->decimation += 1;
+    parse->spectrum_log2 = 0;
     return
-        TEST_OK_(!parse->decimated  ||  decimated_buffer != NULL,
-            "Decimated data not available");
+        TEST_OK_(parse->decimation <= get_decimation_stage_count(),
+            "Decimated data not available")  &&
+        IF_(parse->skip_lag,
+            TEST_OK_(parse->send_timestamp == SEND_EXTENDED,
+                "Extended timestamps needed to skip blocks"))  &&
+        IF_(parse->statistics,
+            TEST_OK_(get_statistics_buffer() != NULL,
+                "Decimated statistics not available")  &&
+            TEST_OK_(!parse->want_t0, "T0 not supported with statistics"))  &&
+        IF_(read_char(string, 'P'),
+            TEST_OK_(parse->decimation <= 1  &&  !parse->statistics,
+                "Spectrum only available for first decimation stage")  &&
+            parse_spectrum(string, parse));
+}
+
+
+/* Returns the buffer for the selected data source. */
+static struct buffer *subscription_buffer(const struct subscribe_parse *parse)
+{
+    if (parse->statistics)
+        return get_statistics_buffer();
+    else if (parse->decimation == 0)
+        return fa_block_buffer;
+    else
+        return get_decimation_buffer(parse->decimation - 1);
 }
 
 /* A subscribe request is a filter mask followed by options:
  *
  *  subscription = "S" filter-mask options
- *  options = [ "T" [ "E" ]] [ "Z" ] [ "U" ] [ "D" ]
+ *  options =
+ *      [ "T" [ "E" ]] [ "Z" ] [ "U" ] [ "X" ] [ "L" ] [ "S" | "D"* ] [ spectrum ]
+ *  spectrum = "P" length [ "A" averages ]
  *
  * The options have the following meanings:
  *
@@ -101,10 +170,22 @@ static bool parse_options(const char **string, struct subscribe_parse *parse)
  *  TE  Send extended timestamps
  *  Z   Start subscription stream with t0
  *  U   Uncork data stream
- *  D   Want decimated data stream
+ *  X   Send each block of data as a compressed chunk, see compress.h
+ *  L   If the subscriber falls behind skip blocks instead of disconnecting.
+ *      Needs TE, and each extended timestamp is followed by a count of blocks
+ *      skipped before the block.
+ *  S   Send live first decimation statistics for archived ids: for each
+ *      decimated sample the mean, min, max and std of each id, as soon as they
+ *      have been computed.
+ *  D   Want decimated data stream.  Each further D selects the next stage of
+ *      cascaded decimation, if configured.
+ *  P   Send power spectra of the given length, averaged over the given number
+ *      of segments, instead of the data stream.
  *
  * If TZ is specified then the timestamp is sent first before T0.
- * If TEZ is specified then T0 is sent with each timestamp. */
+ * If TEZ is specified then T0 is sent with each timestamp.  For spectra T sends
+ * a timestamp with each spectrum, and TE and Z are not supported.  Z is also
+ * not supported with statistics. */
 static bool parse_subscription(
     const char **string, unsigned int fa_entry_count,
     struct subscribe_parse *parse)
@@ -138,27 +219,40 @@ static bool send_header(
 }
 
 
+/* Returns the decimation of the subscribed data relative to FA data. */
+static unsigned int subscription_decimation(const struct subscribe_parse *parse)
+{
+    if (parse->statistics)
+        return 1U << get_header()->first_decimation_log2;
+    else if (parse->decimation > 0)
+        return get_decimation_factor(parse->decimation - 1);
+    else
+        return 1;
+}
+
+
 static bool send_extended_timestamp(
-    int scon, bool want_t0, bool decimated,
-    size_t block_size, uint64_t timestamp, uint32_t id0)
+    int scon, const struct subscribe_parse *parse,
+    size_t block_size, uint64_t timestamp, uint32_t id0, uint32_t skipped)
 {
     const struct disk_header *header = get_header();
 
     /* Compute an estimate of the duration of this block. */
-    unsigned int decimation = decimated ? get_decimation_factor() : 1;
+    unsigned int factor = subscription_decimation(parse);
     uint32_t duration = (uint32_t) (
-        block_size * decimation * header->last_duration /
+        block_size * factor * header->last_duration /
         header->major_sample_count);
     timestamp -= duration;      // timestamp is after *last* point
 
 #define TS_ERROR "Unable to write timestamp block"
-    if (want_t0)
+    bool ok;
+    if (parse->want_t0)
     {
         struct extended_timestamp_id0 extended_timestamp = {
             .timestamp = timestamp,
             .duration = duration,
             .id_zero = id0 };
-        return TEST_write_(
+        ok = TEST_write_(
             scon, &extended_timestamp, sizeof(extended_timestamp), TS_ERROR);
     }
     else
@@ -166,48 +260,312 @@ static bool send_extended_timestamp(
         struct extended_timestamp extended_timestamp = {
             .timestamp = timestamp,
             .duration = duration };
-        return TEST_write_(
+        ok = TEST_write_(
             scon, &extended_timestamp, sizeof(extended_timestamp), TS_ERROR);
     }
+    return ok  &&
+        IF_(parse->skip_lag,
+            TEST_write_(scon, &skipped, sizeof(skipped), TS_ERROR));
 }
 
 
-/* Copies a single FA frame taking the mask into account.
- * 'from' should point to a completely populated frame, 'to' will contain X,Y
- * pairs in ascending numerical order for bits set in mask. */
-static void copy_frame(
-    struct fa_entry *to, const struct fa_entry *from,
-    const struct filter_mask *mask, unsigned int fa_entry_count)
+/* A subscriber with the L option which is falling behind is only sent every
+ * stride'th block.  The stride doubles whenever more than half the buffer is
+ * waiting to be sent and halves again once less than an eighth is waiting.
+ * Called after releasing the block just sent, returns the number of blocks
+ * skipped. */
+static uint32_t skip_lagging_blocks(
+    struct reader_state *reader, unsigned int block_count,
+    unsigned int *stride)
 {
-    for (unsigned int i = 0; i < fa_entry_count / 8; i ++)  // 8 bits at a time
-    {
-        uint8_t m = mask->mask[i];
-        for (unsigned int j = 0; j < 8; j ++)
-        {
-            if ((m >> j) & 1)
-                *to++ = *from;
-            from += 1;
-        }
-    }
+    unsigned int backlog = reader_backlog(reader);
+    if (backlog > block_count / 2  &&  *stride < MAX_LAG_STRIDE)
+        *stride *= 2;
+    else if (backlog < block_count / 8  &&  *stride > 1)
+        *stride /= 2;
+    return *stride > 1 ? skip_read_blocks(reader, *stride - 1) : 0;
 }
 
 
-/* Takes copy of masked frames to buffer. */
+/* Takes copy of masked frames to buffer using the gather plan computed from
+ * the subscription mask.  The copy will contain X,Y pairs in ascending
+ * numerical order for the ids selected by the mask. */
 static void copy_frames(
     void *buffer, const void *block,
-    const struct filter_mask *mask, unsigned int fa_entry_count,
-    unsigned int count)
+    const struct id_run runs[], unsigned int run_count, unsigned int id_count,
+    unsigned int fa_entry_count, unsigned int count)
+{
+    gather_frames(runs, run_count, FA_ENTRY_SIZE,
+        block, fa_entry_count * FA_ENTRY_SIZE,
+        buffer, id_count * FA_ENTRY_SIZE, count);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Shared masked copies. */
+
+/* Subscribers with identical masks on the same data source join a mask group
+ * and share a single masked copy of each block: the first subscriber to reach
+ * a block makes the copy and the rest simply send it.  A handful of copies are
+ * kept so that subscribers running slightly out of step can still share, and a
+ * subscriber which finds every copy in use makes its own private copy.  The
+ * mask is compiled once into a gather plan when the group is created. */
+
+#define SHARED_COPIES   4
+
+struct shared_copy {
+    const void *block;          // Block this was copied from, or NULL
+    uint64_t timestamp;         // Timestamp of copied block
+    unsigned int users;         // Subscribers currently sending this copy
+    void *data;                 // Masked block data
+};
+
+struct mask_group {
+    struct list_head list;
+    struct filter_mask mask;
+    unsigned int decimation;
+    unsigned int subscribers;
+    unsigned int id_count;      // Number of ids in mask
+    unsigned int run_count;     // Number of runs in gather plan
+    struct id_run runs[MAX_FA_ENTRY_COUNT];
+    struct locking lock;
+    struct shared_copy copies[SHARED_COPIES];
+};
+
+DECLARE_LOCKING(groups_lock);
+static LIST_HEAD(mask_groups);
+
+
+/* Looks for an existing group for this mask, called with groups_lock held. */
+static struct mask_group *find_mask_group(
+    const struct filter_mask *mask, unsigned int decimation)
+{
+    list_for_each_entry(struct mask_group, list, group, &mask_groups)
+        if (group->decimation == decimation  &&
+            memcmp(&group->mask, mask, sizeof(struct filter_mask)) == 0)
+            return group;
+    return NULL;
+}
+
+static struct mask_group *create_mask_group(
+    const struct filter_mask *mask, unsigned int decimation,
+    unsigned int fa_entry_count, size_t data_size)
+{
+    struct mask_group *group;
+    if (!TEST_NULL(group = calloc(1, sizeof(struct mask_group))))
+        return NULL;
+
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < SHARED_COPIES; i ++)
+        ok = TEST_NULL(group->copies[i].data = malloc(data_size));
+    if (!ok)
+    {
+        /* Unallocated copies are still NULL from calloc. */
+        for (unsigned int i = 0; i < SHARED_COPIES; i ++)
+            free(group->copies[i].data);
+        free(group);
+        return NULL;
+    }
+
+    group->mask = *mask;
+    group->decimation = decimation;
+    group->id_count = count_mask_bits(mask, fa_entry_count);
+    group->run_count = compute_id_runs(
+        mask, fa_entry_count, (unsigned int) -1, group->runs);
+    initialise_locking(&group->lock);
+    list_add(&group->list, &mask_groups);
+    return group;
+}
+
+static struct mask_group *join_mask_group(
+    const struct filter_mask *mask, unsigned int decimation,
+    unsigned int fa_entry_count, size_t data_size)
+{
+    struct mask_group *group;
+    LOCK(groups_lock);
+    group = find_mask_group(mask, decimation);
+    if (group == NULL)
+        group = create_mask_group(
+            mask, decimation, fa_entry_count, data_size);
+    if (group)
+        group->subscribers += 1;
+    UNLOCK(groups_lock);
+    return group;
+}
+
+static void leave_mask_group(struct mask_group *group)
+{
+    bool last;
+    LOCK(groups_lock);
+    group->subscribers -= 1;
+    last = group->subscribers == 0;
+    if (last)
+        list_del(&group->list);
+    UNLOCK(groups_lock);
+
+    if (last)
+    {
+        for (unsigned int i = 0; i < SHARED_COPIES; i ++)
+            free(group->copies[i].data);
+        free(group);
+    }
+}
+
+
+/* Returns a copy of the given block, called with the group locked.  If the
+ * block has already been copied we use that, otherwise we reuse the oldest
+ * copy not currently being sent.  Returns NULL if all copies are busy. */
+static struct shared_copy *find_shared_copy(
+    struct mask_group *group, const void *block, uint64_t timestamp,
+    unsigned int fa_entry_count, unsigned int block_size)
+{
+    struct shared_copy *free_copy = NULL;
+    for (unsigned int i = 0; i < SHARED_COPIES; i ++)
+    {
+        struct shared_copy *copy = &group->copies[i];
+        if (copy->block == block  &&  copy->timestamp == timestamp)
+            return copy;
+        else if (copy->users == 0  &&  (
+                free_copy == NULL  ||  free_copy->block == NULL  ||
+                (copy->block != NULL  &&
+                 copy->timestamp < free_copy->timestamp)))
+            free_copy = copy;
+    }
+
+    if (free_copy)
+    {
+        copy_frames(free_copy->data, block, group->runs, group->run_count,
+            group->id_count, fa_entry_count, block_size);
+        free_copy->block = block;
+        free_copy->timestamp = timestamp;
+    }
+    return free_copy;
+}
+
+static struct shared_copy *get_shared_copy(
+    struct mask_group *group, const void *block, uint64_t timestamp,
+    unsigned int fa_entry_count, unsigned int block_size)
+{
+    struct shared_copy *copy;
+    LOCK(group->lock);
+    copy = find_shared_copy(
+        group, block, timestamp, fa_entry_count, block_size);
+    if (copy)
+        copy->users += 1;
+    UNLOCK(group->lock);
+    return copy;
+}
+
+static void release_shared_copy(
+    struct mask_group *group, struct shared_copy *copy)
+{
+    LOCK(group->lock);
+    copy->users -= 1;
+    UNLOCK(group->lock);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Subscription. */
+
+/* Writes a block of frames already packed into a single compressed chunk. */
+static bool send_packed(
+    int scon, const void *packed, size_t length, unsigned int block_size)
+{
+    struct compressed_chunk chunk = {
+        .sample_count = block_size,
+        .length = (uint32_t) length };
+    return
+        TEST_write_(scon, &chunk, sizeof(chunk), "Unable to write frame")  &&
+        TEST_write_(scon, packed, length, "Unable to write frame")  &&
+        DO_(account_client_bytes(sizeof(chunk) + length));
+}
+
+/* Writes a block of frames, packed into a single compressed chunk if packed is
+ * not NULL. */
+static bool send_frames(
+    int scon, void *packed, const void *data,
+    unsigned int block_size, unsigned int id_count, size_t buffer_size)
 {
-    size_t out_frame_size =
-        count_mask_bits(mask, fa_entry_count) * FA_ENTRY_SIZE;
-    size_t in_frame_size = fa_entry_count * FA_ENTRY_SIZE;
+    if (packed)
+        return send_packed(scon, packed,
+            pack_frames(data, block_size, id_count, packed), block_size);
+    else
+        return
+            TEST_write_(scon, data, buffer_size, "Unable to write frame")  &&
+            DO_(account_client_bytes(buffer_size));
+}
 
-    for (unsigned int i = 0; i < count; i ++)
+/* Writes as much of the block as the socket will take without blocking,
+ * returning the number of bytes written. */
+static bool send_nonblocking(
+    int scon, const void *data, size_t length, size_t *sent)
+{
+    ssize_t written = send(scon, data, length, MSG_DONTWAIT);
+    *sent = written > 0 ? (size_t) written : 0;
+    return
+        written >= 0  ||  errno == EAGAIN  ||  errno == EINTR  ||
+        TEST_IO_(written, "Unable to write frame");
+}
+
+/* Subscribers to the full mask are sent data directly from the buffer where
+ * this is safe, but no data is sent before it has been checked for underrun.
+ * A block is only sent straight from the buffer while the writer is at least a
+ * whole block behind it, and then only as much as the socket will take without
+ * blocking: this is copied out by the kernel long before the writer can reach
+ * it.  Whatever is left, and any compressed data, is copied out of the buffer
+ * and checked for underrun before being sent. */
+static bool send_direct(
+    int scon, struct reader_state *reader, struct subscribe_parse *parse,
+    const void *block, uint64_t timestamp, uint32_t skipped,
+    void *packed, void *spare,
+    unsigned int block_size, unsigned int id_count, size_t buffer_size)
+{
+    uint32_t id0 = *(const uint32_t *) block;
+    if (packed)
     {
-        copy_frame(buffer, block, mask, fa_entry_count);
-        buffer += out_frame_size;
-        block += in_frame_size;
+        size_t length = pack_frames(block, block_size, id_count, packed);
+        return
+            TEST_OK_(release_read_block(reader), "Write underrun to client")  &&
+            IF_(parse->send_timestamp == SEND_EXTENDED,
+                send_extended_timestamp(
+                    scon, parse, block_size, timestamp, id0, skipped))  &&
+            send_packed(scon, packed, length, block_size);
     }
+
+    size_t sent = 0;
+    bool ok =
+        /* The timestamp includes id0, so check this is clean first. */
+        TEST_OK_(check_read_block(reader, 0), "Write underrun to client")  &&
+        IF_(parse->send_timestamp == SEND_EXTENDED,
+            send_extended_timestamp(
+                scon, parse, block_size, timestamp, id0, skipped))  &&
+        IF_(check_read_block(reader, 1),
+            send_nonblocking(scon, block, buffer_size, &sent));
+    size_t rest = buffer_size - sent;
+    return ok  &&
+        DO_(memcpy(spare, block + sent, rest))  &&
+        TEST_OK_(release_read_block(reader), "Write underrun to client")  &&
+        IF_(rest > 0,
+            TEST_write_(scon, spare, rest, "Unable to write frame"))  &&
+        DO_(account_client_bytes(buffer_size));
+}
+
+/* Otherwise we send a masked copy which is checked for underrun first. */
+static bool send_masked(
+    int scon, struct reader_state *reader, struct subscribe_parse *parse,
+    const void *data, uint32_t id0, uint64_t timestamp, uint32_t skipped,
+    void *packed,
+    unsigned int block_size, unsigned int id_count, size_t buffer_size)
+{
+    return
+        /* See if the data is clean, or if we've underrun. */
+        TEST_OK_(release_read_block(reader), "Write underrun to client")  &&
+        /* Write the data if it's clean. */
+        IF_(parse->send_timestamp == SEND_EXTENDED,
+            send_extended_timestamp(
+                scon, parse, block_size, timestamp, id0, skipped))  &&
+        send_frames(scon, packed, data, block_size, id_count, buffer_size);
 }
 
 
@@ -222,32 +580,207 @@ static bool send_subscription(
         reader_block_size(reader) / fa_entry_count / FA_ENTRY_SIZE);
     unsigned int id_count = count_mask_bits(&parse->mask, fa_entry_count);
     size_t buffer_size = block_size * FA_ENTRY_SIZE * id_count;
+    bool full_mask = id_count == fa_entry_count;
+
+    struct mask_group *group = full_mask ? NULL :
+        join_mask_group(
+            &parse->mask, parse->decimation, fa_entry_count, buffer_size);
+    void *private_copy = NULL;
+    void *packed = parse->compress ?
+        malloc(packed_frames_size(block_size, id_count)) : NULL;
+    unsigned int block_count =
+        (unsigned int) buffer_block_count(subscription_buffer(parse));
+    unsigned int stride = 1;
+    uint32_t skipped = 0;
 
     bool ok =
+        IF_(!full_mask, TEST_NULL(group))  &&
+        IF_(parse->compress, TEST_NULL(packed))  &&
+        /* Full mask subscribers need somewhere to copy unsent data. */
+        IF_(full_mask  &&  packed == NULL,
+            TEST_NULL(private_copy = malloc(buffer_size)))  &&
         send_header(scon, parse, block_size, timestamp, block)  &&
         IF_(parse->uncork, set_socket_cork(scon, false));
 
     while (ok)
     {
-        /* Grab a copy of the data in the buffer. */
-        char buffer[buffer_size];
-        copy_frames(buffer, block, &parse->mask, fa_entry_count, block_size);
-        uint32_t id0 = *(const uint32_t *) block;
+        if (full_mask)
+            ok = send_direct(scon, reader, parse, block, timestamp, skipped,
+                packed, private_copy, block_size, id_count, buffer_size);
+        else
+        {
+            /* Use a shared copy of the data if possible, otherwise grab our
+             * own copy. */
+            uint32_t id0 = *(const uint32_t *) block;
+            struct shared_copy *copy = get_shared_copy(
+                group, block, timestamp, fa_entry_count, block_size);
+            if (copy)
+            {
+                ok = send_masked(scon, reader, parse, copy->data,
+                    id0, timestamp, skipped, packed,
+                    block_size, id_count, buffer_size);
+                release_shared_copy(group, copy);
+            }
+            else
+            {
+                ok = IF_(private_copy == NULL,
+                    TEST_NULL(private_copy = malloc(buffer_size)));
+                if (ok)
+                {
+                    copy_frames(private_copy, block,
+                        group->runs, group->run_count, id_count,
+                        fa_entry_count, block_size);
+                    ok = send_masked(scon, reader, parse, private_copy,
+                        id0, timestamp, skipped, packed,
+                        block_size, id_count, buffer_size);
+                }
+            }
+        }
+
+        /* Get the next block. */
+        if (ok  &&  parse->skip_lag)
+            skipped = skip_lagging_blocks(reader, block_count, &stride);
+        ok = ok  &&  TEST_NULL_(
+            block = get_read_block(reader, &timestamp),
+            "Gap in subscribed data");
+    }
+
+    free(private_copy);
+    free(packed);
+    if (group)
+        leave_mask_group(group);
+    return ok;
+}
+
+
+/* Converts the subscription mask into indexes into the archived ids, failing if
+ * any requested id isn't archived. */
+static bool statistics_ids(
+    const struct filter_mask *mask, uint16_t index[], unsigned int *id_count)
+{
+    const struct disk_header *header = get_header();
+    unsigned int n = 0;
+    uint16_t archive_index = 0;
+    bool ok = true;
+    for (unsigned int id = 0; ok  &&  id < header->fa_entry_count; id ++)
+    {
+        bool archived = test_mask_bit(&header->archive_mask, id);
+        if (test_mask_bit(mask, id))
+        {
+            ok = TEST_OK_(archived, "BPM %u not in archive", id);
+            index[n++] = archive_index;
+        }
+        if (archived)
+            archive_index += 1;
+    }
+    *id_count = n;
+    return ok;
+}
 
+
+/* Sends live statistics until something fails.  As the buffered rows are small
+ * each subscriber simply takes its own copy of the ids it wants, using a gather
+ * plan computed from the list of archive indexes.  For compression each
+ * decimated_data is treated as four separate fields. */
+static bool send_statistics_subscription(
+    int scon, struct reader_state *reader, struct subscribe_parse *parse,
+    const uint16_t index[], unsigned int id_count,
+    const void *block, uint64_t timestamp)
+{
+    unsigned int block_size = (unsigned int) (
+        reader_block_size(reader) / get_header()->archive_mask_count /
+        sizeof(struct decimated_data));
+    size_t buffer_size = block_size * id_count * sizeof(struct decimated_data);
+    unsigned int field_count =
+        id_count * (unsigned int) (sizeof(struct decimated_data) / FA_ENTRY_SIZE);
+    unsigned int archive_count = get_header()->archive_mask_count;
+    struct decimated_data *data = malloc(buffer_size);
+    void *packed = parse->compress ?
+        malloc(packed_frames_size(block_size, field_count)) : NULL;
+    struct id_run *runs = malloc(id_count * sizeof(struct id_run));
+    unsigned int run_count = compute_index_runs(index, id_count, runs);
+    unsigned int block_count =
+        (unsigned int) buffer_block_count(get_statistics_buffer());
+    unsigned int stride = 1;
+    uint32_t skipped = 0;
+
+    bool ok =
+        send_header(scon, parse, block_size, timestamp, block)  &&
+        IF_(parse->uncork, set_socket_cork(scon, false));
+    while (ok)
+    {
+        gather_frames(runs, run_count, sizeof(struct decimated_data),
+            block, archive_count * sizeof(struct decimated_data),
+            data, id_count * sizeof(struct decimated_data), block_size);
         ok =
-            /* See if the data is clean, or if we've underrun. */
             TEST_OK_(release_read_block(reader), "Write underrun to client")  &&
-            /* Write the data if it's clean. */
             IF_(parse->send_timestamp == SEND_EXTENDED,
                 send_extended_timestamp(
-                    scon, parse->want_t0, parse->decimated,
-                    block_size, timestamp, id0))  &&
-            TEST_write_(scon, buffer, buffer_size, "Unable to write frame")  &&
-            /* Get the next block. */
+                    scon, parse, block_size, timestamp, 0, skipped))  &&
+            send_frames(
+                scon, packed, data, block_size, field_count, buffer_size)  &&
+            IF_(parse->skip_lag,
+                DO_(skipped =
+                    skip_lagging_blocks(reader, block_count, &stride)))  &&
             TEST_NULL_(
                 block = get_read_block(reader, &timestamp),
                 "Gap in subscribed data");
     }
+
+    free(data);
+    free(packed);
+    free(runs);
+    return ok;
+}
+
+
+/* Sends spectra until something fails.  Each spectrum is preceded by its
+ * timestamp if requested, and spectra are skipped if the client can't keep
+ * up. */
+static bool send_spectrum_subscription(
+    int scon, struct spectrum_engine *engine,
+    struct subscribe_parse *parse, unsigned int fa_entry_count)
+{
+    unsigned int id_count = count_mask_bits(&parse->mask, fa_entry_count);
+    size_t spectrum_size = id_count * sizeof(struct spectrum_bin) <<
+        (parse->spectrum_log2 - 1);
+    struct spectrum_bin *spectrum = malloc(spectrum_size);
+    unsigned int sequence = 0;
+
+    bool ok = IF_(parse->uncork, set_socket_cork(scon, false));
+    while (ok)
+    {
+        uint64_t timestamp;
+        ok =
+            wait_spectrum(
+                engine, &parse->mask, &sequence, &timestamp, spectrum)  &&
+            IF_(parse->send_timestamp == SEND_BASIC,
+                TEST_write(scon, &timestamp, sizeof(uint64_t)))  &&
+            TEST_write_(scon, spectrum, spectrum_size,
+                "Unable to write spectrum")  &&
+            DO_(account_client_bytes(spectrum_size));
+    }
+
+    free(spectrum);
+    return ok;
+}
+
+
+static bool process_spectrum(
+    int scon, const char *client_name,
+    struct subscribe_parse *parse, unsigned int fa_entry_count)
+{
+    struct spectrum_engine *engine = join_spectrum(
+        parse->decimation > 0, parse->spectrum_log2, parse->averages,
+        &parse->mask);
+    bool ok = report_socket_error(scon, client_name, engine != NULL);
+    if (engine)
+    {
+        if (ok)
+            ok = send_spectrum_subscription(
+                scon, engine, parse, fa_entry_count);
+        leave_spectrum(engine, &parse->mask);
+    }
     return ok;
 }
 
@@ -265,11 +798,17 @@ bool process_subscribe(int scon, const char *client_name, const char *buf)
     if (!DO_PARSE("subscription",
             parse_subscription, buf, fa_entry_count, &parse))
         return report_socket_error(scon, client_name, false);
+    if (parse.spectrum_log2 > 0)
+        return process_spectrum(scon, client_name, &parse, fa_entry_count);
+    uint16_t index[MAX_FA_ENTRY_COUNT];
+    unsigned int id_count = 0;
+    if (parse.statistics  &&  !statistics_ids(&parse.mask, index, &id_count))
+        return report_socket_error(scon, client_name, false);
 
     /* See if we can start the subscription, report the final status to the
      * caller. */
-    struct reader_state *reader = open_reader(
-        parse.decimated ? decimated_buffer : fa_block_buffer, false);
+    struct reader_state *reader =
+        open_reader(subscription_buffer(&parse), false);
     uint64_t timestamp;
     const void *block = get_read_block(reader, &timestamp);
     bool start_ok = TEST_NULL_(block, "No data currently available");
@@ -277,8 +816,14 @@ bool process_subscribe(int scon, const char *client_name, const char *buf)
 
     /* Send the requested subscription if all is well. */
     if (start_ok  &&  ok)
-        ok = send_subscription(
-            scon, reader, &parse, fa_entry_count, block, timestamp);
+    {
+        if (parse.statistics)
+            ok = send_statistics_subscription(
+                scon, reader, &parse, index, id_count, block, timestamp);
+        else
+            ok = send_subscription(
+                scon, reader, &parse, fa_entry_count, block, timestamp);
+    }
 
     close_reader(reader);
 
@@ -286,8 +831,7 @@ bool process_subscribe(int scon, const char *client_name, const char *buf)
 }
 
 
-void initialise_subscribe(struct buffer *fa_buffer, struct buffer *decimated)
+void initialise_subscribe(struct buffer *fa_buffer)
 {
     fa_block_buffer = fa_buffer;
-    decimated_buffer = decimated;
 }
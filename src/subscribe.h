@@ -31,4 +31,4 @@
 bool process_subscribe(int scon, const char *client_name, const char *buf);
 
 /* Inform subscription service of data sources. */
-void initialise_subscribe(struct buffer *fa_buffer, struct buffer *decimated);
+void initialise_subscribe(struct buffer *fa_buffer);
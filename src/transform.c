@@ -46,6 +46,13 @@
 #include "disk_writer.h"
 #include "locking.h"
 #include "disk.h"
+#include "transpose.h"
+#include "block_cache.h"
+#include "dd_cache.h"
+#include "compress.h"
+#include "accum.h"
+#include "placement.h"
+#include "stats.h"
 
 #include "transform.h"
 
@@ -63,6 +70,8 @@
 static struct disk_header *header;
 /* Archiver index. */
 static struct data_index *data_index;
+/* Extent table for compressed archives, otherwise unused. */
+static struct block_extent *extents;
 /* Area to write DD data. */
 static struct decimated_data *dd_area;
 
@@ -80,8 +89,8 @@ static unsigned int input_decimation_count;
  * unconstrained access to this variable, but only updates it under this lock.
  * All major blocks other than current_major_block are valid for reading from
  * disk, the current block is either being worked on or being written to disk.
- * The request_read() function ensures that the previously current block is
- * written and therefore is available. */
+ * The request_read() function ensures that blocks still queued for writing are
+ * not read until they are written and therefore available. */
 DECLARE_LOCKING(transform_lock);
 
 static size_t page_size;    // 4096
@@ -91,23 +100,30 @@ static size_t page_size;    // 4096
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Buffered IO support. */
 
-/* Double-buffered block IO. */
+/* Block IO is buffered through a ring of major buffers: one receiving data
+ * while the others are queued for writing.  For a compressed archive data is
+ * instead assembled in a separate block buffer, which is then packed into the
+ * next buffer in the ring for writing. */
 
-static void *buffers[2];           // Two major buffers to receive data
+static void **buffers;              // Major buffers to be written
+static unsigned int buffer_count;   // Write queue depth plus one
 static unsigned int current_buffer; // Index of buffer currently receiving data
+static void *block_buffer;          // Buffer where block is assembled
+static size_t write_length;         // Length of packed block to write
 static unsigned int fa_offset;     // Current sample count into current block
 static unsigned int d_offset;      // Current decimated sample count
+static struct decimated_data *d_fields_buffer;  // Workspace for D fields
 
 
 static inline struct fa_entry *fa_block(unsigned int id)
 {
-    return buffers[current_buffer] + fa_data_offset(header, fa_offset, id);
+    return block_buffer + fa_data_offset(header, fa_offset, id);
 }
 
 
 static inline struct decimated_data *d_block(unsigned int id)
 {
-    return buffers[current_buffer] + d_data_offset(header, d_offset, id);
+    return block_buffer + d_data_offset(header, d_offset, id);
 }
 
 
@@ -115,7 +131,9 @@ static inline struct decimated_data *d_block(unsigned int id)
  * written, returns true iff the block is now full. */
 static bool advance_block(void)
 {
-    fa_offset += input_frame_count;
+    /* The FA samples before fa_offset can be read by other threads, see
+     * read_live_fa_block(), so publish the new offset after the data. */
+    __atomic_store_n(&fa_offset, fa_offset + input_frame_count, __ATOMIC_RELEASE);
     d_offset += input_frame_count >> header->first_decimation_log2;
     return fa_offset >= header->major_sample_count;
 }
@@ -129,245 +147,196 @@ static void reset_block(void)
 }
 
 
-/* Writes the currently written major block to disk at the current offset. */
-static void write_major_block(void)
+/* If D fields are stored separately then each completed D block is rearranged
+ * into four columns, one for each field, before the block is written.  All the
+ * users of the decimated data in the block, including the live statistics,
+ * have seen it by now. */
+static void separate_d_fields(void)
 {
-    off64_t offset = (off64_t) header->major_data_start +
-        (off64_t) header->current_major_block * header->major_block_size;
-    schedule_write(offset, buffers[current_buffer], header->major_block_size);
-
-    current_buffer = 1 - current_buffer;
-    reset_block();
+    if (header->d_format == D_FORMAT_FIELDS)
+    {
+        unsigned int count = header->d_sample_count;
+        for (unsigned int id = 0; id < header->archive_mask_count; id ++)
+        {
+            void *block = block_buffer + d_data_offset(header, 0, id);
+            memcpy(d_fields_buffer, block,
+                count * sizeof(struct decimated_data));
+            struct fa_entry *column = block;
+            for (unsigned int i = 0; i < count; i ++)
+            {
+                column[i]             = d_fields_buffer[i].mean;
+                column[count + i]     = d_fields_buffer[i].min;
+                column[2 * count + i] = d_fields_buffer[i].max;
+                column[3 * count + i] = d_fields_buffer[i].std;
+            }
+        }
+    }
 }
 
 
-/* Initialises IO buffers for the given minor block size. */
-static void initialise_io_buffer(void)
+/* For a compressed archive packs the assembled block into the current write
+ * buffer: the D blocks are copied unchanged followed by the packed FA blocks,
+ * and the result is padded to a whole number of pages.  This is done before
+ * taking the transform lock, and the column table entries for the current block
+ * can be written here as the current block is never read. */
+static void pack_major_block(void)
 {
-    for (unsigned int i = 0; i < 2; i ++)
-        buffers[i] = valloc(header->major_block_size);
+    if (header->fa_format != FA_FORMAT_RAW)
+    {
+        void *packed = buffers[current_buffer];
+        size_t fa_size = FA_ENTRY_SIZE * header->major_sample_count;
+        size_t fa_area_size = header->archive_mask_count * fa_size;
+        memcpy(packed, block_buffer + fa_area_size,
+            header->major_block_size - fa_area_size);
+
+        uint32_t *columns = column_offsets(
+            header, data_index, header->current_major_block);
+        size_t length = header->major_block_size - fa_area_size;
+        for (unsigned int id = 0; id < header->archive_mask_count; id ++)
+        {
+            columns[id] = (uint32_t) length;
+            length += pack_fa_block(
+                block_buffer + id * fa_size, header->major_sample_count,
+                packed + length);
+        }
 
-    current_buffer = 0;
-    fa_offset = 0;
-    d_offset = 0;
+        write_length = (length + page_size - 1) & ~(page_size - 1);
+        memset(packed + length, 0, write_length - length);
+        extents[header->current_major_block].data_length = (uint32_t) length;
+    }
 }
 
 
-
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Block transpose. */
-
-/* To make reading of individual BPMs more efficient (the usual usage) we
- * transpose frames into individual BPMs until we've assembled a complete
- * collection of disk blocks (determined by output_block_size). */
-
-
-static void transpose_column(
-    const struct fa_entry *input, struct fa_entry *output)
+/* Ensures that changes to the given range of the index are written to disk. */
+static void flush_index_range(const void *start, size_t length)
 {
-    for (unsigned int i = input_frame_count; i > 0; i--)
-    {
-        *output ++ = *input;
-        input += header->fa_entry_count;
-    }
+    uintptr_t page_mask = ~((uintptr_t) page_size - 1);
+    uintptr_t first = (uintptr_t) start & page_mask;
+    uintptr_t end = (uintptr_t) start + length;
+    IGNORE(TEST_IO(msync((void *) first, end - first, MS_ASYNC)));
 }
 
 
-/* Processes a single input block of FA sniffer frames.  Each BPM is written to
- * its own output block.  True is returned iff the transposed buffer set is full
- * and is ready to be written out. */
-static void transpose_block(const void *read_block)
+/* Discards the oldest valid blocks starting in the range [start, end) of the
+ * major data area as they are about to be overwritten.  The valid blocks follow
+ * the current block in order of writing, so we stop at the first valid block
+ * which lies outside this range. */
+static void release_extents(uint64_t start, uint64_t end)
 {
-    /* For the moment forget about being too clever about the impact of
-     * transposing data on the cache.  We copy one column at a time. */
-    unsigned int written = 0;
-    for (unsigned int id = 0; id < header->fa_entry_count; id ++)
+    unsigned int N = header->major_block_count;
+    unsigned int current = header->current_major_block;
+    for (unsigned int block = (current + 1) % N; block != current;
+         block = (block + 1) % N)
     {
-        if (test_mask_bit(&header->archive_mask, id))
+        struct block_extent *extent = &extents[block];
+        if (extent->length == 0)
+            continue;
+        else if (start <= extent->offset  &&  extent->offset < end)
         {
-            transpose_column(
-                read_block + FA_ENTRY_SIZE * id, fa_block(written));
-            written += 1;
+            memset(&data_index[block], 0, sizeof(struct data_index));
+            extent->length = 0;
+            invalidate_cached_block(block);
+            flush_index_range(&data_index[block], sizeof(struct data_index));
+            flush_index_range(extent, sizeof(struct block_extent));
         }
+        else
+            break;
     }
 }
 
 
+/* Allocates space for the current block in a compressed archive.  Each block
+ * is written directly after the previous one, wrapping round if there isn't
+ * room at the end of the data area. */
+static void allocate_extent(size_t length)
+{
+    unsigned int N = header->major_block_count;
+    unsigned int current = header->current_major_block;
+    const struct block_extent *last = &extents[(current + N - 1) % N];
+    uint64_t offset = last->length > 0 ? last->offset + last->length : 0;
+    if (offset + length > header->major_data_size)
+    {
+        release_extents(offset, header->major_data_size);
+        offset = 0;
+    }
+    release_extents(offset, offset + length);
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/* Support for variance calculation. */
-
-/* To avoid overflow and to support the incremental calculation of variance we
- * need to use a long accumulator.  Unfortunately on 32 bit systems we have no
- * intrinsic support for 128 bit integers, so we need some conditional
- * compilation here.
- *    The only operations we need are accumulation (of 64 and 128 bit
- * intermediates) and shifting out the result. */
-
-#ifdef __i386__
-/* Only have 64 bit integers, need to emulate the 128 bit accumulator. */
-
-struct uint128 { uint64_t low; uint64_t high; };
-typedef struct uint128 uint128_t;
-
-/* It's really rather annoying, there doesn't seem to be any good way other than
- * resorting to the assembler below to efficiently compute with 128 bit numbers.
- * The principal problem is that the carry is inaccessible.  The alternative
- * trick of writing:
- *      acc->low += val; if (acc->low < val) acc->high += 1;
- * generates horrible code.
- *
- * Some notes on the assembler constraints, because the documentation can be a
- * bit opaque and some of the interactions are quite subtle:
- *
- *  1.  The form of the asm statement is
- *          __asm__(<code> : <outputs> : <inputs> : <effects>)
- *  2.  We must at least specify "m"(*acc) otherwise the code can end up being
- *      discarded (as having no significant side effects).
- *  3.  The "=&r"(t) output assigns a temporary register.  The & ensures that
- *      this register doesn't overlap with any of the input registers.
- *  4.  The register modifier = is used for an output which is written without
- *      being read, + is used for an output which is also read. */
-
-static void accum128_64(uint128_t *acc, uint64_t val)
-{
-    __asm__(
-        "addl   %[vall], 0(%[acc])" "\n\t"
-        "adcl   %[valh], 4(%[acc])" "\n\t"
-        "adcl   $0, 8(%[acc])" "\n\t"
-        "adcl   $0, 12(%[acc])"
-        :
-        : [acc] "r" (acc), "m" (*acc),
-          [vall] "r" ((uint32_t) val), [valh] "r" ((uint32_t) (val >> 32))
-        : "cc" );
-}
-
-static void accum128_128(uint128_t *acc, const uint128_t *val)
-{
-    int t;
-    __asm__(
-        "movl   0(%[val]), %[t]" "\n\t"
-        "addl   %[t], 0(%[acc])" "\n\t"
-        "movl   4(%[val]), %[t]" "\n\t"
-        "adcl   %[t], 4(%[acc])" "\n\t"
-        "movl   8(%[val]), %[t]" "\n\t"
-        "adcl   %[t], 8(%[acc])" "\n\t"
-        "movl   12(%[val]), %[t]" "\n\t"
-        "adcl   %[t], 12(%[acc])"
-        : [t] "=&r" (t), "+m" (*acc)
-        : [acc] "r" (acc), [val] "r" (val), "m" (*val)
-        : "cc" );
-}
-
-static uint64_t sr128(uint128_t *acc, unsigned int shift)
-{
-    return (acc->low >> shift) | (acc->high << (64 - shift));
+    extents[current].offset = offset;
+    extents[current].length = (uint32_t) length;
 }
 
-#else
-/* Assume built-in 128 bit integers. */
 
-typedef __uint128_t uint128_t;
-
-static void accum128_64(uint128_t *acc, uint64_t val)
+/* Writes the currently written major block to disk at the current offset. */
+static void write_major_block(void)
 {
-    *acc += val;
+    unsigned int current = header->current_major_block;
+    size_t length;
+    if (header->fa_format == FA_FORMAT_RAW)
+        length = header->major_block_size;
+    else
+    {
+        allocate_extent(write_length);
+        length = write_length;
+    }
+    schedule_write(
+        major_block_stripe(header, current),
+        (off64_t) major_block_offset(header, data_index, current),
+        buffers[current_buffer], length);
+
+    current_buffer = (current_buffer + 1) % buffer_count;
+    if (header->fa_format == FA_FORMAT_RAW)
+        block_buffer = buffers[current_buffer];
+    reset_block();
 }
 
-static void accum128_128(uint128_t *acc, const uint128_t *val)
-{
-    *acc += *val;
-}
 
-static uint64_t sr128(uint128_t *acc, unsigned int shift)
+/* Initialises IO buffers for the given minor block size.  One more buffer than
+ * the write queue depth is needed, as schedule_write() only blocks when the
+ * queue is full, so the buffer following the one just queued is free. */
+static void initialise_io_buffer(unsigned int write_queue_depth)
 {
-    return (uint64_t) (*acc >> shift);
-}
+    buffer_count = write_queue_depth + 1;
+    buffers = calloc(buffer_count, sizeof(void *));
+    for (unsigned int i = 0; i < buffer_count; i ++)
+        buffers[i] = allocate_buffer(header->major_block_size);
 
-#endif
-
-
-/* The calculation of variance is really rather delicate, as it is enormously
- * susceptible to numerical problems.  The "proper" way to compute variance is
- * using the formula
- *      var = SUM((x[i] - m)^2) / N   where  m = mean(x) = SUM(x[i]) / N  .
- * This approach isn't so great when dealing with a stream of data, which we
- * have in the case of double decimation, as we need to pass over the dataset
- * twice.  The alternative calulcation is:
- *      var = SUM(x[i]^2) / N - m^2  ,
- * but this is *very* demanding on the intermediate values, particularly if the
- * result is to be accurate when m is large.  In this application x[i] is 32
- * bits, N maybe up to 16 bits, and so we need around 80 bits for the sum, hence
- * the use of 128 bits for the accumulator. */
-
-static int32_t compute_std(uint128_t *acc, int64_t sum, unsigned int shift)
-{
-    /* It's sufficiently accurate and actually faster to change over to floating
-     * point arithmetic at this point. */
-    double mean = (double) sum / (double) (1 << shift);
-    double var  = (double) sr128(acc, shift) - mean * mean;
-    /* Note that rounding errors still allow var in the range -1..0, so need to
-     * truncate these to zero. */
-    return var > 0 ? (int32_t) sqrt(var) : 0;
+    current_buffer = 0;
+    if (header->fa_format == FA_FORMAT_RAW)
+        block_buffer = buffers[0];
+    else
+    {
+        block_buffer = allocate_buffer(header->major_block_size);
+        extents = block_extents(header, data_index);
+    }
+    if (header->d_format == D_FORMAT_FIELDS)
+        d_fields_buffer = malloc(
+            header->d_sample_count * sizeof(struct decimated_data));
+    fa_offset = 0;
+    d_offset = 0;
 }
 
 
-/* Accumulator for generating decimated data. */
-struct fa_accum {
-    int32_t minx, maxx, miny, maxy;
-    int64_t sumx, sumy;
-    uint128_t sum_sq_x, sum_sq_y;
-};
 
-static void initialise_accum(struct fa_accum *acc)
-{
-    memset(acc, 0, sizeof(struct fa_accum));
-    acc->minx = INT32_MAX;
-    acc->maxx = INT32_MIN;
-    acc->miny = INT32_MAX;
-    acc->maxy = INT32_MIN;
-}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Block transpose. */
 
-static void accum_xy(struct fa_accum *acc, const struct fa_entry *input)
-{
-    int32_t x = input->x;
-    int32_t y = input->y;
-    if (x < acc->minx)   acc->minx = x;
-    if (acc->maxx < x)   acc->maxx = x;
-    if (y < acc->miny)   acc->miny = y;
-    if (acc->maxy < y)   acc->maxy = y;
-    acc->sumx += x;
-    acc->sumy += y;
-    accum128_64(&acc->sum_sq_x, (uint64_t) ((int64_t) x * x));
-    accum128_64(&acc->sum_sq_y, (uint64_t) ((int64_t) y * y));
-}
+/* To make reading of individual BPMs more efficient (the usual usage) we
+ * transpose frames into individual BPMs until we've assembled a complete
+ * collection of disk blocks (determined by output_block_size).  The work is
+ * done by the cache blocked kernels in transpose.c. */
 
-static void accum_accum(struct fa_accum *result, const struct fa_accum *input)
-{
-    if (input->minx < result->minx)   result->minx = input->minx;
-    if (result->maxx < input->maxx)   result->maxx = input->maxx;
-    if (input->miny < result->miny)   result->miny = input->miny;
-    if (result->maxy < input->maxy)   result->maxy = input->maxy;
-    result->sumx += input->sumx;
-    result->sumy += input->sumy;
-    accum128_128(&result->sum_sq_x, &input->sum_sq_x);
-    accum128_128(&result->sum_sq_y, &input->sum_sq_y);
-}
 
-static void compute_result(
-    struct fa_accum *acc, unsigned int shift, struct decimated_data *result)
+/* Processes a single input block of FA sniffer frames.  Each BPM in the given
+ * range of output ids is written to its own output block. */
+static void transpose_block(
+    const void *read_block, unsigned int first_id, unsigned int id_count)
 {
-    result->min.x = acc->minx;
-    result->max.x = acc->maxx;
-    result->min.y = acc->miny;
-    result->max.y = acc->maxy;
-    result->mean.x = (int32_t) (acc->sumx >> shift);
-    result->mean.y = (int32_t) (acc->sumy >> shift);
-    result->std.x = compute_std(&acc->sum_sq_x, acc->sumx, shift);
-    result->std.y = compute_std(&acc->sum_sq_y, acc->sumy, shift);
+    transpose_frames(
+        read_block, fa_block(0), input_frame_count, first_id, id_count);
 }
 
 
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Event set decimation. */
 
@@ -419,6 +388,19 @@ static void compute_events_result(
 static struct fa_accum *double_accumulators;
 
 
+/* Accumulates a column of N FA entries. */
+static void accumulate_column(
+    const struct fa_entry *input, struct fa_accum *accum, unsigned int N_log2)
+{
+    initialise_accum(accum);
+    for (unsigned int i = 0; i < 1U << N_log2; i ++)
+    {
+        accum_xy(accum, input);
+        input += header->fa_entry_count;
+    }
+}
+
+
 /* Converts a column of N FA entries into a single entry by computing the mean,
  * min, max and standard deviation of the column. */
 static void decimate_column_one(
@@ -426,13 +408,7 @@ static void decimate_column_one(
     struct fa_accum *double_accum, unsigned int N_log2)
 {
     struct fa_accum accum;
-    initialise_accum(&accum);
-
-    for (unsigned int i = 0; i < 1U << N_log2; i ++)
-    {
-        accum_xy(&accum, input);
-        input += header->fa_entry_count;
-    }
+    accumulate_column(input, &accum, N_log2);
     compute_result(&accum, N_log2, output);
 
     accum_accum(double_accum, &accum);
@@ -457,21 +433,239 @@ static void decimate_column(
     }
 }
 
-static void decimate_block(const void *read_block)
+
+#ifdef __i386__
+/* Without native 128 bit arithmetic we stay with decimating one column at a
+ * time. */
+
+static void decimate_block(
+    const void *read_block, unsigned int first_id, unsigned int id_count)
 {
     unsigned int written = 0;
     for (unsigned int id = 0; id < header->fa_entry_count; id ++)
     {
         if (test_mask_bit(&header->archive_mask, id))
         {
-            decimate_column(
-                id, read_block + FA_ENTRY_SIZE * id, d_block(written),
-                &double_accumulators[written]);
+            if (first_id <= written  &&  written < first_id + id_count)
+                decimate_column(
+                    id, read_block + FA_ENTRY_SIZE * id, d_block(written),
+                    &double_accumulators[written]);
             written += 1;
         }
     }
 }
 
+static void initialise_row_decimation(void) { }
+
+#else
+/* Decimating a column at a time strides through the whole input block for each
+ * id.  Instead we read the block a row at a time, updating accumulators for
+ * all ids at once.  The accumulators are held as separate arrays of "lanes",
+ * two lanes (X and Y) per archived id, so that the inner loops are simple
+ * array operations which the compiler can vectorise.
+ *
+ * To avoid a 128 bit accumulation for every sample we accumulate squares of
+ * offsets from the first sample of each decimation interval in 64 bits.  This
+ * is exact provided the range of values in the interval is small enough, which
+ * we check when computing the result, falling back to the column decimation
+ * above if necessary.  The true sum of squares is then recovered once per
+ * output point. */
+
+/* The archive mask (less the events id) as runs of consecutive ids. */
+static struct id_run *lane_runs;
+static unsigned int lane_run_count;
+
+/* Accumulator lanes, two per archived id, indexed by output index. */
+static struct {
+    int32_t *base;              // First value in the interval
+    int32_t *min;
+    int32_t *max;
+    int64_t *sum;
+    uint64_t *sum_sq;           // Sum of squares of offsets from base
+} lanes;
+/* Scratch row for packing sparse archive masks. */
+static int32_t *packed_row;
+
+
+/* Starts accumulation of a fresh decimation interval with a single row. */
+__attribute__((target_clones("avx2", "default")))
+static void start_lanes(
+    const int32_t *restrict input, unsigned int count,
+    int32_t *restrict base, int32_t *restrict min, int32_t *restrict max,
+    int64_t *restrict sum, uint64_t *restrict sum_sq)
+{
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        int32_t x = input[i];
+        base[i] = x;
+        min[i] = x;
+        max[i] = x;
+        sum[i] = x;
+        sum_sq[i] = 0;
+    }
+}
+
+
+/* Accumulates one row into the given lanes. */
+__attribute__((target_clones("avx2", "default")))
+static void accumulate_lanes(
+    const int32_t *restrict input, unsigned int count,
+    const int32_t *restrict base, int32_t *restrict min, int32_t *restrict max,
+    int64_t *restrict sum, uint64_t *restrict sum_sq)
+{
+    for (unsigned int i = 0; i < count; i ++)
+    {
+        int32_t x = input[i];
+        min[i] = x < min[i] ? x : min[i];
+        max[i] = x > max[i] ? x : max[i];
+        sum[i] += x;
+        /* Wrapping difference: only meaningful if the range check below
+         * passes, in which case it is exact. */
+        int32_t delta = (int32_t) ((uint32_t) x - (uint32_t) base[i]);
+        sum_sq[i] += (uint64_t) ((int64_t) delta * delta);
+    }
+}
+
+
+/* Checks whether the 64 bit sum of squared offsets for this lane is exact:
+ * every offset must fit into 32 bits and 2^N_log2 squares of the range must
+ * fit into 64 bits. */
+static bool lane_exact(unsigned int lane, unsigned int N_log2)
+{
+    uint64_t range = (uint64_t) ((int64_t) lanes.max[lane] - lanes.min[lane]);
+    return range < (1ULL << 31)  &&  range * range <= UINT64_MAX >> N_log2;
+}
+
+
+/* Recovers the sum of squares for a lane from the sum of squared offsets:
+ *      SUM(x^2) = SUM((x-b)^2) + 2 b SUM(x) - N b^2  . */
+static uint128_t lane_sum_sq(unsigned int lane, unsigned int N_log2)
+{
+    __int128_t base = lanes.base[lane];
+    return (uint128_t) (
+        (__int128_t) lanes.sum_sq[lane] + 2 * base * lanes.sum[lane] -
+        ((base * base) << N_log2));
+}
+
+
+/* Converts the X,Y lanes for output index id into an accumulator. */
+static void lanes_to_accum(
+    unsigned int id, struct fa_accum *accum, unsigned int N_log2)
+{
+    unsigned int x = 2 * id, y = 2 * id + 1;
+    *accum = (struct fa_accum) {
+        .minx = lanes.min[x], .maxx = lanes.max[x],
+        .miny = lanes.min[y], .maxy = lanes.max[y],
+        .sumx = lanes.sum[x], .sumy = lanes.sum[y],
+        .sum_sq_x = lane_sum_sq(x, N_log2),
+        .sum_sq_y = lane_sum_sq(y, N_log2),
+    };
+}
+
+
+/* Returns row of input values arranged by output lane, valid for the selected
+ * range of output ids.  Unless the archive mask is a single run the archived
+ * values are first packed into a scratch row, so that each row is accumulated
+ * with a single call.  Note that the lanes for the events id, if present, are
+ * left undefined. */
+static const int32_t *pack_row(
+    const int32_t *input, unsigned int first_id, unsigned int id_count)
+{
+    if (lane_run_count == 1)
+        return input + 2 * (lane_runs[0].input - lane_runs[0].output);
+    else
+    {
+        for (unsigned int i = 0; i < lane_run_count; i ++)
+        {
+            struct id_run run;
+            if (clip_id_run(&lane_runs[i], first_id, id_count, &run))
+                memcpy(packed_row + 2 * run.output, input + 2 * run.input,
+                    FA_ENTRY_SIZE * run.count);
+        }
+        return packed_row;
+    }
+}
+
+
+/* Decimates a single decimation interval of 2^N_log2 rows into output sample
+ * number sample of each D block for the selected range of output ids. */
+static void decimate_rows(
+    const int32_t *input, unsigned int sample,
+    unsigned int first_id, unsigned int id_count)
+{
+    unsigned int N_log2 = header->first_decimation_log2;
+    unsigned int row_length = 2 * header->fa_entry_count;
+    unsigned int lane = 2 * first_id;
+    unsigned int lane_count = 2 * id_count;
+
+    start_lanes(pack_row(input, first_id, id_count) + lane, lane_count,
+        lanes.base + lane, lanes.min + lane, lanes.max + lane,
+        lanes.sum + lane, lanes.sum_sq + lane);
+    for (unsigned int row = 1; row < 1U << N_log2; row ++)
+        accumulate_lanes(
+            pack_row(input + row * row_length, first_id, id_count) + lane,
+            lane_count,
+            lanes.base + lane, lanes.min + lane, lanes.max + lane,
+            lanes.sum + lane, lanes.sum_sq + lane);
+
+    for (unsigned int i = 0; i < lane_run_count; i ++)
+    {
+        struct id_run run;
+        if (clip_id_run(&lane_runs[i], first_id, id_count, &run))
+            for (unsigned int j = 0; j < run.count; j ++)
+            {
+                unsigned int id = run.output + j;
+                struct fa_accum accum;
+                if (lane_exact(2 * id, N_log2)  &&
+                    lane_exact(2 * id + 1, N_log2))
+                    lanes_to_accum(id, &accum, N_log2);
+                else
+                    accumulate_column(
+                        (const struct fa_entry *) input + run.input + j,
+                        &accum, N_log2);
+                compute_result(&accum, N_log2, d_block(id) + sample);
+                accum_accum(&double_accumulators[id], &accum);
+            }
+    }
+}
+
+
+static void decimate_block(
+    const void *read_block, unsigned int first_id, unsigned int id_count)
+{
+    const int32_t *input = read_block;
+    unsigned int interval = 2 * header->fa_entry_count <<
+        header->first_decimation_log2;
+    for (unsigned int i = 0; i < input_decimation_count; i ++)
+        decimate_rows(input + i * interval, i, first_id, id_count);
+
+    /* The events id, if any, is decimated separately. */
+    if (first_id <= events_fa_id_output  &&
+        events_fa_id_output < first_id + id_count)
+        decimate_column(
+            events_fa_id, read_block + FA_ENTRY_SIZE * events_fa_id,
+            d_block(events_fa_id_output),
+            &double_accumulators[events_fa_id_output]);
+}
+
+
+static void initialise_row_decimation(void)
+{
+    lane_runs = calloc(header->fa_entry_count, sizeof(struct id_run));
+    lane_run_count = compute_id_runs(
+        &header->archive_mask, header->fa_entry_count, events_fa_id, lane_runs);
+
+    size_t lane_count = 2 * header->archive_mask_count;
+    lanes.base = calloc(lane_count, sizeof(int32_t));
+    lanes.min = calloc(lane_count, sizeof(int32_t));
+    lanes.max = calloc(lane_count, sizeof(int32_t));
+    lanes.sum = calloc(lane_count, sizeof(int64_t));
+    lanes.sum_sq = calloc(lane_count, sizeof(uint64_t));
+    packed_row = calloc(lane_count, sizeof(int32_t));
+}
+
+#endif
+
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -483,9 +677,110 @@ static unsigned int dd_offset;
 static unsigned int output_id_count;
 /* Array of previously madvised addresses. */
 static void **madvise_array;
+/* Accumulated over the current major block for the long term statistics. */
+static struct fa_accum *block_accumulators;
 
 
 
+/* Each decimation tier above DD is computed from the tier below as each tier
+ * sample completes.  This works from the decimated data already in memory, so a
+ * tier sample simply covers whatever the samples below it hold. */
+
+/* Recombines the standard deviation from the sums of means and of mean squares
+ * plus variances over 2^N_log2 samples. */
+static int32_t tier_std(double sum_sq, int64_t sum, unsigned int N_log2)
+{
+    double mean = ldexp((double) sum, - (int) N_log2);
+    double var = ldexp(sum_sq, - (int) N_log2) - mean * mean;
+    return var > 0 ? (int32_t) sqrt(var) : 0;
+}
+
+static double mean_sq(int32_t mean, int32_t std)
+{
+    return (double) mean * mean + (double) std * std;
+}
+
+
+/* Combines 2^N_log2 consecutive decimated samples into a single sample. */
+static void decimate_tier_sample(
+    const struct decimated_data *input, unsigned int N_log2,
+    struct decimated_data *output)
+{
+    struct fa_entry min = { .x = INT32_MAX, .y = INT32_MAX };
+    struct fa_entry max = { .x = INT32_MIN, .y = INT32_MIN };
+    int64_t sumx = 0, sumy = 0;
+    double sum_sq_x = 0, sum_sq_y = 0;
+    for (unsigned int i = 0; i < 1U << N_log2; i ++)
+    {
+        const struct decimated_data *in = &input[i];
+        if (in->min.x < min.x)  min.x = in->min.x;
+        if (max.x < in->max.x)  max.x = in->max.x;
+        if (in->min.y < min.y)  min.y = in->min.y;
+        if (max.y < in->max.y)  max.y = in->max.y;
+        sumx += in->mean.x;
+        sumy += in->mean.y;
+        sum_sq_x += mean_sq(in->mean.x, in->std.x);
+        sum_sq_y += mean_sq(in->mean.y, in->std.y);
+    }
+    output->min = min;
+    output->max = max;
+    output->mean.x = (int32_t) (sumx >> N_log2);
+    output->mean.y = (int32_t) (sumy >> N_log2);
+    output->std.x = tier_std(sum_sq_x, sumx, N_log2);
+    output->std.y = tier_std(sum_sq_y, sumy, N_log2);
+}
+
+
+/* For the events id the tier sample is the bitwise or of the samples below. */
+static void decimate_tier_events(
+    const struct decimated_data *input, unsigned int N_log2,
+    struct decimated_data *output)
+{
+    memset(output, 0, sizeof(*output));
+    for (unsigned int i = 0; i < 1U << N_log2; i ++)
+    {
+        output->mean.x |= input[i].mean.x;
+        output->mean.y |= input[i].mean.y;
+    }
+    output->min = output->mean;
+    output->max = output->mean;
+    output->std = output->mean;
+}
+
+
+/* Called after DD sample dd_sample has been written to compute any tier samples
+ * which are now complete. */
+static void decimate_tiers(unsigned int dd_sample)
+{
+    const struct decimated_data *below = dd_area;
+    unsigned int below_count = header->dd_total_count;
+    unsigned int sample = dd_sample + 1;    // Samples so far in tier below
+    for (unsigned int t = 0; t < header->tier_count; t ++)
+    {
+        unsigned int N_log2 = header->tier_decimation_log2[t];
+        if (sample & ((1U << N_log2) - 1))
+            break;
+        sample >>= N_log2;
+
+        struct decimated_data *tier = dd_area + tier_data_offset(header, t);
+        unsigned int tier_count = header->tier_total_count[t];
+        for (unsigned int i = 0; i < output_id_count; i ++)
+        {
+            const struct decimated_data *input =
+                below + (size_t) i * below_count + ((sample - 1) << N_log2);
+            struct decimated_data *output =
+                tier + (size_t) i * tier_count + sample - 1;
+            if (i == events_fa_id_output)
+                decimate_tier_events(input, N_log2, output);
+            else
+                decimate_tier_sample(input, N_log2, output);
+        }
+        below = tier;
+        below_count = tier_count;
+    }
+}
+
+
 /* In this case we work on decimated data sorted in the d_block and we write to
  * the in memory DD block. */
 static void double_decimate_block(void)
@@ -500,19 +795,140 @@ static void double_decimate_block(void)
             compute_events_result(&double_accumulators[i], output);
         else
             compute_result(&double_accumulators[i], decimation_log2, output);
+        accum_accum(&block_accumulators[i], &double_accumulators[i]);
         initialise_accum(&double_accumulators[i]);
         output += header->dd_total_count;
     }
+    decimate_tiers(dd_offset);
 
     dd_offset = (dd_offset + 1) % header->dd_total_count;
 }
 
 
+/* When DD data is paged through the DD cache only the pages still being written
+ * are kept in memory.  Each level of decimated data, DD and then each tier, is
+ * released behind the transform as soon as the tier above has finished with
+ * it, and cached copies of the data written for each block are discarded as the
+ * block completes.  Counts the samples of each level released so far. */
+static unsigned int released_samples[MAX_DECIMATION_TIERS + 1];
+
+
+/* Returns the offset into the DD area of the given level, where level 0 is DD
+ * and level t+1 is tier t, together with its samples per id and its decimation
+ * relative to DD. */
+static size_t get_level(
+    unsigned int level, unsigned int *count, unsigned int *log2)
+{
+    if (level == 0)
+    {
+        *count = header->dd_total_count;
+        *log2 = 0;
+        return 0;
+    }
+    else
+    {
+        *count = header->tier_total_count[level - 1];
+        *log2 = tier_decimation_log2(header, level - 1);
+        return tier_data_offset(header, level - 1);
+    }
+}
+
+
+/* Returns the number of samples of the given level no longer needed by the
+ * transform: everything before the sample being accumulated by the level
+ * above, or before the sample being written for the top level. */
+static unsigned int release_limit(unsigned int level, unsigned int log2)
+{
+    if (level < header->tier_count)
+    {
+        unsigned int above = tier_decimation_log2(header, level);
+        return (dd_offset >> above) << (above - log2);
+    }
+    else
+        return dd_offset >> log2;
+}
+
+
+/* Drops the mapped pages covering samples start to end-1 of each row from
+ * memory.  The page holding start can only be shared with samples which are
+ * already finished with, but the page holding end is still being written. */
+static void release_rows(
+    const struct decimated_data *area, unsigned int count,
+    unsigned int start, unsigned int end)
+{
+    for (unsigned int i = 0; i < output_id_count; i ++)
+    {
+        const struct decimated_data *row = area + (size_t) i * count;
+        uintptr_t first = (uintptr_t) (row + start) & -page_size;
+        uintptr_t last = (uintptr_t) (row + end) & -page_size;
+        if (first < last)
+            IGNORE(TEST_IO(
+                madvise((void *) first, last - first, MADV_DONTNEED)));
+    }
+}
+
+
+static void release_level(unsigned int level)
+{
+    unsigned int count, log2;
+    const struct decimated_data *area =
+        dd_area + get_level(level, &count, &log2);
+    unsigned int start = released_samples[level];
+    unsigned int end = release_limit(level, log2);
+    if (end < start)
+    {
+        /* The transform has wrapped round to the start of the area. */
+        release_rows(area, count, start, count);
+        start = 0;
+    }
+    release_rows(area, count, start, end);
+    released_samples[level] = end;
+}
+
+
+/* Discards any cached copies of the samples of each level written while
+ * completing the given block.  Called under transform_lock so that readers
+ * never see the block before its stale pages are gone. */
+static void invalidate_dd_block(unsigned int block)
+{
+    uint64_t dd_first = (uint64_t) block * header->dd_sample_count;
+    uint64_t dd_end = dd_first + header->dd_sample_count;
+    for (unsigned int level = 0; level <= header->tier_count; level ++)
+    {
+        unsigned int count, log2;
+        size_t offset = get_level(level, &count, &log2);
+        size_t first = (size_t) (dd_first >> log2);
+        size_t end = (size_t) ((dd_end - 1) >> log2) + 1;
+        for (unsigned int i = 0; i < output_id_count; i ++)
+            invalidate_dd_cache(
+                (offset + (size_t) i * count + first) *
+                    sizeof(struct decimated_data),
+                (end - first) * sizeof(struct decimated_data));
+    }
+}
+
+
+static void release_double_decimation(void)
+{
+    for (unsigned int level = 0; level <= header->tier_count; level ++)
+        release_level(level);
+}
+
+
 static void reset_double_decimation(void)
 {
     dd_offset = header->current_major_block * header->dd_sample_count;
     for (unsigned int i = 0; i < output_id_count; i ++)
+    {
         initialise_accum(&double_accumulators[i]);
+        initialise_accum(&block_accumulators[i]);
+    }
+    for (unsigned int level = 0; level <= header->tier_count; level ++)
+    {
+        unsigned int count, log2;
+        get_level(level, &count, &log2);
+        released_samples[level] = release_limit(level, log2);
+    }
 }
 
 
@@ -559,6 +975,7 @@ static void initialise_double_decimation(void)
     events_fa_id_output =
         input_id_to_output(&header->archive_mask, events_fa_id);
     double_accumulators = calloc(output_id_count, sizeof(struct fa_accum));
+    block_accumulators = calloc(output_id_count, sizeof(struct fa_accum));
     madvise_array = calloc(output_id_count, sizeof(void *));
     reset_double_decimation();
 
@@ -567,6 +984,245 @@ static void initialise_double_decimation(void)
 
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Long term statistics. */
+
+/* For each major block we keep a summary of the FA data for every archived id,
+ * so that statistics over long ranges can be computed by merging one summary
+ * per block.  Summaries are computed exactly from the double decimation
+ * accumulators as each block is written, but blocks written before the archiver
+ * was started are only summarised from their DD data when first asked for.
+ * The index is only accessed under transform_lock, but as summarising a block
+ * can involve reading its DD data from disk this is done without the lock, and
+ * the summary is then only stored if the block hasn't been overwritten. */
+
+static struct block_statistics *block_statistics;
+static bool *block_statistics_valid;
+
+
+static struct block_statistics *get_block_statistics(unsigned int block)
+{
+    return &block_statistics[(size_t) block * output_id_count];
+}
+
+static void initialise_block_statistic(struct block_statistics *stats)
+{
+    *stats = (struct block_statistics) {
+        .min = { .x = INT32_MAX, .y = INT32_MAX },
+        .max = { .x = INT32_MIN, .y = INT32_MIN } };
+}
+
+
+/* Called under transform_lock as the current block is completed. */
+static void store_block_statistics(void)
+{
+    unsigned int block = header->current_major_block;
+    struct block_statistics *stats = get_block_statistics(block);
+    for (unsigned int i = 0; i < output_id_count; i ++)
+    {
+        struct fa_accum *acc = &block_accumulators[i];
+        stats[i] = (struct block_statistics) {
+            .min = { .x = acc->minx, .y = acc->miny },
+            .max = { .x = acc->maxx, .y = acc->maxy },
+            .sum_x = acc->sumx,
+            .sum_y = acc->sumy,
+            .sum_sq_x = uint128_to_double(&acc->sum_sq_x),
+            .sum_sq_y = uint128_to_double(&acc->sum_sq_y) };
+        initialise_accum(acc);
+    }
+    block_statistics_valid[block] = true;
+}
+
+
+/* Reconstructs the summary of a block from its DD samples into stats[].  Min
+ * and max are exact, the sums are as good as the DD means and standard
+ * deviations.  Called without transform_lock. */
+static bool compute_dd_block_statistics(
+    unsigned int block, struct block_statistics stats[])
+{
+    unsigned int dd_count = header->dd_sample_count;
+    int shift = (int) (
+        header->first_decimation_log2 + header->second_decimation_log2);
+    struct decimated_data dd[dd_count];
+    bool ok = true;
+    for (unsigned int i = 0; ok  &&  i < output_id_count; i ++)
+    {
+        ok = read_dd_data(
+            ((size_t) i * header->dd_total_count + (size_t) block * dd_count) *
+                sizeof(struct decimated_data),
+            dd_count * sizeof(struct decimated_data), dd);
+        initialise_block_statistic(&stats[i]);
+        for (unsigned int j = 0; ok  &&  j < dd_count; j ++)
+        {
+            if (dd[j].min.x < stats[i].min.x)  stats[i].min.x = dd[j].min.x;
+            if (stats[i].max.x < dd[j].max.x)  stats[i].max.x = dd[j].max.x;
+            if (dd[j].min.y < stats[i].min.y)  stats[i].min.y = dd[j].min.y;
+            if (stats[i].max.y < dd[j].max.y)  stats[i].max.y = dd[j].max.y;
+            stats[i].sum_x += (int64_t) dd[j].mean.x << shift;
+            stats[i].sum_y += (int64_t) dd[j].mean.y << shift;
+            stats[i].sum_sq_x +=
+                ldexp(mean_sq(dd[j].mean.x, dd[j].std.x), shift);
+            stats[i].sum_sq_y +=
+                ldexp(mean_sq(dd[j].mean.y, dd[j].std.y), shift);
+        }
+    }
+    return ok;
+}
+
+
+/* Stores a summary computed by compute_dd_block_statistics() unless the block
+ * has since been overwritten: either it is being written now, or its index
+ * entry no longer has the timestamp it had when the summary was requested. */
+static void store_dd_block_statistics(
+    unsigned int block, uint64_t timestamp,
+    const struct block_statistics stats[])
+{
+    LOCK(transform_lock);
+    if (block != header->current_major_block  &&
+        data_index[block].timestamp == timestamp  &&
+        !block_statistics_valid[block])
+    {
+        memcpy(get_block_statistics(block), stats,
+            output_id_count * sizeof(struct block_statistics));
+        block_statistics_valid[block] = true;
+    }
+    UNLOCK(transform_lock);
+}
+
+
+static void merge_block_statistics(
+    struct block_statistics *result, const struct block_statistics *stats)
+{
+    if (stats->min.x < result->min.x)  result->min.x = stats->min.x;
+    if (result->max.x < stats->max.x)  result->max.x = stats->max.x;
+    if (stats->min.y < result->min.y)  result->min.y = stats->min.y;
+    if (result->max.y < stats->max.y)  result->max.y = stats->max.y;
+    result->sum_x += stats->sum_x;
+    result->sum_y += stats->sum_y;
+    result->sum_sq_x += stats->sum_sq_x;
+    result->sum_sq_y += stats->sum_sq_y;
+}
+
+
+static void initialise_block_statistics(void)
+{
+    block_statistics = calloc(
+        (size_t) header->major_block_count * output_id_count,
+        sizeof(struct block_statistics));
+    block_statistics_valid = calloc(header->major_block_count, sizeof(bool));
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Gap tracking. */
+
+/* To avoid scanning the index for gaps on every contiguous read we keep a list
+ * of the blocks which follow a gap, in order of writing, updated as each block
+ * is written.  Gaps in timestamps and gaps in id0 are tracked separately, as
+ * id0 checking is optional.  Each list is a ring buffer with room for an entry
+ * for every block, and is only updated under the transform lock. */
+
+struct gap_list {
+    unsigned int *blocks;       // Blocks directly following a gap, oldest first
+    unsigned int head;          // Index of oldest entry
+    unsigned int count;         // Number of entries
+};
+
+static struct gap_list time_gaps;   // Gaps in timestamp
+static struct gap_list any_gaps;    // Gaps in timestamp or id0
+
+
+/* Number of blocks written since the given block, counting from the oldest
+ * block, which is the block after the current block. */
+static unsigned int block_age(unsigned int block)
+{
+    unsigned int N = header->major_block_count;
+    return (block + N - header->current_major_block - 1) % N;
+}
+
+static unsigned int gap_entry(const struct gap_list *list, unsigned int i)
+{
+    return list->blocks[(list->head + i) % header->major_block_count];
+}
+
+static void push_gap(struct gap_list *list, unsigned int block)
+{
+    unsigned int N = header->major_block_count;
+    if (list->count < N)
+    {
+        list->blocks[(list->head + list->count) % N] = block;
+        list->count += 1;
+    }
+}
+
+/* Discards the entry for the given block, which is about to be overwritten.
+ * As this is the oldest block it can only be at the head of the list. */
+static void discard_gap(struct gap_list *list, unsigned int block)
+{
+    if (list->count > 0  &&  gap_entry(list, 0) == block)
+    {
+        list->head = (list->head + 1) % header->major_block_count;
+        list->count -= 1;
+    }
+}
+
+
+/* Checks for a gap between the given block and the one before it. */
+static void update_gaps(unsigned int block)
+{
+    unsigned int N = header->major_block_count;
+    const struct data_index *last = &data_index[(block + N - 1) % N];
+    const struct data_index *ix = &data_index[block];
+    int64_t delta_t = (int64_t) (ix->timestamp - last->timestamp - last->duration);
+    bool time_gap = delta_t < -MAX_DELTA_T  ||  MAX_DELTA_T < delta_t;
+    bool id0_gap = ix->id_zero != last->id_zero + header->major_sample_count;
+    if (time_gap)
+        push_gap(&time_gaps, block);
+    if (time_gap  ||  id0_gap)
+        push_gap(&any_gaps, block);
+}
+
+
+/* Called after the current block has been advanced. */
+static void advance_gaps(unsigned int written_block)
+{
+    update_gaps(written_block);
+    discard_gap(&time_gaps, header->current_major_block);
+    discard_gap(&any_gaps, header->current_major_block);
+}
+
+
+/* Returns the index of the first entry in list for a block newer than the
+ * block of the given age, or list->count if there is none. */
+static unsigned int find_gap_entry(const struct gap_list *list, unsigned int age)
+{
+    unsigned int low = 0;
+    unsigned int high = list->count;
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        if (block_age(gap_entry(list, mid)) <= age)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+
+/* Builds the gap lists from the index at startup. */
+static void initialise_gaps(void)
+{
+    unsigned int N = header->major_block_count;
+    time_gaps.blocks = calloc(N, sizeof(unsigned int));
+    any_gaps.blocks = calloc(N, sizeof(unsigned int));
+    for (unsigned int age = 1; age + 1 < N; age ++)
+        update_gaps((header->current_major_block + 1 + age) % N);
+}
+
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Index maintenance. */
 
@@ -601,12 +1257,15 @@ static void index_minor_block(const void *block, uint64_t timestamp)
  * header and index can be very behind! */
 static void flush_index(uint32_t current_block)
 {
-    uintptr_t page_mask = ~((uintptr_t) page_size - 1);
-    void *index_address = (void *) (
-        (uintptr_t) &data_index[current_block] & page_mask);
-    IGNORE(
-        TEST_IO(msync(header, DISK_HEADER_SIZE, MS_ASYNC))  &&
-        TEST_IO(msync(index_address, page_size, MS_ASYNC)));
+    IGNORE(TEST_IO(msync(header, DISK_HEADER_SIZE, MS_ASYNC)));
+    flush_index_range(&data_index[current_block], sizeof(struct data_index));
+    if (header->fa_format != FA_FORMAT_RAW)
+    {
+        flush_index_range(&extents[current_block], sizeof(struct block_extent));
+        flush_index_range(
+            column_offsets(header, data_index, current_block),
+            header->archive_mask_count * sizeof(uint32_t));
+    }
 }
 
 
@@ -653,6 +1312,7 @@ static void advance_index(void)
     header->current_major_block =
         (header->current_major_block + 1) % header->major_block_count;
     timestamp_index = 0;
+    advance_gaps(current_block);
 
     /* Flush index and header to disk. */
     flush_index(current_block);
@@ -677,31 +1337,97 @@ static void initialise_index(void)
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Interlocked access. */
 
-/* Binary search to find major block corresponding to timestamp.  Note that the
- * high block is never inspected, which is just as well, as the current block is
+/* In a compressed archive the oldest blocks are discarded as space is needed,
+ * so the blocks we skip to avoid reading blocks being overwritten are counted
+ * from the oldest valid block.  The result is never later than the block before
+ * the current block. */
+static unsigned int oldest_search_block(void)
+{
+    unsigned int N = header->major_block_count;
+    unsigned int last = (header->current_major_block + N - 1) % N;
+    unsigned int block = (header->current_major_block + 1) % N;
+    while (block != last  &&  data_index[block].duration == 0)
+        block = (block + 1) % N;
+    for (unsigned int i = 0; block != last  &&  i < INDEX_SKIP; i ++)
+        block = (block + 1) % N;
+    return block;
+}
+
+
+static inline uint64_t search_timestamp(unsigned int start, unsigned int offset)
+{
+    return data_index[(start + offset) % header->major_block_count].timestamp;
+}
+
+
+/* Search to find major block corresponding to timestamp.  Note that the high
+ * block is never inspected, which is just as well, as the current block is
  * invariably invalid.
+ *     As blocks are normally of very nearly equal duration we start with an
+ * estimate of the block computed from the latest block and last_duration.  We
+ * then search outwards from there in steps of increasing size until the target
+ * is bracketed, and finish with a binary search.  Unless there are gaps in the
+ * data this only needs to inspect a handful of index entries.
  *     Returns the index of the latest valid block with a starting timestamp no
  * later than the target timestamp.  If the archive is empty may return an
  * invalid index, this is recognised by comparing the result with current. */
-static unsigned int binary_search(uint64_t timestamp, bool *first_block)
+static unsigned int search_index(uint64_t timestamp, bool *first_block)
 {
     unsigned int N = header->major_block_count;
     unsigned int current = header->current_major_block;
     unsigned int start = (current + 1 + INDEX_SKIP) % N;
-    unsigned int low = start;
-    unsigned int high = current;
-    while ((low + 1) % N != high)
+    if (header->fa_format != FA_FORMAT_RAW)
+        start = oldest_search_block();
+
+    /* Search offsets from start in the range [low,high), with the invariant
+     * that the target is no earlier than low (unless low is 0) and earlier than
+     * high (with high initially the current block). */
+    unsigned int low = 0;
+    unsigned int high = (current + N - start) % N;
+    unsigned int last = high - 1;
+    uint64_t newest = search_timestamp(start, last);
+    if (timestamp >= newest)
+        low = last;
+    else
     {
-        unsigned int mid;
-        if (low < high)
-            mid = (low + high) / 2;
+        uint64_t duration = header->last_duration > 0 ? header->last_duration : 1;
+        uint64_t back = (newest - timestamp + duration - 1) / duration;
+        unsigned int guess = back < last ? last - (unsigned int) back : 0;
+        unsigned int step = 1;
+        if (search_timestamp(start, guess) <= timestamp)
+        {
+            low = guess;
+            while (low + step < high  &&
+                   search_timestamp(start, low + step) <= timestamp)
+            {
+                low += step;
+                step *= 2;
+            }
+            if (low + step < high)
+                high = low + step;
+        }
         else
-            mid = ((low + high + N) / 2) % N;
-        if (timestamp < data_index[mid].timestamp)
+        {
+            high = guess;
+            while (high > step  &&
+                   search_timestamp(start, high - step) > timestamp)
+            {
+                high -= step;
+                step *= 2;
+            }
+            low = high > step ? high - step : 0;
+        }
+    }
+    while (low + 1 < high)
+    {
+        unsigned int mid = low + (high - low) / 2;
+        if (timestamp < search_timestamp(start, mid))
             high = mid;
         else
             low = mid;
     }
+    low = (start + low) % N;
+    high = (start + high) % N;
 
     /* To improve error reporting identify whether this is the first block. */
     if (first_block)
@@ -719,7 +1445,7 @@ uint64_t timestamp_to_index_ts(uint64_t timestamp)
 {
     uint64_t result;
     LOCK(transform_lock);
-    result = data_index[binary_search(timestamp, NULL)].timestamp;
+    result = data_index[search_index(timestamp, NULL)].timestamp;
     UNLOCK(transform_lock);
     return result;
 }
@@ -734,7 +1460,7 @@ static void timestamp_to_block(
     uint64_t timestamp, bool skip_gap, bool *first_block,
     unsigned int *block_out, unsigned int *offset)
 {
-    unsigned int block = binary_search(timestamp, first_block);
+    unsigned int block = search_index(timestamp, first_block);
     uint64_t block_start = data_index[block].timestamp;
     unsigned int duration = data_index[block].duration;
     unsigned int block_size = header->major_sample_count;
@@ -765,6 +1491,101 @@ static void timestamp_to_block(
 }
 
 
+/* The FA data of the major block being assembled can also be read, so that
+ * the most recent data is available without waiting for the block to be
+ * written.  The transform thread only appends to this block, publishing each
+ * new fa_offset after writing the data, and it only completes or discards the
+ * block under transform_lock, so while the lock is held the samples before
+ * fa_offset are valid. */
+
+/* Returns the number of samples in the current block, called with
+ * transform_lock held. */
+static unsigned int live_sample_count(void)
+{
+    return __atomic_load_n(&fa_offset, __ATOMIC_ACQUIRE);
+}
+
+
+/* Estimates the index entry for the current block from its first input block,
+ * whose timestamp marks its end.  Only meaningful if the block has samples. */
+static void live_block_index(struct data_index *ix)
+{
+    *ix = (struct data_index) {
+        .timestamp = first_timestamp -
+            (uint64_t) input_frame_count * header->last_duration /
+                header->major_sample_count,
+        .duration = header->last_duration,
+        .id_zero = data_index[header->current_major_block].id_zero,
+    };
+}
+
+
+/* Returns the number of live samples directly following on from the last
+ * written block, or 0 if there is a gap before the current block.  As the
+ * timestamp of the current block is only estimated, up to an input block of
+ * time error is allowed. */
+static unsigned int live_samples_following(void)
+{
+    unsigned int samples = live_sample_count();
+    if (samples == 0)
+        return 0;
+
+    unsigned int N = header->major_block_count;
+    const struct data_index *last =
+        &data_index[(header->current_major_block + N - 1) % N];
+    struct data_index ix;
+    live_block_index(&ix);
+    int64_t max_delta_t = (int64_t) (
+        (uint64_t) input_frame_count * header->last_duration /
+            header->major_sample_count) + MAX_DELTA_T;
+    int64_t delta_t =
+        (int64_t) (ix.timestamp - last->timestamp - last->duration);
+    bool gap =
+        last->duration == 0  ||
+        delta_t < -max_delta_t  ||  max_delta_t < delta_t  ||
+        ix.id_zero != last->id_zero + header->major_sample_count;
+    return gap ? 0 : samples;
+}
+
+
+/* Converts a timestamp at or after the end of the last written block into an
+ * offset into the current block, limited to the samples available. */
+static unsigned int live_offset(uint64_t timestamp, unsigned int samples)
+{
+    struct data_index ix;
+    live_block_index(&ix);
+    if (timestamp <= ix.timestamp  ||  ix.duration == 0)
+        return 0;
+    else
+    {
+        uint64_t offset = (timestamp - ix.timestamp) *
+            header->major_sample_count / ix.duration;
+        return offset < samples ? (unsigned int) offset : samples;
+    }
+}
+
+
+bool read_live_fa_block(
+    unsigned int block, unsigned int offset, unsigned int count,
+    unsigned int id_count, const uint16_t index[], void *const output[],
+    bool *copied)
+{
+    bool ok;
+    LOCK(transform_lock);
+    *copied = block == header->current_major_block;
+    ok = IF_(*copied,
+        TEST_OK_(offset + count <= live_sample_count(),
+            "Live data lost in data gap"));
+    if (ok  &&  *copied)
+        for (unsigned int i = 0; i < id_count; i ++)
+            memcpy(output[i] + offset * FA_ENTRY_SIZE,
+                block_buffer + fa_data_offset(header, offset, index[i]),
+                count * FA_ENTRY_SIZE);
+    UNLOCK(transform_lock);
+    return ok;
+}
+
+
 /* Computes the number of samples available from the given block:offset to the
  * current end of the archive. */
 static uint64_t compute_samples(unsigned int block, unsigned int offset)
@@ -779,7 +1600,7 @@ static uint64_t compute_samples(unsigned int block, unsigned int offset)
 
 
 bool timestamp_to_start(
-    uint64_t timestamp, bool all_data, uint64_t *samples_available,
+    uint64_t timestamp, bool all_data, bool live, uint64_t *samples_available,
     unsigned int *block, unsigned int *offset)
 {
     bool ok;
@@ -787,13 +1608,59 @@ bool timestamp_to_start(
 
     bool first_block;
     timestamp_to_block(timestamp, true, &first_block, block, offset);
+    if (live  &&  *block == header->current_major_block)
+    {
+        /* The start is after the last written block, so look for it in the
+         * block being assembled. */
+        unsigned int samples = live_sample_count();
+        *offset = live_offset(timestamp, samples);
+        ok = TEST_OK_(*offset < samples, "Start time too late");
+        if (ok)
+            *samples_available = samples - *offset;
+    }
+    else
+    {
+        ok =
+            TEST_OK_(
+                *block != header->current_major_block, "Start time too late")  &&
+            TEST_OK_(all_data  ||  data_index[*block].timestamp <= timestamp,
+                first_block ? "Start time too early" : "Start time in data gap");
+        if (ok)
+            *samples_available = compute_samples(*block, *offset) +
+                (live ? live_samples_following() : 0);
+    }
+
+    UNLOCK(transform_lock);
+    return ok;
+}
+
+
+bool block_to_start(
+    unsigned int block, unsigned int offset, bool live,
+    uint64_t *samples_available)
+{
+    bool ok;
+    LOCK(transform_lock);
+
+    bool current = block == header->current_major_block;
     ok =
-        TEST_OK_(
-            *block != header->current_major_block, "Start time too late")  &&
-        TEST_OK_(all_data  ||  data_index[*block].timestamp <= timestamp,
-            first_block ? "Start time too early" : "Start time in data gap");
+        TEST_OK_(block < header->major_block_count,
+            "Start block %u out of range", block)  &&
+        TEST_OK_(offset < header->major_sample_count,
+            "Start offset %u out of range", offset)  &&
+        IF_ELSE(live  &&  current,
+            TEST_OK_(offset < live_sample_count(),
+                "Start block not yet written"),
+            TEST_OK_(!current  &&  data_index[block].duration > 0,
+                "Start block not yet written"));
     if (ok)
-        *samples_available = compute_samples(*block, *offset);
+    {
+        if (current)
+            *samples_available = live_sample_count() - offset;
+        else
+            *samples_available = compute_samples(block, offset) +
+                (live ? live_samples_following() : 0);
+    }
 
     UNLOCK(transform_lock);
     return ok;
@@ -801,7 +1668,7 @@ bool timestamp_to_start(
 
 
 bool timestamp_to_end(
-    uint64_t timestamp, bool all_data, unsigned int start_block,
+    uint64_t timestamp, bool all_data, bool live, unsigned int start_block,
     unsigned int *block, unsigned int *offset)
 {
     uint64_t end_timestamp;
@@ -813,6 +1680,20 @@ bool timestamp_to_end(
     timestamp_to_block(timestamp, false, NULL, block, offset);
     struct data_index *ix = &data_index[*block];
     end_timestamp = ix->timestamp + ix->duration;
+    if (live  &&  timestamp > end_timestamp  &&
+        (*block + 1) % header->major_block_count == current  &&
+        (start_block == current  ||  live_samples_following() > 0))
+    {
+        /* The end is after the last written block and the block being
+         * assembled follows on, so the end can be in the live block. */
+        unsigned int samples = live_sample_count();
+        struct data_index live_ix;
+        live_block_index(&live_ix);
+        *block = current;
+        *offset = live_offset(timestamp, samples);
+        end_timestamp = live_ix.timestamp +
+            (uint64_t) samples * live_ix.duration / header->major_sample_count;
+    }
 
     UNLOCK(transform_lock);
 
@@ -833,32 +1714,159 @@ bool timestamp_to_end(
 
 bool find_gap(bool check_id0, unsigned int *start, unsigned int *blocks)
 {
-    struct data_index *ix = &data_index[*start];
-    uint64_t timestamp = ix->timestamp + ix->duration;
-    uint32_t id_zero   = ix->id_zero + header->major_sample_count;
-    while (*blocks > 1)
+    if (*blocks <= 1)
+        return false;
+
+    bool gap;
+    LOCK(transform_lock);
+    const struct gap_list *list = check_id0 ? &any_gaps : &time_gaps;
+    unsigned int start_age = block_age(*start);
+    unsigned int entry = find_gap_entry(list, start_age);
+    unsigned int gap_age = entry < list->count ?
+        block_age(gap_entry(list, entry)) : (unsigned int) -1;
+    gap = gap_age - start_age < *blocks;
+    /* Update *start and *blocks to match a scan stopping at the gap, or at the
+     * last block if there is no gap. */
+    unsigned int skip = gap ? gap_age - start_age : *blocks - 1;
+    *start = (*start + skip) % header->major_block_count;
+    *blocks -= skip;
+    UNLOCK(transform_lock);
+
+    return gap;
+}
+
+
+/* A block in the range of a statistics request which has yet to be summarised,
+ * together with its timestamp to detect it being overwritten. */
+struct missing_block {
+    unsigned int block;
+    uint64_t timestamp;
+};
+
+/* Merges the summaries of all blocks in the requested range.  Any blocks which
+ * have not yet been summarised are listed in missing[] instead, in which case
+ * the result is incomplete. */
+static bool merge_long_term_statistics(
+    uint64_t start, uint64_t end, unsigned int id_count, const uint16_t index[],
+    struct block_statistics result[], uint64_t *samples,
+    uint64_t *start_out, uint64_t *end_out,
+    struct missing_block missing[], unsigned int *missing_count)
+{
+    unsigned int N = header->major_block_count;
+    unsigned int start_block, end_block, offset;
+    bool ok;
+
+    LOCK(transform_lock);
+    unsigned int current = header->current_major_block;
+    timestamp_to_block(start, true, NULL, &start_block, &offset);
+    timestamp_to_block(end, false, NULL, &end_block, &offset);
+    ok =
+        TEST_OK_(start_block != current, "Start time too late")  &&
+        TEST_OK_(end_block != current, "No data in selected range")  &&
+        TEST_OK_(end > data_index[start_block].timestamp,
+            "No data in selected range")  &&
+        TEST_OK_(
+            (end_block + N - start_block) % N <
+                (current + N - start_block) % N,
+            "No data in selected range");
+    if (ok)
     {
-        *blocks -= 1;
-        *start += 1;
-        if (*start == header->major_block_count)
-            *start = 0;
+        for (unsigned int i = 0; i < id_count; i ++)
+            initialise_block_statistic(&result[i]);
+        *samples = 0;
+        *missing_count = 0;
+        *start_out = data_index[start_block].timestamp;
+        for (unsigned int block = start_block; ;
+             block = (block + 1) % N)
+        {
+            /* Skip blocks discarded from a compressed archive. */
+            if (data_index[block].duration > 0)
+            {
+                if (block_statistics_valid[block])
+                {
+                    const struct block_statistics *stats =
+                        get_block_statistics(block);
+                    for (unsigned int i = 0; i < id_count; i ++)
+                        merge_block_statistics(&result[i], &stats[index[i]]);
+                    *samples += header->major_sample_count;
+                }
+                else
+                    missing[(*missing_count)++] = (struct missing_block) {
+                        .block = block,
+                        .timestamp = data_index[block].timestamp };
+            }
+            if (block == end_block)
+                break;
+        }
+        *end_out =
+            data_index[end_block].timestamp + data_index[end_block].duration;
+        ok = *missing_count > 0  ||
+            TEST_OK_(*samples > 0, "No data in selected range");
+    }
+    UNLOCK(transform_lock);
+    return ok;
+}
+
 
-        ix = &data_index[*start];
-        int64_t delta_t = (int64_t) (ix->timestamp - timestamp);
-        if ((check_id0  &&  ix->id_zero != id_zero)  ||
-            delta_t < -MAX_DELTA_T  ||  MAX_DELTA_T < delta_t)
-            return true;
+/* Any blocks in the range not yet summarised are summarised from their DD data
+ * without holding transform_lock, and the range is then merged again, as the
+ * archive may have moved on in the meantime. */
+bool read_long_term_statistics(
+    uint64_t start, uint64_t end, unsigned int id_count, const uint16_t index[],
+    struct block_statistics result[], uint64_t *samples,
+    uint64_t *start_out, uint64_t *end_out)
+{
+    struct missing_block *missing =
+        malloc(header->major_block_count * sizeof(struct missing_block));
+    struct block_statistics *stats =
+        malloc(output_id_count * sizeof(struct block_statistics));
+    unsigned int missing_count = 0;
+    bool ok = TEST_NULL(missing)  &&  TEST_NULL(stats);
+    while (ok)
+    {
+        ok = merge_long_term_statistics(
+            start, end, id_count, index, result, samples, start_out, end_out,
+            missing, &missing_count);
+        if (!ok  ||  missing_count == 0)
+            break;
 
-        timestamp = ix->timestamp + ix->duration;
-        id_zero = ix->id_zero + header->major_sample_count;
+        for (unsigned int i = 0; ok  &&  i < missing_count; i ++)
+        {
+            ok = compute_dd_block_statistics(missing[i].block, stats);
+            if (ok)
+                store_dd_block_statistics(
+                    missing[i].block, missing[i].timestamp, stats);
+        }
     }
-    return false;
+    free(missing);
+    free(stats);
+    return ok;
 }
 
 
-const struct data_index *read_index(unsigned int ix)
+void read_index(unsigned int ix, struct data_index *result)
 {
-    return &data_index[ix];
+    LOCK(transform_lock);
+    if (ix == header->current_major_block)
+        live_block_index(result);
+    else
+        *result = data_index[ix];
+    UNLOCK(transform_lock);
+}
+
+uint64_t get_block_offset(unsigned int ix)
+{
+    return major_block_offset(header, data_index, ix);
+}
+
+const struct block_extent *read_extent(unsigned int ix)
+{
+    return &extents[ix];
+}
+
+const uint32_t *read_column_offsets(unsigned int ix)
+{
+    return column_offsets(header, data_index, ix);
 }
 
 const struct disk_header *get_header(void)
@@ -872,6 +1880,180 @@ const struct decimated_data *get_dd_area(void)
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Transform worker pool. */
+
+/* Transposition and first decimation are independent for each archived id, so
+ * this work can be shared among a pool of threads, each working on its own
+ * range of output ids.  The transform thread itself takes the first range, and
+ * waits for all the other workers to finish before the block is written. */
+
+struct transform_worker {
+    pthread_t thread;
+    unsigned int first_id;      // First output id processed by worker
+    unsigned int id_count;      // Number of ids processed by worker
+};
+
+static unsigned int worker_count;   // Number of workers, including ourself
+static struct transform_worker *workers;
+
+DECLARE_LOCKING(worker_lock);
+static bool workers_running;
+static const void *worker_block;    // Block currently being processed
+static unsigned int worker_generation;  // Incremented for each new block
+static unsigned int workers_busy;   // Number of workers still working
+
+
+static void transform_id_range(
+    const void *block, const struct transform_worker *worker)
+{
+    transpose_block(block, worker->first_id, worker->id_count);
+    decimate_block(block, worker->first_id, worker->id_count);
+}
+
+
+/* Waits for a new block to process, returns false if the pool is stopping. */
+static bool wait_for_block(unsigned int *generation, const void **block)
+{
+    bool running;
+    LOCK(worker_lock);
+    while (workers_running  &&  worker_generation == *generation)
+        pwait(&worker_lock);
+    *generation = worker_generation;
+    *block = worker_block;
+    running = workers_running;
+    UNLOCK(worker_lock);
+    return running;
+}
+
+
+static void *worker_thread(void *context)
+{
+    const struct transform_worker *worker = context;
+    unsigned int generation = 0;
+    const void *block;
+    while (wait_for_block(&generation, &block))
+    {
+        transform_id_range(block, worker);
+
+        LOCK(worker_lock);
+        workers_busy -= 1;
+        if (workers_busy == 0)
+            pbroadcast(&worker_lock);
+        UNLOCK(worker_lock);
+    }
+    return NULL;
+}
+
+
+/* Transposes and decimates the given block across all workers. */
+static void transform_block(const void *block)
+{
+    if (worker_count > 1)
+    {
+        LOCK(worker_lock);
+        worker_block = block;
+        worker_generation += 1;
+        workers_busy = worker_count - 1;
+        pbroadcast(&worker_lock);
+        UNLOCK(worker_lock);
+
+        transform_id_range(block, &workers[0]);
+
+        LOCK(worker_lock);
+        while (workers_busy > 0)
+            pwait(&worker_lock);
+        UNLOCK(worker_lock);
+    }
+    else
+        transform_id_range(block, &workers[0]);
+}
+
+
+/* Divides the archived ids as evenly as possible among the workers. */
+static void initialise_workers(unsigned int thread_count)
+{
+    worker_count = thread_count;
+    workers = calloc(worker_count, sizeof(struct transform_worker));
+    unsigned int first_id = 0;
+    for (unsigned int i = 0; i < worker_count; i ++)
+    {
+        unsigned int end_id =
+            (i + 1) * header->archive_mask_count / worker_count;
+        workers[i].first_id = first_id;
+        workers[i].id_count = end_id - first_id;
+        first_id = end_id;
+    }
+}
+
+
+bool start_transform_workers(void)
+{
+    workers_running = true;
+    bool ok = true;
+    for (unsigned int i = 1; ok  &&  i < worker_count; i ++)
+        ok = create_pipeline_thread(THREAD_TRANSFORM,
+            &workers[i].thread, worker_thread, &workers[i]);
+    return ok;
+}
+
+
+void terminate_transform_workers(void)
+{
+    LOCK(worker_lock);
+    workers_running = false;
+    pbroadcast(&worker_lock);
+    UNLOCK(worker_lock);
+    for (unsigned int i = 1; i < worker_count; i ++)
+        ASSERT_0(pthread_join(workers[i].thread, NULL));
+}
+
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+/* Live decimated statistics. */
+
+/* The D data computed for each input block is also published straight away in
+ * a buffer of its own, so that clients can monitor these statistics without
+ * waiting for the major block to be written to disk.  Each block in this
+ * buffer holds the D rows for one input block, each row holding the
+ * decimated_data for every archived id in archive order. */
+
+#define STATISTICS_BLOCK_COUNT  128
+
+static struct buffer *statistics_buffer;
+
+
+static void publish_statistics(bool gap, uint64_t timestamp)
+{
+    struct decimated_data *row = get_write_block(statistics_buffer);
+    if (!gap)
+        for (unsigned int i = 0; i < input_decimation_count; i ++)
+            for (unsigned int id = 0; id < output_id_count; id ++)
+                *row++ = d_block(id)[i];
+    IGNORE(TEST_OK(release_write_block(statistics_buffer, gap, timestamp)));
+}
+
+
+struct buffer *get_statistics_buffer(void)
+{
+    return statistics_buffer;
+}
+
+
+static bool initialise_statistics(void)
+{
+    /* If an input block is shorter than the first decimation there's nothing
+     * to publish. */
+    return IF_(input_decimation_count > 0,
+        create_buffer(&statistics_buffer,
+            input_decimation_count * header->archive_mask_count *
+                sizeof(struct decimated_data),
+            STATISTICS_BLOCK_COUNT));
+}
+
+
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 /* Top level control. */
 
@@ -882,11 +2064,14 @@ const struct decimated_data *get_dd_area(void)
  * enough. */
 void process_block(const void *block, uint64_t timestamp)
 {
+    uint64_t start = start_latency();
     if (block)
     {
+        unsigned int major_block = header->current_major_block;
         index_minor_block(block, timestamp);
-        transpose_block(block);
-        decimate_block(block);
+        transform_block(block);
+        if (statistics_buffer)
+            publish_statistics(false, timestamp);
         bool must_write = advance_block();
         unsigned int decimation = 1U << (
             header->first_decimation_log2 + header->second_decimation_log2);
@@ -894,29 +2079,49 @@ void process_block(const void *block, uint64_t timestamp)
             double_decimate_block();
         if (must_write)
         {
+            separate_d_fields();
+            pack_major_block();
             LOCK(transform_lock);
             write_major_block();
+            store_block_statistics();
             advance_index();
+            invalidate_cached_block(header->current_major_block);
+            if (dd_cache_enabled())
+                invalidate_dd_block(major_block);
             UNLOCK(transform_lock);
 
             madvise_double_decimation();
+            if (dd_cache_enabled())
+                release_double_decimation();
         }
     }
     else
     {
         /* If we see a gap in the block then discard all the work we've done so
-         * far. */
+         * far.  Readers of the live block must see this before it is reused. */
+        LOCK(transform_lock);
         reset_block();
+        UNLOCK(transform_lock);
         reset_index();
         reset_double_decimation();
+        if (statistics_buffer)
+            publish_statistics(true, 0);
     }
+    record_latency(LATENCY_TRANSFORM_BLOCK, start);
 }
 
 
-void initialise_transform(
+bool initialise_transform(
     struct disk_header *header_, struct data_index *data_index_,
-    struct decimated_data *dd_area_, unsigned int events_fa_id_)
+    struct decimated_data *dd_area_, unsigned int events_fa_id_,
+    unsigned int transform_threads, unsigned int write_queue_depth)
 {
+    if (!TEST_OK_(
+            0 < transform_threads  &&
+            transform_threads <= header_->archive_mask_count,
+            "Invalid number of transform threads: %u", transform_threads))
+        return false;
+
     header = header_;
     data_index = data_index_;
     dd_area = dd_area_;
@@ -927,7 +2132,15 @@ void initialise_transform(
     input_decimation_count = input_frame_count >> header->first_decimation_log2;
 
     page_size = (size_t) sysconf(_SC_PAGESIZE);
+    ASSERT_OK(initialise_transpose(
+        &header->archive_mask, header->fa_entry_count,
+        header->major_sample_count, TRANSPOSE_AUTO));
     initialise_double_decimation();
-    initialise_io_buffer();
+    initialise_block_statistics();
+    initialise_row_decimation();
+    initialise_io_buffer(write_queue_depth);
     initialise_index();
+    initialise_gaps();
+    initialise_workers(transform_threads);
+    return initialise_statistics();
 }
@@ -41,31 +41,85 @@ void process_block(const void *read_block, uint64_t timestamp);
 uint64_t __pure timestamp_to_index_ts(uint64_t timestamp);
 
 /* Converts timestamp to block and offset into block together with number of
- * available samples.  Fails if timestamp is too early unless all_data set. */
+ * available samples.  Fails if timestamp is too early unless all_data set.  If
+ * live is set the FA samples so far assembled in the current block are also
+ * available, see read_live_fa_block(). */
 bool timestamp_to_start(
-    uint64_t timestamp, bool all_data, uint64_t *samples_available,
+    uint64_t timestamp, bool all_data, bool live, uint64_t *samples_available,
     unsigned int *block, unsigned int *offset);
+/* Validates an explicit start block and FA offset into block, as previously
+ * reported to a client, and returns the number of available samples. */
+bool block_to_start(
+    unsigned int block, unsigned int offset, bool live,
+    uint64_t *samples_available);
 /* Similar to timestamp_to_start, but used for end time, in particular won't
  * skip over gaps to find a timestamp.  Called with a start_block so that we can
  * verify that *block is no earlier than start_block. */
 bool timestamp_to_end(
-    uint64_t timestamp, bool all_data, unsigned int start_block,
+    uint64_t timestamp, bool all_data, bool live, unsigned int start_block,
     unsigned int *block, unsigned int *offset);
 
+/* If block is the major block currently being assembled copies count FA
+ * samples from offset for each of the given archive ids into the same offset
+ * of the corresponding output buffer and sets *copied, otherwise the block has been
+ * completed and must be read from disk.  Fails if the samples have been
+ * discarded because of a gap in the data. */
+bool read_live_fa_block(
+    unsigned int block, unsigned int offset, unsigned int count,
+    unsigned int id_count, const uint16_t index[], void *const output[],
+    bool *copied);
+
 /* Searches a range of index blocks for a gap in the timestamp, returning true
  * iff a gap is found.  *start is updated to the index of the block directly
  * after the first gap and *blocks is decremented accordingly. */
 bool find_gap(bool check_id0, unsigned int *start, unsigned int *blocks);
-const struct data_index *__const_ read_index(unsigned int ix);
+/* Returns the index entry for the given block, an estimate for the current
+ * block. */
+void read_index(unsigned int ix, struct data_index *result);
+/* Returns the offset into the archive of the given major block. */
+uint64_t get_block_offset(unsigned int ix);
+/* For compressed archives returns the extent of the given major block and the
+ * offsets of its packed FA blocks. */
+const struct block_extent *__const_ read_extent(unsigned int ix);
+const uint32_t *__const_ read_column_offsets(unsigned int ix);
 
 /* Returns an unlocked pointer to the header: should only be used to access the
  * constant header fields. */
 const struct disk_header *__const_ get_header(void);
 
+/* Summary of the FA data of one id over one or more complete major blocks. */
+struct block_statistics {
+    struct fa_entry min, max;       // Extremes of X and Y
+    int64_t sum_x, sum_y;           // Sums of X and Y
+    double sum_sq_x, sum_sq_y;      // Sums of squares of X and Y
+};
+
+/* Merges the per block summaries of the given archive ids over all complete
+ * major blocks from the block containing start to the block containing end,
+ * returning the number of FA samples covered and the actual time range. */
+bool read_long_term_statistics(
+    uint64_t start, uint64_t end, unsigned int id_count, const uint16_t index[],
+    struct block_statistics result[], uint64_t *samples,
+    uint64_t *start_out, uint64_t *end_out);
+
+/* Returns the buffer of live D statistics, or NULL if not available.  Each
+ * block holds the decimated_data rows for one input block for all archived
+ * ids. */
+struct buffer *get_statistics_buffer(void);
 
-void initialise_transform(
+
+/* Initialises transform processing.  The work of transposing and decimating
+ * each block will be shared among transform_threads threads, and enough major
+ * buffers are allocated for write_queue_depth blocks to be queued for writing
+ * while the next is assembled. */
+bool initialise_transform(
     struct disk_header *header, struct data_index *data_index,
-    struct decimated_data *dd_area, unsigned int events_fa_id);
+    struct decimated_data *dd_area, unsigned int events_fa_id,
+    unsigned int transform_threads, unsigned int write_queue_depth);
+
+/* Starts and stops the additional transform worker threads. */
+bool start_transform_workers(void);
+void terminate_transform_workers(void);
 
 // !!!!!!
 // Not right.  Returns DD data area.
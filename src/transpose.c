@@ -0,0 +1,327 @@
+/* Cache friendly transposition of FA frames into archive columns.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Copying one column at a time strides through the input block by an entire
+ * frame per sample, so with large frames each cache line read contributes just
+ * one useful fa_entry.  Instead we work through the input block in narrow
+ * vertical tiles of adjacent ids, transposing small square blocks in registers.
+ * Each input cache line is then consumed by a handful of passes while it is
+ * still in cache, and output is still written as a few sequential streams,
+ * which is important as each output column lives in a different page. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <immintrin.h>
+
+#include "error.h"
+#include "fa_sniffer.h"
+#include "mask.h"
+
+#include "transpose.h"
+
+
+/* The tile kernels process frames in multiples of this count. */
+#define TILE_FRAMES     4
+/* Isolated ids are transposed in strips of this many frames. */
+#define STRIP_FRAMES    8
+
+
+/* The archive mask is reduced to a list of runs of consecutive ids, which lets
+ * us treat sparse masks efficiently: each run is transposed in tiles as a
+ * single rectangular block. */
+static struct id_run id_runs[MAX_FA_ENTRY_COUNT];
+static unsigned int id_run_count;
+
+static unsigned int fa_entry_count; // Input stride between frames
+static unsigned int output_stride;  // Output stride between columns
+
+/* A column kernel copies frame_count samples of a single id into its output
+ * column. */
+typedef void column_kernel_t(
+    const struct fa_entry *input, struct fa_entry *output,
+    unsigned int frame_count);
+/* A tile kernel transposes frame_count frames of count consecutive ids, where
+ * frame_count is a multiple of TILE_FRAMES. */
+typedef void tile_kernel_t(
+    const struct fa_entry *input, struct fa_entry *output,
+    unsigned int count, unsigned int frame_count);
+
+static column_kernel_t *column_kernel;
+static tile_kernel_t *tile_kernel;
+static enum transpose_kernel selected_kernel;
+
+
+/* The kernels below are written in terms of the input stride, which is passed
+ * explicitly and always inlined.  Below we instantiate a copy of each kernel
+ * for each of the standard FA entry counts, where the stride is a compile time
+ * constant, and a generic copy using fa_entry_count; the appropriate set is
+ * selected once by initialise_transpose(). */
+#define KERNEL  static inline __attribute__((always_inline))
+
+
+KERNEL void transpose_column(
+    const struct fa_entry *input, struct fa_entry *output,
+    unsigned int frame_count, unsigned int stride)
+{
+    for (unsigned int i = frame_count; i > 0; i --)
+    {
+        *output ++ = *input;
+        input += stride;
+    }
+}
+
+
+/* Transposes 2x2 blocks of fa_entry values, each a single 128 bit register. */
+KERNEL void transpose_tile_sse2(
+    const struct fa_entry *input, struct fa_entry *output,
+    unsigned int count, unsigned int frame_count, unsigned int stride)
+{
+    unsigned int id = 0;
+    for (; id + 2 <= count; id += 2)
+    {
+        const struct fa_entry *in = input + id;
+        struct fa_entry *out = output + id * output_stride;
+        for (unsigned int f = 0; f < frame_count; f += 2)
+        {
+            const struct fa_entry *row = in + f * stride;
+            __m128i r0 = _mm_loadu_si128((const void *) row);
+            __m128i r1 = _mm_loadu_si128((const void *) (row + stride));
+            _mm_storeu_si128((void *) (out + f), _mm_unpacklo_epi64(r0, r1));
+            _mm_storeu_si128(
+                (void *) (out + output_stride + f), _mm_unpackhi_epi64(r0, r1));
+        }
+    }
+    if (id < count)
+        transpose_column(
+            input + id, output + id * output_stride, frame_count, stride);
+}
+
+
+/* Transposes 4x4 blocks of fa_entry values held in 256 bit registers.  Any
+ * remaining ids are passed on to the SSE2 kernel. */
+__attribute__((target("avx2")))
+KERNEL void transpose_tile_avx2(
+    const struct fa_entry *input, struct fa_entry *output,
+    unsigned int count, unsigned int frame_count, unsigned int stride)
+{
+    unsigned int id = 0;
+    for (; id + 4 <= count; id += 4)
+    {
+        const struct fa_entry *in = input + id;
+        struct fa_entry *out = output + id * output_stride;
+        for (unsigned int f = 0; f < frame_count; f += 4)
+        {
+            const struct fa_entry *row = in + f * stride;
+            __m256i r0 = _mm256_loadu_si256((const void *) row);
+            __m256i r1 = _mm256_loadu_si256((const void *) (row + stride));
+            __m256i r2 = _mm256_loadu_si256((const void *) (row + 2 * stride));
+            __m256i r3 = _mm256_loadu_si256((const void *) (row + 3 * stride));
+
+            /* Interleave pairs of rows within each 128 bit lane and then
+             * exchange lanes to complete the transpose. */
+            __m256i t0 = _mm256_unpacklo_epi64(r0, r1);
+            __m256i t1 = _mm256_unpackhi_epi64(r0, r1);
+            __m256i t2 = _mm256_unpacklo_epi64(r2, r3);
+            __m256i t3 = _mm256_unpackhi_epi64(r2, r3);
+            _mm256_storeu_si256((void *) (out + f),
+                _mm256_permute2x128_si256(t0, t2, 0x20));
+            _mm256_storeu_si256((void *) (out + output_stride + f),
+                _mm256_permute2x128_si256(t1, t3, 0x20));
+            _mm256_storeu_si256((void *) (out + 2 * output_stride + f),
+                _mm256_permute2x128_si256(t0, t2, 0x31));
+            _mm256_storeu_si256((void *) (out + 3 * output_stride + f),
+                _mm256_permute2x128_si256(t1, t3, 0x31));
+        }
+    }
+    if (id < count)
+        transpose_tile_sse2(
+            input + id, output + id * output_stride, count - id, frame_count,
+            stride);
+}
+
+
+#define DEFINE_KERNELS(name, stride) \
+    static void transpose_column_##name( \
+        const struct fa_entry *input, struct fa_entry *output, \
+        unsigned int frame_count) \
+    { \
+        transpose_column(input, output, frame_count, stride); \
+    } \
+    static void transpose_tile_sse2_##name( \
+        const struct fa_entry *input, struct fa_entry *output, \
+        unsigned int count, unsigned int frame_count) \
+    { \
+        transpose_tile_sse2(input, output, count, frame_count, stride); \
+    } \
+    __attribute__((target("avx2"))) \
+    static void transpose_tile_avx2_##name( \
+        const struct fa_entry *input, struct fa_entry *output, \
+        unsigned int count, unsigned int frame_count) \
+    { \
+        transpose_tile_avx2(input, output, count, frame_count, stride); \
+    }
+
+DEFINE_KERNELS(generic, fa_entry_count)
+DEFINE_KERNELS(256, 256)
+DEFINE_KERNELS(512, 512)
+DEFINE_KERNELS(1024, 1024)
+
+
+/* The kernels for one input stride, with tile kernels indexed by enum
+ * transpose_kernel. */
+struct kernel_set {
+    unsigned int fa_entry_count;    // Specialised stride, or 0 if generic
+    column_kernel_t *column;
+    tile_kernel_t *tiles[TRANSPOSE_AVX2 + 1];
+};
+
+#define KERNEL_SET(name, count) \
+    { \
+        .fa_entry_count = count, \
+        .column = transpose_column_##name, \
+        .tiles = { \
+            [TRANSPOSE_SSE2] = transpose_tile_sse2_##name, \
+            [TRANSPOSE_AVX2] = transpose_tile_avx2_##name, \
+        }, \
+    }
+
+static const struct kernel_set kernel_sets[] = {
+    KERNEL_SET(256, 256),
+    KERNEL_SET(512, 512),
+    KERNEL_SET(1024, 1024),
+    KERNEL_SET(generic, 0),         // Must be last
+};
+
+
+/* Isolated ids gain nothing from the vector kernels, and walking a full column
+ * for each one costs a pass over the whole input block per id.  Instead these
+ * are copied in strips of STRIP_FRAMES frames, so that each strip of input is
+ * still in cache while all the isolated ids are picked out of it. */
+static void transpose_isolated(
+    const struct fa_entry *input, struct fa_entry *output,
+    unsigned int frame_count, unsigned int first_id, unsigned int id_count)
+{
+    for (unsigned int frame = 0; frame < frame_count; frame += STRIP_FRAMES)
+    {
+        unsigned int strip = frame_count - frame;
+        if (strip > STRIP_FRAMES)
+            strip = STRIP_FRAMES;
+        for (unsigned int i = 0; i < id_run_count; i ++)
+        {
+            struct id_run run;
+            if (clip_id_run(&id_runs[i], first_id, id_count, &run)  &&
+                run.count == 1)
+                column_kernel(
+                    input + frame * fa_entry_count + run.input,
+                    output + run.output * output_stride + frame, strip);
+        }
+    }
+}
+
+
+void transpose_frames(
+    const struct fa_entry *input, struct fa_entry *output,
+    unsigned int frame_count, unsigned int first_id, unsigned int id_count)
+{
+    if (tile_kernel)
+    {
+        unsigned int frames = frame_count - frame_count % TILE_FRAMES;
+        for (unsigned int i = 0; i < id_run_count; i ++)
+        {
+            struct id_run run;
+            if (clip_id_run(&id_runs[i], first_id, id_count, &run)  &&
+                run.count > 1)
+            {
+                const struct fa_entry *in = input + run.input;
+                struct fa_entry *out = output + run.output * output_stride;
+                tile_kernel(in, out, run.count, frames);
+                /* Mop up any frames the kernel couldn't handle. */
+                for (unsigned int j = 0; frames < frame_count  &&
+                        j < run.count; j ++)
+                    column_kernel(
+                        in + frames * fa_entry_count + j,
+                        out + j * output_stride + frames,
+                        frame_count - frames);
+            }
+        }
+        transpose_isolated(input, output, frame_count, first_id, id_count);
+    }
+    else
+        for (unsigned int i = 0; i < id_run_count; i ++)
+        {
+            struct id_run run;
+            if (clip_id_run(&id_runs[i], first_id, id_count, &run))
+                for (unsigned int j = 0; j < run.count; j ++)
+                    column_kernel(
+                        input + run.input + j,
+                        output + (run.output + j) * output_stride,
+                        frame_count);
+        }
+}
+
+
+const char *transpose_kernel_name(void)
+{
+    static const char *names[] = {
+        [TRANSPOSE_COLUMN] = "column",
+        [TRANSPOSE_SSE2] = "sse2",
+        [TRANSPOSE_AVX2] = "avx2",
+    };
+    return names[selected_kernel];
+}
+
+
+bool initialise_transpose(
+    const struct filter_mask *archive_mask, unsigned int fa_entry_count_,
+    unsigned int output_stride_, enum transpose_kernel kernel)
+{
+    fa_entry_count = fa_entry_count_;
+    output_stride = output_stride_;
+    id_run_count = compute_id_runs(
+        archive_mask, fa_entry_count, (unsigned int) -1, id_runs);
+
+    __builtin_cpu_init();
+    bool have_avx2 = __builtin_cpu_supports("avx2");
+    if (kernel == TRANSPOSE_AUTO)
+        kernel = have_avx2 ? TRANSPOSE_AVX2 : TRANSPOSE_SSE2;
+    selected_kernel = kernel;
+
+    /* Pick the kernels specialised for our frame size, if any. */
+    const struct kernel_set *set = kernel_sets;
+    while (set->fa_entry_count != 0  &&  set->fa_entry_count != fa_entry_count)
+        set += 1;
+
+    ASSERT_OK(TRANSPOSE_COLUMN <= kernel  &&  kernel <= TRANSPOSE_AVX2);
+    column_kernel = set->column;
+    tile_kernel = set->tiles[kernel];
+    return TEST_OK_(kernel != TRANSPOSE_AVX2  ||  have_avx2,
+        "AVX2 not supported on this processor");
+}
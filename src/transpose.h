@@ -0,0 +1,56 @@
+/* Header for cache friendly block transposition.
+ *
+ * Copyright (c) 2011 Michael Abbott, Diamond Light Source Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Contact:
+ *      Dr. Michael Abbott,
+ *      Diamond Light Source Ltd,
+ *      Diamond House,
+ *      Chilton,
+ *      Didcot,
+ *      Oxfordshire,
+ *      OX11 0DE
+ *      michael.abbott@diamond.ac.uk
+ */
+
+/* Selection of transpose kernel.  Normally TRANSPOSE_AUTO should be used, the
+ * other options are provided for benchmarking and testing. */
+enum transpose_kernel {
+    TRANSPOSE_AUTO,         // Best available kernel for this processor
+    TRANSPOSE_COLUMN,       // Original column at a time copy
+    TRANSPOSE_SSE2,         // 2x2 tiles using SSE2
+    TRANSPOSE_AVX2,         // 4x4 tiles using AVX2, if supported
+};
+
+/* Prepares for transposition of frames of fa_entry_count entries into
+ * individual columns for each id in archive_mask.  Successive output columns
+ * are separated by output_stride entries.  Fails if the requested kernel is not
+ * supported by this processor. */
+bool initialise_transpose(
+    const struct filter_mask *archive_mask, unsigned int fa_entry_count,
+    unsigned int output_stride, enum transpose_kernel kernel);
+
+/* Transposes frame_count frames from input into output, where output points to
+ * the first sample to be written for the first archived id.  Only the id_count
+ * archived ids starting with output index first_id are transposed, so that the
+ * work can be split between threads. */
+void transpose_frames(
+    const struct fa_entry *input, struct fa_entry *output,
+    unsigned int frame_count, unsigned int first_id, unsigned int id_count);
+
+/* Returns name of the selected transpose kernel for reporting. */
+const char *transpose_kernel_name(void);